@@ -0,0 +1,705 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Load generating wayland client used by sommelier_benchmark. It draws into
+// a configurable number of surfaces as fast as frame callbacks arrive and
+// reports frame rate, damage throughput, commit latency and the memory used
+// by the sommelier it runs under.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Size of the square updated by the partial damage pattern.
+#define PARTIAL_DAMAGE_SIZE 64
+
+enum {
+  DAMAGE_FULL,
+  DAMAGE_PARTIAL,
+  DAMAGE_RANDOM,
+};
+
+struct bench_buffer {
+  struct bench_window* window;
+  struct wl_buffer* buffer;
+  void* data;
+  size_t size;
+  int busy;
+};
+
+struct bench_window {
+  struct bench_client* client;
+  struct wl_surface* surface;
+  struct wl_shell_surface* shell_surface;
+  struct wl_callback* callback;
+  struct bench_buffer buffers[2];
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  uint64_t commit_time;
+  uint32_t frames;
+  int waiting_for_buffer;
+};
+
+struct bench_client {
+  struct wl_display* display;
+  struct wl_compositor* compositor;
+  struct wl_shell* shell;
+  struct wl_shm* shm;
+  struct wl_seat* seat;
+  struct wl_pointer* pointer;
+  struct wl_data_device_manager* data_device_manager;
+  struct wl_data_source* data_source;
+  struct bench_window* windows;
+  int num_windows;
+  int32_t width;
+  int32_t height;
+  uint32_t format;
+  int damage;
+  int resize_interval;
+  size_t clipboard_size;
+  unsigned int seed;
+  uint64_t start_time;
+  uint64_t frames;
+  uint64_t damage_bytes;
+  uint64_t resizes;
+  uint64_t pointer_events;
+  uint64_t* latencies;
+  size_t num_latencies;
+  size_t max_latencies;
+};
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Bytes per pixel of the first plane. NV12 has a second, half height plane
+// with the same stride.
+static int32_t bench_bpp(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_RGB565:
+      return 2;
+    case WL_SHM_FORMAT_NV12:
+      return 1;
+    default:
+      return 4;
+  }
+}
+
+static size_t bench_buffer_size(uint32_t format,
+                                int32_t stride,
+                                int32_t height) {
+  if (format == WL_SHM_FORMAT_NV12)
+    return stride * height + stride * (height / 2);
+  return stride * height;
+}
+
+static void bench_buffer_release(void* data, struct wl_buffer* buffer);
+
+static const struct wl_buffer_listener bench_buffer_listener = {
+    bench_buffer_release};
+
+static void bench_window_create_buffers(struct bench_window* window) {
+  struct bench_client* client = window->client;
+  int i;
+
+  window->stride = window->width * bench_bpp(client->format);
+  for (i = 0; i < 2; ++i) {
+    struct bench_buffer* buffer = &window->buffers[i];
+    struct wl_shm_pool* pool;
+    int fd;
+    int rv;
+
+    buffer->window = window;
+    buffer->size =
+        bench_buffer_size(client->format, window->stride, window->height);
+    fd = memfd_create("sommelier-benchmark", MFD_CLOEXEC);
+    assert(fd >= 0);
+    rv = ftruncate(fd, buffer->size);
+    assert(!rv);
+    (void)rv;
+    buffer->data =
+        mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(buffer->data != MAP_FAILED);
+
+    pool = wl_shm_create_pool(client->shm, fd, buffer->size);
+    buffer->buffer = wl_shm_pool_create_buffer(
+        pool, 0, window->width, window->height, window->stride, client->format);
+    wl_buffer_add_listener(buffer->buffer, &bench_buffer_listener, buffer);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    buffer->busy = 0;
+  }
+}
+
+static void bench_window_destroy_buffers(struct bench_window* window) {
+  int i;
+
+  for (i = 0; i < 2; ++i) {
+    struct bench_buffer* buffer = &window->buffers[i];
+
+    wl_buffer_destroy(buffer->buffer);
+    munmap(buffer->data, buffer->size);
+  }
+}
+
+static void bench_fill(struct bench_client* client,
+                       struct bench_window* window,
+                       struct bench_buffer* buffer,
+                       int32_t x,
+                       int32_t y,
+                       int32_t width,
+                       int32_t height) {
+  uint32_t color = window->frames * 0x010203;
+  int32_t bpp = bench_bpp(client->format);
+  uint8_t* data = buffer->data;
+  int32_t i, j;
+
+  for (j = y; j < y + height; ++j) {
+    uint8_t* row = data + j * window->stride;
+
+    switch (bpp) {
+      case 4:
+        for (i = x; i < x + width; ++i)
+          ((uint32_t*)row)[i] = color;
+        break;
+      case 2:
+        for (i = x; i < x + width; ++i)
+          ((uint16_t*)row)[i] = color;
+        break;
+      default:
+        memset(row + x, color, width);
+        break;
+    }
+  }
+
+  // Chroma plane of NV12 buffers.
+  if (client->format == WL_SHM_FORMAT_NV12) {
+    uint8_t* uv = data + window->stride * window->height;
+
+    for (j = y / 2; j < (y + height) / 2; ++j)
+      memset(uv + j * window->stride + (x & ~1), color >> 8, width & ~1);
+  }
+}
+
+static void bench_frame_done(void* data,
+                             struct wl_callback* callback,
+                             uint32_t time);
+
+static const struct wl_callback_listener bench_frame_listener = {
+    bench_frame_done};
+
+static void bench_window_draw(struct bench_window* window) {
+  struct bench_client* client = window->client;
+  struct bench_buffer* buffer = NULL;
+  int32_t x = 0, y = 0, width = window->width, height = window->height;
+  int i;
+
+  if (client->resize_interval && window->frames &&
+      window->frames % client->resize_interval == 0) {
+    // Alternate between the full and a random smaller size.
+    bench_window_destroy_buffers(window);
+    if (window->width == client->width) {
+      window->width = MAX(16, rand_r(&client->seed) % client->width) & ~1;
+      window->height = MAX(16, rand_r(&client->seed) % client->height) & ~1;
+    } else {
+      window->width = client->width;
+      window->height = client->height;
+    }
+    bench_window_create_buffers(window);
+    width = window->width;
+    height = window->height;
+    ++client->resizes;
+  }
+
+  for (i = 0; i < 2; ++i) {
+    if (!window->buffers[i].busy) {
+      buffer = &window->buffers[i];
+      break;
+    }
+  }
+  if (!buffer) {
+    window->waiting_for_buffer = 1;
+    return;
+  }
+  window->waiting_for_buffer = 0;
+
+  switch (client->damage) {
+    case DAMAGE_PARTIAL:
+      width = MIN(PARTIAL_DAMAGE_SIZE, window->width);
+      height = MIN(PARTIAL_DAMAGE_SIZE, window->height);
+      x = (window->frames * 16) % (window->width - width + 1);
+      y = (window->frames * 8) % (window->height - height + 1);
+      break;
+    case DAMAGE_RANDOM:
+      width = 1 + rand_r(&client->seed) % window->width;
+      height = 1 + rand_r(&client->seed) % window->height;
+      x = rand_r(&client->seed) % (window->width - width + 1);
+      y = rand_r(&client->seed) % (window->height - height + 1);
+      break;
+  }
+
+  bench_fill(client, window, buffer, x, y, width, height);
+  client->damage_bytes +=
+      (uint64_t)width * height * bench_bpp(client->format) *
+      (client->format == WL_SHM_FORMAT_NV12 ? 3 : 2) / 2;
+
+  window->callback = wl_surface_frame(window->surface);
+  wl_callback_add_listener(window->callback, &bench_frame_listener, window);
+  wl_surface_attach(window->surface, buffer->buffer, 0, 0);
+  wl_surface_damage(window->surface, x, y, width, height);
+  wl_surface_commit(window->surface);
+  buffer->busy = 1;
+  window->commit_time = bench_now();
+}
+
+static void bench_buffer_release(void* data, struct wl_buffer* wl_buffer) {
+  struct bench_buffer* buffer = data;
+
+  buffer->busy = 0;
+  if (buffer->window->waiting_for_buffer)
+    bench_window_draw(buffer->window);
+}
+
+static void bench_frame_done(void* data,
+                             struct wl_callback* callback,
+                             uint32_t time) {
+  struct bench_window* window = data;
+  struct bench_client* client = window->client;
+
+  wl_callback_destroy(callback);
+  window->callback = NULL;
+
+  if (client->num_latencies == client->max_latencies) {
+    client->max_latencies = MAX(1024, client->max_latencies * 2);
+    client->latencies = realloc(client->latencies, client->max_latencies *
+                                                       sizeof(uint64_t));
+    assert(client->latencies);
+  }
+  client->latencies[client->num_latencies++] =
+      bench_now() - window->commit_time;
+
+  ++window->frames;
+  ++client->frames;
+  bench_window_draw(window);
+}
+
+static void bench_shell_surface_ping(void* data,
+                                     struct wl_shell_surface* shell_surface,
+                                     uint32_t serial) {
+  wl_shell_surface_pong(shell_surface, serial);
+}
+
+static void bench_shell_surface_configure(
+    void* data,
+    struct wl_shell_surface* shell_surface,
+    uint32_t edges,
+    int32_t width,
+    int32_t height) {}
+
+static void bench_shell_surface_popup_done(
+    void* data, struct wl_shell_surface* shell_surface) {}
+
+static const struct wl_shell_surface_listener bench_shell_surface_listener = {
+    bench_shell_surface_ping, bench_shell_surface_configure,
+    bench_shell_surface_popup_done};
+
+static void bench_pointer_enter(void* data,
+                                struct wl_pointer* pointer,
+                                uint32_t serial,
+                                struct wl_surface* surface,
+                                wl_fixed_t x,
+                                wl_fixed_t y) {}
+
+static void bench_pointer_leave(void* data,
+                                struct wl_pointer* pointer,
+                                uint32_t serial,
+                                struct wl_surface* surface) {}
+
+static void bench_pointer_motion(void* data,
+                                 struct wl_pointer* pointer,
+                                 uint32_t time,
+                                 wl_fixed_t x,
+                                 wl_fixed_t y) {
+  struct bench_client* client = data;
+
+  ++client->pointer_events;
+}
+
+static void bench_pointer_button(void* data,
+                                 struct wl_pointer* pointer,
+                                 uint32_t serial,
+                                 uint32_t time,
+                                 uint32_t button,
+                                 uint32_t state) {}
+
+static void bench_pointer_axis(void* data,
+                               struct wl_pointer* pointer,
+                               uint32_t time,
+                               uint32_t axis,
+                               wl_fixed_t value) {}
+
+static void bench_pointer_frame(void* data, struct wl_pointer* pointer) {}
+
+static void bench_pointer_axis_source(void* data,
+                                      struct wl_pointer* pointer,
+                                      uint32_t axis_source) {}
+
+static void bench_pointer_axis_stop(void* data,
+                                    struct wl_pointer* pointer,
+                                    uint32_t time,
+                                    uint32_t axis) {}
+
+static void bench_pointer_axis_discrete(void* data,
+                                        struct wl_pointer* pointer,
+                                        uint32_t axis,
+                                        int32_t discrete) {}
+
+static const struct wl_pointer_listener bench_pointer_listener = {
+    bench_pointer_enter,       bench_pointer_leave,     bench_pointer_motion,
+    bench_pointer_button,      bench_pointer_axis,      bench_pointer_frame,
+    bench_pointer_axis_source, bench_pointer_axis_stop,
+    bench_pointer_axis_discrete};
+
+static void bench_data_source_target(void* data,
+                                     struct wl_data_source* data_source,
+                                     const char* mime_type) {}
+
+// Writes the whole clipboard payload. The host reads it concurrently.
+static void bench_data_source_send(void* data,
+                                   struct wl_data_source* data_source,
+                                   const char* mime_type,
+                                   int32_t fd) {
+  struct bench_client* client = data;
+  char buffer[65536];
+  size_t remaining = client->clipboard_size;
+
+  memset(buffer, 'a', sizeof(buffer));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+  while (remaining) {
+    ssize_t bytes = write(fd, buffer, MIN(remaining, sizeof(buffer)));
+
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "error: clipboard write failed: %m\n");
+      break;
+    }
+    remaining -= bytes;
+  }
+  close(fd);
+}
+
+static void bench_data_source_cancelled(void* data,
+                                        struct wl_data_source* data_source) {}
+
+static void bench_data_source_dnd_drop_performed(
+    void* data, struct wl_data_source* data_source) {}
+
+static void bench_data_source_dnd_finished(void* data,
+                                           struct wl_data_source* data_source) {
+}
+
+static void bench_data_source_action(void* data,
+                                     struct wl_data_source* data_source,
+                                     uint32_t dnd_action) {}
+
+static const struct wl_data_source_listener bench_data_source_listener = {
+    bench_data_source_target,
+    bench_data_source_send,
+    bench_data_source_cancelled,
+    bench_data_source_dnd_drop_performed,
+    bench_data_source_dnd_finished,
+    bench_data_source_action};
+
+static void bench_registry_global(void* data,
+                                  struct wl_registry* registry,
+                                  uint32_t id,
+                                  const char* interface,
+                                  uint32_t version) {
+  struct bench_client* client = data;
+
+  if (strcmp(interface, "wl_compositor") == 0) {
+    client->compositor =
+        wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+  } else if (strcmp(interface, "wl_shell") == 0) {
+    client->shell = wl_registry_bind(registry, id, &wl_shell_interface, 1);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    client->shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
+  } else if (strcmp(interface, "wl_seat") == 0 && !client->seat) {
+    client->seat =
+        wl_registry_bind(registry, id, &wl_seat_interface, MIN(version, 5));
+  } else if (strcmp(interface, "wl_data_device_manager") == 0) {
+    client->data_device_manager = wl_registry_bind(
+        registry, id, &wl_data_device_manager_interface, MIN(version, 3));
+  }
+}
+
+static void bench_registry_global_remove(void* data,
+                                         struct wl_registry* registry,
+                                         uint32_t id) {}
+
+static const struct wl_registry_listener bench_registry_listener = {
+    bench_registry_global, bench_registry_global_remove};
+
+static int bench_compare_latency(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+static double bench_percentile_ms(struct bench_client* client, int percent) {
+  size_t index;
+
+  if (!client->num_latencies)
+    return 0;
+
+  index = MIN(client->num_latencies - 1,
+              client->num_latencies * percent / 100);
+  return client->latencies[index] / 1000000.0;
+}
+
+// Reads a memory counter of the parent process, which is the sommelier that
+// forwards this client.
+static long bench_parent_memory_kb(const char* field) {
+  char path[64];
+  char line[256];
+  size_t length = strlen(field);
+  long value = -1;
+  FILE* file;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", getppid());
+  file = fopen(path, "r");
+  if (!file)
+    return -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, field, length) == 0 && line[length] == ':') {
+      value = strtol(line + length + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(file);
+
+  return value;
+}
+
+static void bench_print_report(struct bench_client* client) {
+  double seconds = (bench_now() - client->start_time) / 1000000000.0;
+
+  qsort(client->latencies, client->num_latencies, sizeof(uint64_t),
+        bench_compare_latency);
+
+  printf("client: %d surfaces %dx%d\n", client->num_windows, client->width,
+         client->height);
+  printf("client: %" PRIu64 " frames in %.2f s, %.1f frames/s\n",
+         client->frames, seconds, client->frames / seconds);
+  printf("client: damage %.1f MB/s\n",
+         client->damage_bytes / seconds / (1024 * 1024));
+  printf("client: commit latency p50 %.3f ms p99 %.3f ms\n",
+         bench_percentile_ms(client, 50), bench_percentile_ms(client, 99));
+  if (client->resizes)
+    printf("client: %" PRIu64 " resizes\n", client->resizes);
+  if (client->pointer_events)
+    printf("client: %" PRIu64 " pointer events %.1f/s\n",
+           client->pointer_events, client->pointer_events / seconds);
+  printf("client: sommelier rss %ld kB peak %ld kB\n",
+         bench_parent_memory_kb("VmRSS"), bench_parent_memory_kb("VmHWM"));
+}
+
+static void bench_print_usage() {
+  printf(
+      "usage: sommelier_benchmark_client [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --surfaces=N\t\t\tNumber of surfaces to draw into\n"
+      "  --width=W\t\t\tSurface width\n"
+      "  --height=H\t\t\tSurface height\n"
+      "  --format=FORMAT\t\tBuffer format (argb8888, xrgb8888, rgb565,"
+      " nv12)\n"
+      "  --damage=PATTERN\t\tDamage pattern (full, partial, random)\n"
+      "  --resize-interval=FRAMES\tResize surfaces every FRAMES frames\n"
+      "  --clipboard-size=BYTES\tSet a selection of BYTES at startup\n"
+      "  --duration=SECONDS\t\tTime to run for\n");
+}
+
+static const char* bench_arg_value(const char* arg) {
+  const char* s = strchr(arg, '=');
+  if (!s) {
+    bench_print_usage();
+    exit(EXIT_FAILURE);
+  }
+  return s + 1;
+}
+
+int main(int argc, char** argv) {
+  struct bench_client client = {
+      .num_windows = 1,
+      .width = 512,
+      .height = 512,
+      .format = WL_SHM_FORMAT_ARGB8888,
+      .damage = DAMAGE_FULL,
+      .resize_interval = 0,
+      .clipboard_size = 0,
+      .seed = 1,
+  };
+  uint64_t duration = 5;
+  uint64_t end_time;
+  struct pollfd pollfd;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      bench_print_usage();
+      return EXIT_SUCCESS;
+    }
+    if (strstr(arg, "--surfaces") == arg) {
+      client.num_windows = MAX(1, atoi(bench_arg_value(arg)));
+    } else if (strstr(arg, "--width") == arg) {
+      client.width = MAX(16, atoi(bench_arg_value(arg))) & ~1;
+    } else if (strstr(arg, "--height") == arg) {
+      client.height = MAX(16, atoi(bench_arg_value(arg))) & ~1;
+    } else if (strstr(arg, "--format") == arg) {
+      const char* format = bench_arg_value(arg);
+
+      if (strcmp(format, "argb8888") == 0) {
+        client.format = WL_SHM_FORMAT_ARGB8888;
+      } else if (strcmp(format, "xrgb8888") == 0) {
+        client.format = WL_SHM_FORMAT_XRGB8888;
+      } else if (strcmp(format, "rgb565") == 0) {
+        client.format = WL_SHM_FORMAT_RGB565;
+      } else if (strcmp(format, "nv12") == 0) {
+        client.format = WL_SHM_FORMAT_NV12;
+      } else {
+        fprintf(stderr, "error: unknown format: %s\n", format);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--damage") == arg) {
+      const char* damage = bench_arg_value(arg);
+
+      if (strcmp(damage, "full") == 0) {
+        client.damage = DAMAGE_FULL;
+      } else if (strcmp(damage, "partial") == 0) {
+        client.damage = DAMAGE_PARTIAL;
+      } else if (strcmp(damage, "random") == 0) {
+        client.damage = DAMAGE_RANDOM;
+      } else {
+        fprintf(stderr, "error: unknown damage pattern: %s\n", damage);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--resize-interval") == arg) {
+      client.resize_interval = atoi(bench_arg_value(arg));
+    } else if (strstr(arg, "--clipboard-size") == arg) {
+      client.clipboard_size = strtoul(bench_arg_value(arg), NULL, 10);
+    } else if (strstr(arg, "--duration") == arg) {
+      duration = atoi(bench_arg_value(arg));
+    } else {
+      fprintf(stderr, "error: unknown option: %s\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+
+  client.display = wl_display_connect(NULL);
+  if (!client.display) {
+    fprintf(stderr, "error: failed to connect to display\n");
+    return EXIT_FAILURE;
+  }
+
+  wl_registry_add_listener(wl_display_get_registry(client.display),
+                           &bench_registry_listener, &client);
+  wl_display_roundtrip(client.display);
+
+  if (!client.compositor || !client.shell || !client.shm) {
+    fprintf(stderr, "error: missing compositor, shell or shm global\n");
+    return EXIT_FAILURE;
+  }
+
+  if (client.seat) {
+    client.pointer = wl_seat_get_pointer(client.seat);
+    wl_pointer_add_listener(client.pointer, &bench_pointer_listener, &client);
+  }
+
+  if (client.clipboard_size && client.seat && client.data_device_manager) {
+    struct wl_data_device* data_device = wl_data_device_manager_get_data_device(
+        client.data_device_manager, client.seat);
+
+    client.data_source =
+        wl_data_device_manager_create_data_source(client.data_device_manager);
+    wl_data_source_add_listener(client.data_source,
+                                &bench_data_source_listener, &client);
+    wl_data_source_offer(client.data_source, "text/plain;charset=utf-8");
+    wl_data_device_set_selection(data_device, client.data_source, 0);
+  }
+
+  client.windows = calloc(client.num_windows, sizeof(struct bench_window));
+  assert(client.windows);
+  for (i = 0; i < client.num_windows; ++i) {
+    struct bench_window* window = &client.windows[i];
+
+    window->client = &client;
+    window->width = client.width;
+    window->height = client.height;
+    window->surface = wl_compositor_create_surface(client.compositor);
+    window->shell_surface =
+        wl_shell_get_shell_surface(client.shell, window->surface);
+    wl_shell_surface_add_listener(window->shell_surface,
+                                  &bench_shell_surface_listener, window);
+    wl_shell_surface_set_toplevel(window->shell_surface);
+    wl_shell_surface_set_title(window->shell_surface, "sommelier_benchmark");
+    bench_window_create_buffers(window);
+  }
+
+  client.start_time = bench_now();
+  end_time = client.start_time + duration * 1000000000ull;
+  for (i = 0; i < client.num_windows; ++i)
+    bench_window_draw(&client.windows[i]);
+
+  pollfd.fd = wl_display_get_fd(client.display);
+  pollfd.events = POLLIN;
+  while (bench_now() < end_time) {
+    int rv;
+
+    while (wl_display_prepare_read(client.display) != 0)
+      wl_display_dispatch_pending(client.display);
+    if (wl_display_flush(client.display) < 0 && errno != EAGAIN) {
+      wl_display_cancel_read(client.display);
+      fprintf(stderr, "error: connection lost\n");
+      return EXIT_FAILURE;
+    }
+
+    rv = poll(&pollfd, 1, 100);
+    if (rv > 0) {
+      if (wl_display_read_events(client.display) < 0) {
+        fprintf(stderr, "error: connection lost\n");
+        return EXIT_FAILURE;
+      }
+    } else {
+      wl_display_cancel_read(client.display);
+    }
+    wl_display_dispatch_pending(client.display);
+  }
+
+  bench_print_report(&client);
+  fflush(stdout);
+
+  wl_display_disconnect(client.display);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1181 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Headless host compositor used to benchmark sommelier. It implements just
+// enough of the host protocol for sommelier to forward a client, runs
+// sommelier with the benchmark client and reports what reached the host.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define UNUSED(x) ((void)(x))
+
+#define OUTPUT_WIDTH 1920
+#define OUTPUT_HEIGHT 1080
+
+#define DRM_FORMAT_XRGB8888 0x34325258
+#define DRM_FORMAT_ARGB8888 0x34325241
+
+struct bench_host {
+  struct wl_display* display;
+  struct wl_event_loop* event_loop;
+  struct wl_list surfaces;
+  struct wl_list pointers;
+  struct wl_event_source* pointer_timer;
+  struct wl_event_source* frame_timer;
+  int pointer_rate;
+  int refresh;
+  pid_t child_pid;
+  int child_status;
+  uint32_t serial;
+  uint64_t start_time;
+  uint64_t commits;
+  uint64_t frames;
+  uint64_t shm_bytes;
+  uint64_t dmabuf_bytes;
+  uint64_t pointer_events;
+  uint64_t clipboard_bytes;
+  uint64_t clipboard_start_time;
+  uint64_t clipboard_time;
+  int clipboard_fd;
+  struct wl_event_source* clipboard_event_source;
+  uint32_t checksum;
+};
+
+struct bench_surface {
+  struct bench_host* host;
+  struct wl_resource* resource;
+  struct wl_list link;
+  struct wl_resource* pending_buffer;
+  struct wl_listener pending_buffer_listener;
+  struct wl_resource* current_buffer;
+  struct wl_listener current_buffer_listener;
+  int attached;
+  int32_t damage_x1, damage_y1, damage_x2, damage_y2;
+  struct wl_list pending_frame_callbacks;
+  struct wl_list frame_callbacks;
+};
+
+struct bench_pointer {
+  struct bench_host* host;
+  struct wl_resource* resource;
+  struct wl_list link;
+  struct bench_surface* focus;
+  int32_t x;
+};
+
+struct bench_dmabuf_params {
+  int fds[4];
+};
+
+struct bench_dmabuf_buffer {
+  int32_t width;
+  int32_t height;
+};
+
+struct bench_data_source {
+  char* mime_type;
+};
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t bench_now_ms(void) {
+  return bench_now() / 1000000;
+}
+
+static void bench_destroy(struct wl_client* client,
+                          struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+// Handler for requests without arguments that have no effect here.
+static void bench_ignore(struct wl_client* client,
+                         struct wl_resource* resource) {}
+
+// Buffers.
+
+static void bench_set_buffer(struct wl_resource** slot,
+                             struct wl_listener* listener,
+                             struct wl_resource* buffer) {
+  wl_list_remove(&listener->link);
+  wl_list_init(&listener->link);
+  *slot = buffer;
+  if (buffer)
+    wl_resource_add_destroy_listener(buffer, listener);
+}
+
+static void bench_pending_buffer_destroyed(struct wl_listener* listener,
+                                           void* data) {
+  struct bench_surface* surface =
+      wl_container_of(listener, surface, pending_buffer_listener);
+
+  wl_list_remove(&listener->link);
+  wl_list_init(&listener->link);
+  surface->pending_buffer = NULL;
+}
+
+static void bench_current_buffer_destroyed(struct wl_listener* listener,
+                                           void* data) {
+  struct bench_surface* surface =
+      wl_container_of(listener, surface, current_buffer_listener);
+
+  wl_list_remove(&listener->link);
+  wl_list_init(&listener->link);
+  surface->current_buffer = NULL;
+}
+
+static const struct wl_buffer_interface bench_buffer_implementation = {
+    bench_destroy};
+
+static void bench_dmabuf_buffer_destroy(struct wl_resource* resource) {
+  free(wl_resource_get_user_data(resource));
+}
+
+// Reads the damaged part of a buffer the way a compositor uploading it to
+// the GPU would.
+static void bench_present(struct bench_surface* surface) {
+  struct bench_host* host = surface->host;
+  struct wl_resource* buffer = surface->current_buffer;
+  struct wl_shm_buffer* shm_buffer;
+  int32_t x1, y1, x2, y2;
+
+  if (!buffer || surface->damage_x2 <= surface->damage_x1 ||
+      surface->damage_y2 <= surface->damage_y1)
+    return;
+
+  shm_buffer = wl_shm_buffer_get(buffer);
+  if (shm_buffer) {
+    int32_t width = wl_shm_buffer_get_width(shm_buffer);
+    int32_t height = wl_shm_buffer_get_height(shm_buffer);
+    int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+    int32_t bpp = stride / MAX(width, 1);
+    const uint8_t* data;
+    int32_t x, y;
+
+    x1 = MAX(surface->damage_x1, 0);
+    y1 = MAX(surface->damage_y1, 0);
+    x2 = MIN(surface->damage_x2, width);
+    y2 = MIN(surface->damage_y2, height);
+    if (x2 <= x1 || y2 <= y1 || bpp <= 0)
+      return;
+
+    wl_shm_buffer_begin_access(shm_buffer);
+    data = wl_shm_buffer_get_data(shm_buffer);
+    // Touch one byte per cache line.
+    for (y = y1; y < y2; ++y) {
+      const uint8_t* row = data + y * stride;
+
+      for (x = x1 * bpp; x < x2 * bpp; x += 64)
+        host->checksum += row[x];
+    }
+    wl_shm_buffer_end_access(shm_buffer);
+    host->shm_bytes += (uint64_t)(x2 - x1) * (y2 - y1) * bpp;
+  } else if (wl_resource_instance_of(buffer, &wl_buffer_interface,
+                                     &bench_buffer_implementation)) {
+    struct bench_dmabuf_buffer* dmabuf = wl_resource_get_user_data(buffer);
+
+    x1 = MAX(surface->damage_x1, 0);
+    y1 = MAX(surface->damage_y1, 0);
+    x2 = MIN(surface->damage_x2, dmabuf->width);
+    y2 = MIN(surface->damage_y2, dmabuf->height);
+    if (x2 > x1 && y2 > y1)
+      host->dmabuf_bytes += (uint64_t)(x2 - x1) * (y2 - y1) * 4;
+  }
+}
+
+static void bench_send_frame_callbacks(struct bench_surface* surface,
+                                       uint32_t time) {
+  struct wl_resource* callback;
+  struct wl_resource* tmp;
+
+  wl_resource_for_each_safe(callback, tmp, &surface->frame_callbacks) {
+    wl_callback_send_done(callback, time);
+    wl_resource_destroy(callback);
+    ++surface->host->frames;
+  }
+}
+
+// Surfaces.
+
+static void bench_surface_attach(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 struct wl_resource* buffer_resource,
+                                 int32_t x,
+                                 int32_t y) {
+  struct bench_surface* surface = wl_resource_get_user_data(resource);
+
+  bench_set_buffer(&surface->pending_buffer,
+                   &surface->pending_buffer_listener, buffer_resource);
+  surface->attached = 1;
+}
+
+static void bench_surface_damage(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 int32_t x,
+                                 int32_t y,
+                                 int32_t width,
+                                 int32_t height) {
+  struct bench_surface* surface = wl_resource_get_user_data(resource);
+
+  if (width <= 0 || height <= 0)
+    return;
+
+  // Clamp to avoid overflow from INT32_MAX sized damage.
+  width = MIN(width, OUTPUT_WIDTH * 4);
+  height = MIN(height, OUTPUT_HEIGHT * 4);
+  if (surface->damage_x2 <= surface->damage_x1) {
+    surface->damage_x1 = x;
+    surface->damage_y1 = y;
+    surface->damage_x2 = x + width;
+    surface->damage_y2 = y + height;
+  } else {
+    surface->damage_x1 = MIN(surface->damage_x1, x);
+    surface->damage_y1 = MIN(surface->damage_y1, y);
+    surface->damage_x2 = MAX(surface->damage_x2, x + width);
+    surface->damage_y2 = MAX(surface->damage_y2, y + height);
+  }
+}
+
+static void bench_callback_destroy(struct wl_resource* resource) {
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void bench_surface_frame(struct wl_client* client,
+                                struct wl_resource* resource,
+                                uint32_t callback) {
+  struct bench_surface* surface = wl_resource_get_user_data(resource);
+  struct wl_resource* callback_resource =
+      wl_resource_create(client, &wl_callback_interface, 1, callback);
+
+  wl_resource_set_implementation(callback_resource, NULL, NULL,
+                                 bench_callback_destroy);
+  wl_list_insert(surface->pending_frame_callbacks.prev,
+                 wl_resource_get_link(callback_resource));
+}
+
+static void bench_surface_commit(struct wl_client* client,
+                                 struct wl_resource* resource) {
+  struct bench_surface* surface = wl_resource_get_user_data(resource);
+  struct bench_host* host = surface->host;
+
+  ++host->commits;
+
+  if (surface->attached) {
+    if (surface->current_buffer &&
+        surface->current_buffer != surface->pending_buffer)
+      wl_buffer_send_release(surface->current_buffer);
+    bench_set_buffer(&surface->current_buffer,
+                     &surface->current_buffer_listener,
+                     surface->pending_buffer);
+    bench_set_buffer(&surface->pending_buffer,
+                     &surface->pending_buffer_listener, NULL);
+    surface->attached = 0;
+  }
+
+  bench_present(surface);
+  surface->damage_x1 = surface->damage_y1 = 0;
+  surface->damage_x2 = surface->damage_y2 = 0;
+
+  wl_list_insert_list(surface->frame_callbacks.prev,
+                      &surface->pending_frame_callbacks);
+  wl_list_init(&surface->pending_frame_callbacks);
+
+  // Without a refresh rate every commit is presented immediately.
+  if (!host->refresh)
+    bench_send_frame_callbacks(surface, bench_now_ms());
+}
+
+static void bench_surface_damage_buffer(struct wl_client* client,
+                                        struct wl_resource* resource,
+                                        int32_t x,
+                                        int32_t y,
+                                        int32_t width,
+                                        int32_t height) {
+  bench_surface_damage(client, resource, x, y, width, height);
+}
+
+static void bench_surface_set_region(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     struct wl_resource* region) {}
+
+static void bench_surface_set_buffer_transform(struct wl_client* client,
+                                               struct wl_resource* resource,
+                                               int32_t transform) {}
+
+static void bench_surface_set_buffer_scale(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           int32_t scale) {}
+
+static const struct wl_surface_interface bench_surface_implementation = {
+    bench_destroy,
+    bench_surface_attach,
+    bench_surface_damage,
+    bench_surface_frame,
+    bench_surface_set_region,
+    bench_surface_set_region,
+    bench_surface_commit,
+    bench_surface_set_buffer_transform,
+    bench_surface_set_buffer_scale,
+    bench_surface_damage_buffer};
+
+static void bench_surface_destroy(struct wl_resource* resource) {
+  struct bench_surface* surface = wl_resource_get_user_data(resource);
+  struct bench_pointer* pointer;
+  struct wl_resource* callback;
+  struct wl_resource* tmp;
+
+  wl_list_for_each(pointer, &surface->host->pointers, link) {
+    if (pointer->focus == surface)
+      pointer->focus = NULL;
+  }
+  wl_resource_for_each_safe(callback, tmp, &surface->pending_frame_callbacks)
+      wl_resource_destroy(callback);
+  wl_resource_for_each_safe(callback, tmp, &surface->frame_callbacks)
+      wl_resource_destroy(callback);
+  wl_list_remove(&surface->pending_buffer_listener.link);
+  wl_list_remove(&surface->current_buffer_listener.link);
+  wl_list_remove(&surface->link);
+  free(surface);
+}
+
+static void bench_region_update(struct wl_client* client,
+                                struct wl_resource* resource,
+                                int32_t x,
+                                int32_t y,
+                                int32_t width,
+                                int32_t height) {}
+
+static const struct wl_region_interface bench_region_implementation = {
+    bench_destroy, bench_region_update, bench_region_update};
+
+static void bench_compositor_create_surface(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            uint32_t id) {
+  struct bench_host* host = wl_resource_get_user_data(resource);
+  struct bench_surface* surface = calloc(1, sizeof(*surface));
+
+  assert(surface);
+  surface->host = host;
+  surface->resource = wl_resource_create(
+      client, &wl_surface_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(surface->resource,
+                                 &bench_surface_implementation, surface,
+                                 bench_surface_destroy);
+  wl_list_init(&surface->pending_buffer_listener.link);
+  surface->pending_buffer_listener.notify = bench_pending_buffer_destroyed;
+  wl_list_init(&surface->current_buffer_listener.link);
+  surface->current_buffer_listener.notify = bench_current_buffer_destroyed;
+  wl_list_init(&surface->pending_frame_callbacks);
+  wl_list_init(&surface->frame_callbacks);
+  wl_list_insert(host->surfaces.prev, &surface->link);
+}
+
+static void bench_compositor_create_region(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           uint32_t id) {
+  struct wl_resource* region_resource =
+      wl_resource_create(client, &wl_region_interface, 1, id);
+
+  wl_resource_set_implementation(region_resource,
+                                 &bench_region_implementation, NULL, NULL);
+}
+
+static const struct wl_compositor_interface bench_compositor_implementation = {
+    bench_compositor_create_surface, bench_compositor_create_region};
+
+static void bench_bind_compositor(struct wl_client* client,
+                                  void* data,
+                                  uint32_t version,
+                                  uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_compositor_interface, version, id);
+
+  wl_resource_set_implementation(resource, &bench_compositor_implementation,
+                                 data, NULL);
+}
+
+// Subsurfaces and shell surfaces are accepted but have no effect.
+
+static void bench_subsurface_set_position(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          int32_t x,
+                                          int32_t y) {}
+
+static void bench_subsurface_place(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   struct wl_resource* sibling) {}
+
+static const struct wl_subsurface_interface bench_subsurface_implementation = {
+    bench_destroy,          bench_subsurface_set_position,
+    bench_subsurface_place, bench_subsurface_place,
+    bench_ignore,           bench_ignore};
+
+static void bench_subcompositor_get_subsurface(struct wl_client* client,
+                                               struct wl_resource* resource,
+                                               uint32_t id,
+                                               struct wl_resource* surface,
+                                               struct wl_resource* parent) {
+  struct wl_resource* subsurface_resource =
+      wl_resource_create(client, &wl_subsurface_interface, 1, id);
+
+  wl_resource_set_implementation(subsurface_resource,
+                                 &bench_subsurface_implementation, NULL, NULL);
+}
+
+static const struct wl_subcompositor_interface
+    bench_subcompositor_implementation = {bench_destroy,
+                                          bench_subcompositor_get_subsurface};
+
+static void bench_bind_subcompositor(struct wl_client* client,
+                                     void* data,
+                                     uint32_t version,
+                                     uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_subcompositor_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &bench_subcompositor_implementation,
+                                 data, NULL);
+}
+
+static void bench_shell_surface_pong(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     uint32_t serial) {}
+
+static void bench_shell_surface_move(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     struct wl_resource* seat,
+                                     uint32_t serial) {}
+
+static void bench_shell_surface_resize(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       struct wl_resource* seat,
+                                       uint32_t serial,
+                                       uint32_t edges) {}
+
+static void bench_shell_surface_set_transient(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              struct wl_resource* parent,
+                                              int32_t x,
+                                              int32_t y,
+                                              uint32_t flags) {}
+
+static void bench_shell_surface_set_fullscreen(struct wl_client* client,
+                                               struct wl_resource* resource,
+                                               uint32_t method,
+                                               uint32_t framerate,
+                                               struct wl_resource* output) {}
+
+static void bench_shell_surface_set_popup(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          struct wl_resource* seat,
+                                          uint32_t serial,
+                                          struct wl_resource* parent,
+                                          int32_t x,
+                                          int32_t y,
+                                          uint32_t flags) {}
+
+static void bench_shell_surface_set_maximized(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              struct wl_resource* output) {}
+
+static void bench_shell_surface_set_string(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           const char* value) {}
+
+static const struct wl_shell_surface_interface
+    bench_shell_surface_implementation = {
+        bench_shell_surface_pong,
+        bench_shell_surface_move,
+        bench_shell_surface_resize,
+        bench_ignore,
+        bench_shell_surface_set_transient,
+        bench_shell_surface_set_fullscreen,
+        bench_shell_surface_set_popup,
+        bench_shell_surface_set_maximized,
+        bench_shell_surface_set_string,
+        bench_shell_surface_set_string};
+
+static void bench_shell_get_shell_surface(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t id,
+                                          struct wl_resource* surface) {
+  struct wl_resource* shell_surface_resource =
+      wl_resource_create(client, &wl_shell_surface_interface, 1, id);
+
+  wl_resource_set_implementation(shell_surface_resource,
+                                 &bench_shell_surface_implementation, NULL,
+                                 NULL);
+}
+
+static const struct wl_shell_interface bench_shell_implementation = {
+    bench_shell_get_shell_surface};
+
+static void bench_bind_shell(struct wl_client* client,
+                             void* data,
+                             uint32_t version,
+                             uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_shell_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &bench_shell_implementation, data,
+                                 NULL);
+}
+
+// Output.
+
+static void bench_bind_output(struct wl_client* client,
+                              void* data,
+                              uint32_t version,
+                              uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_output_interface, MIN(version, 2), id);
+
+  wl_resource_set_implementation(resource, NULL, data, NULL);
+  wl_output_send_geometry(resource, 0, 0, 340, 190,
+                          WL_OUTPUT_SUBPIXEL_UNKNOWN, "sommelier", "benchmark",
+                          WL_OUTPUT_TRANSFORM_NORMAL);
+  wl_output_send_mode(resource,
+                      WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+                      OUTPUT_WIDTH, OUTPUT_HEIGHT, 60000);
+  if (wl_resource_get_version(resource) >= WL_OUTPUT_SCALE_SINCE_VERSION)
+    wl_output_send_scale(resource, 1);
+  if (wl_resource_get_version(resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
+    wl_output_send_done(resource);
+}
+
+// Seat. Pointer motion is generated at a fixed rate over the first surface
+// of the client that owns the pointer.
+
+static void bench_pointer_set_cursor(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     uint32_t serial,
+                                     struct wl_resource* surface,
+                                     int32_t hotspot_x,
+                                     int32_t hotspot_y) {}
+
+static const struct wl_pointer_interface bench_pointer_implementation = {
+    bench_pointer_set_cursor, bench_destroy};
+
+static void bench_pointer_destroy(struct wl_resource* resource) {
+  struct bench_pointer* pointer = wl_resource_get_user_data(resource);
+
+  wl_list_remove(&pointer->link);
+  free(pointer);
+}
+
+static int bench_handle_pointer_timer(void* data) {
+  struct bench_host* host = data;
+  struct bench_pointer* pointer;
+  int interval = MAX(1, 1000 / host->pointer_rate);
+  int count = MAX(1, host->pointer_rate * interval / 1000);
+  uint32_t time = bench_now_ms();
+
+  wl_list_for_each(pointer, &host->pointers, link) {
+    struct wl_client* client = wl_resource_get_client(pointer->resource);
+    int version = wl_resource_get_version(pointer->resource);
+    int i;
+
+    if (!pointer->focus) {
+      struct bench_surface* surface;
+
+      wl_list_for_each(surface, &host->surfaces, link) {
+        if (wl_resource_get_client(surface->resource) == client &&
+            surface->current_buffer) {
+          pointer->focus = surface;
+          break;
+        }
+      }
+      if (!pointer->focus)
+        continue;
+      wl_pointer_send_enter(pointer->resource, ++host->serial,
+                            pointer->focus->resource, wl_fixed_from_int(0),
+                            wl_fixed_from_int(0));
+    }
+
+    for (i = 0; i < count; ++i) {
+      pointer->x = (pointer->x + 1) % 256;
+      wl_pointer_send_motion(pointer->resource, time,
+                             wl_fixed_from_int(pointer->x),
+                             wl_fixed_from_int(pointer->x));
+      if (version >= WL_POINTER_FRAME_SINCE_VERSION)
+        wl_pointer_send_frame(pointer->resource);
+      ++host->pointer_events;
+    }
+  }
+
+  wl_event_source_timer_update(host->pointer_timer, interval);
+  return 0;
+}
+
+static void bench_seat_get_pointer(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   uint32_t id) {
+  struct bench_host* host = wl_resource_get_user_data(resource);
+  struct bench_pointer* pointer = calloc(1, sizeof(*pointer));
+
+  assert(pointer);
+  pointer->host = host;
+  pointer->resource = wl_resource_create(
+      client, &wl_pointer_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(pointer->resource,
+                                 &bench_pointer_implementation, pointer,
+                                 bench_pointer_destroy);
+  wl_list_insert(&host->pointers, &pointer->link);
+}
+
+static const struct wl_keyboard_interface bench_keyboard_implementation = {
+    bench_destroy};
+
+static void bench_seat_get_keyboard(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    uint32_t id) {
+  struct wl_resource* keyboard_resource = wl_resource_create(
+      client, &wl_keyboard_interface, wl_resource_get_version(resource), id);
+  int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  wl_resource_set_implementation(keyboard_resource,
+                                 &bench_keyboard_implementation, NULL, NULL);
+  wl_keyboard_send_keymap(keyboard_resource,
+                          WL_KEYBOARD_KEYMAP_FORMAT_NO_KEYMAP, fd, 0);
+  close(fd);
+}
+
+static const struct wl_touch_interface bench_touch_implementation = {
+    bench_destroy};
+
+static void bench_seat_get_touch(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 uint32_t id) {
+  struct wl_resource* touch_resource = wl_resource_create(
+      client, &wl_touch_interface, wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(touch_resource, &bench_touch_implementation,
+                                 NULL, NULL);
+}
+
+static const struct wl_seat_interface bench_seat_implementation = {
+    bench_seat_get_pointer, bench_seat_get_keyboard, bench_seat_get_touch,
+    bench_destroy};
+
+static void bench_bind_seat(struct wl_client* client,
+                            void* data,
+                            uint32_t version,
+                            uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_seat_interface, MIN(version, 5), id);
+
+  wl_resource_set_implementation(resource, &bench_seat_implementation, data,
+                                 NULL);
+  wl_seat_send_capabilities(
+      resource, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD);
+  if (wl_resource_get_version(resource) >= WL_SEAT_NAME_SINCE_VERSION)
+    wl_seat_send_name(resource, "default");
+}
+
+// Selection. The host reads the whole payload of every selection that is
+// set, which measures the client to host clipboard path.
+
+static void bench_data_source_offer(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    const char* mime_type) {
+  struct bench_data_source* source = wl_resource_get_user_data(resource);
+
+  if (!source->mime_type)
+    source->mime_type = strdup(mime_type);
+}
+
+static void bench_data_source_set_actions(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t dnd_actions) {}
+
+static const struct wl_data_source_interface bench_data_source_implementation =
+    {bench_data_source_offer, bench_destroy, bench_data_source_set_actions};
+
+static void bench_data_source_destroy(struct wl_resource* resource) {
+  struct bench_data_source* source = wl_resource_get_user_data(resource);
+
+  free(source->mime_type);
+  free(source);
+}
+
+static int bench_handle_clipboard_readable(int fd, uint32_t mask, void* data) {
+  struct bench_host* host = data;
+  char buffer[65536];
+  ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+  if (bytes > 0) {
+    host->clipboard_bytes += bytes;
+    return 1;
+  }
+  if (bytes < 0 && errno == EAGAIN)
+    return 1;
+
+  host->clipboard_time += bench_now() - host->clipboard_start_time;
+  wl_event_source_remove(host->clipboard_event_source);
+  host->clipboard_event_source = NULL;
+  close(host->clipboard_fd);
+  host->clipboard_fd = -1;
+  return 1;
+}
+
+static void bench_data_device_set_selection(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            struct wl_resource* source_resource,
+                                            uint32_t serial) {
+  struct bench_host* host = wl_resource_get_user_data(resource);
+  struct bench_data_source* source;
+  int fds[2];
+  int rv;
+
+  if (!source_resource || host->clipboard_fd >= 0)
+    return;
+
+  source = wl_resource_get_user_data(source_resource);
+  if (!source->mime_type)
+    return;
+
+  // Only the read end is non-blocking. The client writes the payload with
+  // blocking writes.
+  rv = pipe2(fds, O_CLOEXEC);
+  assert(!rv);
+  rv = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  assert(!rv);
+  UNUSED(rv);
+
+  host->clipboard_start_time = bench_now();
+  host->clipboard_fd = fds[0];
+  host->clipboard_event_source =
+      wl_event_loop_add_fd(host->event_loop, fds[0], WL_EVENT_READABLE,
+                           bench_handle_clipboard_readable, host);
+  wl_data_source_send_send(source_resource, source->mime_type, fds[1]);
+  close(fds[1]);
+}
+
+static void bench_data_device_start_drag(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         struct wl_resource* source,
+                                         struct wl_resource* origin,
+                                         struct wl_resource* icon,
+                                         uint32_t serial) {}
+
+static const struct wl_data_device_interface bench_data_device_implementation =
+    {bench_data_device_start_drag, bench_data_device_set_selection,
+     bench_destroy};
+
+static void bench_data_device_manager_create_data_source(
+    struct wl_client* client, struct wl_resource* resource, uint32_t id) {
+  struct bench_data_source* source = calloc(1, sizeof(*source));
+  struct wl_resource* source_resource = wl_resource_create(
+      client, &wl_data_source_interface, wl_resource_get_version(resource), id);
+
+  assert(source);
+  wl_resource_set_implementation(source_resource,
+                                 &bench_data_source_implementation, source,
+                                 bench_data_source_destroy);
+}
+
+static void bench_data_device_manager_get_data_device(
+    struct wl_client* client,
+    struct wl_resource* resource,
+    uint32_t id,
+    struct wl_resource* seat) {
+  struct wl_resource* data_device_resource = wl_resource_create(
+      client, &wl_data_device_interface, wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(data_device_resource,
+                                 &bench_data_device_implementation,
+                                 wl_resource_get_user_data(resource), NULL);
+}
+
+static const struct wl_data_device_manager_interface
+    bench_data_device_manager_implementation = {
+        bench_data_device_manager_create_data_source,
+        bench_data_device_manager_get_data_device};
+
+static void bench_bind_data_device_manager(struct wl_client* client,
+                                           void* data,
+                                           uint32_t version,
+                                           uint32_t id) {
+  struct wl_resource* resource = wl_resource_create(
+      client, &wl_data_device_manager_interface, MIN(version, 3), id);
+
+  wl_resource_set_implementation(
+      resource, &bench_data_device_manager_implementation, data, NULL);
+}
+
+// Linux dmabuf. Buffers are accepted without being imported, so only the
+// amount of damage is accounted for.
+
+static void bench_dmabuf_params_add(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    int32_t fd,
+                                    uint32_t plane_idx,
+                                    uint32_t offset,
+                                    uint32_t stride,
+                                    uint32_t modifier_hi,
+                                    uint32_t modifier_lo) {
+  struct bench_dmabuf_params* params = wl_resource_get_user_data(resource);
+
+  if (plane_idx < 4 && params->fds[plane_idx] < 0) {
+    params->fds[plane_idx] = fd;
+  } else {
+    close(fd);
+  }
+}
+
+static struct wl_resource* bench_dmabuf_create_buffer(struct wl_client* client,
+                                                      uint32_t id,
+                                                      int32_t width,
+                                                      int32_t height) {
+  struct bench_dmabuf_buffer* dmabuf = malloc(sizeof(*dmabuf));
+  struct wl_resource* buffer_resource =
+      wl_resource_create(client, &wl_buffer_interface, 1, id);
+
+  assert(dmabuf);
+  dmabuf->width = width;
+  dmabuf->height = height;
+  wl_resource_set_implementation(buffer_resource, &bench_buffer_implementation,
+                                 dmabuf, bench_dmabuf_buffer_destroy);
+  return buffer_resource;
+}
+
+static void bench_dmabuf_params_create(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       int32_t width,
+                                       int32_t height,
+                                       uint32_t format,
+                                       uint32_t flags) {
+  zwp_linux_buffer_params_v1_send_created(
+      resource, bench_dmabuf_create_buffer(client, 0, width, height));
+}
+
+static void bench_dmabuf_params_create_immed(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             uint32_t buffer_id,
+                                             int32_t width,
+                                             int32_t height,
+                                             uint32_t format,
+                                             uint32_t flags) {
+  bench_dmabuf_create_buffer(client, buffer_id, width, height);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface
+    bench_dmabuf_params_implementation = {
+        bench_destroy, bench_dmabuf_params_add, bench_dmabuf_params_create,
+        bench_dmabuf_params_create_immed};
+
+static void bench_dmabuf_params_destroy(struct wl_resource* resource) {
+  struct bench_dmabuf_params* params = wl_resource_get_user_data(resource);
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+    if (params->fds[i] >= 0)
+      close(params->fds[i]);
+  }
+  free(params);
+}
+
+static void bench_dmabuf_create_params(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       uint32_t id) {
+  struct bench_dmabuf_params* params = malloc(sizeof(*params));
+  struct wl_resource* params_resource =
+      wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+                         wl_resource_get_version(resource), id);
+  int i;
+
+  assert(params);
+  for (i = 0; i < 4; ++i)
+    params->fds[i] = -1;
+  wl_resource_set_implementation(params_resource,
+                                 &bench_dmabuf_params_implementation, params,
+                                 bench_dmabuf_params_destroy);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface bench_dmabuf_implementation =
+    {bench_destroy, bench_dmabuf_create_params};
+
+static void bench_bind_dmabuf(struct wl_client* client,
+                              void* data,
+                              uint32_t version,
+                              uint32_t id) {
+  struct wl_resource* resource = wl_resource_create(
+      client, &zwp_linux_dmabuf_v1_interface, MIN(version, 2), id);
+
+  wl_resource_set_implementation(resource, &bench_dmabuf_implementation, data,
+                                 NULL);
+  zwp_linux_dmabuf_v1_send_format(resource, DRM_FORMAT_ARGB8888);
+  zwp_linux_dmabuf_v1_send_format(resource, DRM_FORMAT_XRGB8888);
+}
+
+// Runner.
+
+static int bench_handle_frame_timer(void* data) {
+  struct bench_host* host = data;
+  struct bench_surface* surface;
+  uint32_t time = bench_now_ms();
+
+  wl_list_for_each(surface, &host->surfaces, link)
+      bench_send_frame_callbacks(surface, time);
+
+  wl_event_source_timer_update(host->frame_timer, MAX(1, 1000 / host->refresh));
+  return 0;
+}
+
+static int bench_handle_sigchld(int signal_number, void* data) {
+  struct bench_host* host = data;
+  int status;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == host->child_pid) {
+      host->child_pid = -1;
+      host->child_status = status;
+      wl_display_terminate(host->display);
+    }
+  }
+
+  return 1;
+}
+
+static void bench_print_report(struct bench_host* host) {
+  double seconds = (bench_now() - host->start_time) / 1000000000.0;
+
+  printf("host: %" PRIu64 " commits %.1f/s, %" PRIu64 " frames %.1f/s\n",
+         host->commits, host->commits / seconds, host->frames,
+         host->frames / seconds);
+  printf("host: shm read %.1f MB/s, dmabuf damage %.1f MB/s\n",
+         host->shm_bytes / seconds / (1024 * 1024),
+         host->dmabuf_bytes / seconds / (1024 * 1024));
+  if (host->pointer_events)
+    printf("host: %" PRIu64 " pointer events sent\n", host->pointer_events);
+  if (host->clipboard_time) {
+    printf("host: clipboard %" PRIu64 " bytes in %.2f ms, %.1f MB/s\n",
+           host->clipboard_bytes, host->clipboard_time / 1000000.0,
+           host->clipboard_bytes / (host->clipboard_time / 1000000000.0) /
+               (1024 * 1024));
+  }
+}
+
+static void bench_print_usage() {
+  printf(
+      "usage: sommelier_benchmark [options] [CLIENT OPTIONS]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --sommelier=PATH\t\tSommelier binary to run\n"
+      "  --client=PATH\t\t\tBenchmark client binary to run\n"
+      "  --shm-driver=DRIVER\t\tSHM driver for sommelier to use (noop)\n"
+      "  --drm-device=DEVICE\t\tDRM device for sommelier to use\n"
+      "  --sommelier-arg=ARG\t\tExtra argument passed to sommelier\n"
+      "  --refresh=HZ\t\t\tThrottle frame callbacks to HZ\n"
+      "  --pointer-rate=HZ\t\tSend pointer motion at HZ\n\n"
+      "Remaining options are passed to the client, see its --help.\n");
+}
+
+static char* bench_xasprintf(const char* fmt, ...) {
+  char* str;
+  va_list args;
+  int rv;
+
+  va_start(args, fmt);
+  rv = vasprintf(&str, fmt, args);
+  assert(rv >= 0);
+  UNUSED(rv);
+  va_end(args);
+
+  return str;
+}
+
+static const char* bench_arg_value(const char* arg) {
+  const char* s = strchr(arg, '=');
+  if (!s) {
+    bench_print_usage();
+    exit(EXIT_FAILURE);
+  }
+  return s + 1;
+}
+
+int main(int argc, char** argv) {
+  struct bench_host host = {
+      .pointer_rate = 0,
+      .refresh = 0,
+      .child_pid = -1,
+      .child_status = 0,
+      .clipboard_fd = -1,
+  };
+  const char* sommelier = SOMMELIER_PATH;
+  const char* client = BENCHMARK_CLIENT_PATH;
+  const char* shm_driver = "noop";
+  const char* drm_device = NULL;
+  const char* socket_name;
+  const char* args[64];
+  char runtime_dir[] = "/tmp/sommelier-benchmark-XXXXXX";
+  int private_runtime_dir = 0;
+  int sommelier_argc = 0;
+  int i, n = 0;
+  pid_t pid;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      bench_print_usage();
+      return EXIT_SUCCESS;
+    }
+    if (strstr(arg, "--sommelier=") == arg) {
+      sommelier = bench_arg_value(arg);
+    } else if (strstr(arg, "--client=") == arg) {
+      client = bench_arg_value(arg);
+    } else if (strstr(arg, "--shm-driver") == arg) {
+      shm_driver = bench_arg_value(arg);
+    } else if (strstr(arg, "--drm-device") == arg) {
+      drm_device = bench_arg_value(arg);
+    } else if (strstr(arg, "--sommelier-arg") == arg) {
+      ++sommelier_argc;
+    } else if (strstr(arg, "--refresh") == arg) {
+      host.refresh = atoi(bench_arg_value(arg));
+    } else if (strstr(arg, "--pointer-rate") == arg) {
+      host.pointer_rate = atoi(bench_arg_value(arg));
+    }
+  }
+
+  if (argc + 8 > (int)(sizeof(args) / sizeof(args[0]))) {
+    fprintf(stderr, "error: too many arguments\n");
+    return EXIT_FAILURE;
+  }
+
+  // Run against a private runtime dir when none is available, e.g. in CI.
+  if (!getenv("XDG_RUNTIME_DIR")) {
+    if (!mkdtemp(runtime_dir)) {
+      fprintf(stderr, "error: mkdtemp failed: %m\n");
+      return EXIT_FAILURE;
+    }
+    setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+    private_runtime_dir = 1;
+  }
+
+  host.display = wl_display_create();
+  assert(host.display);
+  host.event_loop = wl_display_get_event_loop(host.display);
+  wl_list_init(&host.surfaces);
+  wl_list_init(&host.pointers);
+
+  socket_name = wl_display_add_socket_auto(host.display);
+  if (!socket_name) {
+    fprintf(stderr, "error: failed to add socket: %m\n");
+    return EXIT_FAILURE;
+  }
+
+  wl_global_create(host.display, &wl_compositor_interface, 4, &host,
+                   bench_bind_compositor);
+  wl_global_create(host.display, &wl_subcompositor_interface, 1, &host,
+                   bench_bind_subcompositor);
+  wl_global_create(host.display, &wl_shell_interface, 1, &host,
+                   bench_bind_shell);
+  wl_global_create(host.display, &wl_output_interface, 2, &host,
+                   bench_bind_output);
+  wl_global_create(host.display, &wl_seat_interface, 5, &host,
+                   bench_bind_seat);
+  wl_global_create(host.display, &wl_data_device_manager_interface, 3, &host,
+                   bench_bind_data_device_manager);
+  wl_global_create(host.display, &zwp_linux_dmabuf_v1_interface, 2, &host,
+                   bench_bind_dmabuf);
+  wl_display_init_shm(host.display);
+  wl_display_add_shm_format(host.display, WL_SHM_FORMAT_RGB565);
+  wl_display_add_shm_format(host.display, WL_SHM_FORMAT_NV12);
+
+  wl_event_loop_add_signal(host.event_loop, SIGCHLD, bench_handle_sigchld,
+                           &host);
+  if (host.refresh > 0) {
+    host.frame_timer = wl_event_loop_add_timer(
+        host.event_loop, bench_handle_frame_timer, &host);
+    wl_event_source_timer_update(host.frame_timer,
+                                 MAX(1, 1000 / host.refresh));
+  }
+  if (host.pointer_rate > 0) {
+    host.pointer_timer = wl_event_loop_add_timer(
+        host.event_loop, bench_handle_pointer_timer, &host);
+    wl_event_source_timer_update(host.pointer_timer, 1);
+  }
+
+  args[n++] = sommelier;
+  args[n++] = bench_xasprintf("--display=%s", socket_name);
+  args[n++] = bench_xasprintf("--shm-driver=%s", shm_driver);
+  // Buffers are only forwarded through virtwl when a virtwl driver is used.
+  if (strncmp(shm_driver, "virtwl", strlen("virtwl")))
+    args[n++] = "--virtwl-device=";
+  if (drm_device)
+    args[n++] = bench_xasprintf("--drm-device=%s", drm_device);
+  for (i = 1; i < argc && sommelier_argc; ++i) {
+    if (strstr(argv[i], "--sommelier-arg") == argv[i])
+      args[n++] = bench_arg_value(argv[i]);
+  }
+  args[n++] = client;
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+
+    if (strstr(arg, "--sommelier") == arg || strstr(arg, "--client=") == arg ||
+        strstr(arg, "--shm-driver") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--refresh") == arg || strstr(arg, "--pointer-rate") == arg)
+      continue;
+    args[n++] = arg;
+  }
+  args[n++] = NULL;
+
+  // The event loop blocks SIGCHLD to receive it through a signalfd. The mask
+  // is inherited, so restore it in the child.
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    execvp(args[0], (char* const*)args);
+    perror(args[0]);
+    _exit(EXIT_FAILURE);
+  }
+  host.child_pid = pid;
+  host.start_time = bench_now();
+
+  wl_display_run(host.display);
+
+  // Flush the clipboard read if it was still in progress.
+  while (host.clipboard_fd >= 0 &&
+         wl_event_loop_dispatch(host.event_loop, 100) >= 0 &&
+         host.clipboard_event_source) {
+  }
+
+  bench_print_report(&host);
+  wl_display_destroy(host.display);
+
+  if (private_runtime_dir)
+    rmdir(runtime_dir);
+
+  if (WIFEXITED(host.child_status))
+    return WEXITSTATUS(host.child_status);
+  return EXIT_FAILURE;
+}
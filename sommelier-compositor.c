@@ -7,13 +7,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <gbm.h>
+#include <inttypes.h>
 #include <libdrm/drm_fourcc.h>
 #include <limits.h>
 #include <linux/virtwl.h>
 #include <pixman.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
@@ -25,6 +28,19 @@
 #define MIN_SIZE (INT_MIN / 10)
 #define MAX_SIZE (INT_MAX / 10)
 
+// Number of frames of damage kept per surface. Output buffers that are
+// older than this are fully redrawn.
+#define SL_DAMAGE_HISTORY_SIZE 4
+
+// Damage regions with more rects than this are simplified before copying.
+#define SL_DAMAGE_MAX_RECTS 32
+
+// Frame callbacks of hidden surfaces are sent at this interval (ms).
+#define SL_HIDDEN_FRAME_INTERVAL 1000
+
+// Released output buffers of hidden surfaces are freed after this delay (ms).
+#define SL_HIDDEN_BUFFER_RELEASE_DELAY 5000
+
 #define DMA_BUF_SYNC_READ (1 << 0)
 #define DMA_BUF_SYNC_WRITE (2 << 0)
 #define DMA_BUF_SYNC_RW (DMA_BUF_SYNC_READ | DMA_BUF_SYNC_WRITE)
@@ -44,17 +60,86 @@ struct sl_output_buffer {
   struct wl_list link;
   uint32_t width;
   uint32_t height;
+  uint32_t alloc_width;
+  uint32_t alloc_height;
   uint32_t format;
   struct wl_buffer* internal;
   struct sl_mmap* mmap;
-  struct pixman_region32 damage;
+  // Whether the contents were downsampled to half size.
+  int downsample;
+  // Frame whose contents are in the buffer or 0 if undefined.
+  uint64_t damage_frame;
+  struct sl_host_surface* surface;
+  int64_t idle_time;
+};
+
+struct sl_damage_history {
+  // Damage since the last frame that was copied to an output buffer.
+  struct pixman_region32 pending;
+  // Damage of recent frames, indexed by frame number.
+  struct pixman_region32 frames[SL_DAMAGE_HISTORY_SIZE];
+  uint64_t frame;
+};
+
+struct sl_host_frame_callback {
+  struct wl_resource* resource;
+  struct wl_callback* proxy;
   struct sl_host_surface* surface;
+  uint32_t time;
+  int held;
+  int64_t request_time;
+  struct wl_list link;
+};
+
+// Per-surface counters, only allocated when --stats is enabled. Times are
+// in nanoseconds.
+struct sl_surface_stats {
+  struct sl_host_surface* surface;
+  uint64_t commits;
+  uint64_t copies;
+  uint64_t copy_bytes;
+  uint64_t damage_rects;
+  uint64_t copy_time;
+  uint64_t access_time;
+  uint64_t buffer_allocations;
+  uint64_t frame_callbacks;
+  uint64_t frame_callback_time;
+  int64_t copy_start;
+  uint64_t last_dump_commits;
+  int64_t last_dump_time;
+  struct wl_list link;
 };
 
 struct dma_buf_sync {
   __u64 flags;
 };
 
+static struct sl_free_list sl_host_frame_callback_free_list =
+    SL_FREE_LIST_INIT(struct sl_host_frame_callback);
+static struct sl_free_list sl_host_region_free_list =
+    SL_FREE_LIST_INIT(struct sl_host_region);
+static struct sl_free_list sl_surface_request_free_list =
+    SL_FREE_LIST_INIT(struct sl_surface_request);
+
+// Rect added to or subtracted from a region.
+struct sl_region_op {
+  int32_t subtract;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+static void sl_host_surface_buffer_released(struct sl_host_surface* host);
+static void sl_host_surface_commit_internal(struct sl_host_surface* host);
+
+static int64_t sl_stats_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void sl_dmabuf_sync(int fd, __u64 flags) {
   struct dma_buf_sync sync = {0};
   int rv;
@@ -65,12 +150,57 @@ static void sl_dmabuf_sync(int fd, __u64 flags) {
   } while (rv == -1 && errno == EINTR);
 }
 
-static void sl_dmabuf_begin_write(int fd) {
-  sl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+static void sl_dmabuf_begin_write(struct sl_mmap* map) {
+  sl_dmabuf_sync(map->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
 }
 
-static void sl_dmabuf_end_write(int fd) {
-  sl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+static void sl_dmabuf_end_write(struct sl_mmap* map) {
+  sl_dmabuf_sync(map->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+}
+
+// Tiled buffers are written through a linear view provided by the GBM
+// driver, which detiles on map and retiles on unmap. Only the bounds of the
+// damage are mapped. They are mapped for reading too, as pixels between
+// damaged regions must be preserved.
+static void sl_bo_begin_write(struct sl_mmap* map) {
+  uint32_t stride;
+  uint8_t* addr;
+
+  if (!map->write_width || !map->write_height)
+    return;
+
+  addr = gbm_bo_map(map->bo, map->write_x, map->write_y, map->write_width,
+                    map->write_height, GBM_BO_TRANSFER_READ_WRITE, &stride,
+                    &map->bo_map_data);
+  assert(addr);
+  map->stride[0] = stride;
+
+  // Copies address the buffer from its origin.
+  map->addr = addr - map->write_y * stride - map->write_x * map->bpp;
+}
+
+static void sl_bo_end_write(struct sl_mmap* map) {
+  if (!map->addr)
+    return;
+
+  gbm_bo_unmap(map->bo, map->bo_map_data);
+  map->bo_map_data = NULL;
+  map->addr = NULL;
+}
+
+// Not every modifier can be mapped by the CPU, e.g. compressed ones.
+static int sl_bo_can_map(struct gbm_bo* bo) {
+  void* map_data = NULL;
+  uint32_t stride;
+  void* addr;
+
+  addr = gbm_bo_map(bo, 0, 0, 1, 1, GBM_BO_TRANSFER_WRITE, &stride,
+                    &map_data);
+  if (!addr)
+    return 0;
+
+  gbm_bo_unmap(bo, map_data);
+  return 1;
 }
 
 static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
@@ -83,12 +213,12 @@ static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
   UNUSED(rv);
 }
 
-static void sl_virtwl_dmabuf_begin_write(int fd) {
-  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+static void sl_virtwl_dmabuf_begin_write(struct sl_mmap* map) {
+  sl_virtwl_dmabuf_sync(map->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
 }
 
-static void sl_virtwl_dmabuf_end_write(int fd) {
-  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+static void sl_virtwl_dmabuf_end_write(struct sl_mmap* map) {
+  sl_virtwl_dmabuf_sync(map->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
 }
 
 static uint32_t sl_gbm_format_for_shm_format(uint32_t format) {
@@ -110,39 +240,161 @@ static uint32_t sl_gbm_format_for_shm_format(uint32_t format) {
   return 0;
 }
 
-static uint32_t sl_drm_format_for_shm_format(int format) {
-  switch (format) {
-    case WL_SHM_FORMAT_NV12:
-      return WL_DRM_FORMAT_NV12;
-    case WL_SHM_FORMAT_RGB565:
-      return WL_DRM_FORMAT_RGB565;
-    case WL_SHM_FORMAT_ARGB8888:
-      return WL_DRM_FORMAT_ARGB8888;
-    case WL_SHM_FORMAT_ABGR8888:
-      return WL_DRM_FORMAT_ABGR8888;
-    case WL_SHM_FORMAT_XRGB8888:
-      return WL_DRM_FORMAT_XRGB8888;
-    case WL_SHM_FORMAT_XBGR8888:
-      return WL_DRM_FORMAT_XBGR8888;
+// Allocates a buffer object using one of the modifiers the host advertised
+// for |drm_format|. Returns NULL when the host only supports linear buffers,
+// or the driver can't allocate or CPU map any of the modifiers.
+static struct gbm_bo* sl_create_bo_with_modifiers(struct sl_context* ctx,
+                                                  uint32_t width,
+                                                  uint32_t height,
+                                                  uint32_t gbm_format,
+                                                  uint32_t drm_format) {
+  struct sl_dmabuf_modifier* modifier;
+  struct gbm_bo* bo = NULL;
+  struct wl_array modifiers;
+  uint64_t* m;
+
+  if (!ctx->dmabuf_modifiers)
+    return NULL;
+
+  wl_array_init(&modifiers);
+  wl_array_for_each(modifier, &ctx->linux_dmabuf->modifiers) {
+    if (modifier->format != drm_format ||
+        modifier->modifier == DRM_FORMAT_MOD_INVALID ||
+        modifier->modifier == DRM_FORMAT_MOD_LINEAR)
+      continue;
+    m = wl_array_add(&modifiers, sizeof(*m));
+    assert(m);
+    *m = modifier->modifier;
   }
-  assert(0);
-  return 0;
+
+  if (modifiers.size)
+    bo = gbm_bo_create_with_modifiers(ctx->gbm, width, height, gbm_format,
+                                      modifiers.data,
+                                      modifiers.size / sizeof(*m));
+  wl_array_release(&modifiers);
+
+  if (bo && !sl_bo_can_map(bo)) {
+    gbm_bo_destroy(bo);
+    bo = NULL;
+  }
+
+  return bo;
 }
 
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
   wl_buffer_destroy(buffer->internal);
   sl_mmap_unref(buffer->mmap);
-  pixman_region32_fini(&buffer->damage);
   wl_list_remove(&buffer->link);
   free(buffer);
 }
 
+static int64_t sl_output_buffer_pool_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Rounds |value| up so that buffers of similar size share an allocation.
+// Size classes are spaced 1/8th of a power of two apart.
+static uint32_t sl_output_buffer_size_class(uint32_t value) {
+  uint32_t step;
+
+  if (value <= 64)
+    return 64;
+
+  step = 1u << (31 - __builtin_clz(value) - 3);
+  return (value + step - 1) & ~(step - 1);
+}
+
+static void sl_output_buffer_pool_remove(struct sl_context* ctx,
+                                         struct sl_output_buffer* buffer) {
+  ctx->output_buffer_pool_size -= buffer->mmap->size;
+  sl_output_buffer_destroy(buffer);
+}
+
+static int sl_output_buffer_pool_timeout(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  int64_t now = sl_output_buffer_pool_now();
+
+  // Oldest buffers are at the end of the list.
+  while (!wl_list_empty(&ctx->output_buffer_pool)) {
+    struct sl_output_buffer* buffer = wl_container_of(
+        ctx->output_buffer_pool.prev, buffer, link);
+    int64_t idle = now - buffer->idle_time;
+
+    if (idle < ctx->output_buffer_pool_timeout) {
+      wl_event_source_timer_update(ctx->output_buffer_pool_timer,
+                                   ctx->output_buffer_pool_timeout - idle);
+      break;
+    }
+
+    sl_output_buffer_pool_remove(ctx, buffer);
+  }
+
+  return 0;
+}
+
+// Moves a released buffer to the context-wide pool so that it can be reused
+// by any surface. Trims the oldest buffers when the pool grows past its cap.
+static void sl_output_buffer_pool_add(struct sl_context* ctx,
+                                      struct sl_output_buffer* buffer) {
+  int was_empty = wl_list_empty(&ctx->output_buffer_pool);
+
+  wl_list_remove(&buffer->link);
+  wl_list_insert(&ctx->output_buffer_pool, &buffer->link);
+  buffer->surface = NULL;
+  buffer->idle_time = sl_output_buffer_pool_now();
+  ctx->output_buffer_pool_size += buffer->mmap->size;
+
+  while (ctx->output_buffer_pool_size > ctx->output_buffer_pool_max_size) {
+    struct sl_output_buffer* oldest = wl_container_of(
+        ctx->output_buffer_pool.prev, oldest, link);
+
+    sl_output_buffer_pool_remove(ctx, oldest);
+  }
+
+  if (was_empty && !wl_list_empty(&ctx->output_buffer_pool) &&
+      ctx->output_buffer_pool_timeout > 0) {
+    if (!ctx->output_buffer_pool_timer) {
+      ctx->output_buffer_pool_timer = wl_event_loop_add_timer(
+          wl_display_get_event_loop(ctx->host_display),
+          sl_output_buffer_pool_timeout, ctx);
+    }
+    wl_event_source_timer_update(ctx->output_buffer_pool_timer,
+                                 ctx->output_buffer_pool_timeout);
+  }
+}
+
+static struct sl_output_buffer* sl_output_buffer_pool_take(
+    struct sl_context* ctx,
+    uint32_t alloc_width,
+    uint32_t alloc_height,
+    uint32_t format) {
+  struct sl_output_buffer* buffer;
+
+  wl_list_for_each(buffer, &ctx->output_buffer_pool, link) {
+    if (buffer->alloc_width == alloc_width &&
+        buffer->alloc_height == alloc_height && buffer->format == format) {
+      wl_list_remove(&buffer->link);
+      wl_list_init(&buffer->link);
+      ctx->output_buffer_pool_size -= buffer->mmap->size;
+      // Contents were last written for another surface.
+      buffer->damage_frame = 0;
+      return buffer;
+    }
+  }
+
+  return NULL;
+}
+
 static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_output_buffer* output_buffer = wl_buffer_get_user_data(buffer);
   struct sl_host_surface* host_surface = output_buffer->surface;
 
   wl_list_remove(&output_buffer->link);
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+  sl_host_surface_buffer_released(host_surface);
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
@@ -153,227 +405,658 @@ static void sl_host_surface_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
-static void sl_host_surface_attach(struct wl_client* client,
-                                   struct wl_resource* resource,
-                                   struct wl_resource* buffer_resource,
-                                   int32_t x,
-                                   int32_t y) {
-  struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_host_buffer* host_buffer =
-      buffer_resource ? wl_resource_get_user_data(buffer_resource) : NULL;
-  struct wl_buffer* buffer_proxy = NULL;
+// Completes a commit once the contents of the current buffer are up to
+// date. Called directly from commit or when an async copy has finished.
+static void sl_host_surface_commit_contents(struct sl_host_surface* host) {
   struct sl_window* window;
-  double scale = host->ctx->scale;
+  TRACE_EVENT("surface");
+
+  if (host->contents_shm_mmap && host->stats) {
+    int64_t now = sl_stats_now();
+
+    host->stats->copy_time += now - host->stats->copy_start;
+    host->stats->copy_start = now;
+  }
+
+  if (host->contents_shm_mmap && host->current_buffer->mmap->end_write) {
+    host->current_buffer->mmap->end_write(host->current_buffer->mmap);
+    if (host->stats)
+      host->stats->access_time += sl_stats_now() - host->stats->copy_start;
+  }
+
+  // No need to defer client commits if surface has a role. E.g. is a cursor
+  // or shell surface.
+  if (host->has_role) {
+    wl_surface_commit(host->proxy);
+
+    // GTK determines the scale based on the output the surface has entered.
+    // If the surface has not entered any output, then have it enter the
+    // internal output. TODO(reveman): Remove this when surface-output tracking
+    // has been implemented in Chrome.
+    if (!host->has_output) {
+      struct sl_host_output* output;
+
+      wl_list_for_each(output, &host->ctx->host_outputs, link) {
+        if (output->internal && wl_resource_get_client(output->resource) ==
+                                    wl_resource_get_client(host->resource)) {
+          wl_surface_send_enter(host->resource, output->resource);
+          host->has_output = 1;
+          break;
+        }
+      }
+    }
+  } else {
+    // Commit if surface is associated with a window. Otherwise, defer
+    // commit until window is created.
+    window = sl_lookup_host_surface_window(
+        host->ctx, wl_resource_get_id(host->resource), 0);
+    if (window && window->xdg_surface) {
+      wl_surface_commit(host->proxy);
+      if (host->contents_width && host->contents_height)
+        window->realized = 1;
+    }
+  }
 
-  host->current_buffer = NULL;
   if (host->contents_shm_mmap) {
+    if (host->contents_shm_mmap->buffer_resource)
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
   }
+}
 
-  if (host_buffer) {
-    host->contents_width = host_buffer->width;
-    host->contents_height = host_buffer->height;
-    buffer_proxy = host_buffer->proxy;
-    if (host_buffer->shm_mmap)
-      host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
+static void sl_surface_request_free(struct sl_surface_request* request) {
+  wl_list_remove(&request->link);
+  wl_list_remove(&request->resource_destroy_listener.link);
+  wl_list_remove(&request->object_destroy_listener.link);
+  if (request->region)
+    wl_region_destroy(request->region);
+  sl_free_list_free(&sl_surface_request_free_list, request);
+}
+
+static void sl_surface_request_resource_destroyed(struct wl_listener* listener,
+                                                  void* data) {
+  struct sl_surface_request* request =
+      wl_container_of(listener, request, resource_destroy_listener);
+
+  sl_surface_request_free(request);
+}
+
+static void sl_surface_request_object_destroyed(struct wl_listener* listener,
+                                                void* data) {
+  struct sl_surface_request* request =
+      wl_container_of(listener, request, object_destroy_listener);
+
+  wl_list_remove(&request->object_destroy_listener.link);
+  wl_list_init(&request->object_destroy_listener.link);
+  request->object = NULL;
+}
+
+// Returns true while a commit of |host| has not reached the host yet,
+// either because its contents are still being copied or because it waits
+// for rendering to the attached buffer.
+static int sl_host_surface_commit_pending(struct sl_host_surface* host) {
+  return host->pending_copy || (host->sync_buffer && host->deferred_commit);
+}
+
+struct sl_surface_request* sl_host_surface_queue_request(
+    struct sl_host_surface* host,
+    struct wl_resource* resource,
+    sl_surface_request_func_t func) {
+  struct sl_surface_request* request;
+
+  // Requests made while replaying run in order with the remaining queue.
+  if (!sl_host_surface_commit_pending(host) &&
+      (host->replaying_requests || wl_list_empty(&host->requests)))
+    return NULL;
+
+  request = sl_free_list_alloc(&sl_surface_request_free_list);
+  request->func = func;
+  request->resource = resource;
+  request->resource_destroy_listener.notify =
+      sl_surface_request_resource_destroyed;
+  wl_resource_add_destroy_listener(resource,
+                                   &request->resource_destroy_listener);
+  request->object = NULL;
+  wl_list_init(&request->object_destroy_listener.link);
+  request->region = NULL;
+  memset(request->args, 0, sizeof(request->args));
+  wl_list_insert(host->requests.prev, &request->link);
+
+  return request;
+}
+
+void sl_surface_request_set_object(struct sl_surface_request* request,
+                                   struct wl_resource* object) {
+  if (!object)
+    return;
+
+  request->object = object;
+  request->object_destroy_listener.notify = sl_surface_request_object_destroyed;
+  wl_resource_add_destroy_listener(object, &request->object_destroy_listener);
+}
+
+// Replays queued requests after a deferred commit has reached the host.
+// Stops early when one of them defers a commit again.
+static void sl_host_surface_replay_requests(struct sl_host_surface* host) {
+  if (host->replaying_requests)
+    return;
+
+  host->replaying_requests = 1;
+  while (!wl_list_empty(&host->requests) &&
+         !sl_host_surface_commit_pending(host)) {
+    struct sl_surface_request* request =
+        wl_container_of(host->requests.next, request, link);
+
+    // The objects are still alive, and the request may destroy them.
+    wl_list_remove(&request->resource_destroy_listener.link);
+    wl_list_init(&request->resource_destroy_listener.link);
+    wl_list_remove(&request->object_destroy_listener.link);
+    wl_list_init(&request->object_destroy_listener.link);
+    wl_list_remove(&request->link);
+    wl_list_init(&request->link);
+    request->func(request);
+    sl_surface_request_free(request);
   }
+  host->replaying_requests = 0;
+}
 
-  if (host->contents_shm_mmap) {
-    while (!wl_list_empty(&host->released_buffers)) {
-      host->current_buffer = wl_container_of(host->released_buffers.next,
-                                             host->current_buffer, link);
-
-      if (host->current_buffer->width == host_buffer->width &&
-          host->current_buffer->height == host_buffer->height &&
-          host->current_buffer->format == host_buffer->shm_format) {
-        break;
-      }
+static void sl_host_surface_copy_done(void* data) {
+  struct sl_host_surface* host = (struct sl_host_surface*)data;
+
+  host->pending_copy = NULL;
+  sl_host_surface_commit_contents(host);
+  sl_host_surface_replay_requests(host);
+}
+
+// Attaches a buffer without waiting for GPU rendering to it, and replays
+// the commit if the client committed while we were waiting.
+static void sl_host_surface_skip_sync(struct sl_host_surface* host) {
+  struct sl_host_buffer* buffer = host->sync_buffer;
+
+  wl_event_source_remove(host->sync_event_source);
+  host->sync_event_source = NULL;
+  host->sync_buffer = NULL;
+  buffer->sync_surface = NULL;
+
+  host->deferred_attach = 0;
+  wl_surface_attach(host->proxy, buffer->proxy, host->deferred_x,
+                    host->deferred_y);
+  if (host->deferred_commit) {
+    host->deferred_commit = 0;
+    sl_host_surface_commit_internal(host);
+    sl_host_surface_replay_requests(host);
+  }
+}
+
+// Attaches a buffer once the GPU is done rendering to it.
+void sl_host_surface_sync_done(struct sl_host_surface* host) {
+  struct sl_sync_point* sync_point = host->sync_buffer->sync_point;
+
+  // Doesn't block when the fence has signaled.
+  sync_point->sync(host->ctx, sync_point);
+  sl_host_surface_skip_sync(host);
+}
 
-      sl_output_buffer_destroy(host->current_buffer);
-      host->current_buffer = NULL;
+static int sl_handle_host_surface_sync_event(int fd,
+                                             uint32_t mask,
+                                             void* data) {
+  struct sl_host_surface* host = (struct sl_host_surface*)data;
+
+  sl_host_surface_sync_done(host);
+  return 1;
+}
+
+static int sl_host_surface_at_buffer_limit(struct sl_host_surface* host) {
+  return host->ctx->max_output_buffers &&
+         wl_list_length(&host->busy_buffers) >= host->ctx->max_output_buffers;
+}
+
+// Contents that are shown at less than half their size on the host are
+// downsampled while copying, and the host viewport scales them back to the
+// same logical size. Only single plane 32 bit formats without a client
+// viewport are handled.
+static int sl_host_surface_should_downsample(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_mmap* mmap = host->contents_shm_mmap;
+
+  if (!ctx->downsample || !host->viewport ||
+      !wl_list_empty(&host->contents_viewport))
+    return 0;
+
+  if (mmap->num_planes != 1 || mmap->bpp != 4 || host->contents_width < 2 ||
+      host->contents_height < 2)
+    return 0;
+
+  return ctx->scale * host->contents_scale >=
+         2.0 * sl_output_get_host_scale(ctx);
+}
+
+// Picks an output buffer for the current shm contents. Leaves
+// |current_buffer| unset when the surface is at its in-flight buffer limit.
+static void sl_host_surface_get_output_buffer(struct sl_host_surface* host) {
+  uint32_t alloc_width, alloc_height;
+
+  host->downsample = sl_host_surface_should_downsample(host);
+  alloc_width = host->contents_width >> host->downsample;
+  alloc_height = host->contents_height >> host->downsample;
+
+  // Allocations can only be larger than the contents when the host
+  // viewport is available to crop them.
+  if (host->viewport) {
+    alloc_width = sl_output_buffer_size_class(alloc_width);
+    alloc_height = sl_output_buffer_size_class(alloc_height);
+  }
+
+  while (!wl_list_empty(&host->released_buffers)) {
+    host->current_buffer = wl_container_of(host->released_buffers.next,
+                                           host->current_buffer, link);
+
+    if (host->current_buffer->alloc_width == alloc_width &&
+        host->current_buffer->alloc_height == alloc_height &&
+        host->current_buffer->format == host->contents_shm_format) {
+      break;
     }
 
-    // Allocate new output buffer.
-    if (!host->current_buffer) {
-      size_t width = host_buffer->width;
-      size_t height = host_buffer->height;
-      uint32_t shm_format = host_buffer->shm_format;
-      size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
-      size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+    sl_output_buffer_pool_add(host->ctx, host->current_buffer);
+    host->current_buffer = NULL;
+  }
+
+  // Don't grow past the in-flight limit. The caller defers the frame until
+  // the host releases one of the busy buffers.
+  if (!host->current_buffer && sl_host_surface_at_buffer_limit(host))
+    return;
 
-      host->current_buffer = malloc(sizeof(struct sl_output_buffer));
-      assert(host->current_buffer);
+  if (!host->current_buffer) {
+    host->current_buffer = sl_output_buffer_pool_take(
+        host->ctx, alloc_width, alloc_height, host->contents_shm_format);
+    if (host->current_buffer) {
       wl_list_insert(&host->released_buffers, &host->current_buffer->link);
-      host->current_buffer->width = width;
-      host->current_buffer->height = height;
-      host->current_buffer->format = shm_format;
       host->current_buffer->surface = host;
-      pixman_region32_init_rect(&host->current_buffer->damage, 0, 0, MAX_SIZE,
-                                MAX_SIZE);
-
-      switch (host->ctx->shm_driver) {
-        case SHM_DRIVER_DMABUF: {
-          struct zwp_linux_buffer_params_v1* buffer_params;
-          struct gbm_bo* bo;
-          int stride0;
-          int fd;
-
-          bo = gbm_bo_create(host->ctx->gbm, width, height,
-                             sl_gbm_format_for_shm_format(shm_format),
-                             GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
-          stride0 = gbm_bo_get_stride(bo);
-          fd = gbm_bo_get_fd(bo);
-
-          buffer_params = zwp_linux_dmabuf_v1_create_params(
-              host->ctx->linux_dmabuf->internal);
-          zwp_linux_buffer_params_v1_add(buffer_params, fd, 0, 0, stride0,
-                                         DRM_FORMAT_MOD_INVALID >> 32,
-                                         DRM_FORMAT_MOD_INVALID & 0xffffffff);
-          host->current_buffer->internal =
-              zwp_linux_buffer_params_v1_create_immed(
-                  buffer_params, width, height,
-                  sl_drm_format_for_shm_format(shm_format), 0);
-          zwp_linux_buffer_params_v1_destroy(buffer_params);
+    }
+  }
 
+  // Allocate new output buffer.
+  if (!host->current_buffer) {
+    size_t width = alloc_width;
+    size_t height = alloc_height;
+    uint32_t shm_format = host->contents_shm_format;
+    size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
+    size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+
+    if (host->stats)
+      ++host->stats->buffer_allocations;
+
+    host->current_buffer = malloc(sizeof(struct sl_output_buffer));
+    assert(host->current_buffer);
+    wl_list_insert(&host->released_buffers, &host->current_buffer->link);
+    host->current_buffer->width = host->contents_width;
+    host->current_buffer->height = host->contents_height;
+    host->current_buffer->alloc_width = width;
+    host->current_buffer->alloc_height = height;
+    host->current_buffer->format = shm_format;
+    host->current_buffer->surface = host;
+    host->current_buffer->downsample = host->downsample;
+    host->current_buffer->damage_frame = 0;
+
+    switch (host->ctx->shm_driver) {
+      case SHM_DRIVER_DMABUF: {
+        struct zwp_linux_buffer_params_v1* buffer_params;
+        uint32_t gbm_format = sl_gbm_format_for_shm_format(shm_format);
+        uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+        uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+        struct gbm_bo* bo = NULL;
+        int bo_planes = 1;
+        int stride0;
+        int fd;
+        int i;
+
+        // Multi-planar formats keep using linear buffers as the CPU upload
+        // path only maps the first plane of a buffer object.
+        if (num_planes == 1)
+          bo = sl_create_bo_with_modifiers(host->ctx, width, height,
+                                           gbm_format, drm_format);
+        if (bo) {
+          modifier = gbm_bo_get_modifier(bo);
+          bo_planes = gbm_bo_get_plane_count(bo);
+        } else {
+          bo = gbm_bo_create(host->ctx->gbm, width, height, gbm_format,
+                             GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+        }
+        stride0 = gbm_bo_get_stride(bo);
+        fd = gbm_bo_get_fd(bo);
+
+        // Compressed modifiers can add auxiliary planes to the buffer
+        // object. They all live in the same dmabuf.
+        buffer_params = zwp_linux_dmabuf_v1_create_params(
+            host->ctx->linux_dmabuf->internal);
+        for (i = 0; i < bo_planes; ++i)
+          zwp_linux_buffer_params_v1_add(
+              buffer_params, fd, i, gbm_bo_get_offset(bo, i),
+              gbm_bo_get_stride_for_plane(bo, i), modifier >> 32,
+              modifier & 0xffffffff);
+        host->current_buffer->internal =
+            zwp_linux_buffer_params_v1_create_immed(buffer_params, width,
+                                                    height, drm_format, 0);
+        zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+        if (modifier == DRM_FORMAT_MOD_INVALID) {
           host->current_buffer->mmap = sl_mmap_create(
               fd, height * stride0, bpp, 1, 0, stride0, 0, 0, 1, 0);
           host->current_buffer->mmap->begin_write = sl_dmabuf_begin_write;
           host->current_buffer->mmap->end_write = sl_dmabuf_end_write;
-
           gbm_bo_destroy(bo);
-        } break;
-        case SHM_DRIVER_VIRTWL: {
-          size_t size = host_buffer->shm_mmap->size;
-          struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
-                                               .fd = -1,
-                                               .flags = 0,
-                                               .size = size};
-          struct wl_shm_pool* pool;
-          int rv;
-
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          assert(rv == 0);
-          UNUSED(rv);
-
-          pool =
-              wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
-          host->current_buffer->internal = wl_shm_pool_create_buffer(
-              pool, 0, width, height, host_buffer->shm_mmap->stride[0],
-              shm_format);
-          wl_shm_pool_destroy(pool);
+        } else {
+          // The buffer object stays alive for as long as the mapping, which
+          // owns it from here on.
+          close(fd);
+          host->current_buffer->mmap = sl_mmap_create_bo(bo, bpp);
+          host->current_buffer->mmap->begin_write = sl_bo_begin_write;
+          host->current_buffer->mmap->end_write = sl_bo_end_write;
+        }
+      } break;
+      case SHM_DRIVER_VIRTWL: {
+        size_t stride0 =
+            MAX(host->contents_shm_mmap->stride[0], width * bpp);
+        size_t stride1 =
+            MAX(host->contents_shm_mmap->stride[1], width * bpp);
+        size_t offset1 = stride0 * height;
+        size_t size = offset1;
+        struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
+                                             .fd = -1,
+                                             .flags = 0,
+                                             .size = 0};
+        struct wl_shm_pool* pool;
+        int rv;
+
+        if (num_planes > 1) {
+          size_t y_ss1 = host->contents_shm_mmap->y_ss[1];
+
+          size += stride1 * ((height + y_ss1 - 1) / y_ss1);
+        }
+        ioctl_new.size = size;
+
+        rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+        assert(rv == 0);
+        UNUSED(rv);
+
+        pool =
+            wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
+        host->current_buffer->internal = wl_shm_pool_create_buffer(
+            pool, 0, width, height, stride0, shm_format);
+        wl_shm_pool_destroy(pool);
+
+        host->current_buffer->mmap = sl_mmap_create(
+            ioctl_new.fd, size, bpp, num_planes, 0, stride0, offset1,
+            stride1, host->contents_shm_mmap->y_ss[0],
+            host->contents_shm_mmap->y_ss[1]);
+      } break;
+      case SHM_DRIVER_VIRTWL_DMABUF: {
+        uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+        struct virtwl_ioctl_new ioctl_new = {
+            .type = VIRTWL_IOCTL_NEW_DMABUF,
+            .fd = -1,
+            .flags = 0,
+            .dmabuf = {
+                .width = width, .height = height, .format = drm_format}};
+        struct zwp_linux_buffer_params_v1* buffer_params;
+        size_t size;
+        int rv;
+
+        rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+        if (rv) {
+          fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
+                  strerror(errno));
+          _exit(EXIT_FAILURE);
+        }
 
-          host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, 0,
-              host_buffer->shm_mmap->stride[0],
-              host_buffer->shm_mmap->offset[1] -
-                  host_buffer->shm_mmap->offset[0],
-              host_buffer->shm_mmap->stride[1], host_buffer->shm_mmap->y_ss[0],
-              host_buffer->shm_mmap->y_ss[1]);
-        } break;
-        case SHM_DRIVER_VIRTWL_DMABUF: {
-          uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
-          struct virtwl_ioctl_new ioctl_new = {
-              .type = VIRTWL_IOCTL_NEW_DMABUF,
-              .fd = -1,
-              .flags = 0,
-              .dmabuf = {
-                  .width = width, .height = height, .format = drm_format}};
-          struct zwp_linux_buffer_params_v1* buffer_params;
-          size_t size;
-          int rv;
-
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          if (rv) {
-            fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
-                    strerror(errno));
-            _exit(EXIT_FAILURE);
-          }
-
-          size = ioctl_new.dmabuf.stride0 * height;
-          buffer_params = zwp_linux_dmabuf_v1_create_params(
-              host->ctx->linux_dmabuf->internal);
-          zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 0,
-                                         ioctl_new.dmabuf.offset0,
-                                         ioctl_new.dmabuf.stride0, 0, 0);
-          if (num_planes > 1) {
-            zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 1,
-                                           ioctl_new.dmabuf.offset1,
-                                           ioctl_new.dmabuf.stride1, 0, 0);
-            size = MAX(size, ioctl_new.dmabuf.offset1 +
-                                 ioctl_new.dmabuf.stride1 * height /
-                                     host_buffer->shm_mmap->y_ss[1]);
-          }
-          host->current_buffer->internal =
-              zwp_linux_buffer_params_v1_create_immed(buffer_params, width,
-                                                      height, drm_format, 0);
-          zwp_linux_buffer_params_v1_destroy(buffer_params);
+        size = ioctl_new.dmabuf.stride0 * height;
+        buffer_params = zwp_linux_dmabuf_v1_create_params(
+            host->ctx->linux_dmabuf->internal);
+        zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 0,
+                                       ioctl_new.dmabuf.offset0,
+                                       ioctl_new.dmabuf.stride0, 0, 0);
+        if (num_planes > 1) {
+          zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 1,
+                                         ioctl_new.dmabuf.offset1,
+                                         ioctl_new.dmabuf.stride1, 0, 0);
+          size = MAX(size, ioctl_new.dmabuf.offset1 +
+                               ioctl_new.dmabuf.stride1 * height /
+                                   host->contents_shm_mmap->y_ss[1]);
+        }
+        host->current_buffer->internal =
+            zwp_linux_buffer_params_v1_create_immed(buffer_params, width,
+                                                    height, drm_format, 0);
+        zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+        host->current_buffer->mmap = sl_mmap_create(
+            ioctl_new.fd, size, bpp, num_planes, ioctl_new.dmabuf.offset0,
+            ioctl_new.dmabuf.stride0, ioctl_new.dmabuf.offset1,
+            ioctl_new.dmabuf.stride1, host->contents_shm_mmap->y_ss[0],
+            host->contents_shm_mmap->y_ss[1]);
+        host->current_buffer->mmap->begin_write =
+            sl_virtwl_dmabuf_begin_write;
+        host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
+      } break;
+    }
 
-          host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, ioctl_new.dmabuf.offset0,
-              ioctl_new.dmabuf.stride0, ioctl_new.dmabuf.offset1,
-              ioctl_new.dmabuf.stride1, host_buffer->shm_mmap->y_ss[0],
-              host_buffer->shm_mmap->y_ss[1]);
-          host->current_buffer->mmap->begin_write =
-              sl_virtwl_dmabuf_begin_write;
-          host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
-        } break;
-      }
+    assert(host->current_buffer->internal);
+    assert(host->current_buffer->mmap);
+
+    wl_buffer_set_user_data(host->current_buffer->internal,
+                            host->current_buffer);
+    wl_buffer_add_listener(host->current_buffer->internal,
+                           &sl_output_buffer_listener, host->current_buffer);
+  }
+
+  // Contents of a reused allocation were written for another size.
+  if (host->current_buffer->width != host->contents_width ||
+      host->current_buffer->height != host->contents_height ||
+      host->current_buffer->downsample != host->downsample) {
+    host->current_buffer->width = host->contents_width;
+    host->current_buffer->height = host->contents_height;
+    host->current_buffer->downsample = host->downsample;
+    host->current_buffer->damage_frame = 0;
+  }
+}
 
-      assert(host->current_buffer->internal);
-      assert(host->current_buffer->mmap);
+// Trades some overdraw for fewer, larger copies when damage is fragmented.
+// Each band of rects is replaced by its horizontal extent, and the region
+// by its bounding box if there are still too many bands.
+static void sl_damage_simplify(pixman_region32_t* region) {
+  pixman_box32_t bands[SL_DAMAGE_MAX_RECTS];
+  pixman_box32_t* rect;
+  int count = 0;
+  int n;
+
+  rect = pixman_region32_rectangles(region, &n);
+  if (n <= SL_DAMAGE_MAX_RECTS)
+    return;
+
+  while (n--) {
+    if (count && bands[count - 1].y1 == rect->y1) {
+      bands[count - 1].x1 = MIN(bands[count - 1].x1, rect->x1);
+      bands[count - 1].x2 = MAX(bands[count - 1].x2, rect->x2);
+    } else if (count < SL_DAMAGE_MAX_RECTS) {
+      bands[count++] = *rect;
+    } else {
+      pixman_box32_t extents = *pixman_region32_extents(region);
 
-      wl_buffer_set_user_data(host->current_buffer->internal,
-                              host->current_buffer);
-      wl_buffer_add_listener(host->current_buffer->internal,
-                             &sl_output_buffer_listener, host->current_buffer);
+      pixman_region32_reset(region, &extents);
+      return;
     }
+    ++rect;
   }
 
+  pixman_region32_fini(region);
+  pixman_region32_init_rects(region, bands, count);
+}
+
+// Computes the damage that brings |buffer| up to date with the pending
+// frame: everything damaged since the frame it was last written for.
+static void sl_host_surface_buffer_damage(struct sl_host_surface* host,
+                                          struct sl_output_buffer* buffer,
+                                          pixman_region32_t* damage) {
+  struct sl_damage_history* history = host->damage;
+  uint64_t frame;
+
+  if (!buffer->damage_frame ||
+      history->frame - buffer->damage_frame > SL_DAMAGE_HISTORY_SIZE) {
+    pixman_region32_init_rect(damage, 0, 0, MAX_SIZE, MAX_SIZE);
+    return;
+  }
+
+  pixman_region32_init(damage);
+  pixman_region32_copy(damage, &history->pending);
+  for (frame = buffer->damage_frame + 1; frame <= history->frame; ++frame) {
+    pixman_region32_union(damage, damage,
+                          &history->frames[frame % SL_DAMAGE_HISTORY_SIZE]);
+  }
+  sl_damage_simplify(damage);
+}
+
+// Moves pending damage into the history once it has been copied to an
+// output buffer.
+static void sl_host_surface_push_damage(struct sl_host_surface* host,
+                                        struct sl_output_buffer* buffer) {
+  struct sl_damage_history* history = host->damage;
+  struct pixman_region32* frame;
+
+  ++history->frame;
+  frame = &history->frames[history->frame % SL_DAMAGE_HISTORY_SIZE];
+  pixman_region32_copy(frame, &history->pending);
+  pixman_region32_clear(&history->pending);
+  buffer->damage_frame = history->frame;
+}
+
+static void sl_host_surface_attach_internal(
+    struct sl_host_surface* host,
+    struct wl_resource* buffer_resource,
+    int32_t x,
+    int32_t y) {
+  struct sl_host_buffer* host_buffer =
+      buffer_resource ? wl_resource_get_user_data(buffer_resource) : NULL;
+  struct wl_buffer* buffer_proxy = NULL;
+  struct sl_window* window;
+  double scale = host->ctx->scale;
+  TRACE_EVENT("surface");
+
+  // The buffer being replaced was never committed. Stop waiting for it
+  // instead of blocking on its fence.
+  if (host->sync_buffer) {
+    wl_event_source_remove(host->sync_event_source);
+    host->sync_event_source = NULL;
+    host->sync_buffer->sync_surface = NULL;
+    host->sync_buffer = NULL;
+  }
+
+  host->current_buffer = NULL;
+  if (host->contents_shm_mmap) {
+    // Drop a frame that never made it to the host.
+    if (host->deferred_attach && host->contents_shm_mmap->buffer_resource)
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
+    sl_mmap_unref(host->contents_shm_mmap);
+    host->contents_shm_mmap = NULL;
+  }
+  host->deferred_attach = 0;
+  host->deferred_commit = 0;
+
+  host->buffer_attached = !!host_buffer;
+  host->buffer_is_dmabuf = host_buffer && host_buffer->is_dmabuf;
+  if (host_buffer) {
+    host->contents_width = host_buffer->width;
+    host->contents_height = host_buffer->height;
+    host->contents_shm_format = host_buffer->shm_format;
+    buffer_proxy = host_buffer->proxy;
+    if (host_buffer->shm_mmap)
+      host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
+  }
+
+  // Hidden surfaces don't copy their contents. Damage accumulates until
+  // the surface is visible again.
+  if (host->contents_shm_mmap && !host->hidden)
+    sl_host_surface_get_output_buffer(host);
+
   x /= scale;
   y /= scale;
 
-  // TODO(davidriley): This should be done in the commit.
+  // Poll the buffer for completion of GPU rendering instead of blocking the
+  // event loop. Attach and commit are deferred until the fence signals.
   if (host_buffer && host_buffer->sync_point) {
-    host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+    struct pollfd pfd = {.fd = host_buffer->sync_point->fd, .events = POLLIN};
+
+    if (poll(&pfd, 1, 0) == 0) {
+      host->sync_buffer = host_buffer;
+      host_buffer->sync_surface = host;
+      host->sync_event_source = wl_event_loop_add_fd(
+          wl_display_get_event_loop(host->ctx->host_display), pfd.fd,
+          WL_EVENT_READABLE, sl_handle_host_surface_sync_event, host);
+    } else {
+      host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+    }
   }
 
-  if (host->current_buffer) {
+  if (host->sync_buffer) {
+    host->deferred_attach = 1;
+    host->deferred_x = x;
+    host->deferred_y = y;
+  } else if (host->current_buffer) {
     assert(host->current_buffer->internal);
     wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
+  } else if (host->contents_shm_mmap) {
+    // All output buffers are in flight or the surface is hidden. Attach
+    // when one is released or the surface is shown.
+    host->deferred_attach = 1;
+    host->deferred_x = x;
+    host->deferred_y = y;
   } else {
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
   }
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      while (sl_process_pending_configure_acks(window, host))
-        continue;
+  window = sl_lookup_host_surface_window(
+      host->ctx, wl_resource_get_id(host->resource), 0);
+  if (window)
+    sl_process_pending_configure_acks(window, host);
+}
 
-      break;
-    }
-  }
+// A buffer destroyed while the attach was queued is attached as NULL.
+static void sl_host_surface_attach_request(struct sl_surface_request* request) {
+  sl_host_surface_attach_internal(wl_resource_get_user_data(request->resource),
+                                  request->object, request->args[0],
+                                  request->args[1]);
 }
 
-static void sl_host_surface_damage(struct wl_client* client,
+static void sl_host_surface_attach(struct wl_client* client,
                                    struct wl_resource* resource,
+                                   struct wl_resource* buffer_resource,
                                    int32_t x,
-                                   int32_t y,
-                                   int32_t width,
-                                   int32_t height) {
+                                   int32_t y) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_surface_request* request = sl_host_surface_queue_request(
+      host, resource, sl_host_surface_attach_request);
+
+  if (request) {
+    sl_surface_request_set_object(request, buffer_resource);
+    request->args[0] = x;
+    request->args[1] = y;
+    return;
+  }
+
+  sl_host_surface_attach_internal(host, buffer_resource, x, y);
+}
+
+static void sl_host_surface_damage_internal(struct sl_host_surface* host,
+                                            int32_t x,
+                                            int32_t y,
+                                            int32_t width,
+                                            int32_t height) {
   double scale = host->ctx->scale;
-  struct sl_output_buffer* buffer;
   int64_t x1, y1, x2, y2;
+  TRACE_EVENT("surface");
 
-  wl_list_for_each(buffer, &host->busy_buffers, link) {
-    pixman_region32_union_rect(&buffer->damage, &buffer->damage, x, y, width,
-                               height);
-  }
-  wl_list_for_each(buffer, &host->released_buffers, link) {
-    pixman_region32_union_rect(&buffer->damage, &buffer->damage, x, y, width,
-                               height);
-  }
+  // Output buffers resolve their damage from the history when copied.
+  pixman_region32_union_rect(&host->damage->pending, &host->damage->pending,
+                             x, y, width, height);
 
   x1 = x;
   y1 = y;
@@ -390,10 +1073,56 @@ static void sl_host_surface_damage(struct wl_client* client,
   wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
+static void sl_host_surface_damage_request(struct sl_surface_request* request) {
+  sl_host_surface_damage_internal(wl_resource_get_user_data(request->resource),
+                                  request->args[0], request->args[1],
+                                  request->args[2], request->args[3]);
+}
+
+static void sl_host_surface_damage(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   int32_t x,
+                                   int32_t y,
+                                   int32_t width,
+                                   int32_t height) {
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_surface_request* request = sl_host_surface_queue_request(
+      host, resource, sl_host_surface_damage_request);
+
+  if (request) {
+    request->args[0] = x;
+    request->args[1] = y;
+    request->args[2] = width;
+    request->args[3] = height;
+    return;
+  }
+
+  sl_host_surface_damage_internal(host, x, y, width, height);
+}
+
 static void sl_frame_callback_done(void* data,
                                    struct wl_callback* callback,
                                    uint32_t time) {
-  struct sl_host_callback* host = wl_callback_get_user_data(callback);
+  struct sl_host_frame_callback* host = wl_callback_get_user_data(callback);
+
+  if (host->surface && host->surface->stats && !host->held) {
+    ++host->surface->stats->frame_callbacks;
+    host->surface->stats->frame_callback_time +=
+        sl_stats_now() - host->request_time;
+  }
+
+  // Hold the callback to keep the client from drawing another frame while
+  // all output buffers are in flight. Hidden surfaces get their callbacks
+  // from the throttle timer instead.
+  if (host->surface &&
+      (host->surface->hidden ||
+       (host->surface->ctx->output_buffer_policy ==
+            OUTPUT_BUFFER_POLICY_WAIT &&
+        sl_host_surface_at_buffer_limit(host->surface)))) {
+    host->time = time;
+    host->held = 1;
+    return;
+  }
 
   wl_callback_send_done(host->resource, time);
   wl_resource_destroy(host->resource);
@@ -402,31 +1131,89 @@ static void sl_frame_callback_done(void* data,
 static const struct wl_callback_listener sl_frame_callback_listener = {
     sl_frame_callback_done};
 
-static void sl_host_callback_destroy(struct wl_resource* resource) {
-  struct sl_host_callback* host = wl_resource_get_user_data(resource);
+static void sl_host_frame_callback_destroy(struct wl_resource* resource) {
+  struct sl_host_frame_callback* host = wl_resource_get_user_data(resource);
 
-  wl_callback_destroy(host->proxy);
+  if (host->proxy)
+    wl_callback_destroy(host->proxy);
+  wl_list_remove(&host->link);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_free_list_free(&sl_host_frame_callback_free_list, host);
+}
+
+static void sl_host_frame_callback_request_proxy(
+    struct sl_host_frame_callback* host_callback) {
+  host_callback->proxy = wl_surface_frame(host_callback->surface->proxy);
+  wl_callback_set_user_data(host_callback->proxy, host_callback);
+  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
+                           host_callback);
+}
+
+// The callback resource exists from the start. Only the host callback is
+// requested once the earlier commit has reached the host.
+static void sl_host_surface_frame_request(struct sl_surface_request* request) {
+  struct sl_host_frame_callback* host_callback;
+
+  if (!request->object)
+    return;
+
+  host_callback = wl_resource_get_user_data(request->object);
+  if (host_callback->surface)
+    sl_host_frame_callback_request_proxy(host_callback);
 }
 
 static void sl_host_surface_frame(struct wl_client* client,
                                   struct wl_resource* resource,
                                   uint32_t callback) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_host_callback* host_callback;
-
-  host_callback = malloc(sizeof(*host_callback));
-  assert(host_callback);
-
+  struct sl_host_frame_callback* host_callback;
+  struct sl_surface_request* request;
+  TRACE_EVENT("surface");
+
+  host_callback = sl_free_list_alloc(&sl_host_frame_callback_free_list);
+  host_callback->surface = host;
+  host_callback->time = 0;
+  host_callback->held = 0;
+  host_callback->request_time = host->stats ? sl_stats_now() : 0;
+  wl_list_insert(&host->frame_callbacks, &host_callback->link);
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
-                                 sl_host_callback_destroy);
-  host_callback->proxy = wl_surface_frame(host->proxy);
-  wl_callback_set_user_data(host_callback->proxy, host_callback);
-  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
-                           host_callback);
+                                 sl_host_frame_callback_destroy);
+  host_callback->proxy = NULL;
+
+  request = sl_host_surface_queue_request(host, resource,
+                                          sl_host_surface_frame_request);
+  if (request) {
+    sl_surface_request_set_object(request, host_callback->resource);
+    return;
+  }
+
+  sl_host_frame_callback_request_proxy(host_callback);
+}
+
+// Creates a host region with the current contents of |host|. The client
+// can change or destroy its region before a queued request is replayed.
+static struct wl_region* sl_host_region_copy(struct sl_host_region* host) {
+  struct wl_region* region =
+      wl_compositor_create_region(host->ctx->compositor->internal);
+  struct sl_region_op* op;
+
+  wl_array_for_each(op, &host->ops) {
+    if (op->subtract)
+      wl_region_subtract(region, op->x, op->y, op->width, op->height);
+    else
+      wl_region_add(region, op->x, op->y, op->width, op->height);
+  }
+
+  return region;
+}
+
+static void sl_host_surface_set_opaque_region_request(
+    struct sl_surface_request* request) {
+  struct sl_host_surface* host = wl_resource_get_user_data(request->resource);
+
+  wl_surface_set_opaque_region(host->proxy, request->region);
 }
 
 static void sl_host_surface_set_opaque_region(
@@ -436,11 +1223,28 @@ static void sl_host_surface_set_opaque_region(
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_region* host_region =
       region_resource ? wl_resource_get_user_data(region_resource) : NULL;
+  struct sl_surface_request* request;
+  TRACE_EVENT("surface");
+
+  request = sl_host_surface_queue_request(
+      host, resource, sl_host_surface_set_opaque_region_request);
+  if (request) {
+    if (host_region)
+      request->region = sl_host_region_copy(host_region);
+    return;
+  }
 
   wl_surface_set_opaque_region(host->proxy,
                                host_region ? host_region->proxy : NULL);
 }
 
+static void sl_host_surface_set_input_region_request(
+    struct sl_surface_request* request) {
+  struct sl_host_surface* host = wl_resource_get_user_data(request->resource);
+
+  wl_surface_set_input_region(host->proxy, request->region);
+}
+
 static void sl_host_surface_set_input_region(
     struct wl_client* client,
     struct wl_resource* resource,
@@ -448,35 +1252,45 @@ static void sl_host_surface_set_input_region(
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_region* host_region =
       region_resource ? wl_resource_get_user_data(region_resource) : NULL;
+  struct sl_surface_request* request;
+  TRACE_EVENT("surface");
+
+  request = sl_host_surface_queue_request(
+      host, resource, sl_host_surface_set_input_region_request);
+  if (request) {
+    if (host_region)
+      request->region = sl_host_region_copy(host_region);
+    return;
+  }
 
   wl_surface_set_input_region(host->proxy,
                               host_region ? host_region->proxy : NULL);
 }
 
-static void sl_host_surface_commit(struct wl_client* client,
-                                   struct wl_resource* resource) {
-  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+static void sl_host_surface_commit_internal(struct sl_host_surface* host) {
   struct sl_viewport* viewport = NULL;
-  struct sl_window* window;
+  TRACE_EVENT("surface");
+
+  // Commit once the deferred attach has happened.
+  if (host->deferred_attach) {
+    host->deferred_commit = 1;
+    return;
+  }
 
   if (!wl_list_empty(&host->contents_viewport))
     viewport = wl_container_of(host->contents_viewport.next, viewport, link);
 
   if (host->contents_shm_mmap) {
-    uint8_t* src_addr = host->contents_shm_mmap->addr;
-    uint8_t* dst_addr = host->current_buffer->mmap->addr;
-    size_t* src_offset = host->contents_shm_mmap->offset;
-    size_t* dst_offset = host->current_buffer->mmap->offset;
-    size_t* src_stride = host->contents_shm_mmap->stride;
-    size_t* dst_stride = host->current_buffer->mmap->stride;
-    size_t* y_ss = host->contents_shm_mmap->y_ss;
-    size_t bpp = host->contents_shm_mmap->bpp;
-    size_t num_planes = host->contents_shm_mmap->num_planes;
     double contents_scale_x = host->contents_scale;
     double contents_scale_y = host->contents_scale;
     double contents_offset_x = 0.0;
     double contents_offset_y = 0.0;
+    struct wl_array* boxes = &host->damage_boxes;
+    pixman_region32_t damage;
     pixman_box32_t* rect;
+    pixman_box32_t* box;
+    pixman_box32_t bounds = {0, 0, 0, 0};
+    struct sl_mmap* dst;
     int n;
 
     // Determine scale and offset for damage based on current viewport.
@@ -505,10 +1319,9 @@ static void sl_host_surface_commit(struct wl_client* client,
       }
     }
 
-    if (host->current_buffer->mmap->begin_write)
-      host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd);
-
-    rect = pixman_region32_rectangles(&host->current_buffer->damage, &n);
+    boxes->size = 0;
+    sl_host_surface_buffer_damage(host, host->current_buffer, &damage);
+    rect = pixman_region32_rectangles(&damage, &n);
     while (n--) {
       int32_t x1, y1, x2, y2;
 
@@ -523,33 +1336,77 @@ static void sl_host_surface_commit(struct wl_client* client,
       x2 = MIN(host->contents_width, x2);
       y2 = MIN(host->contents_height, y2);
 
+      // Downsampling works on whole 2x2 blocks. A trailing odd row or
+      // column is dropped.
+      if (host->downsample) {
+        x1 &= ~1;
+        y1 &= ~1;
+        x2 = MIN((int32_t)host->contents_width & ~1, (x2 + 1) & ~1);
+        y2 = MIN((int32_t)host->contents_height & ~1, (y2 + 1) & ~1);
+      }
+
       if (x1 < x2 && y1 < y2) {
-        size_t i;
-
-        for (i = 0; i < num_planes; ++i) {
-          uint8_t* src_base = src_addr + src_offset[i];
-          uint8_t* dst_base = dst_addr + dst_offset[i];
-          uint8_t* src = src_base + y1 * src_stride[i] + x1 * bpp;
-          uint8_t* dst = dst_base + y1 * dst_stride[i] + x1 * bpp;
-          int32_t width = x2 - x1;
-          int32_t height = (y2 - y1) / y_ss[i];
-          size_t bytes = width * bpp;
-
-          while (height--) {
-            memcpy(dst, src, bytes);
-            dst += dst_stride[i];
-            src += src_stride[i];
-          }
+        box = wl_array_add(boxes, sizeof(*box));
+        assert(box);
+        box->x1 = x1;
+        box->y1 = y1;
+        box->x2 = x2;
+        box->y2 = y2;
+
+        if (bounds.x1 < bounds.x2) {
+          bounds.x1 = MIN(bounds.x1, x1);
+          bounds.y1 = MIN(bounds.y1, y1);
+          bounds.x2 = MAX(bounds.x2, x2);
+          bounds.y2 = MAX(bounds.y2, y2);
+        } else {
+          bounds = *box;
         }
       }
 
       ++rect;
     }
 
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd);
+    if (host->stats) {
+      struct sl_mmap* mmap = host->contents_shm_mmap;
+      size_t i;
+
+      ++host->stats->copies;
+      box = (pixman_box32_t*)boxes->data;
+      for (i = 0; i < boxes->size / sizeof(*box); ++i, ++box) {
+        uint64_t area = (uint64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+
+        host->stats->copy_bytes += area * mmap->bpp;
+        if (mmap->num_planes > 1)
+          host->stats->copy_bytes += area * mmap->bpp / mmap->y_ss[1];
+      }
+      host->stats->damage_rects += boxes->size / sizeof(*box);
+      host->stats->copy_start = sl_stats_now();
+    }
+
+    // Bounds of the write in output buffer coordinates.
+    dst = host->current_buffer->mmap;
+    dst->write_x = bounds.x1 >> host->downsample;
+    dst->write_y = bounds.y1 >> host->downsample;
+    dst->write_width = (bounds.x2 >> host->downsample) - dst->write_x;
+    dst->write_height = (bounds.y2 >> host->downsample) - dst->write_y;
+
+    if (dst->begin_write) {
+      dst->begin_write(dst);
+      if (host->stats) {
+        int64_t now = sl_stats_now();
+
+        host->stats->access_time += now - host->stats->copy_start;
+        host->stats->copy_start = now;
+      }
+    }
+
+    host->pending_copy = sl_copy_region(
+        host->ctx->copy_pool, host->current_buffer->mmap,
+        host->contents_shm_mmap, boxes->data, boxes->size / sizeof(*box),
+        host->downsample, sl_host_surface_copy_done, host);
 
-    pixman_region32_clear(&host->current_buffer->damage);
+    pixman_region32_fini(&damage);
+    sl_host_surface_push_damage(host, host->current_buffer);
 
     wl_list_remove(&host->current_buffer->link);
     wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
@@ -561,6 +1418,7 @@ static void sl_host_surface_commit(struct wl_client* client,
     if (host->viewport) {
       int width = host->contents_width;
       int height = host->contents_height;
+      int has_source = 0;
 
       // We need to take the client's viewport into account while still
       // making sure our scale is accounted for.
@@ -576,6 +1434,7 @@ static void sl_host_surface_commit(struct wl_client* client,
           // surface size becomes the source rectangle size.
           width = wl_fixed_to_int(viewport->src_width);
           height = wl_fixed_to_int(viewport->src_height);
+          has_source = 1;
         }
 
         // Use destination size as surface size when set.
@@ -585,6 +1444,30 @@ static void sl_host_surface_commit(struct wl_client* client,
         }
       }
 
+      // Crop pooled buffers that are larger than the contents.
+      if (!has_source && host->contents_shm_mmap) {
+        uint32_t buffer_width = host->contents_width >> host->downsample;
+        uint32_t buffer_height = host->contents_height >> host->downsample;
+
+        if (host->current_buffer->alloc_width != buffer_width ||
+            host->current_buffer->alloc_height != buffer_height) {
+          wp_viewport_set_source(host->viewport, wl_fixed_from_int(0),
+                                 wl_fixed_from_int(0),
+                                 wl_fixed_from_int(buffer_width),
+                                 wl_fixed_from_int(buffer_height));
+          has_source = 1;
+        }
+      }
+
+      if (has_source) {
+        host->has_viewport_source = 1;
+      } else if (host->has_viewport_source) {
+        wp_viewport_set_source(host->viewport, wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1));
+        host->has_viewport_source = 0;
+      }
+
       wp_viewport_set_destination(host->viewport, ceil(width / scale),
                                   ceil(height / scale));
     } else {
@@ -592,61 +1475,167 @@ static void sl_host_surface_commit(struct wl_client* client,
     }
   }
 
-  // No need to defer client commits if surface has a role. E.g. is a cursor
-  // or shell surface.
-  if (host->has_role) {
-    wl_surface_commit(host->proxy);
+  // Defer the rest of the commit until the copy is done.
+  if (host->pending_copy)
+    return;
 
-    // GTK determines the scale based on the output the surface has entered.
-    // If the surface has not entered any output, then have it enter the
-    // internal output. TODO(reveman): Remove this when surface-output tracking
-    // has been implemented in Chrome.
-    if (!host->has_output) {
-      struct sl_host_output* output;
+  sl_host_surface_commit_contents(host);
+}
 
-      wl_list_for_each(output, &host->ctx->host_outputs, link) {
-        if (output->internal) {
-          wl_surface_send_enter(host->resource, output->resource);
-          host->has_output = 1;
-          break;
-        }
-      }
+static void sl_host_surface_commit_request(struct sl_surface_request* request);
+
+static void sl_host_surface_commit(struct wl_client* client,
+                                   struct wl_resource* resource) {
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  TRACE_EVENT("surface");
+
+  if (sl_host_surface_queue_request(host, resource,
+                                    sl_host_surface_commit_request))
+    return;
+
+  if (host->stats)
+    ++host->stats->commits;
+
+  if (host->synchronization) {
+    int rv = sl_surface_synchronization_commit(host, host->buffer_attached);
+
+    if (rv < 0)
+      return;
+
+    // The host waits for the acquire fence before it reads the buffer, so
+    // the attach doesn't have to wait for rendering to finish here.
+    if (rv && host->sync_buffer)
+      sl_host_surface_skip_sync(host);
+  }
+  host->buffer_attached = 0;
+  host->buffer_is_dmabuf = 0;
+
+  sl_host_surface_commit_internal(host);
+}
+
+static void sl_host_surface_commit_request(struct sl_surface_request* request) {
+  sl_host_surface_commit(wl_resource_get_client(request->resource),
+                         request->resource);
+}
+
+// Called when the host releases one of our output buffers. Replays a frame
+// that was deferred at the in-flight limit and sends frame callbacks that
+// were held back.
+static void sl_host_surface_buffer_released(struct sl_host_surface* host) {
+  struct sl_host_frame_callback *callback, *next;
+
+  if (host->deferred_attach && host->contents_shm_mmap && !host->hidden) {
+    sl_host_surface_get_output_buffer(host);
+    if (!host->current_buffer)
+      return;
+
+    host->deferred_attach = 0;
+    wl_surface_attach(host->proxy, host->current_buffer->internal,
+                      host->deferred_x, host->deferred_y);
+    if (host->deferred_commit) {
+      host->deferred_commit = 0;
+      sl_host_surface_commit_internal(host);
     }
-  } else {
-    // Commit if surface is associated with a window. Otherwise, defer
-    // commit until window is created.
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == wl_resource_get_id(resource)) {
-        if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
-            window->realized = 1;
-        }
-        break;
-      }
+  }
+
+  if (sl_host_surface_at_buffer_limit(host))
+    return;
+
+  wl_list_for_each_safe(callback, next, &host->frame_callbacks, link) {
+    if (callback->held) {
+      wl_callback_send_done(callback->resource, callback->time);
+      wl_resource_destroy(callback->resource);
     }
   }
+}
 
-  if (host->contents_shm_mmap) {
-    if (host->contents_shm_mmap->buffer_resource)
-      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
-    sl_mmap_unref(host->contents_shm_mmap);
-    host->contents_shm_mmap = NULL;
+// Sends the frame callbacks of a hidden surface at a low rate and frees its
+// idle output buffers once it has been hidden for a while.
+static int sl_host_surface_hidden_timeout(void* data) {
+  struct sl_host_surface* host = (struct sl_host_surface*)data;
+  struct sl_host_frame_callback *callback, *next;
+  struct sl_output_buffer *buffer, *tmp;
+  int64_t now = sl_output_buffer_pool_now();
+
+  wl_list_for_each_safe(callback, next, &host->frame_callbacks, link) {
+    wl_callback_send_done(callback->resource, now);
+    wl_resource_destroy(callback->resource);
   }
+
+  if (now - host->hidden_time >= SL_HIDDEN_BUFFER_RELEASE_DELAY) {
+    wl_list_for_each_safe(buffer, tmp, &host->released_buffers, link) {
+      if (buffer != host->current_buffer)
+        sl_output_buffer_destroy(buffer);
+    }
+  }
+
+  wl_event_source_timer_update(host->hidden_timer, SL_HIDDEN_FRAME_INTERVAL);
+  return 0;
+}
+
+void sl_host_surface_set_hidden(struct sl_host_surface* host, int hidden) {
+  if (host->hidden == hidden)
+    return;
+
+  host->hidden = hidden;
+  if (hidden) {
+    host->hidden_time = sl_output_buffer_pool_now();
+    if (!host->hidden_timer) {
+      host->hidden_timer = wl_event_loop_add_timer(
+          wl_display_get_event_loop(host->ctx->host_display),
+          sl_host_surface_hidden_timeout, host);
+    }
+    wl_event_source_timer_update(host->hidden_timer,
+                                 SL_HIDDEN_FRAME_INTERVAL);
+  } else {
+    wl_event_source_timer_update(host->hidden_timer, 0);
+
+    // Resync the host with the damage accumulated while hidden and send
+    // the callbacks that were held back.
+    sl_host_surface_buffer_released(host);
+  }
+}
+
+static void sl_host_surface_set_buffer_transform_request(
+    struct sl_surface_request* request) {
+  struct sl_host_surface* host = wl_resource_get_user_data(request->resource);
+
+  wl_surface_set_buffer_transform(host->proxy, request->args[0]);
 }
 
 static void sl_host_surface_set_buffer_transform(struct wl_client* client,
                                                  struct wl_resource* resource,
                                                  int32_t transform) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_surface_request* request = sl_host_surface_queue_request(
+      host, resource, sl_host_surface_set_buffer_transform_request);
+
+  if (request) {
+    request->args[0] = transform;
+    return;
+  }
 
   wl_surface_set_buffer_transform(host->proxy, transform);
 }
 
+static void sl_host_surface_set_buffer_scale_request(
+    struct sl_surface_request* request) {
+  struct sl_host_surface* host = wl_resource_get_user_data(request->resource);
+
+  host->contents_scale = request->args[0];
+}
+
 static void sl_host_surface_set_buffer_scale(struct wl_client* client,
                                              struct wl_resource* resource,
                                              int32_t scale) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_surface_request* request = sl_host_surface_queue_request(
+      host, resource, sl_host_surface_set_buffer_scale_request);
+
+  if (request) {
+    request->args[0] = scale;
+    return;
+  }
 
   host->contents_scale = scale;
 }
@@ -674,34 +1663,79 @@ static const struct wl_surface_interface sl_surface_implementation = {
 
 static void sl_destroy_host_surface(struct wl_resource* resource) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_window *window, *surface_window = NULL;
+  struct sl_window* surface_window;
   struct sl_output_buffer* buffer;
+  struct sl_host_frame_callback *callback, *next;
+  int i;
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
-  }
+  // Requests made on the surface itself have been dropped already.
+  while (!wl_list_empty(&host->requests)) {
+    struct sl_surface_request* request =
+        wl_container_of(host->requests.next, request, link);
 
+    sl_surface_request_free(request);
+  }
+  if (host->pending_copy)
+    sl_copy_job_finish(host->pending_copy);
+  if (host->sync_event_source)
+    wl_event_source_remove(host->sync_event_source);
+  if (host->sync_buffer)
+    host->sync_buffer->sync_surface = NULL;
+  if (host->hidden_timer)
+    wl_event_source_remove(host->hidden_timer);
+
+  surface_window = sl_lookup_host_surface_window(
+      host->ctx, wl_resource_get_id(resource), 0);
   if (surface_window) {
-    surface_window->host_surface_id = 0;
+    sl_window_set_host_surface_id(surface_window, 0);
     sl_window_update(surface_window);
   }
 
-  if (host->contents_shm_mmap)
+  if (host->contents_shm_mmap) {
+    if (host->deferred_attach && host->contents_shm_mmap->buffer_resource)
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
     sl_mmap_unref(host->contents_shm_mmap);
+  }
+
+  // Callbacks are no longer throttled once the surface is gone.
+  wl_list_for_each_safe(callback, next, &host->frame_callbacks, link) {
+    if (callback->held) {
+      wl_callback_send_done(callback->resource, callback->time);
+      wl_resource_destroy(callback->resource);
+    } else {
+      callback->surface = NULL;
+      wl_list_remove(&callback->link);
+      wl_list_init(&callback->link);
+    }
+  }
 
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_pool_add(host->ctx, buffer);
   }
   while (!wl_list_empty(&host->busy_buffers)) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
     sl_output_buffer_destroy(buffer);
   }
-  while (!wl_list_empty(&host->contents_viewport))
-    wl_list_remove(host->contents_viewport.next);
+  while (!wl_list_empty(&host->contents_viewport)) {
+    struct sl_viewport* viewport =
+        wl_container_of(host->contents_viewport.next, viewport, link);
+
+    wl_list_remove(&viewport->link);
+    wl_list_init(&viewport->link);
+    viewport->surface = NULL;
+  }
+
+  if (host->stats) {
+    wl_list_remove(&host->stats->link);
+    free(host->stats);
+  }
+
+  pixman_region32_fini(&host->damage->pending);
+  for (i = 0; i < SL_DAMAGE_HISTORY_SIZE; ++i)
+    pixman_region32_fini(&host->damage->frames[i]);
+  free(host->damage);
+  wl_array_release(&host->damage_boxes);
 
   if (host->viewport)
     wp_viewport_destroy(host->viewport);
@@ -716,6 +1750,11 @@ static void sl_surface_enter(void* data,
   struct sl_host_surface* host = wl_surface_get_user_data(surface);
   struct sl_host_output* host_output = wl_output_get_user_data(output);
 
+  // The host reports outputs bound by every client of this process.
+  if (wl_resource_get_client(host_output->resource) !=
+      wl_resource_get_client(host->resource))
+    return;
+
   wl_surface_send_enter(host->resource, host_output->resource);
   host->has_output = 1;
 }
@@ -726,6 +1765,10 @@ static void sl_surface_leave(void* data,
   struct sl_host_surface* host = wl_surface_get_user_data(surface);
   struct sl_host_output* host_output = wl_output_get_user_data(output);
 
+  if (wl_resource_get_client(host_output->resource) !=
+      wl_resource_get_client(host->resource))
+    return;
+
   wl_surface_send_leave(host->resource, host_output->resource);
 }
 
@@ -737,6 +1780,22 @@ static void sl_region_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+static void sl_host_region_record(struct sl_host_region* host,
+                                  int subtract,
+                                  int32_t x,
+                                  int32_t y,
+                                  int32_t width,
+                                  int32_t height) {
+  struct sl_region_op* op = wl_array_add(&host->ops, sizeof(*op));
+
+  assert(op);
+  op->subtract = subtract;
+  op->x = x;
+  op->y = y;
+  op->width = width;
+  op->height = height;
+}
+
 static void sl_region_add(struct wl_client* client,
                           struct wl_resource* resource,
                           int32_t x,
@@ -752,6 +1811,7 @@ static void sl_region_add(struct wl_client* client,
   x2 = (x + width) / scale;
   y2 = (y + height) / scale;
 
+  sl_host_region_record(host, 0, x1, y1, x2 - x1, y2 - y1);
   wl_region_add(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -770,6 +1830,7 @@ static void sl_region_subtract(struct wl_client* client,
   x2 = (x + width) / scale;
   y2 = (y + height) / scale;
 
+  sl_host_region_record(host, 1, x1, y1, x2 - x1, y2 - y1);
   wl_region_subtract(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -780,8 +1841,9 @@ static void sl_destroy_host_region(struct wl_resource* resource) {
   struct sl_host_region* host = wl_resource_get_user_data(resource);
 
   wl_region_destroy(host->proxy);
+  wl_array_release(&host->ops);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_free_list_free(&sl_host_region_free_list, host);
 }
 
 static void sl_compositor_create_host_surface(struct wl_client* client,
@@ -789,7 +1851,8 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
                                               uint32_t id) {
   struct sl_host_compositor* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_surface;
-  struct sl_window *window, *unpaired_window = NULL;
+  struct sl_window* unpaired_window;
+  int i;
 
   host_surface = malloc(sizeof(*host_surface));
   assert(host_surface);
@@ -804,6 +1867,41 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->has_output = 0;
   host_surface->last_event_serial = 0;
   host_surface->current_buffer = NULL;
+  host_surface->pending_copy = NULL;
+  host_surface->has_viewport_source = 0;
+  host_surface->contents_shm_format = 0;
+  host_surface->deferred_attach = 0;
+  host_surface->deferred_commit = 0;
+  host_surface->deferred_x = 0;
+  host_surface->deferred_y = 0;
+  host_surface->sync_buffer = NULL;
+  host_surface->stats = NULL;
+  if (host_surface->ctx->stats) {
+    host_surface->stats = calloc(1, sizeof(*host_surface->stats));
+    assert(host_surface->stats);
+    host_surface->stats->surface = host_surface;
+    host_surface->stats->last_dump_time = sl_stats_now();
+    wl_list_insert(&host_surface->ctx->surface_stats,
+                   &host_surface->stats->link);
+  }
+  host_surface->sync_event_source = NULL;
+  host_surface->hidden = 0;
+  host_surface->hidden_time = 0;
+  host_surface->hidden_timer = NULL;
+  host_surface->downsample = 0;
+  host_surface->synchronization = NULL;
+  host_surface->buffer_attached = 0;
+  host_surface->buffer_is_dmabuf = 0;
+  wl_list_init(&host_surface->frame_callbacks);
+  wl_list_init(&host_surface->requests);
+  host_surface->replaying_requests = 0;
+  wl_array_init(&host_surface->damage_boxes);
+  host_surface->damage = malloc(sizeof(*host_surface->damage));
+  assert(host_surface->damage);
+  pixman_region32_init(&host_surface->damage->pending);
+  for (i = 0; i < SL_DAMAGE_HISTORY_SIZE; ++i)
+    pixman_region32_init(&host_surface->damage->frames[i]);
+  host_surface->damage->frame = 0;
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
   host_surface->resource = wl_resource_create(
@@ -821,15 +1919,10 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
         host_surface->ctx->viewporter->internal, host_surface->proxy);
   }
 
-  wl_list_for_each(window, &host->compositor->ctx->unpaired_windows, link) {
-    if (window->host_surface_id == id) {
-      unpaired_window = window;
-      break;
-    }
-  }
-
+  unpaired_window =
+      sl_lookup_host_surface_window(host->compositor->ctx, id, 1);
   if (unpaired_window)
-    sl_window_update(window);
+    sl_window_update(unpaired_window);
 }
 
 static void sl_compositor_create_host_region(struct wl_client* client,
@@ -838,10 +1931,9 @@ static void sl_compositor_create_host_region(struct wl_client* client,
   struct sl_host_compositor* host = wl_resource_get_user_data(resource);
   struct sl_host_region* host_region;
 
-  host_region = malloc(sizeof(*host_region));
-  assert(host_region);
-
+  host_region = sl_free_list_alloc(&sl_host_region_free_list);
   host_region->ctx = host->compositor->ctx;
+  wl_array_init(&host_region->ops);
   host_region->resource = wl_resource_create(
       client, &wl_region_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_region->resource,
@@ -883,6 +1975,33 @@ static void sl_bind_host_compositor(struct wl_client* client,
   wl_compositor_set_user_data(host->proxy, host);
 }
 
+void sl_compositor_dump_stats(struct sl_context* ctx) {
+  struct sl_surface_stats* stats;
+  int64_t now = sl_stats_now();
+
+  wl_list_for_each(stats, &ctx->surface_stats, link) {
+    double elapsed = (now - stats->last_dump_time) / 1e9;
+    double copies = MAX(stats->copies, 1);
+
+    fprintf(stderr,
+            "surface %u: commits %" PRIu64 " (%.1f/s) copies %" PRIu64
+            " bytes/copy %.0f rects/copy %.1f copy %.3f ms/copy"
+            " access %.3f ms/copy allocations %" PRIu64
+            " frame latency %.3f ms\n",
+            wl_resource_get_id(stats->surface->resource), stats->commits,
+            elapsed > 0 ? (stats->commits - stats->last_dump_commits) / elapsed
+                        : 0.0,
+            stats->copies, stats->copy_bytes / copies,
+            stats->damage_rects / copies, stats->copy_time / copies / 1e6,
+            stats->access_time / copies / 1e6, stats->buffer_allocations,
+            stats->frame_callbacks ? stats->frame_callback_time /
+                                         (double)stats->frame_callbacks / 1e6
+                                   : 0.0);
+    stats->last_dump_commits = stats->commits;
+    stats->last_dump_time = now;
+  }
+}
+
 struct sl_global* sl_compositor_global_create(struct sl_context* ctx) {
   return sl_global_create(ctx, &wl_compositor_interface,
                           ctx->compositor->version, ctx,
@@ -0,0 +1,611 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pixman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SL_COPY_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SL_COPY_NEON 1
+#endif
+
+// Rects smaller than this are copied with regular stores even when the
+// destination is write-combined memory, as they are likely to still be in
+// cache when the host reads them.
+#define SL_COPY_STREAM_THRESHOLD (256 * 1024)
+
+// Maximum amount of row padding we are willing to copy to turn a multi-row
+// copy into a single contiguous one.
+#define SL_COPY_COALESCE_SLACK 256
+
+// Damage smaller than this is always copied inline on the calling thread,
+// as waking up the workers would cost more than the copy itself.
+#define SL_COPY_PARALLEL_THRESHOLD (1024 * 1024)
+
+// Approximate number of bytes per tile handed to a worker.
+#define SL_COPY_TILE_SIZE (256 * 1024)
+
+struct sl_copy_tile {
+  int32_t x1;
+  int32_t y1;
+  int32_t x2;
+  int32_t y2;
+};
+
+struct sl_copy_job {
+  struct sl_copy_pool* pool;
+  struct sl_mmap* dst;
+  struct sl_mmap* src;
+  int downsample;
+  int stream;
+  struct sl_copy_tile* tiles;
+  size_t tiles_size;
+  size_t num_tiles;
+  size_t next_tile;
+  size_t pending_tiles;
+  sl_copy_done_func_t done;
+  void* data;
+  struct wl_list link;
+};
+
+struct sl_copy_pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  int num_threads;
+  struct wl_list jobs;
+  // Finished jobs kept with their tile arrays. Only used on the main thread.
+  struct wl_list free_jobs;
+  int event_fd;
+  struct wl_event_source* event_source;
+};
+
+typedef void (*sl_copy_func_t)(uint8_t* dst, const uint8_t* src, size_t size);
+
+static void sl_copy_memcpy(uint8_t* dst, const uint8_t* src, size_t size) {
+  memcpy(dst, src, size);
+}
+
+#if SL_COPY_X86
+__attribute__((target("sse2"))) static void sl_copy_stream_sse2(
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t size) {
+  size_t head = MIN(size, (16 - ((uintptr_t)dst & 15)) & 15);
+
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  size -= head;
+
+  while (size >= 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)src + 0);
+    __m128i b = _mm_loadu_si128((const __m128i*)src + 1);
+    __m128i c = _mm_loadu_si128((const __m128i*)src + 2);
+    __m128i d = _mm_loadu_si128((const __m128i*)src + 3);
+
+    _mm_stream_si128((__m128i*)dst + 0, a);
+    _mm_stream_si128((__m128i*)dst + 1, b);
+    _mm_stream_si128((__m128i*)dst + 2, c);
+    _mm_stream_si128((__m128i*)dst + 3, d);
+    dst += 64;
+    src += 64;
+    size -= 64;
+  }
+
+  memcpy(dst, src, size);
+}
+
+__attribute__((target("avx2"))) static void sl_copy_stream_avx2(
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t size) {
+  size_t head = MIN(size, (32 - ((uintptr_t)dst & 31)) & 31);
+
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  size -= head;
+
+  while (size >= 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)src + 0);
+    __m256i b = _mm256_loadu_si256((const __m256i*)src + 1);
+    __m256i c = _mm256_loadu_si256((const __m256i*)src + 2);
+    __m256i d = _mm256_loadu_si256((const __m256i*)src + 3);
+
+    _mm256_stream_si256((__m256i*)dst + 0, a);
+    _mm256_stream_si256((__m256i*)dst + 1, b);
+    _mm256_stream_si256((__m256i*)dst + 2, c);
+    _mm256_stream_si256((__m256i*)dst + 3, d);
+    dst += 128;
+    src += 128;
+    size -= 128;
+  }
+
+  memcpy(dst, src, size);
+}
+#endif
+
+#if SL_COPY_NEON
+// NEON has no non-temporal store instruction that is usable from
+// intrinsics, but wide unrolled stores still behave much better than byte
+// sized memcpy tails when the destination is uncached.
+static void sl_copy_stream_neon(uint8_t* dst, const uint8_t* src, size_t size) {
+  while (size >= 64) {
+    uint8x16_t a = vld1q_u8(src + 0);
+    uint8x16_t b = vld1q_u8(src + 16);
+    uint8x16_t c = vld1q_u8(src + 32);
+    uint8x16_t d = vld1q_u8(src + 48);
+
+    vst1q_u8(dst + 0, a);
+    vst1q_u8(dst + 16, b);
+    vst1q_u8(dst + 32, c);
+    vst1q_u8(dst + 48, d);
+    dst += 64;
+    src += 64;
+    size -= 64;
+  }
+
+  memcpy(dst, src, size);
+}
+#endif
+
+static sl_copy_func_t sl_copy_stream = sl_copy_memcpy;
+
+// Box filters |width| 2x2 blocks of 32 bit pixels from the two rows at |s0|
+// and |s1| into |width| pixels at |d|. Each channel is averaged separately,
+// so this works for any 8 bit per channel format.
+typedef void (*sl_downsample_func_t)(uint32_t* d,
+                                     const uint32_t* s0,
+                                     const uint32_t* s1,
+                                     size_t width);
+
+static void sl_downsample_row_c(uint32_t* d,
+                                const uint32_t* s0,
+                                const uint32_t* s1,
+                                size_t width) {
+  while (width--) {
+    uint32_t a = s0[0], b = s0[1], c = s1[0], e = s1[1];
+    uint32_t lo = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) +
+                  (e & 0x00ff00ff) + 0x00020002;
+    uint32_t hi = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+                  ((c >> 8) & 0x00ff00ff) + ((e >> 8) & 0x00ff00ff) +
+                  0x00020002;
+
+    *d++ = ((lo >> 2) & 0x00ff00ff) | (((hi >> 2) & 0x00ff00ff) << 8);
+    s0 += 2;
+    s1 += 2;
+  }
+}
+
+#if SL_COPY_X86
+// Box filters the 4 pixels at |s0| and |s1| into 2 pixels with 16 bit
+// channels, rounded like the C version.
+__attribute__((target("sse2"))) static inline __m128i sl_downsample_block_sse2(
+    const uint32_t* s0,
+    const uint32_t* s1) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = _mm_loadu_si128((const __m128i*)s0);
+  __m128i b = _mm_loadu_si128((const __m128i*)s1);
+  // Pixels 0 and 1, and pixels 2 and 3, of both rows.
+  __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                             _mm_unpacklo_epi8(b, zero));
+  __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                             _mm_unpackhi_epi8(b, zero));
+  __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                              _mm_unpackhi_epi64(lo, hi));
+
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("sse2"))) static void sl_downsample_row_sse2(
+    uint32_t* d,
+    const uint32_t* s0,
+    const uint32_t* s1,
+    size_t width) {
+  while (width >= 4) {
+    __m128i first = sl_downsample_block_sse2(s0, s1);
+    __m128i second = sl_downsample_block_sse2(s0 + 4, s1 + 4);
+
+    _mm_storeu_si128((__m128i*)d, _mm_packus_epi16(first, second));
+    d += 4;
+    s0 += 8;
+    s1 += 8;
+    width -= 4;
+  }
+
+  sl_downsample_row_c(d, s0, s1, width);
+}
+#endif
+
+#if SL_COPY_NEON
+static void sl_downsample_row_neon(uint32_t* d,
+                                   const uint32_t* s0,
+                                   const uint32_t* s1,
+                                   size_t width) {
+  while (width >= 4) {
+    // Even and odd pixels of both rows.
+    uint32x4x2_t a = vld2q_u32(s0);
+    uint32x4x2_t b = vld2q_u32(s1);
+    uint8x16_t a0 = vreinterpretq_u8_u32(a.val[0]);
+    uint8x16_t a1 = vreinterpretq_u8_u32(a.val[1]);
+    uint8x16_t b0 = vreinterpretq_u8_u32(b.val[0]);
+    uint8x16_t b1 = vreinterpretq_u8_u32(b.val[1]);
+    uint16x8_t lo =
+        vaddq_u16(vaddl_u8(vget_low_u8(a0), vget_low_u8(a1)),
+                  vaddl_u8(vget_low_u8(b0), vget_low_u8(b1)));
+    uint16x8_t hi =
+        vaddq_u16(vaddl_u8(vget_high_u8(a0), vget_high_u8(a1)),
+                  vaddl_u8(vget_high_u8(b0), vget_high_u8(b1)));
+
+    // Rounding narrow by 4 matches (sum + 2) >> 2 of the C version.
+    vst1q_u32(d, vreinterpretq_u32_u8(vcombine_u8(vrshrn_n_u16(lo, 2),
+                                                  vrshrn_n_u16(hi, 2))));
+    d += 4;
+    s0 += 8;
+    s1 += 8;
+    width -= 4;
+  }
+
+  sl_downsample_row_c(d, s0, s1, width);
+}
+#endif
+
+static sl_downsample_func_t sl_downsample_row = sl_downsample_row_c;
+
+void sl_copy_init(void) {
+#if SL_COPY_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    sl_copy_stream = sl_copy_stream_avx2;
+  else
+    sl_copy_stream = sl_copy_stream_sse2;
+  sl_downsample_row = sl_downsample_row_sse2;
+#elif SL_COPY_NEON
+  sl_copy_stream = sl_copy_stream_neon;
+  sl_downsample_row = sl_downsample_row_neon;
+#endif
+}
+
+static void sl_copy_rect(struct sl_mmap* dst,
+                         struct sl_mmap* src,
+                         int32_t x1,
+                         int32_t y1,
+                         int32_t x2,
+                         int32_t y2,
+                         int stream) {
+  size_t bpp = src->bpp;
+  sl_copy_func_t copy = stream ? sl_copy_stream : sl_copy_memcpy;
+  size_t i;
+  TRACE_EVENT("copy");
+
+  for (i = 0; i < src->num_planes; ++i) {
+    size_t ss = src->y_ss[i];
+    // Subsampled planes store interleaved chroma pairs, so align the rect
+    // to whole samples before converting it to plane coordinates.
+    size_t px1 = x1 / ss * ss;
+    size_t px2 = (x2 + ss - 1) / ss * ss;
+    size_t row1 = y1 / ss;
+    size_t row2 = (y2 + ss - 1) / ss;
+    size_t src_stride = src->stride[i];
+    size_t dst_stride = dst->stride[i];
+    const uint8_t* s = (uint8_t*)src->addr + src->offset[i] +
+                       row1 * src_stride + px1 * bpp;
+    uint8_t* d =
+        (uint8_t*)dst->addr + dst->offset[i] + row1 * dst_stride + px1 * bpp;
+    size_t row_size = MIN(src_stride, dst_stride);
+    size_t bytes = MIN(px2 * bpp, row_size) - MIN(px1 * bpp, row_size);
+    size_t rows = row2 - row1;
+
+    if (!rows || !bytes)
+      continue;
+
+    // Copy the rows as one contiguous block when the layouts match and the
+    // padding in between is small.
+    if (src_stride == dst_stride && src_stride >= bytes &&
+        src_stride - bytes <= SL_COPY_COALESCE_SLACK) {
+      copy(d, s, (rows - 1) * src_stride + bytes);
+      continue;
+    }
+
+    while (rows--) {
+      copy(d, s, bytes);
+      d += dst_stride;
+      s += src_stride;
+    }
+  }
+
+#if SL_COPY_X86
+  // Make streaming stores visible to other threads and the host before
+  // end_write hands the buffer back.
+  if (stream)
+    _mm_sfence();
+#endif
+}
+
+// Downsamples a rect of a single plane 32 bit buffer to half its size in
+// both directions. The rect is in source coordinates and has even bounds.
+static void sl_downsample_rect(struct sl_mmap* dst,
+                               struct sl_mmap* src,
+                               int32_t x1,
+                               int32_t y1,
+                               int32_t x2,
+                               int32_t y2) {
+  size_t src_stride = src->stride[0];
+  size_t dst_stride = dst->stride[0];
+  size_t width = (x2 - x1) / 2;
+  const uint8_t* s =
+      (uint8_t*)src->addr + src->offset[0] + y1 * src_stride + x1 * 4;
+  uint8_t* d = (uint8_t*)dst->addr + dst->offset[0] + y1 / 2 * dst_stride +
+               x1 / 2 * 4;
+  int32_t y;
+  TRACE_EVENT("copy");
+
+  for (y = y1; y < y2; y += 2) {
+    sl_downsample_row((uint32_t*)d, (const uint32_t*)s,
+                      (const uint32_t*)(s + src_stride), width);
+    d += dst_stride;
+    s += 2 * src_stride;
+  }
+}
+
+// Called with the pool mutex held. Copies tiles of |job| until none are
+// left and signals completion when the last tile is done.
+static void sl_copy_job_work(struct sl_copy_job* job) {
+  struct sl_copy_pool* pool = job->pool;
+
+  while (job->next_tile < job->num_tiles) {
+    struct sl_copy_tile tile = job->tiles[job->next_tile++];
+
+    pthread_mutex_unlock(&pool->mutex);
+    if (job->downsample)
+      sl_downsample_rect(job->dst, job->src, tile.x1, tile.y1, tile.x2,
+                         tile.y2);
+    else
+      sl_copy_rect(job->dst, job->src, tile.x1, tile.y1, tile.x2, tile.y2,
+                   job->stream);
+    pthread_mutex_lock(&pool->mutex);
+
+    if (--job->pending_tiles == 0) {
+      uint64_t value = 1;
+      int rv;
+
+      pthread_cond_broadcast(&pool->done_cond);
+      rv = write(pool->event_fd, &value, sizeof(value));
+      assert(rv == sizeof(value));
+      UNUSED(rv);
+    }
+  }
+}
+
+static void* sl_copy_pool_thread(void* data) {
+  struct sl_copy_pool* pool = (struct sl_copy_pool*)data;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    struct sl_copy_job* job;
+    int found = 0;
+
+    wl_list_for_each(job, &pool->jobs, link) {
+      if (job->next_tile < job->num_tiles) {
+        found = 1;
+        break;
+      }
+    }
+
+    if (found)
+      sl_copy_job_work(job);
+    else
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+  }
+
+  return NULL;
+}
+
+static int sl_handle_copy_pool_event(int fd, uint32_t mask, void* data) {
+  struct sl_copy_pool* pool = (struct sl_copy_pool*)data;
+  uint64_t value;
+  int rv;
+
+  rv = read(fd, &value, sizeof(value));
+  if (rv != sizeof(value))
+    return 0;
+
+  for (;;) {
+    struct sl_copy_job* job;
+    int found = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    wl_list_for_each(job, &pool->jobs, link) {
+      if (!job->pending_tiles) {
+        found = 1;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!found)
+      break;
+    sl_copy_job_finish(job);
+  }
+
+  return 1;
+}
+
+struct sl_copy_pool* sl_copy_pool_create(struct wl_event_loop* event_loop,
+                                         int num_threads) {
+  struct sl_copy_pool* pool;
+  int i;
+
+  pool = malloc(sizeof(*pool));
+  assert(pool);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  pool->num_threads = 0;
+  wl_list_init(&pool->jobs);
+  wl_list_init(&pool->free_jobs);
+  pool->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool->event_fd == -1) {
+    fprintf(stderr, "warning: failed to create copy eventfd: %s\n",
+            strerror(errno));
+    free(pool);
+    return NULL;
+  }
+  pool->event_source =
+      wl_event_loop_add_fd(event_loop, pool->event_fd, WL_EVENT_READABLE,
+                           sl_handle_copy_pool_event, pool);
+
+  for (i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, sl_copy_pool_thread, pool)) {
+      fprintf(stderr, "warning: failed to create copy thread\n");
+      break;
+    }
+    pthread_detach(thread);
+    ++pool->num_threads;
+  }
+
+  if (!pool->num_threads) {
+    wl_event_source_remove(pool->event_source);
+    close(pool->event_fd);
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+static void sl_copy_job_add_tile(struct sl_copy_job* job,
+                                 int32_t x1,
+                                 int32_t y1,
+                                 int32_t x2,
+                                 int32_t y2) {
+  struct sl_copy_tile* tile;
+
+  if (job->num_tiles == job->tiles_size) {
+    job->tiles_size = MAX(64, job->tiles_size * 2);
+    job->tiles = realloc(job->tiles, job->tiles_size * sizeof(*job->tiles));
+    assert(job->tiles);
+  }
+
+  tile = &job->tiles[job->num_tiles++];
+  tile->x1 = x1;
+  tile->y1 = y1;
+  tile->x2 = x2;
+  tile->y2 = y2;
+}
+
+// Copies |boxes| from |src| to |dst|. With |downsample| set, |dst| is half
+// the size of |src| and the boxes, which must have even bounds, are box
+// filtered into it.
+struct sl_copy_job* sl_copy_region(struct sl_copy_pool* pool,
+                                   struct sl_mmap* dst,
+                                   struct sl_mmap* src,
+                                   const struct pixman_box32* boxes,
+                                   int n,
+                                   int downsample,
+                                   sl_copy_done_func_t done,
+                                   void* data) {
+  struct sl_copy_job* job;
+  size_t size = 0;
+  int stream;
+  int i;
+
+  for (i = 0; i < n; ++i)
+    size += (size_t)(boxes[i].x2 - boxes[i].x1) *
+            (boxes[i].y2 - boxes[i].y1) * src->bpp;
+
+  // Buffers that need begin/end write calls are dmabufs, which are mapped
+  // write-combined. Bypass the cache for large updates to them.
+  stream = dst->begin_write && size >= SL_COPY_STREAM_THRESHOLD;
+
+  if (!pool || size < SL_COPY_PARALLEL_THRESHOLD) {
+    for (i = 0; i < n; ++i) {
+      if (downsample)
+        sl_downsample_rect(dst, src, boxes[i].x1, boxes[i].y1, boxes[i].x2,
+                           boxes[i].y2);
+      else
+        sl_copy_rect(dst, src, boxes[i].x1, boxes[i].y1, boxes[i].x2,
+                     boxes[i].y2, stream);
+    }
+    return NULL;
+  }
+
+  // Jobs are recycled so that steady state uploads don't allocate.
+  if (!wl_list_empty(&pool->free_jobs)) {
+    job = wl_container_of(pool->free_jobs.next, job, link);
+    wl_list_remove(&job->link);
+  } else {
+    job = malloc(sizeof(*job));
+    assert(job);
+    job->tiles = NULL;
+    job->tiles_size = 0;
+  }
+  job->pool = pool;
+  job->dst = sl_mmap_ref(dst);
+  job->src = sl_mmap_ref(src);
+  job->downsample = downsample;
+  job->stream = stream;
+  job->num_tiles = 0;
+  job->next_tile = 0;
+  job->done = done;
+  job->data = data;
+
+  // Split rects into bands of rows. Bands start on even rows so that
+  // subsampled chroma rows and downsampled row pairs are never shared
+  // between two tiles.
+  for (i = 0; i < n; ++i) {
+    size_t row_size = (size_t)(boxes[i].x2 - boxes[i].x1) * src->bpp;
+    int32_t rows = MAX(2, SL_COPY_TILE_SIZE / MAX(row_size, 1)) & ~1;
+    int32_t y = boxes[i].y1;
+
+    while (y < boxes[i].y2) {
+      int32_t y2 = MIN(boxes[i].y2, (y & ~1) + rows);
+
+      sl_copy_job_add_tile(job, boxes[i].x1, y, boxes[i].x2, y2);
+      y = y2;
+    }
+  }
+  job->pending_tiles = job->num_tiles;
+
+  pthread_mutex_lock(&pool->mutex);
+  wl_list_insert(pool->jobs.prev, &job->link);
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  return job;
+}
+
+void sl_copy_job_finish(struct sl_copy_job* job) {
+  struct sl_copy_pool* pool = job->pool;
+
+  // Help out instead of idling while the workers copy.
+  pthread_mutex_lock(&pool->mutex);
+  sl_copy_job_work(job);
+  while (job->pending_tiles)
+    pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  wl_list_remove(&job->link);
+  pthread_mutex_unlock(&pool->mutex);
+
+  sl_mmap_unref(job->dst);
+  sl_mmap_unref(job->src);
+  if (job->done)
+    job->done(job->data);
+  wl_list_insert(&pool->free_jobs, &job->link);
+}
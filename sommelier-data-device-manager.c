@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -25,6 +26,7 @@ struct sl_host_data_device {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_data_device* proxy;
+  int entered;
 };
 
 struct sl_host_data_source {
@@ -38,69 +40,267 @@ struct sl_host_data_offer {
   struct wl_data_offer* proxy;
 };
 
+// Transfers start with a small ring buffer that grows while the reader
+// outpaces the writer.
+#define SL_DATA_TRANSFER_MIN_SIZE (64 * 1024)
+#define SL_DATA_TRANSFER_MAX_SIZE (4 * 1024 * 1024)
+
+// Requested size of the kernel pipe used for splice transfers.
+#define SL_DATA_TRANSFER_PIPE_SIZE (1024 * 1024)
+
 struct sl_data_transfer {
   int read_fd;
   int write_fd;
+  int eof;
+  // Set once the writer has closed |read_fd|. The data it still holds is
+  // read as space frees up instead of waiting for events.
+  int hangup;
+  // Kernel pipe that data is spliced through, or -1 after falling back to
+  // the ring buffer.
+  int pipe_fds[2];
+  size_t pipe_size;
+  size_t pipe_bytes;
+  uint8_t* data;
+  size_t size;
   size_t offset;
   size_t bytes_left;
-  uint8_t data[4096];
+  uint32_t read_mask;
+  uint32_t write_mask;
   struct wl_event_source* read_event_source;
   struct wl_event_source* write_event_source;
 };
 
 static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
-  assert(transfer->read_event_source);
-  wl_event_source_remove(transfer->read_event_source);
+  if (transfer->read_event_source)
+    wl_event_source_remove(transfer->read_event_source);
   assert(transfer->write_event_source);
   wl_event_source_remove(transfer->write_event_source);
   close(transfer->read_fd);
   close(transfer->write_fd);
+  if (transfer->pipe_fds[0] >= 0) {
+    close(transfer->pipe_fds[0]);
+    close(transfer->pipe_fds[1]);
+  }
+  free(transfer->data);
   free(transfer);
 }
 
+static int sl_data_transfer_has_space(struct sl_data_transfer* transfer) {
+  if (transfer->pipe_fds[0] >= 0)
+    return transfer->pipe_bytes < transfer->pipe_size;
+
+  return transfer->bytes_left < transfer->size ||
+         transfer->size < SL_DATA_TRANSFER_MAX_SIZE;
+}
+
+static int sl_data_transfer_has_data(struct sl_data_transfer* transfer) {
+  return transfer->pipe_fds[0] >= 0 ? transfer->pipe_bytes > 0
+                                    : transfer->bytes_left > 0;
+}
+
+static ssize_t sl_data_transfer_read(struct sl_data_transfer* transfer);
+
+// Enables reading while there is room for more data and writing while
+// there is data left, so that both ends make progress at the same time.
+// Ends the transfer once all data has been written after EOF.
+static void sl_data_transfer_update(struct sl_data_transfer* transfer) {
+  uint32_t read_mask = 0;
+  uint32_t write_mask = 0;
+
+  while (transfer->hangup && !transfer->eof &&
+         sl_data_transfer_has_space(transfer)) {
+    if (!sl_data_transfer_read(transfer))
+      break;
+  }
+
+  if (transfer->eof && !sl_data_transfer_has_data(transfer)) {
+    sl_data_transfer_destroy(transfer);
+    return;
+  }
+
+  if (!transfer->eof && sl_data_transfer_has_space(transfer))
+    read_mask = WL_EVENT_READABLE;
+  if (sl_data_transfer_has_data(transfer))
+    write_mask = WL_EVENT_WRITABLE;
+
+  if (transfer->read_event_source && read_mask != transfer->read_mask) {
+    wl_event_source_fd_update(transfer->read_event_source, read_mask);
+    transfer->read_mask = read_mask;
+  }
+  if (write_mask != transfer->write_mask) {
+    wl_event_source_fd_update(transfer->write_event_source, write_mask);
+    transfer->write_mask = write_mask;
+  }
+}
+
+// Epoll (and therefore wl_event_loop) will keep notifying listeners of
+// hangups even if all other events are disabled, so stop listening on the
+// read end once no more events are needed from it.
+static void sl_data_transfer_stop_polling(struct sl_data_transfer* transfer) {
+  if (transfer->read_event_source) {
+    wl_event_source_remove(transfer->read_event_source);
+    transfer->read_event_source = NULL;
+  }
+}
+
+static void sl_data_transfer_set_eof(struct sl_data_transfer* transfer) {
+  transfer->eof = 1;
+  sl_data_transfer_stop_polling(transfer);
+}
+
+// Grows the ring buffer and moves its contents to the front.
+static void sl_data_transfer_grow(struct sl_data_transfer* transfer,
+                                  size_t size) {
+  uint8_t* data = malloc(size);
+  size_t head;
+
+  assert(data);
+  head = MIN(transfer->bytes_left, transfer->size - transfer->offset);
+  if (head)
+    memcpy(data, transfer->data + transfer->offset, head);
+  if (transfer->bytes_left > head)
+    memcpy(data + head, transfer->data, transfer->bytes_left - head);
+  free(transfer->data);
+  transfer->data = data;
+  transfer->size = size;
+  transfer->offset = 0;
+}
+
+// Switches to the ring buffer when one of the ends doesn't support splice.
+// Data that was already spliced into the pipe is moved to the ring buffer.
+static void sl_data_transfer_fallback(struct sl_data_transfer* transfer) {
+  transfer->size = MAX(SL_DATA_TRANSFER_MIN_SIZE, transfer->pipe_size);
+  transfer->data = malloc(transfer->size);
+  assert(transfer->data);
+  transfer->offset = 0;
+  transfer->bytes_left = 0;
+
+  while (transfer->pipe_bytes) {
+    ssize_t rv = read(transfer->pipe_fds[0],
+                      transfer->data + transfer->bytes_left,
+                      transfer->size - transfer->bytes_left);
+    if (rv <= 0)
+      break;
+    transfer->bytes_left += rv;
+    transfer->pipe_bytes -= rv;
+  }
+
+  if (transfer->pipe_fds[0] >= 0) {
+    close(transfer->pipe_fds[0]);
+    close(transfer->pipe_fds[1]);
+    transfer->pipe_fds[0] = transfer->pipe_fds[1] = -1;
+  }
+  transfer->pipe_bytes = 0;
+}
+
+static ssize_t sl_data_transfer_read_ring(struct sl_data_transfer* transfer) {
+  struct iovec iov[2];
+  size_t tail, space;
+  int iovcnt = 1;
+  ssize_t rv;
+
+  if (transfer->bytes_left == transfer->size)
+    sl_data_transfer_grow(transfer, MIN(transfer->size * 2,
+                                        SL_DATA_TRANSFER_MAX_SIZE));
+
+  tail = (transfer->offset + transfer->bytes_left) % transfer->size;
+  space = transfer->size - transfer->bytes_left;
+  iov[0].iov_base = transfer->data + tail;
+  iov[0].iov_len = MIN(space, transfer->size - tail);
+  if (iov[0].iov_len < space) {
+    iov[1].iov_base = transfer->data;
+    iov[1].iov_len = space - iov[0].iov_len;
+    iovcnt = 2;
+  }
+
+  rv = readv(transfer->read_fd, iov, iovcnt);
+  if (rv > 0) {
+    transfer->bytes_left += rv;
+    return rv;
+  }
+
+  // On a read error or EOF, finish writing what we have. No more data
+  // becomes ready after the writer has hung up.
+  if (rv == 0 || errno != EAGAIN || transfer->hangup)
+    sl_data_transfer_set_eof(transfer);
+  return 0;
+}
+
+// Reads as much data as there is room for. Returns the number of bytes
+// read, or 0 if nothing was ready or EOF was reached.
+static ssize_t sl_data_transfer_read(struct sl_data_transfer* transfer) {
+  ssize_t rv;
+
+  if (transfer->pipe_fds[0] < 0)
+    return sl_data_transfer_read_ring(transfer);
+
+  rv = splice(transfer->read_fd, NULL, transfer->pipe_fds[1], NULL,
+              transfer->pipe_size - transfer->pipe_bytes,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rv > 0) {
+    transfer->pipe_bytes += rv;
+    return rv;
+  }
+  if (rv < 0 && errno == EINVAL) {
+    sl_data_transfer_fallback(transfer);
+    return sl_data_transfer_read_ring(transfer);
+  }
+
+  if (rv == 0 || errno != EAGAIN || transfer->hangup)
+    sl_data_transfer_set_eof(transfer);
+  return 0;
+}
+
+static int sl_data_transfer_write_ring(struct sl_data_transfer* transfer) {
+  while (transfer->bytes_left) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t rv;
+
+    iov[0].iov_base = transfer->data + transfer->offset;
+    iov[0].iov_len =
+        MIN(transfer->bytes_left, transfer->size - transfer->offset);
+    if (iov[0].iov_len < transfer->bytes_left) {
+      iov[1].iov_base = transfer->data;
+      iov[1].iov_len = transfer->bytes_left - iov[0].iov_len;
+      iovcnt = 2;
+    }
+
+    rv = writev(transfer->write_fd, iov, iovcnt);
+    if (rv < 0)
+      return errno == EAGAIN ? 0 : -1;
+
+    transfer->offset = (transfer->offset + rv) % transfer->size;
+    transfer->bytes_left -= rv;
+  }
+
+  transfer->offset = 0;
+  return 0;
+}
+
 static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+  TRACE_EVENT("data");
+
   if ((mask & WL_EVENT_READABLE) == 0) {
     assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
 
-    // Epoll (and therefore wl_event_loop) will notify listeners of errors and
-    // hangups even if all other events are disabled. Therefore, at this point,
-    // we don't know whether we didn't get a readable event because the fd has
-    // been exhausted, or because we aren't in the reading state and weren't
-    // listening for one. We can make the distinction be checking if there's any
-    // data left in the buffer. If there is, then we are just waiting for the
-    // writing to finish, otherwise end the transfer.
-
-    // In the case of an error, where there is not likely to be any more data to
-    // read, we still want to wait for any data we did get to be written out.
-    if (!transfer->bytes_left) {
-      sl_data_transfer_destroy(transfer);
-    }
-    return 0;
-  }
-
-  // At this point we must be in the reading state.
-  assert(!transfer->bytes_left);
-
-  transfer->bytes_left =
-      read(transfer->read_fd, transfer->data, sizeof(transfer->data));
-  if (transfer->bytes_left > 0) {
-    transfer->offset = 0;
-    // There may still be data to read from the event source, but we have no
-    // room in our buffer so move to the writing state.
-    wl_event_source_fd_update(transfer->read_event_source, 0);
-    wl_event_source_fd_update(transfer->write_event_source, WL_EVENT_WRITABLE);
+    // Hangups are also reported while reads are disabled because the
+    // buffer is full. The writer is gone but |read_fd| can still hold data,
+    // which sl_data_transfer_update() reads until it returns EOF.
+    transfer->hangup = 1;
+    sl_data_transfer_stop_polling(transfer);
   } else {
-    // On a read error or EOF, end the transfer.
-    sl_data_transfer_destroy(transfer);
+    sl_data_transfer_read(transfer);
   }
 
+  sl_data_transfer_update(transfer);
   return 0;
 }
 
 static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
-  int rv;
+  TRACE_EVENT("data");
 
   // If we receive a HANGUP or ERROR event on the write source then there is no
   // point in continuing the transfer. We could still read more data, but we
@@ -111,28 +311,30 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
     return 0;
   }
 
-  // At this point we must be in the writing state.
-  assert(transfer->bytes_left);
-
-  rv = write(transfer->write_fd, transfer->data + transfer->offset,
-             transfer->bytes_left);
+  while (transfer->pipe_fds[0] >= 0 && transfer->pipe_bytes) {
+    ssize_t rv = splice(transfer->pipe_fds[0], NULL, transfer->write_fd, NULL,
+                        transfer->pipe_bytes,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
-  if (rv < 0) {
-    // On a write error, end the transfer.
-    sl_data_transfer_destroy(transfer);
-  } else {
-    assert(rv <= transfer->bytes_left);
-    transfer->bytes_left -= rv;
-    transfer->offset += rv;
+    if (rv > 0) {
+      transfer->pipe_bytes -= rv;
+    } else if (rv < 0 && errno == EINVAL) {
+      sl_data_transfer_fallback(transfer);
+    } else if (rv < 0 && errno == EAGAIN) {
+      break;
+    } else {
+      // On a write error, end the transfer.
+      sl_data_transfer_destroy(transfer);
+      return 0;
+    }
   }
 
-  if (!transfer->bytes_left) {
-    // If all data has been written, move back to the reading state.
-    wl_event_source_fd_update(transfer->write_event_source, 0);
-    wl_event_source_fd_update(transfer->read_event_source, WL_EVENT_READABLE);
+  if (transfer->pipe_fds[0] < 0 && sl_data_transfer_write_ring(transfer)) {
+    sl_data_transfer_destroy(transfer);
+    return 0;
   }
 
-  // If there is still data left, continue in the writing state.
+  sl_data_transfer_update(transfer);
   return 0;
 }
 
@@ -153,8 +355,29 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
   assert(transfer);
   transfer->read_fd = read_fd;
   transfer->write_fd = write_fd;
+  transfer->eof = 0;
+  transfer->hangup = 0;
+  transfer->pipe_bytes = 0;
+  transfer->pipe_size = 0;
+  transfer->data = NULL;
+  transfer->size = 0;
   transfer->offset = 0;
   transfer->bytes_left = 0;
+
+  // Data is spliced through a kernel pipe until one of the ends turns out
+  // not to support it.
+  if (pipe2(transfer->pipe_fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+    fcntl(transfer->pipe_fds[1], F_SETPIPE_SZ, SL_DATA_TRANSFER_PIPE_SIZE);
+    rv = fcntl(transfer->pipe_fds[1], F_GETPIPE_SZ);
+    transfer->pipe_size = rv > 0 ? rv : 0;
+  } else {
+    transfer->pipe_fds[0] = transfer->pipe_fds[1] = -1;
+  }
+  if (transfer->pipe_fds[0] < 0 || !transfer->pipe_size)
+    sl_data_transfer_fallback(transfer);
+
+  transfer->read_mask = WL_EVENT_READABLE;
+  transfer->write_mask = 0;
   transfer->read_event_source =
       wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
                            sl_handle_data_transfer_read, transfer);
@@ -430,6 +653,12 @@ static void sl_data_device_enter(void* data,
       wl_data_offer_get_user_data(data_offer);
   double scale = host->ctx->scale;
 
+  // Drags over surfaces of other clients are not forwarded.
+  host->entered = wl_resource_get_client(host_surface->resource) ==
+                  wl_resource_get_client(host->resource);
+  if (!host->entered)
+    return;
+
   wl_data_device_send_enter(host->resource, serial, host_surface->resource,
                             wl_fixed_from_double(wl_fixed_to_double(x) * scale),
                             wl_fixed_from_double(wl_fixed_to_double(y) * scale),
@@ -440,6 +669,10 @@ static void sl_data_device_leave(void* data,
                                  struct wl_data_device* data_device) {
   struct sl_host_data_device* host = wl_data_device_get_user_data(data_device);
 
+  if (!host->entered)
+    return;
+
+  host->entered = 0;
   wl_data_device_send_leave(host->resource);
 }
 
@@ -451,6 +684,9 @@ static void sl_data_device_motion(void* data,
   struct sl_host_data_device* host = wl_data_device_get_user_data(data_device);
   double scale = host->ctx->scale;
 
+  if (!host->entered)
+    return;
+
   wl_data_device_send_motion(
       host->resource, time, wl_fixed_from_double(wl_fixed_to_double(x) * scale),
       wl_fixed_from_double(wl_fixed_to_double(y) * scale));
@@ -460,6 +696,9 @@ static void sl_data_device_drop(void* data,
                                 struct wl_data_device* data_device) {
   struct sl_host_data_device* host = wl_data_device_get_user_data(data_device);
 
+  if (!host->entered)
+    return;
+
   wl_data_device_send_drop(host->resource);
 }
 
@@ -525,6 +764,7 @@ static void sl_data_device_manager_get_data_device(
   assert(host_data_device);
 
   host_data_device->ctx = host->ctx;
+  host_data_device->entered = 0;
   host_data_device->resource = wl_resource_create(
       client, &wl_data_device_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_data_device->resource,
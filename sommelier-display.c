@@ -120,7 +120,8 @@ static enum wl_iterator_result sl_set_implementation(
   return WL_ITERATOR_CONTINUE;
 }
 
-void sl_set_display_implementation(struct sl_context* ctx) {
+void sl_set_display_implementation(struct sl_context* ctx,
+                                   struct wl_client* client) {
   // Find display resource and set implementation.
-  wl_client_for_each_resource(ctx->client, sl_set_implementation, ctx);
+  wl_client_for_each_resource(client, sl_set_implementation, ctx);
 }
@@ -25,6 +25,61 @@ struct sl_host_drm {
   struct wl_callback* callback;
 };
 
+// GEM handle imported from a prime fd. The kernel returns the same handle
+// each time a buffer object is imported, so handles are shared and
+// refcounted across all buffers that refer to the same object.
+struct sl_drm_handle {
+  struct sl_context* ctx;
+  uint32_t handle;
+  int refcount;
+  struct wl_list link;
+};
+
+struct sl_drm_handle* sl_drm_handle_import(struct sl_context* ctx, int fd) {
+  int drm_fd = gbm_device_get_fd(ctx->gbm);
+  struct drm_prime_handle prime_handle;
+  struct sl_drm_handle* handle;
+  int ret;
+
+  // This will fail if this function was not passed a prime handle that can
+  // be imported by the drm device given to sommelier.
+  memset(&prime_handle, 0, sizeof(prime_handle));
+  prime_handle.fd = fd;
+  ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
+  if (ret)
+    return NULL;
+
+  wl_list_for_each(handle, &ctx->drm_handles, link) {
+    if (handle->handle == prime_handle.handle) {
+      ++handle->refcount;
+      return handle;
+    }
+  }
+
+  handle = malloc(sizeof(*handle));
+  assert(handle);
+  handle->ctx = ctx;
+  handle->handle = prime_handle.handle;
+  handle->refcount = 1;
+  wl_list_insert(&ctx->drm_handles, &handle->link);
+
+  return handle;
+}
+
+void sl_drm_handle_unref(struct sl_drm_handle* handle) {
+  struct drm_gem_close gem_close;
+
+  if (--handle->refcount)
+    return;
+
+  memset(&gem_close, 0, sizeof(gem_close));
+  gem_close.handle = handle->handle;
+  drmIoctl(gbm_device_get_fd(handle->ctx->gbm), DRM_IOCTL_GEM_CLOSE,
+           &gem_close);
+  wl_list_remove(&handle->link);
+  free(handle);
+}
+
 static void sl_drm_authenticate(struct wl_client* client,
                                 struct wl_resource* resource,
                                 uint32_t id) {
@@ -60,32 +115,19 @@ static void sl_drm_create_planar_buffer(struct wl_client* client,
 
 static void sl_drm_sync(struct sl_context* ctx,
                         struct sl_sync_point* sync_point) {
-  int drm_fd = gbm_device_get_fd(ctx->gbm);
-  struct drm_prime_handle prime_handle;
-  int ret;
+  struct sl_drm_handle* handle = (struct sl_drm_handle*)sync_point->data;
+  struct drm_virtgpu_3d_wait wait_arg;
+  TRACE_EVENT("drm");
+
+  // Waits for GPU operations to complete. This will fail silently if the
+  // drm device passed to sommelier is not a virtio-gpu device.
+  memset(&wait_arg, 0, sizeof(wait_arg));
+  wait_arg.handle = handle->handle;
+  drmIoctl(gbm_device_get_fd(ctx->gbm), DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
+}
 
-  // First imports the prime fd to a gem handle. This will fail if this
-  // function was not passed a prime handle that can be imported by the drm
-  // device given to sommelier.
-  memset(&prime_handle, 0, sizeof(prime_handle));
-  prime_handle.fd = sync_point->fd;
-  ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-  if (!ret) {
-    struct drm_virtgpu_3d_wait wait_arg;
-    struct drm_gem_close gem_close;
-
-    // Then attempts to wait for GPU operations to complete. This will fail
-    // silently if the drm device passed to sommelier is not a virtio-gpu
-    // device.
-    memset(&wait_arg, 0, sizeof(wait_arg));
-    wait_arg.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
-
-    // Always close the handle we imported.
-    memset(&gem_close, 0, sizeof(gem_close));
-    gem_close.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-  }
+static void sl_drm_sync_destroy(struct sl_sync_point* sync_point) {
+  sl_drm_handle_unref((struct sl_drm_handle*)sync_point->data);
 }
 
 static void sl_drm_create_prime_buffer(struct wl_client* client,
@@ -113,37 +155,28 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
   // Attempts to correct stride0 with virtio-gpu specific resource information,
   // if available.  Ideally mesa/gbm should have the correct stride. Remove
   // after crbug.com/892242 is resolved in mesa.
-  int is_gpu_buffer = 0;
+  // The imported handle is kept for the lifetime of the buffer so that
+  // sl_drm_sync doesn't need to import it again for every frame.
+  struct sl_drm_handle* handle = NULL;
   if (host->ctx->gbm) {
-    int drm_fd = gbm_device_get_fd(host->ctx->gbm);
-    struct drm_prime_handle prime_handle;
-    int ret;
-
-    // First imports the prime fd to a gem handle. This will fail if this
-    // function was not passed a prime handle that can be imported by the drm
-    // device given to sommelier.
-    memset(&prime_handle, 0, sizeof(prime_handle));
-    prime_handle.fd = name;
-    ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-    if (!ret) {
+    handle = sl_drm_handle_import(host->ctx, name);
+    if (handle) {
       struct drm_virtgpu_resource_info info_arg;
-      struct drm_gem_close gem_close;
+      int ret;
 
-      // Then attempts to get resource information. This will fail silently if
+      // Attempts to get resource information. This will fail silently if
       // the drm device passed to sommelier is not a virtio-gpu device.
       memset(&info_arg, 0, sizeof(info_arg));
-      info_arg.bo_handle = prime_handle.handle;
-      ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info_arg);
+      info_arg.bo_handle = handle->handle;
+      ret = drmIoctl(gbm_device_get_fd(host->ctx->gbm),
+                     DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info_arg);
       // Correct stride0 if we are able to get proper resource info.
       if (!ret) {
         stride0 = info_arg.stride;
-        is_gpu_buffer = 1;
+      } else {
+        sl_drm_handle_unref(handle);
+        handle = NULL;
       }
-
-      // Always close the handle we imported.
-      memset(&gem_close, 0, sizeof(gem_close));
-      gem_close.handle = prime_handle.handle;
-      drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
     }
   }
 
@@ -158,9 +191,12 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
                             zwp_linux_buffer_params_v1_create_immed(
                                 buffer_params, width, height, format, 0),
                             width, height);
-  if (is_gpu_buffer) {
+  host_buffer->is_dmabuf = 1;
+  if (handle) {
     host_buffer->sync_point = sl_sync_point_create(name);
     host_buffer->sync_point->sync = sl_drm_sync;
+    host_buffer->sync_point->destroy = sl_drm_sync_destroy;
+    host_buffer->sync_point->data = handle;
   } else {
     close(name);
   }
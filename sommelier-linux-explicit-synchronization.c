@@ -0,0 +1,318 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "linux-explicit-synchronization-unstable-v1-client-protocol.h"
+#include "linux-explicit-synchronization-unstable-v1-server-protocol.h"
+
+struct sl_host_linux_explicit_synchronization {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct zwp_linux_explicit_synchronization_v1* proxy;
+};
+
+// Acquire fences and release requests are double-buffered surface state.
+// They are held until commit, where the attached buffer decides whether
+// they can be forwarded to the host. Copied shm buffers don't support
+// explicit synchronization.
+struct sl_host_surface_synchronization {
+  struct wl_resource* resource;
+  struct zwp_linux_surface_synchronization_v1* proxy;
+  struct sl_host_surface* surface;
+  struct wl_listener surface_destroy_listener;
+  int acquire_fence_fd;
+  struct sl_host_buffer_release* pending_release;
+};
+
+struct sl_host_buffer_release {
+  struct wl_resource* resource;
+  struct zwp_linux_buffer_release_v1* proxy;
+  struct sl_host_surface_synchronization* synchronization;
+};
+
+static void sl_buffer_release_fenced_release(
+    void* data, struct zwp_linux_buffer_release_v1* buffer_release,
+    int32_t fence) {
+  struct sl_host_buffer_release* host = data;
+
+  zwp_linux_buffer_release_v1_send_fenced_release(host->resource, fence);
+  close(fence);
+  wl_resource_destroy(host->resource);
+}
+
+static void sl_buffer_release_immediate_release(
+    void* data, struct zwp_linux_buffer_release_v1* buffer_release) {
+  struct sl_host_buffer_release* host = data;
+
+  zwp_linux_buffer_release_v1_send_immediate_release(host->resource);
+  wl_resource_destroy(host->resource);
+}
+
+static const struct zwp_linux_buffer_release_v1_listener
+    sl_buffer_release_listener = {sl_buffer_release_fenced_release,
+                                  sl_buffer_release_immediate_release};
+
+static void sl_destroy_host_buffer_release(struct wl_resource* resource) {
+  struct sl_host_buffer_release* host = wl_resource_get_user_data(resource);
+
+  if (host->proxy)
+    zwp_linux_buffer_release_v1_destroy(host->proxy);
+  if (host->synchronization)
+    host->synchronization->pending_release = NULL;
+  wl_resource_set_user_data(resource, NULL);
+  free(host);
+}
+
+static void sl_surface_synchronization_destroy(struct wl_client* client,
+                                               struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_surface_synchronization_set_acquire_fence(
+    struct wl_client* client, struct wl_resource* resource, int32_t fd) {
+  struct sl_host_surface_synchronization* host =
+      wl_resource_get_user_data(resource);
+
+  if (!host->surface) {
+    close(fd);
+    wl_resource_post_error(
+        resource, ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_NO_SURFACE,
+        "associated surface was destroyed");
+    return;
+  }
+
+  if (host->acquire_fence_fd >= 0) {
+    close(fd);
+    wl_resource_post_error(
+        resource, ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_DUPLICATE_FENCE,
+        "fence already set for this commit");
+    return;
+  }
+
+  host->acquire_fence_fd = fd;
+}
+
+static void sl_surface_synchronization_get_release(
+    struct wl_client* client, struct wl_resource* resource, uint32_t id) {
+  struct sl_host_surface_synchronization* host =
+      wl_resource_get_user_data(resource);
+  struct sl_host_buffer_release* buffer_release;
+
+  if (!host->surface) {
+    wl_resource_post_error(
+        resource, ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_NO_SURFACE,
+        "associated surface was destroyed");
+    return;
+  }
+
+  if (host->pending_release) {
+    wl_resource_post_error(
+        resource,
+        ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_DUPLICATE_RELEASE,
+        "release already requested for this commit");
+    return;
+  }
+
+  buffer_release = malloc(sizeof(*buffer_release));
+  assert(buffer_release);
+  buffer_release->proxy = NULL;
+  buffer_release->synchronization = host;
+  buffer_release->resource =
+      wl_resource_create(client, &zwp_linux_buffer_release_v1_interface, 1, id);
+  wl_resource_set_implementation(buffer_release->resource, NULL,
+                                 buffer_release,
+                                 sl_destroy_host_buffer_release);
+  host->pending_release = buffer_release;
+}
+
+static const struct zwp_linux_surface_synchronization_v1_interface
+    sl_surface_synchronization_implementation = {
+        sl_surface_synchronization_destroy,
+        sl_surface_synchronization_set_acquire_fence,
+        sl_surface_synchronization_get_release};
+
+static void sl_surface_synchronization_reset(
+    struct sl_host_surface_synchronization* host) {
+  if (host->acquire_fence_fd >= 0) {
+    close(host->acquire_fence_fd);
+    host->acquire_fence_fd = -1;
+  }
+  if (host->pending_release) {
+    host->pending_release->synchronization = NULL;
+    host->pending_release = NULL;
+  }
+}
+
+static void sl_surface_synchronization_surface_destroyed(
+    struct wl_listener* listener, void* data) {
+  struct sl_host_surface_synchronization* host =
+      wl_container_of(listener, host, surface_destroy_listener);
+
+  wl_list_remove(&host->surface_destroy_listener.link);
+  wl_list_init(&host->surface_destroy_listener.link);
+  host->surface->synchronization = NULL;
+  host->surface = NULL;
+}
+
+static void sl_destroy_host_surface_synchronization(
+    struct wl_resource* resource) {
+  struct sl_host_surface_synchronization* host =
+      wl_resource_get_user_data(resource);
+
+  sl_surface_synchronization_reset(host);
+  if (host->surface)
+    host->surface->synchronization = NULL;
+  wl_list_remove(&host->surface_destroy_listener.link);
+  zwp_linux_surface_synchronization_v1_destroy(host->proxy);
+  wl_resource_set_user_data(resource, NULL);
+  free(host);
+}
+
+int sl_surface_synchronization_commit(struct sl_host_surface* surface,
+                                      int has_buffer) {
+  struct sl_host_surface_synchronization* host = surface->synchronization;
+  int has_fence = host->acquire_fence_fd >= 0;
+
+  if (!has_fence && !host->pending_release)
+    return 0;
+
+  if (!has_buffer) {
+    sl_surface_synchronization_reset(host);
+    wl_resource_post_error(host->resource,
+                           ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_NO_BUFFER,
+                           "no buffer attached");
+    return -1;
+  }
+
+  // Only dmabufs are guaranteed to support explicit synchronization on the
+  // host. An error raised by the host would be fatal for our connection,
+  // which all clients may share.
+  if (!surface->buffer_is_dmabuf) {
+    sl_surface_synchronization_reset(host);
+    wl_resource_post_error(
+        host->resource,
+        ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_UNSUPPORTED_BUFFER,
+        "buffer does not support explicit synchronization");
+    return -1;
+  }
+
+  if (has_fence) {
+    zwp_linux_surface_synchronization_v1_set_acquire_fence(
+        host->proxy, host->acquire_fence_fd);
+    close(host->acquire_fence_fd);
+    host->acquire_fence_fd = -1;
+  }
+
+  if (host->pending_release) {
+    struct sl_host_buffer_release* buffer_release = host->pending_release;
+
+    buffer_release->proxy =
+        zwp_linux_surface_synchronization_v1_get_release(host->proxy);
+    zwp_linux_buffer_release_v1_add_listener(
+        buffer_release->proxy, &sl_buffer_release_listener, buffer_release);
+    buffer_release->synchronization = NULL;
+    host->pending_release = NULL;
+  }
+
+  return has_fence;
+}
+
+static void sl_linux_explicit_synchronization_destroy(
+    struct wl_client* client, struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_linux_explicit_synchronization_get_synchronization(
+    struct wl_client* client,
+    struct wl_resource* resource,
+    uint32_t id,
+    struct wl_resource* surface_resource) {
+  struct sl_host_linux_explicit_synchronization* host =
+      wl_resource_get_user_data(resource);
+  struct sl_host_surface* host_surface =
+      wl_resource_get_user_data(surface_resource);
+  struct sl_host_surface_synchronization* synchronization;
+
+  if (host_surface->synchronization) {
+    wl_resource_post_error(
+        resource,
+        ZWP_LINUX_EXPLICIT_SYNCHRONIZATION_V1_ERROR_SYNCHRONIZATION_EXISTS,
+        "surface already has a synchronization object");
+    return;
+  }
+
+  synchronization = malloc(sizeof(*synchronization));
+  assert(synchronization);
+  synchronization->surface = host_surface;
+  synchronization->acquire_fence_fd = -1;
+  synchronization->pending_release = NULL;
+  synchronization->surface_destroy_listener.notify =
+      sl_surface_synchronization_surface_destroyed;
+  wl_resource_add_destroy_listener(surface_resource,
+                                   &synchronization->surface_destroy_listener);
+  synchronization->resource = wl_resource_create(
+      client, &zwp_linux_surface_synchronization_v1_interface,
+      wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(synchronization->resource,
+                                 &sl_surface_synchronization_implementation,
+                                 synchronization,
+                                 sl_destroy_host_surface_synchronization);
+  synchronization->proxy =
+      zwp_linux_explicit_synchronization_v1_get_synchronization(
+          host->proxy, host_surface->proxy);
+  zwp_linux_surface_synchronization_v1_set_user_data(synchronization->proxy,
+                                                     synchronization);
+  host_surface->synchronization = synchronization;
+}
+
+static const struct zwp_linux_explicit_synchronization_v1_interface
+    sl_linux_explicit_synchronization_implementation = {
+        sl_linux_explicit_synchronization_destroy,
+        sl_linux_explicit_synchronization_get_synchronization};
+
+static void sl_destroy_host_linux_explicit_synchronization(
+    struct wl_resource* resource) {
+  struct sl_host_linux_explicit_synchronization* host =
+      wl_resource_get_user_data(resource);
+
+  zwp_linux_explicit_synchronization_v1_destroy(host->proxy);
+  wl_resource_set_user_data(resource, NULL);
+  free(host);
+}
+
+static void sl_bind_host_linux_explicit_synchronization(
+    struct wl_client* client, void* data, uint32_t version, uint32_t id) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_linux_explicit_synchronization* linux_explicit_synchronization =
+      ctx->linux_explicit_synchronization;
+  struct sl_host_linux_explicit_synchronization* host;
+
+  host = malloc(sizeof(*host));
+  assert(host);
+  host->ctx = ctx;
+  host->resource = wl_resource_create(
+      client, &zwp_linux_explicit_synchronization_v1_interface,
+      MIN(version, linux_explicit_synchronization->version), id);
+  wl_resource_set_implementation(
+      host->resource, &sl_linux_explicit_synchronization_implementation, host,
+      sl_destroy_host_linux_explicit_synchronization);
+  host->proxy = wl_registry_bind(
+      wl_display_get_registry(ctx->display), linux_explicit_synchronization->id,
+      &zwp_linux_explicit_synchronization_v1_interface,
+      wl_resource_get_version(host->resource));
+  zwp_linux_explicit_synchronization_v1_set_user_data(host->proxy, host);
+}
+
+struct sl_global* sl_linux_explicit_synchronization_global_create(
+    struct sl_context* ctx) {
+  return sl_global_create(ctx,
+                          &zwp_linux_explicit_synchronization_v1_interface,
+                          ctx->linux_explicit_synchronization->version, ctx,
+                          sl_bind_host_linux_explicit_synchronization);
+}
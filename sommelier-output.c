@@ -31,6 +31,26 @@ int dpi_to_physical_mm(double dpi, int px) {
   return px * (INCH_IN_MM / dpi);
 }
 
+// Returns the largest number of physical pixels per logical pixel across
+// the host outputs. This is the same scale as the one applied in
+// sl_output_get_host_output_state().
+double sl_output_get_host_scale(struct sl_context* ctx) {
+  struct sl_host_output* host;
+  double scale = 1.0;
+
+  wl_list_for_each(host, &ctx->host_outputs, link) {
+    double applied_scale =
+        sl_output_aura_scale_factor_to_double(host->device_scale_factor) *
+        sl_output_aura_scale_factor_to_double(host->current_scale);
+
+    if (!ctx->aura_shell)
+      applied_scale = host->scale_factor;
+    scale = MAX(scale, applied_scale);
+  }
+
+  return scale;
+}
+
 void sl_output_get_host_output_state(struct sl_host_output* host,
                                      int* scale,
                                      int* physical_width,
@@ -297,6 +317,7 @@ static void sl_bind_host_output(struct wl_client* client,
   struct sl_output* output = (struct sl_output*)data;
   struct sl_context* ctx = output->ctx;
   struct sl_host_output* host;
+  struct sl_host_output* other;
 
   host = malloc(sizeof(*host));
   assert(host);
@@ -311,8 +332,14 @@ static void sl_bind_host_output(struct wl_client* client,
   wl_output_set_user_data(host->proxy, host);
   wl_output_add_listener(host->proxy, &sl_output_listener, host);
   host->aura_output = NULL;
-  // We assume that first output is internal by default.
-  host->internal = wl_list_empty(&ctx->host_outputs);
+  // We assume that first output of each client is internal by default.
+  host->internal = 1;
+  wl_list_for_each(other, &ctx->host_outputs, link) {
+    if (wl_resource_get_client(other->resource) == client) {
+      host->internal = 0;
+      break;
+    }
+  }
   host->x = 0;
   host->y = 0;
   host->physical_width = 0;
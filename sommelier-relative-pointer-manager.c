@@ -27,6 +27,8 @@ struct sl_host_relative_pointer {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zwp_relative_pointer_v1* proxy;
+  struct sl_host_pointer* pointer;
+  struct wl_listener pointer_destroy_listener;
 };
 
 // Like ceil(), but strictly increases the magnitude of the input value (i.e.
@@ -49,6 +51,11 @@ static void sl_relative_pointer_relative_motion(
   struct sl_host_relative_pointer* host =
       zwp_relative_pointer_v1_get_user_data(relative_pointer);
 
+  // Motion is only forwarded while one of the client's surfaces has pointer
+  // focus. The host sends it to the relative pointers of every client.
+  if (!host->pointer || !host->pointer->focus_resource)
+    return;
+
   // Unfortunately, many x11 toolkits truncate RawMotion events. We force them
   // to interpret cursor movement by rounding to the next greater-magnitude
   // value.
@@ -65,10 +72,21 @@ static void sl_destroy_host_relative_pointer(struct wl_resource* resource) {
   struct sl_host_relative_pointer* host = wl_resource_get_user_data(resource);
 
   zwp_relative_pointer_v1_destroy(host->proxy);
+  wl_list_remove(&host->pointer_destroy_listener.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
 
+static void sl_relative_pointer_pointer_destroyed(struct wl_listener* listener,
+                                                  void* data) {
+  struct sl_host_relative_pointer* host =
+      wl_container_of(listener, host, pointer_destroy_listener);
+
+  wl_list_remove(&host->pointer_destroy_listener.link);
+  wl_list_init(&host->pointer_destroy_listener.link);
+  host->pointer = NULL;
+}
+
 static void sl_relative_pointer_destroy(struct wl_client* client,
                                         struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -114,6 +132,11 @@ static void sl_relative_pointer_manager_get_relative_pointer(
   assert(relative_pointer_host);
   relative_pointer_host->resource = relative_pointer_resource;
   relative_pointer_host->ctx = host->ctx;
+  relative_pointer_host->pointer = host_pointer;
+  relative_pointer_host->pointer_destroy_listener.notify =
+      sl_relative_pointer_pointer_destroyed;
+  wl_resource_add_destroy_listener(
+      pointer, &relative_pointer_host->pointer_destroy_listener);
   relative_pointer_host->proxy =
       zwp_relative_pointer_manager_v1_get_relative_pointer(
           host->ctx->relative_pointer_manager->internal, host_pointer->proxy);
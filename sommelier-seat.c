@@ -32,14 +32,69 @@ struct sl_host_keyboard {
   struct wl_array pressed_keys;
 };
 
+// Number of compiled keymaps kept around for reuse.
+#define KEYMAP_CACHE_SIZE 4
+
+struct sl_keymap_cache_entry {
+  struct wl_list link;
+  uint64_t hash;
+  uint32_t size;
+  // Copy of the keymap text, compared before the entry is reused.
+  char* data;
+  struct xkb_keymap* keymap;
+};
+
+// Maximum number of touch points with coalesced motion in one frame.
+#define MAX_TOUCH_MOTIONS 10
+
+// Maximum number of touch points that are down on a client's surfaces.
+#define MAX_TOUCH_POINTS 10
+
+struct sl_touch_motion {
+  int32_t id;
+  uint32_t time;
+  wl_fixed_t x;
+  wl_fixed_t y;
+};
+
 struct sl_host_touch {
   struct sl_seat* seat;
   struct wl_resource* resource;
   struct wl_touch* proxy;
   struct wl_resource* focus_resource;
   struct wl_listener focus_resource_listener;
+  struct sl_touch_motion motions[MAX_TOUCH_MOTIONS];
+  int motion_count;
+  int32_t points[MAX_TOUCH_POINTS];
+  int point_count;
+  int frame_has_events;
 };
 
+static void sl_host_pointer_set_cursor_internal(
+    struct sl_host_pointer* host,
+    uint32_t serial,
+    struct sl_host_surface* host_surface,
+    int32_t hotspot_x,
+    int32_t hotspot_y) {
+  if (host_surface && host_surface->contents_width &&
+      host_surface->contents_height)
+    wl_surface_commit(host_surface->proxy);
+
+  wl_pointer_set_cursor(host->proxy, serial,
+                        host_surface ? host_surface->proxy : NULL, hotspot_x,
+                        hotspot_y);
+}
+
+// A cursor surface destroyed in the meantime leaves the pointer without
+// a cursor, as it would on the host.
+static void sl_host_pointer_set_cursor_request(
+    struct sl_surface_request* request) {
+  sl_host_pointer_set_cursor_internal(
+      wl_resource_get_user_data(request->resource), request->args[0],
+      request->object ? wl_resource_get_user_data(request->object) : NULL,
+      request->args[1], request->args[2]);
+}
+
 static void sl_host_pointer_set_cursor(struct wl_client* client,
                                        struct wl_resource* resource,
                                        uint32_t serial,
@@ -48,18 +103,25 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
                                        int32_t hotspot_y) {
   struct sl_host_pointer* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_surface = NULL;
+  struct sl_surface_request* request = NULL;
   double scale = host->seat->ctx->scale;
 
   if (surface_resource) {
     host_surface = wl_resource_get_user_data(surface_resource);
     host_surface->has_role = 1;
-    if (host_surface->contents_width && host_surface->contents_height)
-      wl_surface_commit(host_surface->proxy);
+    request = sl_host_surface_queue_request(
+        host_surface, resource, sl_host_pointer_set_cursor_request);
+  }
+  if (request) {
+    sl_surface_request_set_object(request, surface_resource);
+    request->args[0] = serial;
+    request->args[1] = hotspot_x / scale;
+    request->args[2] = hotspot_y / scale;
+    return;
   }
 
-  wl_pointer_set_cursor(host->proxy, serial,
-                        host_surface ? host_surface->proxy : NULL,
-                        hotspot_x / scale, hotspot_y / scale);
+  sl_host_pointer_set_cursor_internal(host, serial, host_surface,
+                                      hotspot_x / scale, hotspot_y / scale);
 }
 
 static void sl_host_pointer_release(struct wl_client* client,
@@ -78,6 +140,34 @@ static void sl_set_last_event_serial(struct wl_resource* surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+// Returns the host surface for |surface| if it belongs to the client of
+// |resource|. The host sends input events for all of our surfaces to every
+// device, and in single-process mode other clients must not see them.
+static struct sl_host_surface* sl_host_surface_for_client(
+    struct wl_resource* resource, struct wl_surface* surface) {
+  struct sl_host_surface* host_surface =
+      surface ? wl_surface_get_user_data(surface) : NULL;
+
+  if (!host_surface || wl_resource_get_client(host_surface->resource) !=
+                           wl_resource_get_client(resource))
+    return NULL;
+
+  return host_surface;
+}
+
+// Sends the motion held back by motion coalescing, if any.
+static void sl_pointer_flush_motion(struct sl_host_pointer* host) {
+  double scale = host->seat->ctx->scale;
+
+  if (!host->motion_pending)
+    return;
+
+  host->motion_pending = 0;
+  host->last_frame_time = host->motion_time;
+  wl_pointer_send_motion(host->resource, host->motion_time,
+                         host->motion_x * scale, host->motion_y * scale);
+}
+
 static void sl_pointer_set_focus(struct sl_host_pointer* host,
                                  uint32_t serial,
                                  struct sl_host_surface* host_surface,
@@ -89,6 +179,10 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
   if (surface_resource == host->focus_resource)
     return;
 
+  // Motion belongs to the surface that is losing focus.
+  sl_pointer_flush_motion(host);
+  host->frame_has_events = 1;
+
   if (host->focus_resource)
     wl_pointer_send_leave(host->resource, serial, host->focus_resource);
 
@@ -122,7 +216,7 @@ static void sl_pointer_enter(void* data,
                              wl_fixed_t y) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   struct sl_host_surface* host_surface =
-      surface ? wl_surface_get_user_data(surface) : NULL;
+      sl_host_surface_for_client(host->resource, surface);
 
   if (!host_surface)
     return;
@@ -151,7 +245,24 @@ static void sl_pointer_motion(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
-  wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
+  // Pointer events are only forwarded while one of the client's surfaces
+  // has focus.
+  if (!host->focus_resource)
+    return;
+
+  // Without frame events there is no boundary to coalesce motion within.
+  if (!host->seat->ctx->coalesce_motion ||
+      wl_pointer_get_version(pointer) < WL_POINTER_FRAME_SINCE_VERSION) {
+    wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
+    return;
+  }
+
+  // Only the last position matters. Relative motion is forwarded as is by
+  // the relative pointer so no accumulated motion is lost.
+  host->motion_pending = 1;
+  host->motion_time = time;
+  host->motion_x = x;
+  host->motion_y = y;
 }
 
 static void sl_pointer_button(void* data,
@@ -162,6 +273,11 @@ static void sl_pointer_button(void* data,
                               uint32_t state) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  if (!host->focus_resource)
+    return;
+
+  sl_pointer_flush_motion(host);
+  host->frame_has_events = 1;
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
   if (host->focus_resource)
@@ -177,13 +293,15 @@ static void sl_pointer_axis(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  if (!host->focus_resource)
+    return;
+
   host->time = time;
   host->axis_delta[axis] += value * scale;
+  host->frame_has_events = 1;
 }
 
-static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
-  struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
-
+static void sl_pointer_send_frame(struct sl_host_pointer* host) {
   // Many X apps (e.g. VS Code, Firefox, Chromium) only allow scrolls to happen
   // in multiples of 5 units. This value comes from the smooth scrolling
   // extension of X, which says that 5 smooth scroll units is equal to 1 tick of
@@ -217,11 +335,58 @@ static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   wl_pointer_send_frame(host->resource);
 }
 
+static void sl_pointer_flush_frame(struct sl_host_pointer* host) {
+  sl_pointer_flush_motion(host);
+  sl_pointer_send_frame(host);
+  host->frame_has_events = 0;
+  if (host->frame_deferred) {
+    host->frame_deferred = 0;
+    wl_event_source_timer_update(host->motion_timer, 0);
+  }
+}
+
+static int sl_pointer_motion_timeout(void* data) {
+  struct sl_host_pointer* host = data;
+
+  if (host->frame_deferred)
+    sl_pointer_flush_frame(host);
+
+  return 0;
+}
+
+static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
+  struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
+  int interval = host->seat->ctx->motion_interval;
+  uint32_t elapsed = host->motion_time - host->last_frame_time;
+
+  // Frames that end a leave are still sent.
+  if (!host->focus_resource && !host->frame_has_events)
+    return;
+
+  // Frames that only move the pointer are merged until the interval since
+  // the last motion sent has passed. Any other event flushes right away.
+  if (host->motion_timer && host->motion_pending && !host->frame_has_events &&
+      elapsed < (uint32_t)interval) {
+    if (!host->frame_deferred) {
+      host->frame_deferred = 1;
+      wl_event_source_timer_update(host->motion_timer, interval - elapsed);
+    }
+    return;
+  }
+
+  sl_pointer_flush_frame(host);
+}
+
 void sl_pointer_axis_source(void* data,
                             struct wl_pointer* pointer,
                             uint32_t axis_source) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  if (!host->focus_resource)
+    return;
+
+  sl_pointer_flush_motion(host);
+  host->frame_has_events = 1;
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -231,6 +396,11 @@ static void sl_pointer_axis_stop(void* data,
                                  uint32_t axis) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  if (!host->focus_resource)
+    return;
+
+  sl_pointer_flush_motion(host);
+  host->frame_has_events = 1;
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -240,7 +410,11 @@ static void sl_pointer_axis_discrete(void* data,
                                      int32_t discrete) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  if (!host->focus_resource)
+    return;
+
   host->axis_discrete[axis] += discrete;
+  host->frame_has_events = 1;
 }
 
 static const struct wl_pointer_listener sl_pointer_listener = {
@@ -256,6 +430,65 @@ static void sl_host_keyboard_release(struct wl_client* client,
 static const struct wl_keyboard_interface sl_keyboard_implementation = {
     sl_host_keyboard_release};
 
+// FNV-1a hash of the keymap text.
+static uint64_t sl_keymap_hash(const char* data, uint32_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  uint32_t i;
+
+  for (i = 0; i < size; ++i) {
+    hash ^= (uint8_t)data[i];
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+// Returns a reference to the compiled keymap for |data|. The host sends the
+// same keymap to every keyboard it creates, so most lookups hit the cache and
+// skip compilation.
+static struct xkb_keymap* sl_keymap_cache_get(struct sl_context* ctx,
+                                              const char* data,
+                                              uint32_t size) {
+  struct sl_keymap_cache_entry* entry;
+  uint64_t hash = sl_keymap_hash(data, size);
+  int count = 0;
+
+  wl_list_for_each(entry, &ctx->keymap_cache, link) {
+    if (entry->hash == hash && entry->size == size &&
+        !memcmp(entry->data, data, size)) {
+      // Move to front so the least recently used entry is evicted first.
+      wl_list_remove(&entry->link);
+      wl_list_insert(&ctx->keymap_cache, &entry->link);
+      return xkb_keymap_ref(entry->keymap);
+    }
+    ++count;
+  }
+
+  if (count >= KEYMAP_CACHE_SIZE) {
+    entry = wl_container_of(ctx->keymap_cache.prev, entry, link);
+    wl_list_remove(&entry->link);
+    xkb_keymap_unref(entry->keymap);
+    free(entry->data);
+    free(entry);
+  }
+
+  entry = malloc(sizeof(*entry));
+  assert(entry);
+  entry->hash = hash;
+  entry->size = size;
+  entry->data = malloc(size);
+  assert(entry->data);
+  memcpy(entry->data, data, size);
+  // The keymap text is null terminated and |size| includes the terminator.
+  entry->keymap = xkb_keymap_new_from_buffer(
+      ctx->xkb_context, data, strnlen(data, size), XKB_KEYMAP_FORMAT_TEXT_V1,
+      0);
+  assert(entry->keymap);
+  wl_list_insert(&ctx->keymap_cache, &entry->link);
+
+  return xkb_keymap_ref(entry->keymap);
+}
+
 static void sl_keyboard_keymap(void* data,
                                struct wl_keyboard* keyboard,
                                uint32_t format,
@@ -273,9 +506,7 @@ static void sl_keyboard_keymap(void* data,
     if (host->keymap)
       xkb_keymap_unref(host->keymap);
 
-    host->keymap = xkb_keymap_new_from_string(
-        host->seat->ctx->xkb_context, data, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
-    assert(host->keymap);
+    host->keymap = sl_keymap_cache_get(host->seat->ctx, data, size);
 
     munmap(data, size);
 
@@ -326,7 +557,7 @@ static void sl_keyboard_enter(void* data,
                               struct wl_array* keys) {
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   struct sl_host_surface* host_surface =
-      surface ? wl_surface_get_user_data(surface) : NULL;
+      sl_host_surface_for_client(host->resource, surface);
 
   if (!host_surface)
     return;
@@ -385,6 +616,10 @@ static void sl_keyboard_key(void* data,
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   int handled = 1;
 
+  // Keys are only forwarded to, and acked by, the client that has focus.
+  if (!host->focus_resource)
+    return;
+
   if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
     if (host->state) {
       const xkb_keysym_t* symbols;
@@ -443,11 +678,11 @@ static void sl_keyboard_modifiers(void* data,
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   xkb_mod_mask_t mask;
 
-  wl_keyboard_send_modifiers(host->resource, serial, mods_depressed,
-                             mods_latched, mods_locked, group);
-
-  if (host->focus_resource)
+  if (host->focus_resource) {
+    wl_keyboard_send_modifiers(host->resource, serial, mods_depressed,
+                               mods_latched, mods_locked, group);
     sl_set_last_event_serial(host->focus_resource, serial);
+  }
   host->seat->last_serial = serial;
 
   if (!host->keymap)
@@ -487,6 +722,32 @@ static void sl_host_touch_release(struct wl_client* client,
 static const struct wl_touch_interface sl_touch_implementation = {
     sl_host_touch_release};
 
+// Sends the motion of all touch points held back by motion coalescing.
+static void sl_host_touch_flush_motion(struct sl_host_touch* host) {
+  double scale = host->seat->ctx->scale;
+  int i;
+
+  for (i = 0; i < host->motion_count; ++i) {
+    struct sl_touch_motion* motion = &host->motions[i];
+
+    wl_touch_send_motion(host->resource, motion->time, motion->id,
+                         motion->x * scale, motion->y * scale);
+  }
+  host->motion_count = 0;
+}
+
+// Returns the index of touch point |id| if it went down on a surface of
+// this device's client, or -1.
+static int sl_host_touch_find_point(struct sl_host_touch* host, int32_t id) {
+  int i;
+
+  for (i = 0; i < host->point_count; ++i) {
+    if (host->points[i] == id)
+      return i;
+  }
+  return -1;
+}
+
 static void sl_host_touch_down(void* data,
                                struct wl_touch* touch,
                                uint32_t serial,
@@ -497,12 +758,14 @@ static void sl_host_touch_down(void* data,
                                wl_fixed_t y) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
   struct sl_host_surface* host_surface =
-      surface ? wl_surface_get_user_data(surface) : NULL;
+      sl_host_surface_for_client(host->resource, surface);
   double scale = host->seat->ctx->scale;
 
-  if (!host_surface)
+  if (!host_surface || host->point_count == MAX_TOUCH_POINTS)
     return;
 
+  host->points[host->point_count++] = id;
+
   if (host_surface->resource != host->focus_resource) {
     wl_list_remove(&host->focus_resource_listener.link);
     wl_list_init(&host->focus_resource_listener.link);
@@ -518,8 +781,10 @@ static void sl_host_touch_down(void* data,
     sl_roundtrip(host->seat->ctx);
   }
 
+  sl_host_touch_flush_motion(host);
   wl_touch_send_down(host->resource, serial, time, host_surface->resource, id,
                      x * scale, y * scale);
+  host->frame_has_events = 1;
 
   if (host->focus_resource)
     sl_set_last_event_serial(host->focus_resource, serial);
@@ -532,16 +797,28 @@ static void sl_host_touch_up(void* data,
                              uint32_t time,
                              int32_t id) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
+  int i = sl_host_touch_find_point(host, id);
 
-  wl_list_remove(&host->focus_resource_listener.link);
-  wl_list_init(&host->focus_resource_listener.link);
-  host->focus_resource = NULL;
+  // Touch points of other clients are not forwarded.
+  if (i < 0)
+    return;
+
+  host->points[i] = host->points[--host->point_count];
 
+  sl_host_touch_flush_motion(host);
   wl_touch_send_up(host->resource, serial, time, id);
+  host->frame_has_events = 1;
 
   if (host->focus_resource)
     sl_set_last_event_serial(host->focus_resource, serial);
   host->seat->last_serial = serial;
+
+  // Focus is kept until the last touch point of the client goes up.
+  if (!host->point_count) {
+    wl_list_remove(&host->focus_resource_listener.link);
+    wl_list_init(&host->focus_resource_listener.link);
+    host->focus_resource = NULL;
+  }
 }
 
 static void sl_host_touch_motion(void* data,
@@ -552,19 +829,61 @@ static void sl_host_touch_motion(void* data,
                                  wl_fixed_t y) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
   double scale = host->seat->ctx->scale;
+  struct sl_touch_motion* motion = NULL;
+  int i;
+
+  if (sl_host_touch_find_point(host, id) < 0)
+    return;
 
-  wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
+  host->frame_has_events = 1;
+
+  if (!host->seat->ctx->coalesce_motion) {
+    wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
+    return;
+  }
+
+  // Keep the last position of each touch point until the frame ends.
+  for (i = 0; i < host->motion_count; ++i) {
+    if (host->motions[i].id == id) {
+      motion = &host->motions[i];
+      break;
+    }
+  }
+  if (!motion) {
+    if (host->motion_count == MAX_TOUCH_MOTIONS)
+      sl_host_touch_flush_motion(host);
+    motion = &host->motions[host->motion_count++];
+    motion->id = id;
+  }
+  motion->time = time;
+  motion->x = x;
+  motion->y = y;
 }
 
 static void sl_host_touch_frame(void* data, struct wl_touch* touch) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  // Frames are only sent to clients that got events in them.
+  if (!host->frame_has_events)
+    return;
+
+  host->frame_has_events = 0;
+  sl_host_touch_flush_motion(host);
   wl_touch_send_frame(host->resource);
 }
 
 static void sl_host_touch_cancel(void* data, struct wl_touch* touch) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  host->motion_count = 0;
+  host->frame_has_events = 0;
+  if (!host->point_count)
+    return;
+
+  host->point_count = 0;
+  wl_list_remove(&host->focus_resource_listener.link);
+  wl_list_init(&host->focus_resource_listener.link);
+  host->focus_resource = NULL;
   wl_touch_send_cancel(host->resource);
 }
 
@@ -580,6 +899,8 @@ static void sl_destroy_host_pointer(struct wl_resource* resource) {
   } else {
     wl_pointer_destroy(host->proxy);
   }
+  if (host->motion_timer)
+    wl_event_source_remove(host->motion_timer);
   wl_list_remove(&host->focus_resource_listener.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -622,6 +943,19 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
   host_pointer->axis_delta[1] = wl_fixed_from_int(0);
   host_pointer->axis_discrete[0] = 0;
   host_pointer->axis_discrete[1] = 0;
+  host_pointer->motion_pending = 0;
+  host_pointer->motion_time = 0;
+  host_pointer->motion_x = 0;
+  host_pointer->motion_y = 0;
+  host_pointer->frame_has_events = 0;
+  host_pointer->frame_deferred = 0;
+  host_pointer->last_frame_time = 0;
+  host_pointer->motion_timer = NULL;
+  if (host->seat->ctx->motion_interval) {
+    host_pointer->motion_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->seat->ctx->host_display),
+        sl_pointer_motion_timeout, host_pointer);
+  }
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -743,6 +1077,9 @@ static void sl_host_seat_get_host_touch(struct wl_client* client,
   host_touch->focus_resource_listener.notify =
       sl_touch_focus_resource_destroyed;
   host_touch->focus_resource = NULL;
+  host_touch->motion_count = 0;
+  host_touch->point_count = 0;
+  host_touch->frame_has_events = 0;
 }
 
 static void sl_host_seat_release(struct wl_client* client,
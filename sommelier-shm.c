@@ -5,6 +5,7 @@
 #include "sommelier.h"
 
 #include <assert.h>
+#include <libdrm/drm_fourcc.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <wayland-client.h>
@@ -17,6 +18,9 @@ struct sl_host_shm_pool {
   struct wl_resource* resource;
   struct wl_shm_pool* proxy;
   int fd;
+  struct sl_mmap* mmap;
+  // Set when the pool is a dma-buf imported by the drm device.
+  struct sl_drm_handle* drm_handle;
 };
 
 struct sl_host_shm {
@@ -121,6 +125,39 @@ static size_t sl_size_for_shm_format(uint32_t format,
   return total_size;
 }
 
+uint32_t sl_drm_format_for_shm_format(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_NV12:
+      return WL_DRM_FORMAT_NV12;
+    case WL_SHM_FORMAT_RGB565:
+      return WL_DRM_FORMAT_RGB565;
+    case WL_SHM_FORMAT_ARGB8888:
+      return WL_DRM_FORMAT_ARGB8888;
+    case WL_SHM_FORMAT_ABGR8888:
+      return WL_DRM_FORMAT_ABGR8888;
+    case WL_SHM_FORMAT_XRGB8888:
+      return WL_DRM_FORMAT_XRGB8888;
+    case WL_SHM_FORMAT_XBGR8888:
+      return WL_DRM_FORMAT_XBGR8888;
+  }
+  assert(0);
+  return 0;
+}
+
+// Maps the whole pool once. Buffers are views into this mapping.
+static struct sl_mmap* sl_shm_pool_mmap_create(int fd, int32_t size) {
+  struct sl_mmap* map = sl_mmap_create(fd, size, 0, 0, 0, 0, 0, 0, 1, 1);
+
+  // In the case of mmaps created from the client pool, we want to be able
+  // to close the FD when the client releases the shm pool (i.e. when it's
+  // done transferring) as opposed to when the mapping is freed (i.e. when
+  // we're done drawing).
+  // We do this by removing the handle to the FD after it has been mmapped,
+  // which prevents a double-close.
+  map->fd = -1;
+  return map;
+}
+
 static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 struct wl_resource* resource,
                                                 uint32_t id,
@@ -131,31 +168,59 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 uint32_t format) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
-  if (host->shm->ctx->shm_driver == SHM_DRIVER_NOOP) {
-    assert(host->proxy);
+  if (host->proxy) {
     sl_create_host_buffer(client, id,
                           wl_shm_pool_create_buffer(host->proxy, offset, width,
                                                     height, stride, format),
                           width, height);
+  } else if (host->drm_handle) {
+    struct sl_context* ctx = host->shm->ctx;
+    struct zwp_linux_buffer_params_v1* buffer_params;
+    struct sl_host_buffer* host_buffer;
+    size_t num_planes = sl_shm_num_planes_for_shm_format(format);
+    size_t i;
+
+    buffer_params =
+        zwp_linux_dmabuf_v1_create_params(ctx->linux_dmabuf->internal);
+    for (i = 0; i < num_planes; ++i) {
+      zwp_linux_buffer_params_v1_add(
+          buffer_params, host->fd, i,
+          offset + sl_offset_for_shm_format_plane(format, height, stride, i),
+          stride, DRM_FORMAT_MOD_INVALID >> 32,
+          DRM_FORMAT_MOD_INVALID & 0xffffffff);
+    }
+    host_buffer = sl_create_host_buffer(
+        client, id,
+        zwp_linux_buffer_params_v1_create_immed(
+            buffer_params, width, height, sl_drm_format_for_shm_format(format),
+            0),
+        width, height);
+    host_buffer->is_dmabuf = 1;
+    zwp_linux_buffer_params_v1_destroy(buffer_params);
   } else {
     struct sl_host_buffer* host_buffer =
         sl_create_host_buffer(client, id, NULL, width, height);
 
+    size_t size = sl_size_for_shm_format(format, height, stride);
+    size_t bpp = sl_shm_bpp_for_shm_format(format);
+    size_t num_planes = sl_shm_num_planes_for_shm_format(format);
+    size_t offset1 =
+        offset + sl_offset_for_shm_format_plane(format, height, stride, 1);
+    size_t y_ss0 = sl_y_subsampling_for_shm_format_plane(format, 0);
+    size_t y_ss1 = sl_y_subsampling_for_shm_format_plane(format, 1);
+
     host_buffer->shm_format = format;
-    host_buffer->shm_mmap = sl_mmap_create(
-        host->fd, sl_size_for_shm_format(format, height, stride),
-        sl_shm_bpp_for_shm_format(format),
-        sl_shm_num_planes_for_shm_format(format), offset, stride,
-        offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
-        stride, sl_y_subsampling_for_shm_format_plane(format, 0),
-        sl_y_subsampling_for_shm_format_plane(format, 1));
-    // In the case of mmaps created from the client buffer, we want to be able
-    // to close the FD when the client releases the shm pool (i.e. when it's
-    // done transferring) as opposed to when the pool is freed (i.e. when we're
-    // done drawing).
-    // We do this by removing the handle to the FD after it has been mmapped,
-    // which prevents a double-close.
-    host_buffer->shm_mmap->fd = -1;
+    if (offset + size <= host->mmap->size) {
+      host_buffer->shm_mmap =
+          sl_mmap_create_view(host->mmap, bpp, num_planes, offset, stride,
+                              offset1, stride, y_ss0, y_ss1);
+    } else {
+      // Buffer extends past the pool size we know about. Map it separately.
+      host_buffer->shm_mmap =
+          sl_mmap_create(host->fd, size, bpp, num_planes, offset, stride,
+                         offset1, stride, y_ss0, y_ss1);
+      host_buffer->shm_mmap->fd = -1;
+    }
     host_buffer->shm_mmap->buffer_resource = host_buffer->resource;
   }
 }
@@ -172,6 +237,13 @@ static void sl_host_shm_pool_resize(struct wl_client* client,
 
   if (host->proxy)
     wl_shm_pool_resize(host->proxy, size);
+
+  // Buffers created before the resize keep the old mapping alive until they
+  // are destroyed.
+  if (host->mmap && size > host->mmap->size) {
+    sl_mmap_unref(host->mmap);
+    host->mmap = sl_shm_pool_mmap_create(host->fd, size);
+  }
 }
 
 static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
@@ -181,6 +253,10 @@ static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
 static void sl_destroy_host_shm_pool(struct wl_resource* resource) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
+  if (host->mmap)
+    sl_mmap_unref(host->mmap);
+  if (host->drm_handle)
+    sl_drm_handle_unref(host->drm_handle);
   if (host->fd >= 0)
     close(host->fd);
   if (host->proxy)
@@ -202,7 +278,9 @@ static void sl_shm_create_host_pool(struct wl_client* client,
 
   host_shm_pool->shm = host->shm;
   host_shm_pool->fd = -1;
+  host_shm_pool->mmap = NULL;
   host_shm_pool->proxy = NULL;
+  host_shm_pool->drm_handle = NULL;
   host_shm_pool->resource =
       wl_resource_create(client, &wl_shm_pool_interface, 1, id);
   wl_resource_set_implementation(host_shm_pool->resource,
@@ -217,9 +295,19 @@ static void sl_shm_create_host_pool(struct wl_client* client,
       break;
     case SHM_DRIVER_DMABUF:
     case SHM_DRIVER_VIRTWL:
-    case SHM_DRIVER_VIRTWL_DMABUF:
+    case SHM_DRIVER_VIRTWL_DMABUF: {
+      struct sl_context* ctx = host->shm->ctx;
+
       host_shm_pool->fd = fd;
-      break;
+      // A pool that the drm device given to sommelier imports is a dma-buf
+      // and is forwarded as is instead of being copied on every commit. Only
+      // virtwl fds can be sent over a virtwl host connection, and client
+      // memory can't be told apart from them, so those pools are copied.
+      if (ctx->virtwl_socket_fd == -1 && ctx->gbm && host->linux_dmabuf_proxy)
+        host_shm_pool->drm_handle = sl_drm_handle_import(ctx, fd);
+      if (!host_shm_pool->drm_handle)
+        host_shm_pool->mmap = sl_shm_pool_mmap_create(fd, size);
+    } break;
   }
 }
 
@@ -18,39 +18,108 @@ struct sl_host_subsurface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_subsurface* proxy;
+  struct sl_host_surface* parent;
+  struct wl_listener parent_destroy_listener;
 };
 
+// Position and stacking are applied on the next commit of the parent, so
+// they are queued behind a deferred commit of the parent.
+static struct sl_surface_request* sl_subsurface_queue_request(
+    struct sl_host_subsurface* host, sl_surface_request_func_t func) {
+  if (!host->parent)
+    return NULL;
+
+  return sl_host_surface_queue_request(host->parent, host->resource, func);
+}
+
 static void sl_subsurface_destroy(struct wl_client* client,
                                   struct wl_resource* resource) {
   wl_resource_destroy(resource);
 }
 
+static void sl_subsurface_set_position_request(
+    struct sl_surface_request* request) {
+  struct sl_host_subsurface* host =
+      wl_resource_get_user_data(request->resource);
+
+  wl_subsurface_set_position(host->proxy, request->args[0], request->args[1]);
+}
+
 static void sl_subsurface_set_position(struct wl_client* client,
                                        struct wl_resource* resource,
                                        int32_t x,
                                        int32_t y) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
   double scale = host->ctx->scale;
+  struct sl_surface_request* request =
+      sl_subsurface_queue_request(host, sl_subsurface_set_position_request);
+
+  if (request) {
+    request->args[0] = x / scale;
+    request->args[1] = y / scale;
+    return;
+  }
 
   wl_subsurface_set_position(host->proxy, x / scale, y / scale);
 }
 
+// Stacking against a sibling that is gone by now is dropped.
+static void sl_subsurface_place_above_request(
+    struct sl_surface_request* request) {
+  struct sl_host_subsurface* host =
+      wl_resource_get_user_data(request->resource);
+  struct sl_host_surface* host_sibling;
+
+  if (!request->object)
+    return;
+
+  host_sibling = wl_resource_get_user_data(request->object);
+  wl_subsurface_place_above(host->proxy, host_sibling->proxy);
+}
+
 static void sl_subsurface_place_above(struct wl_client* client,
                                       struct wl_resource* resource,
                                       struct wl_resource* sibling_resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_sibling =
       wl_resource_get_user_data(sibling_resource);
+  struct sl_surface_request* request =
+      sl_subsurface_queue_request(host, sl_subsurface_place_above_request);
+
+  if (request) {
+    sl_surface_request_set_object(request, sibling_resource);
+    return;
+  }
 
   wl_subsurface_place_above(host->proxy, host_sibling->proxy);
 }
 
+static void sl_subsurface_place_below_request(
+    struct sl_surface_request* request) {
+  struct sl_host_subsurface* host =
+      wl_resource_get_user_data(request->resource);
+  struct sl_host_surface* host_sibling;
+
+  if (!request->object)
+    return;
+
+  host_sibling = wl_resource_get_user_data(request->object);
+  wl_subsurface_place_below(host->proxy, host_sibling->proxy);
+}
+
 static void sl_subsurface_place_below(struct wl_client* client,
                                       struct wl_resource* resource,
                                       struct wl_resource* sibling_resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_sibling =
       wl_resource_get_user_data(sibling_resource);
+  struct sl_surface_request* request =
+      sl_subsurface_queue_request(host, sl_subsurface_place_below_request);
+
+  if (request) {
+    sl_surface_request_set_object(request, sibling_resource);
+    return;
+  }
 
   wl_subsurface_place_below(host->proxy, host_sibling->proxy);
 }
@@ -78,10 +147,21 @@ static void sl_destroy_host_subsurface(struct wl_resource* resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
 
   wl_subsurface_destroy(host->proxy);
+  wl_list_remove(&host->parent_destroy_listener.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
 
+static void sl_subsurface_parent_destroyed(struct wl_listener* listener,
+                                           void* data) {
+  struct sl_host_subsurface* host =
+      wl_container_of(listener, host, parent_destroy_listener);
+
+  wl_list_remove(&host->parent_destroy_listener.link);
+  wl_list_init(&host->parent_destroy_listener.link);
+  host->parent = NULL;
+}
+
 static void sl_subcompositor_destroy(struct wl_client* client,
                                      struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -104,6 +184,11 @@ static void sl_subcompositor_get_subsurface(
   assert(host_subsurface);
 
   host_subsurface->ctx = host->ctx;
+  host_subsurface->parent = host_parent;
+  host_subsurface->parent_destroy_listener.notify =
+      sl_subsurface_parent_destroyed;
+  wl_resource_add_destroy_listener(parent_resource,
+                                   &host_subsurface->parent_destroy_listener);
   host_subsurface->resource =
       wl_resource_create(client, &wl_subsurface_interface, 1, id);
   wl_resource_set_implementation(host_subsurface->resource,
@@ -0,0 +1,145 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of events kept in memory. Older events are overwritten once the
+// ring buffer is full.
+#define TRACE_RING_SIZE 65536
+
+struct sl_trace_event {
+  const char* category;
+  const char* name;
+  uint64_t begin;
+  uint64_t duration;
+  pid_t tid;
+};
+
+static struct sl_trace_event* sl_trace_ring;
+static uint64_t sl_trace_next;
+static char* sl_trace_path;
+static int sl_trace_marker_fd = -1;
+
+static uint64_t sl_trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Events are written to the ftrace marker file as they happen when |output|
+// is "ftrace". Otherwise they are kept in a ring buffer that is written to
+// |output| as Chrome JSON on SIGUSR1 and at exit. "%p" in |output| is
+// replaced by the process id so that peers don't overwrite each other.
+void sl_trace_init(const char* output) {
+  const char* pid_token;
+
+  if (strcmp(output, "ftrace") == 0) {
+    sl_trace_marker_fd =
+        open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    if (sl_trace_marker_fd == -1)
+      sl_trace_marker_fd =
+          open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    if (sl_trace_marker_fd == -1)
+      fprintf(stderr, "error: could not open trace_marker: %s\n",
+              strerror(errno));
+    return;
+  }
+
+  pid_token = strstr(output, "%p");
+  if (pid_token) {
+    int rv = asprintf(&sl_trace_path, "%.*s%d%s", (int)(pid_token - output),
+                      output, getpid(), pid_token + 2);
+    assert(rv >= 0);
+    UNUSED(rv);
+  } else {
+    sl_trace_path = strdup(output);
+    assert(sl_trace_path);
+  }
+
+  sl_trace_ring = calloc(TRACE_RING_SIZE, sizeof(*sl_trace_ring));
+  assert(sl_trace_ring);
+  atexit(sl_trace_dump);
+}
+
+struct sl_trace_scope sl_trace_scope_begin(const char* category,
+                                           const char* name) {
+  struct sl_trace_scope scope = {category, name, 0};
+
+  if (sl_trace_marker_fd >= 0) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "B|%d|%s:%s", getpid(), category,
+                       name);
+
+    if (write(sl_trace_marker_fd, buf, MIN(len, (int)sizeof(buf) - 1)) < 0)
+      return scope;
+  } else if (sl_trace_ring) {
+    scope.begin = sl_trace_now();
+  }
+
+  return scope;
+}
+
+void sl_trace_scope_end(struct sl_trace_scope* scope) {
+  if (sl_trace_marker_fd >= 0) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "E|%d", getpid());
+
+    if (write(sl_trace_marker_fd, buf, len) < 0)
+      return;
+  } else if (sl_trace_ring) {
+    // Copy workers record events too, so slots are claimed atomically.
+    uint64_t index = __atomic_fetch_add(&sl_trace_next, 1, __ATOMIC_RELAXED);
+    struct sl_trace_event* event = &sl_trace_ring[index % TRACE_RING_SIZE];
+
+    event->category = scope->category;
+    event->name = scope->name;
+    event->begin = scope->begin;
+    event->duration = sl_trace_now() - scope->begin;
+    event->tid = syscall(SYS_gettid);
+  }
+}
+
+void sl_trace_dump(void) {
+  uint64_t next = __atomic_load_n(&sl_trace_next, __ATOMIC_RELAXED);
+  uint64_t i = next > TRACE_RING_SIZE ? next - TRACE_RING_SIZE : 0;
+  pid_t pid = getpid();
+  const char* separator = "";
+  FILE* file;
+
+  if (!sl_trace_ring)
+    return;
+
+  file = fopen(sl_trace_path, "w");
+  if (!file) {
+    fprintf(stderr, "error: could not open %s: %s\n", sl_trace_path,
+            strerror(errno));
+    return;
+  }
+
+  // Timestamps are CLOCK_MONOTONIC in microseconds.
+  fprintf(file, "{\"traceEvents\":[");
+  for (; i < next; ++i) {
+    struct sl_trace_event* event = &sl_trace_ring[i % TRACE_RING_SIZE];
+
+    fprintf(file,
+            "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+            separator, event->name, event->category, event->begin / 1000.0,
+            event->duration / 1000.0, pid, event->tid);
+    separator = ",";
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(file);
+}
@@ -26,6 +26,34 @@ static void sl_viewport_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+// The viewport is read when the surface commits. Changes are queued behind
+// a deferred commit so that it doesn't pick up the new state.
+static struct sl_surface_request* sl_viewport_queue_request(
+    struct sl_host_viewport* host, sl_surface_request_func_t func) {
+  if (!host->viewport.surface)
+    return NULL;
+
+  return sl_host_surface_queue_request(host->viewport.surface, host->resource,
+                                       func);
+}
+
+static void sl_viewport_set_source_internal(struct sl_host_viewport* host,
+                                            wl_fixed_t x,
+                                            wl_fixed_t y,
+                                            wl_fixed_t width,
+                                            wl_fixed_t height) {
+  host->viewport.src_x = x;
+  host->viewport.src_y = y;
+  host->viewport.src_width = width;
+  host->viewport.src_height = height;
+}
+
+static void sl_viewport_set_source_request(struct sl_surface_request* request) {
+  sl_viewport_set_source_internal(wl_resource_get_user_data(request->resource),
+                                  request->args[0], request->args[1],
+                                  request->args[2], request->args[3]);
+}
+
 static void sl_viewport_set_source(struct wl_client* client,
                                    struct wl_resource* resource,
                                    wl_fixed_t x,
@@ -33,11 +61,32 @@ static void sl_viewport_set_source(struct wl_client* client,
                                    wl_fixed_t width,
                                    wl_fixed_t height) {
   struct sl_host_viewport* host = wl_resource_get_user_data(resource);
+  struct sl_surface_request* request =
+      sl_viewport_queue_request(host, sl_viewport_set_source_request);
+
+  if (request) {
+    request->args[0] = x;
+    request->args[1] = y;
+    request->args[2] = width;
+    request->args[3] = height;
+    return;
+  }
+
+  sl_viewport_set_source_internal(host, x, y, width, height);
+}
 
-  host->viewport.src_x = x;
-  host->viewport.src_y = y;
-  host->viewport.src_width = width;
-  host->viewport.src_height = height;
+static void sl_viewport_set_destination_internal(struct sl_host_viewport* host,
+                                                 int32_t width,
+                                                 int32_t height) {
+  host->viewport.dst_width = width;
+  host->viewport.dst_height = height;
+}
+
+static void sl_viewport_set_destination_request(
+    struct sl_surface_request* request) {
+  sl_viewport_set_destination_internal(
+      wl_resource_get_user_data(request->resource), request->args[0],
+      request->args[1]);
 }
 
 static void sl_viewport_set_destination(struct wl_client* client,
@@ -45,9 +94,16 @@ static void sl_viewport_set_destination(struct wl_client* client,
                                         int32_t width,
                                         int32_t height) {
   struct sl_host_viewport* host = wl_resource_get_user_data(resource);
+  struct sl_surface_request* request =
+      sl_viewport_queue_request(host, sl_viewport_set_destination_request);
 
-  host->viewport.dst_width = width;
-  host->viewport.dst_height = height;
+  if (request) {
+    request->args[0] = width;
+    request->args[1] = height;
+    return;
+  }
+
+  sl_viewport_set_destination_internal(host, width, height);
 }
 
 static const struct wp_viewport_interface sl_viewport_implementation = {
@@ -83,6 +139,7 @@ static void sl_viewporter_get_viewport(struct wl_client* client,
   host_viewport->viewport.src_height = -1;
   host_viewport->viewport.dst_width = -1;
   host_viewport->viewport.dst_height = -1;
+  host_viewport->viewport.surface = host_surface;
   wl_list_insert(&host_surface->contents_viewport,
                  &host_viewport->viewport.link);
   host_viewport->resource =
@@ -20,6 +20,8 @@ struct sl_host_xdg_surface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct xdg_surface* proxy;
+  struct sl_host_surface* surface;
+  struct wl_listener surface_destroy_listener;
 };
 
 struct sl_host_xdg_toplevel {
@@ -399,6 +401,16 @@ static void sl_xdg_surface_get_popup(struct wl_client* client,
                          host_xdg_popup);
 }
 
+static void sl_xdg_surface_set_window_geometry_request(
+    struct sl_surface_request* request) {
+  struct sl_host_xdg_surface* host =
+      wl_resource_get_user_data(request->resource);
+
+  xdg_surface_set_window_geometry(host->proxy, request->args[0],
+                                  request->args[1], request->args[2],
+                                  request->args[3]);
+}
+
 static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
                                                struct wl_resource* resource,
                                                int32_t x,
@@ -407,6 +419,7 @@ static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
                                                int32_t height) {
   struct sl_host_xdg_surface* host = wl_resource_get_user_data(resource);
   double scale = host->ctx->scale;
+  struct sl_surface_request* request = NULL;
   int32_t x1, y1, x2, y2;
 
   x1 = x / scale;
@@ -414,6 +427,19 @@ static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
   x2 = (x + width) / scale;
   y2 = (y + height) / scale;
 
+  // Window geometry is applied on the next commit of the surface.
+  if (host->surface) {
+    request = sl_host_surface_queue_request(
+        host->surface, resource, sl_xdg_surface_set_window_geometry_request);
+  }
+  if (request) {
+    request->args[0] = x1;
+    request->args[1] = y1;
+    request->args[2] = x2 - x1;
+    request->args[3] = y2 - y1;
+    return;
+  }
+
   xdg_surface_set_window_geometry(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -445,10 +471,21 @@ static void sl_destroy_host_xdg_surface(struct wl_resource* resource) {
   struct sl_host_xdg_surface* host = wl_resource_get_user_data(resource);
 
   xdg_surface_destroy(host->proxy);
+  wl_list_remove(&host->surface_destroy_listener.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
 
+static void sl_xdg_surface_surface_destroyed(struct wl_listener* listener,
+                                             void* data) {
+  struct sl_host_xdg_surface* host =
+      wl_container_of(listener, host, surface_destroy_listener);
+
+  wl_list_remove(&host->surface_destroy_listener.link);
+  wl_list_init(&host->surface_destroy_listener.link);
+  host->surface = NULL;
+}
+
 static void sl_xdg_shell_destroy(struct wl_client* client,
                                  struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -486,6 +523,11 @@ static void sl_xdg_shell_get_xdg_surface(struct wl_client* client,
   assert(host_xdg_surface);
 
   host_xdg_surface->ctx = host->ctx;
+  host_xdg_surface->surface = host_surface;
+  host_xdg_surface->surface_destroy_listener.notify =
+      sl_xdg_surface_surface_destroyed;
+  wl_resource_add_destroy_listener(
+      surface_resource, &host_xdg_surface->surface_destroy_listener);
   host_xdg_surface->resource =
       wl_resource_create(client, &xdg_surface_interface, 1, id);
   wl_resource_set_implementation(host_xdg_surface->resource,
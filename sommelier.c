@@ -8,9 +8,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gbm.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <linux/virtwl.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +23,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <xcb/composite.h>
@@ -82,6 +85,18 @@ struct sl_data_source {
   struct wl_data_source* internal;
 };
 
+// Client connection handed over to a warm peer by the master.
+struct sl_peer_control {
+  struct sl_context* ctx;
+  int client_fd;
+};
+
+// Peer started ahead of time by the master, waiting for a client.
+struct sl_warm_peer {
+  pid_t pid;
+  int control_fd;
+};
+
 enum {
   PROPERTY_WM_NAME,
   PROPERTY_WM_CLASS,
@@ -93,6 +108,7 @@ enum {
   PROPERTY_NET_STARTUP_ID,
   PROPERTY_NET_WM_STATE,
   PROPERTY_GTK_THEME_VARIANT,
+  PROPERTY_COUNT,
 };
 
 #define US_POSITION (1L << 0)
@@ -165,6 +181,55 @@ struct sl_mwm_hints {
   uint32_t status;
 };
 
+// Continuation run once the reply to an X request has been received. The
+// reply is NULL if the request failed and is freed after the call.
+typedef void (*sl_x_reply_func_t)(struct sl_context* ctx,
+                                  void* reply,
+                                  void* data);
+
+struct sl_x_reply_handler {
+  unsigned int sequence;
+  sl_x_reply_func_t func;
+  void* data;
+  struct wl_list link;
+};
+
+// Known atom names. Atoms never change on a server so entries stay valid
+// for the lifetime of the connection.
+struct sl_atom_name {
+  xcb_atom_t atom;
+  char* name;
+  struct wl_list atom_link;
+  struct wl_list name_link;
+};
+
+// Offered MIME types of a Wayland selection that are being interned.
+struct sl_selection_types_request {
+  uint32_t serial;
+  struct wl_array types;  // Contains struct sl_data_offer_type
+};
+
+// Names of selection targets that were not in the atom cache.
+struct sl_targets_request {
+  int count;
+  xcb_atom_t* atoms;
+  xcb_get_atom_name_cookie_t* cookies;
+};
+
+// State of a map request while the window properties are being fetched.
+struct sl_map_request {
+  xcb_window_t window;
+  int has_geometry;
+  xcb_get_geometry_cookie_t geometry_cookie;
+  xcb_get_property_cookie_t property_cookies[PROPERTY_COUNT];
+  struct sl_wm_size_hints size_hints;
+};
+
+struct sl_property_request {
+  xcb_window_t window;
+  xcb_atom_t atom;
+};
+
 #define NET_WM_MOVERESIZE_SIZE_TOPLEFT 0
 #define NET_WM_MOVERESIZE_SIZE_TOP 1
 #define NET_WM_MOVERESIZE_SIZE_TOPRIGHT 2
@@ -207,6 +272,18 @@ struct sl_mwm_hints {
 #define WM_CLASS_APPLICATION_ID_FORMAT \
   APPLICATION_ID_FORMAT_PREFIX ".wmclass.%s"
 
+#define DEFAULT_BUFFER_POOL_SIZE (64 * 1024 * 1024)
+#define DEFAULT_BUFFER_POOL_TIMEOUT 2000
+
+// Size of clipboard chunks sent to X clients. Clamped to what fits in a
+// single request to the X server.
+#define DEFAULT_SELECTION_CHUNK_SIZE (256 * 1024)
+#define MIN_SELECTION_CHUNK_SIZE 4096
+
+// How long the master waits for a warm peer to take over a client before
+// it starts a new peer for the client instead.
+#define PEER_ACK_TIMEOUT_MS 200
+
 #define MIN_AURA_SHELL_VERSION 6
 #define MAX_AURA_SHELL_VERSION 10
 
@@ -225,6 +302,92 @@ __attribute__((__format__(__printf__, 1, 0))) static char* sl_xasprintf(
   return str;
 }
 
+// Heap allocations made by the whole process, dumped on SIGUSR1. The
+// definitions below interpose malloc, calloc and realloc for sommelier and
+// every library it loads, including allocations made inside glibc such as
+// strdup and asprintf, and forward to the glibc allocator. Copy threads
+// allocate too, so the counter is updated atomically.
+#ifdef __GLIBC__
+static uint64_t sl_heap_alloc_count = 0;
+static uint64_t sl_heap_alloc_count_last_dump = 0;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  __atomic_add_fetch(&sl_heap_alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+  __atomic_add_fetch(&sl_heap_alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  __atomic_add_fetch(&sl_heap_alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+// Number of objects carved out of each heap allocation made by a free list.
+#define SL_FREE_LIST_SLAB_SIZE 32
+
+// Heap allocations made by free lists and the number of objects currently
+// handed out by them, dumped on SIGUSR1. Neither should grow while frames
+// are produced at a steady rate.
+static uint64_t sl_free_list_slab_count = 0;
+static uint64_t sl_free_list_live_count = 0;
+
+static struct sl_free_list sl_mmap_free_list =
+    SL_FREE_LIST_INIT(struct sl_mmap);
+static struct sl_free_list sl_host_buffer_free_list =
+    SL_FREE_LIST_INIT(struct sl_host_buffer);
+static struct sl_free_list sl_data_source_send_request_free_list =
+    SL_FREE_LIST_INIT(struct sl_data_source_send_request);
+static struct sl_free_list sl_x_reply_handler_free_list =
+    SL_FREE_LIST_INIT(struct sl_x_reply_handler);
+static struct sl_free_list sl_property_request_free_list =
+    SL_FREE_LIST_INIT(struct sl_property_request);
+
+static void sl_free_list_push(struct sl_free_list* list, void* object) {
+  *(void**)object = list->head;
+  list->head = object;
+}
+
+// Returns an uninitialized object. The list grows by a whole slab when it
+// is empty. Slabs are never returned to the heap, so memory use is bounded
+// by the peak number of live objects.
+void* sl_free_list_alloc(struct sl_free_list* list) {
+  void* object;
+
+  if (!list->head) {
+    size_t size = (list->size + 15) & ~(size_t)15;
+    uint8_t* slab = malloc(size * SL_FREE_LIST_SLAB_SIZE);
+    int i;
+
+    assert(slab);
+    for (i = SL_FREE_LIST_SLAB_SIZE - 1; i >= 0; --i)
+      sl_free_list_push(list, slab + i * size);
+    ++sl_free_list_slab_count;
+  }
+
+  object = list->head;
+  list->head = *(void**)object;
+  ++sl_free_list_live_count;
+  return object;
+}
+
+void sl_free_list_free(struct sl_free_list* list, void* object) {
+  sl_free_list_push(list, object);
+  --sl_free_list_live_count;
+}
+
+// Number of mmap and munmap calls made for buffers, dumped on SIGUSR1.
+static uint64_t sl_mmap_count = 0;
+static uint64_t sl_munmap_count = 0;
+
 struct sl_mmap* sl_mmap_create(int fd,
                                size_t size,
                                size_t bpp,
@@ -237,7 +400,7 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t y_ss1) {
   struct sl_mmap* map;
 
-  map = malloc(sizeof(*map));
+  map = sl_free_list_alloc(&sl_mmap_free_list);
   map->refcount = 1;
   map->fd = fd;
   map->size = size;
@@ -252,9 +415,88 @@ struct sl_mmap* sl_mmap_create(int fd,
   map->begin_write = NULL;
   map->end_write = NULL;
   map->buffer_resource = NULL;
+  map->parent = NULL;
+  map->bo = NULL;
+  map->bo_map_data = NULL;
+  map->write_x = 0;
+  map->write_y = 0;
+  map->write_width = 0;
+  map->write_height = 0;
   map->addr =
       mmap(NULL, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   errno_assert(map->addr != MAP_FAILED);
+  ++sl_mmap_count;
+
+  return map;
+}
+
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* parent,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1) {
+  struct sl_mmap* map;
+
+  map = sl_free_list_alloc(&sl_mmap_free_list);
+  map->refcount = 1;
+  map->fd = -1;
+  map->size = parent->size;
+  map->num_planes = num_planes;
+  map->bpp = bpp;
+  map->offset[0] = offset0;
+  map->stride[0] = stride0;
+  map->offset[1] = offset1;
+  map->stride[1] = stride1;
+  map->y_ss[0] = y_ss0;
+  map->y_ss[1] = y_ss1;
+  map->begin_write = NULL;
+  map->end_write = NULL;
+  map->buffer_resource = NULL;
+  map->parent = sl_mmap_ref(parent);
+  map->bo = NULL;
+  map->bo_map_data = NULL;
+  map->write_x = 0;
+  map->write_y = 0;
+  map->write_width = 0;
+  map->write_height = 0;
+  map->addr = parent->addr;
+
+  return map;
+}
+
+// Creates a mapping for a buffer object that can't be mapped linearly
+// through its dmabuf fd. |addr| and |stride| are only valid between
+// begin_write and end_write, which map and unmap the buffer object.
+struct sl_mmap* sl_mmap_create_bo(struct gbm_bo* bo, size_t bpp) {
+  struct sl_mmap* map;
+
+  map = sl_free_list_alloc(&sl_mmap_free_list);
+  map->refcount = 1;
+  map->fd = -1;
+  map->size = (size_t)gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
+  map->num_planes = 1;
+  map->bpp = bpp;
+  map->offset[0] = 0;
+  map->stride[0] = gbm_bo_get_stride(bo);
+  map->offset[1] = 0;
+  map->stride[1] = 0;
+  map->y_ss[0] = 1;
+  map->y_ss[1] = 1;
+  map->begin_write = NULL;
+  map->end_write = NULL;
+  map->buffer_resource = NULL;
+  map->parent = NULL;
+  map->bo = bo;
+  map->bo_map_data = NULL;
+  map->write_x = 0;
+  map->write_y = 0;
+  map->write_width = 0;
+  map->write_height = 0;
+  map->addr = NULL;
 
   return map;
 }
@@ -266,10 +508,19 @@ struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
 
 void sl_mmap_unref(struct sl_mmap* map) {
   if (map->refcount-- == 1) {
-    munmap(map->addr, map->size + map->offset[0]);
+    if (map->parent) {
+      sl_mmap_unref(map->parent);
+    } else if (map->bo) {
+      if (map->bo_map_data)
+        gbm_bo_unmap(map->bo, map->bo_map_data);
+      gbm_bo_destroy(map->bo);
+    } else {
+      munmap(map->addr, map->size + map->offset[0]);
+      ++sl_munmap_count;
+    }
     if (map->fd != -1)
       close(map->fd);
-    free(map);
+    sl_free_list_free(&sl_mmap_free_list, map);
   }
 }
 
@@ -279,11 +530,15 @@ struct sl_sync_point* sl_sync_point_create(int fd) {
   sync_point = malloc(sizeof(*sync_point));
   sync_point->fd = fd;
   sync_point->sync = NULL;
+  sync_point->destroy = NULL;
+  sync_point->data = NULL;
 
   return sync_point;
 }
 
 void sl_sync_point_destroy(struct sl_sync_point* sync_point) {
+  if (sync_point->destroy)
+    sync_point->destroy(sync_point);
   close(sync_point->fd);
   free(sync_point);
 }
@@ -334,6 +589,20 @@ static void sl_adjust_window_position_for_screen_size(
   window->y = ctx->screen->height_in_pixels / 2 - window->height / 2;
 }
 
+// Queues |window| for sl_process_dirty_windows(), which runs once per event
+// loop iteration before outgoing requests are flushed.
+static void sl_window_mark_dirty(struct sl_window* window) {
+  if (wl_list_empty(&window->dirty_link))
+    wl_list_insert(window->ctx->dirty_windows.prev, &window->dirty_link);
+}
+
+// Defers sl_window_update() so that bursts of X events touching the same
+// window result in a single update.
+static void sl_window_schedule_update(struct sl_window* window) {
+  window->needs_update = 1;
+  sl_window_mark_dirty(window);
+}
+
 static void sl_configure_window(struct sl_window* window) {
   assert(!window->pending_config.serial);
 
@@ -465,34 +734,66 @@ int sl_process_pending_configure_acks(struct sl_window* window,
   }
   window->pending_config.serial = 0;
 
+  // The next configure is applied at the end of the event loop iteration so
+  // that configures arriving in the meantime collapse into it.
   if (window->next_config.serial)
-    sl_configure_window(window);
+    sl_window_mark_dirty(window);
 
   return 1;
 }
 
+static struct sl_window* sl_lookup_window(struct sl_context* ctx,
+                                          xcb_window_t id);
+
+// Acks are checked against the contents of the surface, so they wait for a
+// deferred commit. |args[0]| is the window id.
+static void sl_window_ack_configure_request(
+    struct sl_surface_request* request) {
+  struct sl_host_surface* host_surface =
+      wl_resource_get_user_data(request->resource);
+  struct sl_window* window =
+      sl_lookup_window(host_surface->ctx, request->args[0]);
+
+  if (window && sl_process_pending_configure_acks(window, host_surface))
+    wl_surface_commit(host_surface->proxy);
+}
+
+// Applies the latest configure event to the X window. Only the last serial
+// needs to be acked as xdg_surface.ack_configure implies all earlier ones.
+static void sl_window_apply_configure(struct sl_window* window) {
+  struct wl_resource* host_resource;
+  struct sl_host_surface* host_surface = NULL;
+  struct sl_surface_request* request = NULL;
+
+  host_resource =
+      wl_client_get_object(window->ctx->client, window->host_surface_id);
+  if (host_resource)
+    host_surface = wl_resource_get_user_data(host_resource);
+
+  sl_configure_window(window);
+
+  if (host_surface) {
+    request = sl_host_surface_queue_request(host_surface, host_resource,
+                                            sl_window_ack_configure_request);
+  }
+  if (request) {
+    request->args[0] = window->id;
+    return;
+  }
+
+  if (sl_process_pending_configure_acks(window, host_surface)) {
+    if (host_surface)
+      wl_surface_commit(host_surface->proxy);
+  }
+}
+
 static void sl_internal_xdg_surface_configure(void* data,
                                               struct xdg_surface* xdg_surface,
                                               uint32_t serial) {
   struct sl_window* window = xdg_surface_get_user_data(xdg_surface);
 
   window->next_config.serial = serial;
-  if (!window->pending_config.serial) {
-    struct wl_resource* host_resource;
-    struct sl_host_surface* host_surface = NULL;
-
-    host_resource =
-        wl_client_get_object(window->ctx->client, window->host_surface_id);
-    if (host_resource)
-      host_surface = wl_resource_get_user_data(host_resource);
-
-    sl_configure_window(window);
-
-    if (sl_process_pending_configure_acks(window, host_surface)) {
-      if (host_surface)
-        wl_surface_commit(host_surface->proxy);
-    }
-  }
+  sl_window_mark_dirty(window);
 }
 
 static const struct xdg_surface_listener sl_internal_xdg_surface_listener = {
@@ -598,6 +899,46 @@ static void sl_internal_xdg_popup_done(void* data,
 static const struct xdg_popup_listener sl_internal_xdg_popup_listener = {
     sl_internal_xdg_popup_configure, sl_internal_xdg_popup_done};
 
+// Throttles windows that the host reports as fully occluded, which also
+// covers minimized windows.
+static void sl_internal_aura_surface_occlusion_changed(
+    void* data,
+    struct zaura_surface* aura_surface,
+    wl_fixed_t occlusion_fraction,
+    uint32_t occlusion_reason) {
+  struct sl_window* window = zaura_surface_get_user_data(aura_surface);
+  struct wl_resource* host_resource;
+
+  window->hidden = occlusion_fraction >= wl_fixed_from_int(1);
+
+  host_resource =
+      wl_client_get_object(window->ctx->client, window->host_surface_id);
+  if (host_resource)
+    sl_host_surface_set_hidden(wl_resource_get_user_data(host_resource),
+                               window->hidden);
+}
+
+static const struct zaura_surface_listener sl_internal_aura_surface_listener =
+    {sl_internal_aura_surface_occlusion_changed};
+
+// Stops throttling the host surface paired with |window|. Must be called
+// before the window stops tracking the surface, so the surface doesn't stay
+// hidden when it is shown through another window.
+static void sl_window_clear_hidden(struct sl_window* window) {
+  struct wl_resource* host_resource = NULL;
+
+  if (!window->hidden)
+    return;
+
+  window->hidden = 0;
+  if (window->host_surface_id) {
+    host_resource =
+        wl_client_get_object(window->ctx->client, window->host_surface_id);
+  }
+  if (host_resource)
+    sl_host_surface_set_hidden(wl_resource_get_user_data(host_resource), 0);
+}
+
 static void sl_window_set_wm_state(struct sl_window* window, int state) {
   struct sl_context* ctx = window->ctx;
   uint32_t values[2];
@@ -638,12 +979,33 @@ void sl_update_application_id(struct sl_context* ctx,
   }
 }
 
+static void sl_window_commit(struct sl_window* window,
+                             struct sl_host_surface* host_surface) {
+  wl_surface_commit(host_surface->proxy);
+  if (host_surface->contents_width && host_surface->contents_height)
+    window->realized = 1;
+}
+
+// |args[0]| is the window id.
+static void sl_window_commit_request(struct sl_surface_request* request) {
+  struct sl_host_surface* host_surface =
+      wl_resource_get_user_data(request->resource);
+  struct sl_window* window =
+      sl_lookup_window(host_surface->ctx, request->args[0]);
+
+  if (window)
+    sl_window_commit(window, host_surface);
+}
+
 void sl_window_update(struct sl_window* window) {
   struct wl_resource* host_resource = NULL;
   struct sl_host_surface* host_surface;
+  struct sl_surface_request* request;
   struct sl_context* ctx = window->ctx;
   struct sl_window* parent = NULL;
 
+  window->needs_update = 0;
+
   if (window->host_surface_id) {
     host_resource = wl_client_get_object(ctx->client, window->host_surface_id);
     if (host_resource && window->unpaired) {
@@ -662,6 +1024,7 @@ void sl_window_update(struct sl_window* window) {
       zaura_surface_destroy(window->aura_surface);
       window->aura_surface = NULL;
     }
+    sl_window_clear_hidden(window);
     if (window->xdg_toplevel) {
       xdg_toplevel_destroy(window->xdg_toplevel);
       window->xdg_toplevel = NULL;
@@ -758,6 +1121,13 @@ void sl_window_update(struct sl_window* window) {
     if (!window->aura_surface) {
       window->aura_surface = zaura_shell_get_aura_surface(
           ctx->aura_shell->internal, host_surface->proxy);
+      if (ctx->aura_shell->version >=
+          ZAURA_SURFACE_SET_OCCLUSION_TRACKING_SINCE_VERSION) {
+        zaura_surface_set_user_data(window->aura_surface, window);
+        zaura_surface_add_listener(window->aura_surface,
+                                   &sl_internal_aura_surface_listener, window);
+        zaura_surface_set_occlusion_tracking(window->aura_surface);
+      }
     }
 
     zaura_surface_set_frame(window->aura_surface,
@@ -832,9 +1202,14 @@ void sl_window_update(struct sl_window* window) {
                              (window->y - parent->y) / ctx->scale);
   }
 
-  wl_surface_commit(host_surface->proxy);
-  if (host_surface->contents_width && host_surface->contents_height)
-    window->realized = 1;
+  request = sl_host_surface_queue_request(host_surface, host_resource,
+                                          sl_window_commit_request);
+  if (request) {
+    request->args[0] = window->id;
+    return;
+  }
+
+  sl_window_commit(window, host_surface);
 }
 
 static void sl_host_buffer_destroy(struct wl_client* client,
@@ -856,6 +1231,10 @@ static const struct wl_buffer_listener sl_buffer_listener = {sl_buffer_release};
 static void sl_destroy_host_buffer(struct wl_resource* resource) {
   struct sl_host_buffer* host = wl_resource_get_user_data(resource);
 
+  // A surface still waiting for rendering to this buffer has to attach it
+  // before the proxy and sync point go away.
+  if (host->sync_surface)
+    sl_host_surface_sync_done(host->sync_surface);
   if (host->proxy)
     wl_buffer_destroy(host->proxy);
   if (host->shm_mmap) {
@@ -866,7 +1245,7 @@ static void sl_destroy_host_buffer(struct wl_resource* resource) {
     sl_sync_point_destroy(host->sync_point);
   }
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_free_list_free(&sl_host_buffer_free_list, host);
 }
 
 struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
@@ -876,9 +1255,7 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
                                              int32_t height) {
   struct sl_host_buffer* host_buffer;
 
-  host_buffer = malloc(sizeof(*host_buffer));
-  assert(host_buffer);
-
+  host_buffer = sl_free_list_alloc(&sl_host_buffer_free_list);
   host_buffer->width = width;
   host_buffer->height = height;
   host_buffer->resource =
@@ -895,19 +1272,134 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
                            host_buffer);
   }
   host_buffer->sync_point = NULL;
+  host_buffer->is_dmabuf = 0;
+  host_buffer->sync_surface = NULL;
 
   return host_buffer;
 }
 
+static uint32_t sl_atom_hash(xcb_atom_t atom) {
+  return (atom * 2654435761u >> 16) & (SL_ATOM_TABLE_SIZE - 1);
+}
+
+// FNV-1a hash of |name|.
+static uint32_t sl_atom_name_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+
+  while (*name) {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+
+  return hash & (SL_ATOM_TABLE_SIZE - 1);
+}
+
+static const char* sl_atom_cache_get_name(struct sl_context* ctx,
+                                          xcb_atom_t atom) {
+  struct wl_list* bucket = &ctx->atom_table[sl_atom_hash(atom)];
+  struct sl_atom_name* entry;
+
+  wl_list_for_each(entry, bucket, atom_link) {
+    if (entry->atom == atom)
+      return entry->name;
+  }
+
+  return NULL;
+}
+
+static xcb_atom_t sl_atom_cache_get_atom(struct sl_context* ctx,
+                                         const char* name) {
+  struct wl_list* bucket = &ctx->atom_name_table[sl_atom_name_hash(name)];
+  struct sl_atom_name* entry;
+
+  wl_list_for_each(entry, bucket, name_link) {
+    if (strcmp(entry->name, name) == 0)
+      return entry->atom;
+  }
+
+  return XCB_ATOM_NONE;
+}
+
+static void sl_atom_cache_add(struct sl_context* ctx,
+                              xcb_atom_t atom,
+                              const char* name) {
+  struct sl_atom_name* entry;
+
+  if (sl_atom_cache_get_name(ctx, atom))
+    return;
+
+  entry = malloc(sizeof(*entry));
+  assert(entry);
+  entry->atom = atom;
+  entry->name = strdup(name);
+  wl_list_insert(&ctx->atom_table[sl_atom_hash(atom)], &entry->atom_link);
+  wl_list_insert(&ctx->atom_name_table[sl_atom_name_hash(name)],
+                 &entry->name_link);
+}
+
 static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
+  struct sl_data_offer_type* type;
+
   wl_data_offer_destroy(host->internal);
   wl_array_release(&host->atoms);
-  wl_array_release(&host->cookies);
+  wl_array_for_each(type, &host->types) {
+    free(type->name);
+  }
+  wl_array_release(&host->types);
   free(host);
 }
 
+static void sl_add_x_reply_handler(struct sl_context* ctx,
+                                   unsigned int sequence,
+                                   sl_x_reply_func_t func,
+                                   void* data);
+
+// Adds the interned types to the offer they were requested for, and takes
+// over the X selection once all of them are known.
+static void sl_handle_selection_types(struct sl_context* ctx,
+                                      void* last_reply,
+                                      void* data) {
+  struct sl_selection_types_request* request = data;
+  struct sl_data_offer* data_offer = ctx->selection_data_offer;
+  struct sl_data_offer_type* type;
+  struct sl_data_offer_type* last_type =
+      (struct sl_data_offer_type*)request->types.data +
+      request->types.size / sizeof(*type) - 1;
+
+  if (request->serial != ctx->selection_offer_serial)
+    data_offer = NULL;
+
+  // Replies arrive in order, so the earlier ones are already there.
+  wl_array_for_each(type, &request->types) {
+    xcb_intern_atom_reply_t* reply =
+        type == last_type
+            ? last_reply
+            : xcb_intern_atom_reply(ctx->connection, type->cookie, NULL);
+
+    if (reply) {
+      sl_atom_cache_add(ctx, reply->atom, type->name);
+      if (data_offer) {
+        xcb_atom_t* atom = wl_array_add(&data_offer->atoms, sizeof(*atom));
+        assert(atom);
+        *atom = reply->atom;
+      }
+      if (reply != last_reply)
+        free(reply);
+    }
+    free(type->name);
+  }
+  wl_array_release(&request->types);
+  free(request);
+
+  if (data_offer) {
+    xcb_set_selection_owner(ctx->connection, ctx->selection_window,
+                            ctx->atoms[ATOM_CLIPBOARD].value, XCB_CURRENT_TIME);
+  }
+}
+
 static void sl_set_selection(struct sl_context* ctx,
                              struct sl_data_offer* data_offer) {
+  ++ctx->selection_offer_serial;
   if (ctx->selection_data_offer) {
     sl_internal_data_offer_destroy(ctx->selection_data_offer);
     ctx->selection_data_offer = NULL;
@@ -922,23 +1414,42 @@ static void sl_set_selection(struct sl_context* ctx,
       return;
     }
 
-    int atoms = data_offer->cookies.size / sizeof(xcb_intern_atom_cookie_t);
-    wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t) * (atoms + 2));
-    ((xcb_atom_t*)data_offer->atoms.data)[0] = ctx->atoms[ATOM_TARGETS].value;
-    ((xcb_atom_t*)data_offer->atoms.data)[1] = ctx->atoms[ATOM_TIMESTAMP].value;
-    for (int i = 0; i < atoms; i++) {
-      xcb_intern_atom_cookie_t cookie =
-          ((xcb_intern_atom_cookie_t*)data_offer->cookies.data)[i];
-      xcb_intern_atom_reply_t* reply =
-          xcb_intern_atom_reply(ctx->connection, cookie, NULL);
-      if (reply) {
-        ((xcb_atom_t*)data_offer->atoms.data)[i + 2] = reply->atom;
-        free(reply);
-      }
-    }
+    struct wl_array atoms;
+    xcb_atom_t* atom;
 
-    xcb_set_selection_owner(ctx->connection, ctx->selection_window,
-                            ctx->atoms[ATOM_CLIPBOARD].value, XCB_CURRENT_TIME);
+    // Types found in the atom cache were resolved when offered. Only
+    // types that haven't been seen before wait for the X server, and the
+    // selection is taken over once they have been interned.
+    wl_array_init(&atoms);
+    atom = wl_array_add(&atoms, sizeof(*atom) * 2);
+    assert(atom);
+    atom[0] = ctx->atoms[ATOM_TARGETS].value;
+    atom[1] = ctx->atoms[ATOM_TIMESTAMP].value;
+    if (data_offer->atoms.size) {
+      atom = wl_array_add(&atoms, data_offer->atoms.size);
+      assert(atom);
+      memcpy(atom, data_offer->atoms.data, data_offer->atoms.size);
+    }
+    wl_array_release(&data_offer->atoms);
+    data_offer->atoms = atoms;
+
+    if (data_offer->types.size) {
+      struct sl_selection_types_request* request = malloc(sizeof(*request));
+      struct sl_data_offer_type* last_type;
+
+      assert(request);
+      request->serial = ctx->selection_offer_serial;
+      request->types = data_offer->types;
+      wl_array_init(&data_offer->types);
+      last_type = (struct sl_data_offer_type*)request->types.data +
+                  request->types.size / sizeof(*last_type) - 1;
+      sl_add_x_reply_handler(ctx, last_type->cookie.sequence,
+                             sl_handle_selection_types, request);
+    } else {
+      xcb_set_selection_owner(ctx->connection, ctx->selection_window,
+                              ctx->atoms[ATOM_CLIPBOARD].value,
+                              XCB_CURRENT_TIME);
+    }
   }
 
   ctx->selection_data_offer = data_offer;
@@ -948,9 +1459,21 @@ static void sl_internal_data_offer_offer(void* data,
                                          struct wl_data_offer* data_offer,
                                          const char* type) {
   struct sl_data_offer* host = data;
-  xcb_intern_atom_cookie_t* cookie =
-      wl_array_add(&host->cookies, sizeof(xcb_intern_atom_cookie_t));
-  *cookie = xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+  xcb_atom_t atom = sl_atom_cache_get_atom(host->ctx, type);
+  struct sl_data_offer_type* offer_type;
+
+  if (atom != XCB_ATOM_NONE) {
+    xcb_atom_t* value = wl_array_add(&host->atoms, sizeof(*value));
+    assert(value);
+    *value = atom;
+    return;
+  }
+
+  offer_type = wl_array_add(&host->types, sizeof(*offer_type));
+  assert(offer_type);
+  offer_type->name = strdup(type);
+  offer_type->cookie =
+      xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
 }
 
 static void sl_internal_data_offer_source_actions(
@@ -977,7 +1500,7 @@ static void sl_internal_data_device_data_offer(
   host_data_offer->ctx = ctx;
   host_data_offer->internal = data_offer;
   wl_array_init(&host_data_offer->atoms);
-  wl_array_init(&host_data_offer->cookies);
+  wl_array_init(&host_data_offer->types);
 
   wl_data_offer_add_listener(host_data_offer->internal,
                              &sl_internal_data_offer_listener, host_data_offer);
@@ -1081,6 +1604,27 @@ static void sl_global_destroy(struct sl_global* global) {
   free(global);
 }
 
+static void sl_linux_dmabuf_format(void* data,
+                                   struct zwp_linux_dmabuf_v1* linux_dmabuf,
+                                   uint32_t format) {}
+
+static void sl_linux_dmabuf_modifier(void* data,
+                                     struct zwp_linux_dmabuf_v1* linux_dmabuf,
+                                     uint32_t format,
+                                     uint32_t modifier_hi,
+                                     uint32_t modifier_lo) {
+  struct sl_linux_dmabuf* host = (struct sl_linux_dmabuf*)data;
+  struct sl_dmabuf_modifier* modifier;
+
+  modifier = wl_array_add(&host->modifiers, sizeof(*modifier));
+  assert(modifier);
+  modifier->format = format;
+  modifier->modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener sl_linux_dmabuf_listener = {
+    sl_linux_dmabuf_format, sl_linux_dmabuf_modifier};
+
 static void sl_registry_handler(void* data,
                                 struct wl_registry* registry,
                                 uint32_t id,
@@ -1167,6 +1711,21 @@ static void sl_registry_handler(void* data,
     ctx->pointer_constraints = pointer_constraints;
     pointer_constraints->host_global =
         sl_pointer_constraints_global_create(ctx);
+  } else if (strcmp(interface, "zwp_linux_explicit_synchronization_v1") ==
+                 0 &&
+             ctx->virtwl_socket_fd == -1) {
+    // Fences are sync_file fds, which can't be forwarded over a virtwl
+    // channel.
+    struct sl_linux_explicit_synchronization* linux_explicit_synchronization =
+        malloc(sizeof(struct sl_linux_explicit_synchronization));
+    assert(linux_explicit_synchronization);
+    linux_explicit_synchronization->ctx = ctx;
+    linux_explicit_synchronization->id = id;
+    linux_explicit_synchronization->version = MIN(2, version);
+    assert(!ctx->linux_explicit_synchronization);
+    ctx->linux_explicit_synchronization = linux_explicit_synchronization;
+    linux_explicit_synchronization->host_global =
+        sl_linux_explicit_synchronization_global_create(ctx);
   } else if (strcmp(interface, "wl_data_device_manager") == 0) {
     struct sl_data_device_manager* data_device_manager =
         malloc(sizeof(struct sl_data_device_manager));
@@ -1236,9 +1795,13 @@ static void sl_registry_handler(void* data,
     assert(linux_dmabuf);
     linux_dmabuf->ctx = ctx;
     linux_dmabuf->id = id;
-    linux_dmabuf->version = MIN(2, version);
+    // Version 3 is needed to receive modifier events.
+    linux_dmabuf->version = MIN(3, version);
     linux_dmabuf->internal = wl_registry_bind(
         registry, id, &zwp_linux_dmabuf_v1_interface, linux_dmabuf->version);
+    wl_array_init(&linux_dmabuf->modifiers);
+    zwp_linux_dmabuf_v1_add_listener(linux_dmabuf->internal,
+                                     &sl_linux_dmabuf_listener, linux_dmabuf);
     assert(!ctx->linux_dmabuf);
     ctx->linux_dmabuf = linux_dmabuf;
     linux_dmabuf->host_drm_global = sl_drm_global_create(ctx);
@@ -1337,6 +1900,7 @@ static void sl_registry_remover(void* data,
     if (ctx->linux_dmabuf->host_drm_global)
       sl_global_destroy(ctx->linux_dmabuf->host_drm_global);
     zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf->internal);
+    wl_array_release(&ctx->linux_dmabuf->modifiers);
     free(ctx->linux_dmabuf);
     ctx->linux_dmabuf = NULL;
     return;
@@ -1366,6 +1930,13 @@ static void sl_registry_remover(void* data,
     ctx->pointer_constraints = NULL;
     return;
   }
+  if (ctx->linux_explicit_synchronization &&
+      ctx->linux_explicit_synchronization->id == id) {
+    sl_global_destroy(ctx->linux_explicit_synchronization->host_global);
+    free(ctx->linux_explicit_synchronization);
+    ctx->linux_explicit_synchronization = NULL;
+    return;
+  }
   wl_list_for_each(output, &ctx->outputs, link) {
     if (output->id == id) {
       sl_global_destroy(output->host_global);
@@ -1395,23 +1966,150 @@ static int sl_handle_event(int fd, uint32_t mask, void* data) {
   int count = 0;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    wl_client_flush(ctx->client);
+    wl_display_flush_clients(ctx->host_display);
     exit(EXIT_SUCCESS);
   }
 
-  if (mask & WL_EVENT_READABLE)
-    count = wl_display_dispatch(ctx->display);
-  if (mask & WL_EVENT_WRITABLE)
-    wl_display_flush(ctx->display);
-
-  if (mask == 0) {
+  // Only read and dispatch here. Outgoing requests are flushed once per
+  // event loop iteration by sl_flush_connections().
+  if (mask & WL_EVENT_READABLE) {
+    while (wl_display_prepare_read(ctx->display) != 0)
+      wl_display_dispatch_pending(ctx->display);
+    if (wl_display_read_events(ctx->display) < 0)
+      return -1;
+    ++ctx->loop_stats.host_reads;
     count = wl_display_dispatch_pending(ctx->display);
-    wl_display_flush(ctx->display);
   }
+  if (mask & WL_EVENT_WRITABLE) {
+    if (wl_display_flush(ctx->display) >= 0) {
+      ++ctx->loop_stats.host_writes;
+      wl_event_source_fd_update(ctx->display_event_source, WL_EVENT_READABLE);
+    } else if (errno != EAGAIN) {
+      return -1;
+    }
+  }
+
+  if (mask == 0)
+    count = wl_display_dispatch_pending(ctx->display);
 
   return count;
 }
 
+// Per client state used to count flushes that actually write to the client.
+struct sl_client_flush_state {
+  struct wl_listener destroy_listener;
+  struct wl_list dirty_link;
+};
+
+static void sl_client_flush_state_destroy(struct wl_listener* listener,
+                                          void* data) {
+  struct sl_client_flush_state* state =
+      wl_container_of(listener, state, destroy_listener);
+
+  wl_list_remove(&state->destroy_listener.link);
+  wl_list_remove(&state->dirty_link);
+  free(state);
+}
+
+// Marks the client of each event sent as having data to flush.
+static void sl_protocol_logger(void* data,
+                               enum wl_protocol_logger_type type,
+                               const struct wl_protocol_logger_message* msg) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct wl_client* client;
+  struct wl_listener* listener;
+  struct sl_client_flush_state* state;
+
+  if (type != WL_PROTOCOL_LOGGER_EVENT)
+    return;
+
+  client = wl_resource_get_client(msg->resource);
+  listener =
+      wl_client_get_destroy_listener(client, sl_client_flush_state_destroy);
+  if (listener) {
+    state = wl_container_of(listener, state, destroy_listener);
+  } else {
+    state = malloc(sizeof(*state));
+    assert(state);
+    state->destroy_listener.notify = sl_client_flush_state_destroy;
+    wl_client_add_destroy_listener(client, &state->destroy_listener);
+    wl_list_init(&state->dirty_link);
+  }
+  if (wl_list_empty(&state->dirty_link))
+    wl_list_insert(&ctx->dirty_clients, &state->dirty_link);
+}
+
+// Flushes each outgoing connection once after all ready event sources have
+// been dispatched. Returns -1 if the host connection failed.
+static int sl_flush_connections(struct sl_context* ctx) {
+  int rv;
+
+  ++ctx->loop_stats.iterations;
+
+  // Only clients with queued events are written to by the flush. Clients
+  // destroyed by a failed flush have already left the dirty list, which
+  // stays empty without --stats.
+  wl_display_flush_clients(ctx->host_display);
+  while (!wl_list_empty(&ctx->dirty_clients)) {
+    struct sl_client_flush_state* state =
+        wl_container_of(ctx->dirty_clients.next, state, dirty_link);
+
+    wl_list_remove(&state->dirty_link);
+    wl_list_init(&state->dirty_link);
+    ++ctx->loop_stats.client_flushes;
+  }
+
+  if (ctx->connection) {
+    uint64_t written = xcb_total_written(ctx->connection);
+
+    xcb_flush(ctx->connection);
+    if (xcb_total_written(ctx->connection) != written)
+      ++ctx->loop_stats.x_flushes;
+  }
+
+  rv = wl_display_flush(ctx->display);
+  if (rv < 0) {
+    if (errno != EAGAIN)
+      return -1;
+
+    // The host socket is full. Finish the flush once it is writable again.
+    ++ctx->loop_stats.host_writes_blocked;
+    wl_event_source_fd_update(ctx->display_event_source,
+                              WL_EVENT_READABLE | WL_EVENT_WRITABLE);
+  } else if (rv > 0) {
+    ++ctx->loop_stats.host_writes;
+  }
+
+  return 0;
+}
+
+// Applies the window state changes queued since the last event loop
+// iteration. Each window is updated and configured at most once.
+static void sl_process_dirty_windows(struct sl_context* ctx) {
+  while (!wl_list_empty(&ctx->dirty_windows)) {
+    struct sl_window* window =
+        wl_container_of(ctx->dirty_windows.next, window, dirty_link);
+
+    wl_list_remove(&window->dirty_link);
+    wl_list_init(&window->dirty_link);
+
+    if (window->needs_update)
+      sl_window_update(window);
+
+    // A configure waiting for matching contents is followed up once it has
+    // been acked.
+    if (window->xdg_surface && window->next_config.serial &&
+        !window->pending_config.serial) {
+      sl_window_apply_configure(window);
+    }
+  }
+}
+
+// Maps an X window id or host surface id to a window table bucket.
+static uint32_t sl_window_hash(uint32_t id) {
+  return (id * 2654435761u >> 16) & (SL_WINDOW_TABLE_SIZE - 1);
+}
+
 static void sl_create_window(struct sl_context* ctx,
                              xcb_window_t id,
                              int x,
@@ -1455,13 +2153,19 @@ static void sl_create_window(struct sl_context* ctx,
   window->xdg_toplevel = NULL;
   window->xdg_popup = NULL;
   window->aura_surface = NULL;
+  window->hidden = 0;
   window->next_config.serial = 0;
   window->next_config.mask = 0;
   window->next_config.states_length = 0;
   window->pending_config.serial = 0;
   window->pending_config.mask = 0;
   window->pending_config.states_length = 0;
+  window->needs_update = 0;
   wl_list_insert(&ctx->unpaired_windows, &window->link);
+  wl_list_insert(&ctx->window_table[sl_window_hash(id)], &window->window_link);
+  wl_list_init(&window->frame_link);
+  wl_list_init(&window->host_surface_link);
+  wl_list_init(&window->dirty_link);
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_EVENT_MASK,
                                values);
@@ -1484,6 +2188,7 @@ static void sl_destroy_window(struct sl_window* window) {
     xdg_surface_destroy(window->xdg_surface);
   if (window->aura_surface)
     zaura_surface_destroy(window->aura_surface);
+  sl_window_clear_hidden(window);
 
   if (window->name)
     free(window->name);
@@ -1493,31 +2198,65 @@ static void sl_destroy_window(struct sl_window* window) {
     free(window->startup_id);
 
   wl_list_remove(&window->link);
+  wl_list_remove(&window->window_link);
+  wl_list_remove(&window->frame_link);
+  wl_list_remove(&window->host_surface_link);
+  wl_list_remove(&window->dirty_link);
   free(window);
 }
 
-static int sl_is_window(struct sl_window* window, xcb_window_t id) {
-  if (window->id == id)
-    return 1;
-
-  if (window->frame_id != XCB_WINDOW_NONE) {
-    if (window->frame_id == id)
-      return 1;
+static void sl_window_set_frame_id(struct sl_window* window,
+                                   xcb_window_t frame_id) {
+  wl_list_remove(&window->frame_link);
+  wl_list_init(&window->frame_link);
+  window->frame_id = frame_id;
+  if (frame_id != XCB_WINDOW_NONE) {
+    wl_list_insert(&window->ctx->frame_table[sl_window_hash(frame_id)],
+                   &window->frame_link);
   }
+}
 
-  return 0;
+void sl_window_set_host_surface_id(struct sl_window* window,
+                                   uint32_t host_surface_id) {
+  if (host_surface_id != window->host_surface_id)
+    sl_window_clear_hidden(window);
+  wl_list_remove(&window->host_surface_link);
+  wl_list_init(&window->host_surface_link);
+  window->host_surface_id = host_surface_id;
+  if (host_surface_id) {
+    wl_list_insert(
+        &window->ctx->host_surface_table[sl_window_hash(host_surface_id)],
+        &window->host_surface_link);
+  }
 }
 
 static struct sl_window* sl_lookup_window(struct sl_context* ctx,
                                           xcb_window_t id) {
+  struct wl_list* bucket = &ctx->window_table[sl_window_hash(id)];
   struct sl_window* window;
 
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (sl_is_window(window, id))
+  wl_list_for_each(window, bucket, window_link) {
+    if (window->id == id)
+      return window;
+  }
+  bucket = &ctx->frame_table[sl_window_hash(id)];
+  wl_list_for_each(window, bucket, frame_link) {
+    if (window->frame_id == id)
       return window;
   }
-  wl_list_for_each(window, &ctx->unpaired_windows, link) {
-    if (sl_is_window(window, id))
+  return NULL;
+}
+
+struct sl_window* sl_lookup_host_surface_window(struct sl_context* ctx,
+                                                uint32_t host_surface_id,
+                                                int unpaired) {
+  struct wl_list* bucket =
+      &ctx->host_surface_table[sl_window_hash(host_surface_id)];
+  struct sl_window* window;
+
+  wl_list_for_each(window, bucket, host_surface_link) {
+    if (window->host_surface_id == host_surface_id &&
+        window->unpaired == unpaired)
       return window;
   }
   return NULL;
@@ -1531,6 +2270,8 @@ static int sl_is_our_window(struct sl_context* ctx, xcb_window_t id) {
 
 static void sl_handle_create_notify(struct sl_context* ctx,
                                     xcb_create_notify_event_t* event) {
+  TRACE_EVENT("x11");
+
   if (sl_is_our_window(ctx, event->window))
     return;
 
@@ -1538,9 +2279,16 @@ static void sl_handle_create_notify(struct sl_context* ctx,
                    event->height, event->border_width);
 }
 
+static void sl_cancel_selection_transfers(struct sl_context* ctx,
+                                          xcb_window_t requestor);
+
 static void sl_handle_destroy_notify(struct sl_context* ctx,
                                      xcb_destroy_notify_event_t* event) {
   struct sl_window* window;
+  TRACE_EVENT("x11");
+
+  // Nobody is left to receive the rest of the data.
+  sl_cancel_selection_transfers(ctx, event->window);
 
   if (sl_is_our_window(ctx, event->window))
     return;
@@ -1555,6 +2303,7 @@ static void sl_handle_destroy_notify(struct sl_context* ctx,
 static void sl_handle_reparent_notify(struct sl_context* ctx,
                                       xcb_reparent_notify_event_t* event) {
   struct sl_window* window;
+  TRACE_EVENT("x11");
 
   if (event->parent == ctx->screen->root) {
     int width = 1;
@@ -1606,62 +2355,187 @@ static void sl_decode_wm_class(struct sl_window* window,
   }
 }
 
-static void sl_handle_map_request(struct sl_context* ctx,
-                                  xcb_map_request_event_t* event) {
-  struct sl_window* window = sl_lookup_window(ctx, event->window);
-  struct {
-    int type;
-    xcb_atom_t atom;
-  } properties[] = {
-      {PROPERTY_WM_NAME, XCB_ATOM_WM_NAME},
-      {PROPERTY_WM_CLASS, XCB_ATOM_WM_CLASS},
-      {PROPERTY_WM_TRANSIENT_FOR, XCB_ATOM_WM_TRANSIENT_FOR},
-      {PROPERTY_WM_NORMAL_HINTS, XCB_ATOM_WM_NORMAL_HINTS},
-      {PROPERTY_WM_CLIENT_LEADER, ctx->atoms[ATOM_WM_CLIENT_LEADER].value},
-      {PROPERTY_WM_PROTOCOLS, ctx->atoms[ATOM_WM_PROTOCOLS].value},
-      {PROPERTY_MOTIF_WM_HINTS, ctx->atoms[ATOM_MOTIF_WM_HINTS].value},
-      {PROPERTY_NET_STARTUP_ID, ctx->atoms[ATOM_NET_STARTUP_ID].value},
-      {PROPERTY_NET_WM_STATE, ctx->atoms[ATOM_NET_WM_STATE].value},
-      {PROPERTY_GTK_THEME_VARIANT, ctx->atoms[ATOM_GTK_THEME_VARIANT].value},
-  };
-  xcb_get_geometry_cookie_t geometry_cookie;
-  xcb_get_property_cookie_t property_cookies[ARRAY_SIZE(properties)];
-  struct sl_wm_size_hints size_hints = {0};
-  struct sl_mwm_hints mwm_hints = {0};
-  xcb_atom_t* reply_atoms;
-  bool maximize_h = false, maximize_v = false;
-  uint32_t values[5];
-  int i;
+// Runs |func| once the reply to the request with |sequence| is received.
+// Handlers are queued in request order and dispatched from the X connection
+// handler so that the event loop never blocks on the X server.
+static void sl_add_x_reply_handler(struct sl_context* ctx,
+                                   unsigned int sequence,
+                                   sl_x_reply_func_t func,
+                                   void* data) {
+  struct sl_x_reply_handler* handler;
+
+  handler = sl_free_list_alloc(&sl_x_reply_handler_free_list);
+  handler->sequence = sequence;
+  handler->func = func;
+  handler->data = data;
+  wl_list_insert(ctx->x_reply_handlers.prev, &handler->link);
+}
 
-  if (!window)
-    return;
+// Dispatches handlers whose replies have been received. If |event| is set,
+// only replies that the server sent before |event| are dispatched so that
+// replies and events are handled in the order they were generated.
+static void sl_dispatch_x_replies(struct sl_context* ctx,
+                                  xcb_generic_event_t* event) {
+  while (!wl_list_empty(&ctx->x_reply_handlers)) {
+    struct sl_x_reply_handler* handler =
+        wl_container_of(ctx->x_reply_handlers.next, handler, link);
+    xcb_generic_error_t* error = NULL;
+    void* reply = NULL;
+
+    if (event && (int32_t)(handler->sequence - event->full_sequence) > 0)
+      break;
 
-  if (sl_is_our_window(ctx, event->window))
-    return;
+    if (!xcb_poll_for_reply(ctx->connection, handler->sequence, &reply,
+                            &error))
+      break;
 
-  window->managed = 1;
-  if (window->frame_id == XCB_WINDOW_NONE)
-    geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
+    wl_list_remove(&handler->link);
+    free(error);
+    handler->func(ctx, reply, handler->data);
+    free(reply);
+    sl_free_list_free(&sl_x_reply_handler_free_list, handler);
+  }
+}
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
-    property_cookies[i] =
-        xcb_get_property(ctx->connection, 0, window->id, properties[i].atom,
-                         XCB_ATOM_ANY, 0, 2048);
+static void sl_map_request_finish(struct sl_context* ctx,
+                                  struct sl_window* window,
+                                  struct sl_map_request* request) {
+  struct sl_wm_size_hints* size_hints = &request->size_hints;
+  uint32_t values[5];
+
+  window->size_flags |= size_hints->flags & (P_MIN_SIZE | P_MAX_SIZE);
+  if (window->size_flags & P_MIN_SIZE) {
+    window->min_width = size_hints->min_width;
+    window->min_height = size_hints->min_height;
+  }
+  if (window->size_flags & P_MAX_SIZE) {
+    window->max_width = size_hints->max_width;
+    window->max_height = size_hints->max_height;
   }
 
+  window->border_width = 0;
+  sl_adjust_window_size_for_screen_size(window);
+  if (!(window->size_flags & (US_POSITION | P_POSITION)))
+    sl_adjust_window_position_for_screen_size(window);
+
+  values[0] = window->width;
+  values[1] = window->height;
+  values[2] = 0;
+  xcb_configure_window(ctx->connection, window->id,
+                       XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT |
+                           XCB_CONFIG_WINDOW_BORDER_WIDTH,
+                       values);
+  // This needs to match the frame extents of the X11 frame window used
+  // for reparenting or applications tend to be confused. The actual window
+  // frame size used by the host compositor can be different.
+  values[0] = 0;
+  values[1] = 0;
+  values[2] = 0;
+  values[3] = 0;
+  xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE, window->id,
+                      ctx->atoms[ATOM_NET_FRAME_EXTENTS].value,
+                      XCB_ATOM_CARDINAL, 32, 4, values);
+
+  // Remove weird gravities.
+  values[0] = XCB_GRAVITY_NORTH_WEST;
+  xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_WIN_GRAVITY,
+                               values);
+
   if (window->frame_id == XCB_WINDOW_NONE) {
-    xcb_get_geometry_reply_t* geometry_reply =
-        xcb_get_geometry_reply(ctx->connection, geometry_cookie, NULL);
-    if (geometry_reply) {
+    int depth = window->depth ? window->depth : ctx->screen->root_depth;
+
+    values[0] = ctx->screen->black_pixel;
+    values[1] = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
+                XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
+    values[2] = ctx->colormaps[depth];
+
+    sl_window_set_frame_id(window, xcb_generate_id(ctx->connection));
+    xcb_create_window(
+        ctx->connection, depth, window->frame_id, ctx->screen->root, window->x,
+        window->y, window->width, window->height, 0,
+        XCB_WINDOW_CLASS_INPUT_OUTPUT, ctx->visual_ids[depth],
+        XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP, values);
+    values[0] = XCB_STACK_MODE_BELOW;
+    xcb_configure_window(ctx->connection, window->frame_id,
+                         XCB_CONFIG_WINDOW_STACK_MODE, values);
+    xcb_reparent_window(ctx->connection, window->id, window->frame_id, 0, 0);
+  } else {
+    values[0] = window->x;
+    values[1] = window->y;
+    values[2] = window->width;
+    values[3] = window->height;
+    values[4] = XCB_STACK_MODE_BELOW;
+    xcb_configure_window(
+        ctx->connection, window->frame_id,
+        XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
+            XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_STACK_MODE,
+        values);
+  }
+
+  sl_window_set_wm_state(window, WM_STATE_NORMAL);
+  sl_send_configure_notify(window);
+
+  xcb_map_window(ctx->connection, window->id);
+  xcb_map_window(ctx->connection, window->frame_id);
+}
+
+static void sl_handle_map_request_startup_id(struct sl_context* ctx,
+                                             void* reply,
+                                             void* data) {
+  struct sl_map_request* request = data;
+  struct sl_window* window = sl_lookup_window(ctx, request->window);
+  xcb_get_property_reply_t* property_reply = reply;
+
+  if (window) {
+    if (property_reply && property_reply->type != XCB_ATOM_NONE) {
+      window->startup_id =
+          strndup(xcb_get_property_value(property_reply),
+                  xcb_get_property_value_length(property_reply));
+    }
+    sl_map_request_finish(ctx, window, request);
+  }
+  free(request);
+}
+
+// Called once the last property reply has been received. Earlier replies
+// have already been queued by then so collecting them does not block.
+static void sl_handle_map_request_properties(struct sl_context* ctx,
+                                             void* last_reply,
+                                             void* data) {
+  struct sl_map_request* request = data;
+  struct sl_window* window = sl_lookup_window(ctx, request->window);
+  struct sl_wm_size_hints* size_hints = &request->size_hints;
+  struct sl_mwm_hints mwm_hints = {0};
+  xcb_atom_t* reply_atoms;
+  bool maximize_h = false, maximize_v = false;
+  int i, j;
+
+  if (!window) {
+    if (request->has_geometry)
+      xcb_discard_reply(ctx->connection, request->geometry_cookie.sequence);
+    for (i = 0; i < PROPERTY_COUNT - 1; ++i) {
+      xcb_discard_reply(ctx->connection,
+                        request->property_cookies[i].sequence);
+    }
+    free(request);
+    return;
+  }
+
+  if (request->has_geometry) {
+    xcb_get_geometry_reply_t* geometry_reply = xcb_get_geometry_reply(
+        ctx->connection, request->geometry_cookie, NULL);
+    // Another map request may have created the frame in the meantime.
+    if (geometry_reply && window->frame_id == XCB_WINDOW_NONE) {
       window->x = geometry_reply->x;
       window->y = geometry_reply->y;
       window->width = geometry_reply->width;
       window->height = geometry_reply->height;
       window->depth = geometry_reply->depth;
-      free(geometry_reply);
     }
+    free(geometry_reply);
   }
 
+  window->managed = 1;
   free(window->name);
   window->name = NULL;
   free(window->clazz);
@@ -1674,19 +2548,20 @@ static void sl_handle_map_request(struct sl_context* ctx,
   window->size_flags = 0;
   window->dark_frame = 0;
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
+  for (i = 0; i < PROPERTY_COUNT; ++i) {
     xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, property_cookies[i], NULL);
-
-    if (!reply)
-      continue;
+        i == PROPERTY_COUNT - 1
+            ? last_reply
+            : xcb_get_property_reply(ctx->connection,
+                                     request->property_cookies[i], NULL);
 
-    if (reply->type == XCB_ATOM_NONE) {
-      free(reply);
+    if (!reply || reply->type == XCB_ATOM_NONE) {
+      if (reply != last_reply)
+        free(reply);
       continue;
     }
 
-    switch (properties[i].type) {
+    switch (i) {
       case PROPERTY_WM_NAME:
         window->name = strndup(xcb_get_property_value(reply),
                                xcb_get_property_value_length(reply));
@@ -1699,9 +2574,9 @@ static void sl_handle_map_request(struct sl_context* ctx,
           window->transient_for = *((uint32_t*)xcb_get_property_value(reply));
         break;
       case PROPERTY_WM_NORMAL_HINTS:
-        if (xcb_get_property_value_length(reply) >= sizeof(size_hints))
-          memcpy(&size_hints, xcb_get_property_value(reply),
-                 sizeof(size_hints));
+        if (xcb_get_property_value_length(reply) >= sizeof(*size_hints))
+          memcpy(size_hints, xcb_get_property_value(reply),
+                 sizeof(*size_hints));
         break;
       case PROPERTY_WM_CLIENT_LEADER:
         if (xcb_get_property_value_length(reply) >= 4)
@@ -1709,10 +2584,10 @@ static void sl_handle_map_request(struct sl_context* ctx,
         break;
       case PROPERTY_WM_PROTOCOLS:
         reply_atoms = xcb_get_property_value(reply);
-        for (i = 0;
-             i < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
-             ++i) {
-          if (reply_atoms[i] == ctx->atoms[ATOM_WM_TAKE_FOCUS].value)
+        for (j = 0;
+             j < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+             ++j) {
+          if (reply_atoms[j] == ctx->atoms[ATOM_WM_TAKE_FOCUS].value)
             window->focus_model_take_focus = 1;
         }
         break;
@@ -1726,13 +2601,13 @@ static void sl_handle_map_request(struct sl_context* ctx,
         break;
       case PROPERTY_NET_WM_STATE:
         reply_atoms = xcb_get_property_value(reply);
-        for (i = 0;
-             i < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
-             ++i) {
-          if (reply_atoms[i] ==
+        for (j = 0;
+             j < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+             ++j) {
+          if (reply_atoms[j] ==
               ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_HORZ].value) {
             maximize_h = true;
-          } else if (reply_atoms[i] ==
+          } else if (reply_atoms[j] ==
                      ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_VERT].value) {
             maximize_v = true;
           }
@@ -1749,7 +2624,8 @@ static void sl_handle_map_request(struct sl_context* ctx,
       default:
         break;
     }
-    free(reply);
+    if (reply != last_reply)
+      free(reply);
   }
 
   if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
@@ -1761,99 +2637,66 @@ static void sl_handle_map_request(struct sl_context* ctx,
 
   // Allow user/program controlled position for transients.
   if (window->transient_for)
-    window->size_flags |= size_hints.flags & (US_POSITION | P_POSITION);
+    window->size_flags |= size_hints->flags & (US_POSITION | P_POSITION);
 
   // If startup ID is not set, then try the client leader window.
   if (!window->startup_id && window->client_leader) {
-    xcb_get_property_reply_t* reply = xcb_get_property_reply(
-        ctx->connection,
-        xcb_get_property(ctx->connection, 0, window->client_leader,
-                         ctx->atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_ANY, 0,
-                         2048),
-        NULL);
-    if (reply) {
-      if (reply->type != XCB_ATOM_NONE) {
-        window->startup_id = strndup(xcb_get_property_value(reply),
-                                     xcb_get_property_value_length(reply));
-      }
-      free(reply);
-    }
-  }
-
-  window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
-  if (window->size_flags & P_MIN_SIZE) {
-    window->min_width = size_hints.min_width;
-    window->min_height = size_hints.min_height;
-  }
-  if (window->size_flags & P_MAX_SIZE) {
-    window->max_width = size_hints.max_width;
-    window->max_height = size_hints.max_height;
+    xcb_get_property_cookie_t cookie = xcb_get_property(
+        ctx->connection, 0, window->client_leader,
+        ctx->atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_ANY, 0, 2048);
+    sl_add_x_reply_handler(ctx, cookie.sequence,
+                           sl_handle_map_request_startup_id, request);
+    return;
   }
 
-  window->border_width = 0;
-  sl_adjust_window_size_for_screen_size(window);
-  if (!(window->size_flags & (US_POSITION | P_POSITION)))
-    sl_adjust_window_position_for_screen_size(window);
-
-  values[0] = window->width;
-  values[1] = window->height;
-  values[2] = 0;
-  xcb_configure_window(ctx->connection, window->id,
-                       XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT |
-                           XCB_CONFIG_WINDOW_BORDER_WIDTH,
-                       values);
-  // This needs to match the frame extents of the X11 frame window used
-  // for reparenting or applications tend to be confused. The actual window
-  // frame size used by the host compositor can be different.
-  values[0] = 0;
-  values[1] = 0;
-  values[2] = 0;
-  values[3] = 0;
-  xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE, window->id,
-                      ctx->atoms[ATOM_NET_FRAME_EXTENTS].value,
-                      XCB_ATOM_CARDINAL, 32, 4, values);
+  sl_map_request_finish(ctx, window, request);
+  free(request);
+}
 
-  // Remove weird gravities.
-  values[0] = XCB_GRAVITY_NORTH_WEST;
-  xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_WIN_GRAVITY,
-                               values);
+static void sl_handle_map_request(struct sl_context* ctx,
+                                  xcb_map_request_event_t* event) {
+  struct sl_window* window = sl_lookup_window(ctx, event->window);
+  const xcb_atom_t property_atoms[PROPERTY_COUNT] = {
+      [PROPERTY_WM_NAME] = XCB_ATOM_WM_NAME,
+      [PROPERTY_WM_CLASS] = XCB_ATOM_WM_CLASS,
+      [PROPERTY_WM_TRANSIENT_FOR] = XCB_ATOM_WM_TRANSIENT_FOR,
+      [PROPERTY_WM_NORMAL_HINTS] = XCB_ATOM_WM_NORMAL_HINTS,
+      [PROPERTY_WM_CLIENT_LEADER] = ctx->atoms[ATOM_WM_CLIENT_LEADER].value,
+      [PROPERTY_WM_PROTOCOLS] = ctx->atoms[ATOM_WM_PROTOCOLS].value,
+      [PROPERTY_MOTIF_WM_HINTS] = ctx->atoms[ATOM_MOTIF_WM_HINTS].value,
+      [PROPERTY_NET_STARTUP_ID] = ctx->atoms[ATOM_NET_STARTUP_ID].value,
+      [PROPERTY_NET_WM_STATE] = ctx->atoms[ATOM_NET_WM_STATE].value,
+      [PROPERTY_GTK_THEME_VARIANT] = ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
+  };
+  struct sl_map_request* request;
+  int i;
+  TRACE_EVENT("x11");
 
-  if (window->frame_id == XCB_WINDOW_NONE) {
-    int depth = window->depth ? window->depth : ctx->screen->root_depth;
+  if (!window)
+    return;
 
-    values[0] = ctx->screen->black_pixel;
-    values[1] = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
-                XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
-    values[2] = ctx->colormaps[depth];
+  if (sl_is_our_window(ctx, event->window))
+    return;
 
-    window->frame_id = xcb_generate_id(ctx->connection);
-    xcb_create_window(
-        ctx->connection, depth, window->frame_id, ctx->screen->root, window->x,
-        window->y, window->width, window->height, 0,
-        XCB_WINDOW_CLASS_INPUT_OUTPUT, ctx->visual_ids[depth],
-        XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP, values);
-    values[0] = XCB_STACK_MODE_BELOW;
-    xcb_configure_window(ctx->connection, window->frame_id,
-                         XCB_CONFIG_WINDOW_STACK_MODE, values);
-    xcb_reparent_window(ctx->connection, window->id, window->frame_id, 0, 0);
-  } else {
-    values[0] = window->x;
-    values[1] = window->y;
-    values[2] = window->width;
-    values[3] = window->height;
-    values[4] = XCB_STACK_MODE_BELOW;
-    xcb_configure_window(
-        ctx->connection, window->frame_id,
-        XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-            XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_STACK_MODE,
-        values);
+  // Send all requests up front and finish mapping the window when the
+  // replies arrive. Other windows are processed in the meantime.
+  request = malloc(sizeof(*request));
+  assert(request);
+  memset(request, 0, sizeof(*request));
+  request->window = window->id;
+  request->has_geometry = window->frame_id == XCB_WINDOW_NONE;
+  if (request->has_geometry)
+    request->geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
+
+  for (i = 0; i < PROPERTY_COUNT; ++i) {
+    request->property_cookies[i] =
+        xcb_get_property(ctx->connection, 0, window->id, property_atoms[i],
+                         XCB_ATOM_ANY, 0, 2048);
   }
 
-  sl_window_set_wm_state(window, WM_STATE_NORMAL);
-  sl_send_configure_notify(window);
-
-  xcb_map_window(ctx->connection, window->id);
-  xcb_map_window(ctx->connection, window->frame_id);
+  sl_add_x_reply_handler(ctx,
+                         request->property_cookies[PROPERTY_COUNT - 1].sequence,
+                         sl_handle_map_request_properties, request);
 }
 
 static void sl_handle_map_notify(struct sl_context* ctx,
@@ -1862,6 +2705,7 @@ static void sl_handle_map_notify(struct sl_context* ctx,
 static void sl_handle_unmap_notify(struct sl_context* ctx,
                                    xcb_unmap_notify_event_t* event) {
   struct sl_window* window;
+  TRACE_EVENT("x11");
 
   if (sl_is_our_window(ctx, event->window))
     return;
@@ -1879,7 +2723,7 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
   }
 
   if (window->host_surface_id) {
-    window->host_surface_id = 0;
+    sl_window_set_host_surface_id(window, 0);
     sl_window_update(window);
   }
 
@@ -1890,7 +2734,7 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
     xcb_reparent_window(ctx->connection, window->id, ctx->screen->root,
                         window->x, window->y);
     xcb_destroy_window(ctx->connection, window->frame_id);
-    window->frame_id = XCB_WINDOW_NONE;
+    sl_window_set_frame_id(window, XCB_WINDOW_NONE);
   }
 
   // Reset properties to unmanaged state in case the window transitions to
@@ -1906,6 +2750,7 @@ static void sl_handle_configure_request(struct sl_context* ctx,
   int width = window->width;
   int height = window->height;
   uint32_t values[7];
+  TRACE_EVENT("x11");
 
   if (sl_is_our_window(ctx, event->window))
     return;
@@ -1966,7 +2811,7 @@ static void sl_handle_configure_request(struct sl_context* ctx,
 
   sl_adjust_window_size_for_screen_size(window);
   if (window->size_flags & (US_POSITION | P_POSITION))
-    sl_window_update(window);
+    sl_window_schedule_update(window);
   else
     sl_adjust_window_position_for_screen_size(window);
 
@@ -1998,6 +2843,7 @@ static void sl_handle_configure_request(struct sl_context* ctx,
 static void sl_handle_configure_notify(struct sl_context* ctx,
                                        xcb_configure_notify_event_t* event) {
   struct sl_window* window;
+  TRACE_EVENT("x11");
 
   if (sl_is_our_window(ctx, event->window))
     return;
@@ -2059,7 +2905,7 @@ static void sl_handle_configure_notify(struct sl_context* ctx,
   if (event->x != window->x || event->y != window->y) {
     window->x = event->x;
     window->y = event->y;
-    sl_window_update(window);
+    sl_window_schedule_update(window);
   }
 }
 
@@ -2101,19 +2947,14 @@ static void sl_request_attention(struct sl_context* ctx,
 
 static void sl_handle_client_message(struct sl_context* ctx,
                                      xcb_client_message_event_t* event) {
-  if (event->type == ctx->atoms[ATOM_WL_SURFACE_ID].value) {
-    struct sl_window *window, *unpaired_window = NULL;
+  TRACE_EVENT("x11");
 
-    wl_list_for_each(window, &ctx->unpaired_windows, link) {
-      if (sl_is_window(window, event->window)) {
-        unpaired_window = window;
-        break;
-      }
-    }
+  if (event->type == ctx->atoms[ATOM_WL_SURFACE_ID].value) {
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
 
-    if (unpaired_window) {
-      unpaired_window->host_surface_id = event->data.data32[0];
-      sl_window_update(unpaired_window);
+    if (window && window->unpaired) {
+      sl_window_set_host_surface_id(window, event->data.data32[0]);
+      sl_window_update(window);
     }
   } else if (event->type == ctx->atoms[ATOM_NET_ACTIVE_WINDOW].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
@@ -2181,6 +3022,8 @@ static void sl_handle_client_message(struct sl_context* ctx,
 static void sl_handle_focus_in(struct sl_context* ctx,
                                xcb_focus_in_event_t* event) {
   struct sl_window* window = sl_lookup_window(ctx, event->event);
+  TRACE_EVENT("x11");
+
   if (window && window->transient_for != XCB_WINDOW_NONE) {
     // Set our parent now as it might not have been set properly when the
     // window was realized.
@@ -2193,22 +3036,29 @@ static void sl_handle_focus_in(struct sl_context* ctx,
 static void sl_handle_focus_out(struct sl_context* ctx,
                                 xcb_focus_out_event_t* event) {}
 
+// Starts converting the selection to |atom|. The atom is interned first if
+// it wasn't found in the atom cache.
 int sl_begin_data_source_send(struct sl_context* ctx,
                               int fd,
+                              xcb_atom_t atom,
                               xcb_intern_atom_cookie_t cookie,
                               struct sl_data_source* data_source) {
-  xcb_intern_atom_reply_t* reply =
-      xcb_intern_atom_reply(ctx->connection, cookie, NULL);
+  int flags, rv;
 
-  if (!reply) {
-    close(fd);
-    return 0;
-  }
+  if (atom == XCB_ATOM_NONE) {
+    xcb_intern_atom_reply_t* reply =
+        xcb_intern_atom_reply(ctx->connection, cookie, NULL);
 
-  int flags, rv;
+    if (!reply) {
+      close(fd);
+      return 0;
+    }
+    atom = reply->atom;
+    free(reply);
+  }
 
   xcb_convert_selection(ctx->connection, ctx->selection_window,
-                        ctx->atoms[ATOM_CLIPBOARD].value, reply->atom,
+                        ctx->atoms[ATOM_CLIPBOARD].value, atom,
                         ctx->atoms[ATOM_WL_SELECTION].value, XCB_CURRENT_TIME);
 
   flags = fcntl(fd, F_GETFL, 0);
@@ -2216,7 +3066,6 @@ int sl_begin_data_source_send(struct sl_context* ctx,
   errno_assert(!rv);
 
   ctx->selection_data_source_send_fd = fd;
-  free(reply);
   return 1;
 }
 
@@ -2227,14 +3076,16 @@ void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
     request = wl_container_of(next, request, link);
     wl_list_remove(next);
 
-    int rv = sl_begin_data_source_send(ctx, request->fd, request->cookie,
-                                       request->data_source);
-    free(request);
+    int rv = sl_begin_data_source_send(ctx, request->fd, request->atom,
+                                       request->cookie, request->data_source);
+    sl_free_list_free(&sl_data_source_send_request_free_list, request);
     if (rv)
       break;
   }
 }
 
+static void sl_get_selection_chunk(struct sl_context* ctx);
+
 static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = data;
   uint8_t* value;
@@ -2250,10 +3101,9 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
     close(fd);
     fd = -1;
   } else if (bytes == bytes_left) {
-    if (ctx->selection_incremental_transfer) {
-      xcb_delete_property(ctx->connection, ctx->selection_window,
-                          ctx->atoms[ATOM_WL_SELECTION].value);
-    } else {
+    // Incremental chunks are deleted when fetched, so there is nothing to
+    // acknowledge here.
+    if (!ctx->selection_incremental_transfer) {
       close(fd);
       fd = -1;
     }
@@ -2271,6 +3121,9 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
   if (fd < 0) {
     ctx->selection_data_source_send_fd = -1;
     sl_process_data_source_send_pending_list(ctx);
+  } else if (ctx->selection_property_pending) {
+    ctx->selection_property_pending = 0;
+    sl_get_selection_chunk(ctx);
   }
   return 1;
 }
@@ -2292,111 +3145,232 @@ static void sl_write_selection_property(struct sl_context* ctx,
       sl_handle_selection_fd_writable, ctx);
 }
 
-static void sl_send_selection_notify(struct sl_context* ctx,
-                                     xcb_atom_t property) {
+static void sl_handle_selection_chunk(struct sl_context* ctx,
+                                      void* reply,
+                                      void* data) {
+  xcb_get_property_reply_t* property_reply = reply;
+
+  ctx->selection_property_requested = 0;
+
+  // The transfer may have been dropped while the chunk was fetched.
+  if (!property_reply || !ctx->selection_incremental_transfer ||
+      ctx->selection_data_source_send_fd < 0)
+    return;
+
+  if (xcb_get_property_value_length(property_reply) > 0) {
+    // |reply| is freed after this call but the chunk may not be written out
+    // right away.
+    size_t size = sizeof(*property_reply) + property_reply->length * 4;
+    xcb_get_property_reply_t* chunk = malloc(size);
+
+    assert(chunk);
+    memcpy(chunk, property_reply, size);
+    sl_write_selection_property(ctx, chunk);
+  } else {
+    assert(!ctx->selection_send_event_source);
+    close(ctx->selection_data_source_send_fd);
+    ctx->selection_data_source_send_fd = -1;
+
+    sl_process_data_source_send_pending_list(ctx);
+  }
+}
+
+// Fetches the next chunk of an incremental transfer from the selection
+// owner. The property is deleted right away so that the owner can prepare
+// the following chunk while this one is written out.
+static void sl_get_selection_chunk(struct sl_context* ctx) {
+  xcb_get_property_cookie_t cookie = xcb_get_property(
+      ctx->connection, 1, ctx->selection_window,
+      ctx->atoms[ATOM_WL_SELECTION].value, XCB_GET_PROPERTY_TYPE_ANY, 0,
+      0x1fffffff);
+
+  ctx->selection_property_requested = 1;
+  sl_add_x_reply_handler(ctx, cookie.sequence, sl_handle_selection_chunk,
+                         NULL);
+}
+
+static void sl_send_selection_notify(
+    struct sl_context* ctx,
+    const xcb_selection_request_event_t* request,
+    xcb_atom_t property) {
   xcb_selection_notify_event_t event = {
       .response_type = XCB_SELECTION_NOTIFY,
       .sequence = 0,
-      .time = ctx->selection_request.time,
-      .requestor = ctx->selection_request.requestor,
-      .selection = ctx->selection_request.selection,
-      .target = ctx->selection_request.target,
+      .time = request->time,
+      .requestor = request->requestor,
+      .selection = request->selection,
+      .target = request->target,
       .property = property,
       .pad0 = 0};
 
-  xcb_send_event(ctx->connection, 0, ctx->selection_request.requestor,
+  xcb_send_event(ctx->connection, 0, request->requestor,
                  XCB_EVENT_MASK_NO_EVENT, (char*)&event);
 }
 
-static void sl_send_selection_data(struct sl_context* ctx) {
-  assert(!ctx->selection_data_ack_pending);
-  xcb_change_property(
-      ctx->connection, XCB_PROP_MODE_REPLACE, ctx->selection_request.requestor,
-      ctx->selection_request.property, ctx->selection_data_type,
-      /*format=*/8, ctx->selection_data.size, ctx->selection_data.data);
-  ctx->selection_data_ack_pending = 1;
-  ctx->selection_data.size = 0;
+// Transfer of the Wayland selection to an X requestor. Each requestor gets
+// its own transfer, and at most one chunk is buffered per transfer.
+struct sl_selection_transfer {
+  struct sl_context* ctx;
+  xcb_selection_request_event_t request;
+  xcb_atom_t data_type;
+  int fd;
+  struct wl_event_source* event_source;
+  struct wl_array data;
+  int incremental;
+  int ack_pending;
+  struct wl_list link;
+};
+
+static void sl_selection_transfer_destroy(
+    struct sl_selection_transfer* transfer) {
+  if (transfer->event_source)
+    wl_event_source_remove(transfer->event_source);
+  if (transfer->fd >= 0)
+    close(transfer->fd);
+  wl_list_remove(&transfer->link);
+
+  // Keep the chunk buffer for the next transfer.
+  wl_list_insert(&transfer->ctx->free_selection_transfers, &transfer->link);
 }
 
-static const uint32_t sl_incr_chunk_size = 64 * 1024;
+// Drops the transfers to |requestor|, or all transfers if |requestor| is
+// XCB_WINDOW_NONE. Requestors still waiting for a reply are told that the
+// conversion failed.
+static void sl_cancel_selection_transfers(struct sl_context* ctx,
+                                          xcb_window_t requestor) {
+  struct sl_selection_transfer* transfer;
+  struct sl_selection_transfer* next;
+
+  wl_list_for_each_safe(transfer, next, &ctx->selection_transfers, link) {
+    if (requestor != XCB_WINDOW_NONE &&
+        transfer->request.requestor != requestor)
+      continue;
 
-static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = data;
-  int bytes, offset, bytes_left;
-  void* p;
+    if (requestor == XCB_WINDOW_NONE && !transfer->incremental)
+      sl_send_selection_notify(ctx, &transfer->request, XCB_ATOM_NONE);
+    sl_selection_transfer_destroy(transfer);
+  }
+}
 
-  offset = ctx->selection_data.size;
-  if (ctx->selection_data.size < sl_incr_chunk_size)
-    p = wl_array_add(&ctx->selection_data, sl_incr_chunk_size);
-  else
-    p = (char*)ctx->selection_data.data + ctx->selection_data.size;
-  bytes_left = ctx->selection_data.alloc - offset;
+static void sl_selection_transfer_send_data(
+    struct sl_selection_transfer* transfer) {
+  struct sl_context* ctx = transfer->ctx;
 
-  bytes = read(fd, p, bytes_left);
-  if (bytes == -1) {
-    fprintf(stderr, "read error from data source: %m\n");
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-    ctx->selection_data_offer_receive_fd = -1;
-    close(fd);
-  } else {
-    ctx->selection_data.size = offset + bytes;
-    if (ctx->selection_data.size >= sl_incr_chunk_size) {
-      if (!ctx->selection_incremental_transfer) {
-        ctx->selection_incremental_transfer = 1;
-        xcb_change_property(
-            ctx->connection, XCB_PROP_MODE_REPLACE,
-            ctx->selection_request.requestor, ctx->selection_request.property,
-            ctx->atoms[ATOM_INCR].value, 32, 1, &sl_incr_chunk_size);
-        ctx->selection_data_ack_pending = 1;
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-      } else if (!ctx->selection_data_ack_pending) {
-        sl_send_selection_data(ctx);
-      }
-    } else if (bytes == 0) {
-      if (!ctx->selection_data_ack_pending)
-        sl_send_selection_data(ctx);
-      if (!ctx->selection_incremental_transfer) {
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
-      }
-      xcb_flush(ctx->connection);
-      ctx->selection_data_offer_receive_fd = -1;
-      close(fd);
-    } else {
-      ctx->selection_data.size = offset + bytes;
-      return 1;
-    }
+  assert(!transfer->ack_pending);
+  xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
+                      transfer->request.requestor, transfer->request.property,
+                      transfer->data_type,
+                      /*format=*/8, transfer->data.size, transfer->data.data);
+  transfer->ack_pending = 1;
+  transfer->data.size = 0;
+}
+
+// Sends the next chunk of an incremental transfer once the requestor has
+// deleted the previous one. Returns 0 if the transfer is complete and has
+// been destroyed.
+static int sl_selection_transfer_flush(struct sl_selection_transfer* transfer) {
+  if (!transfer->incremental || transfer->ack_pending)
+    return 1;
+
+  if (transfer->data.size) {
+    sl_selection_transfer_send_data(transfer);
+    return 1;
+  }
+
+  // A zero-length chunk ends the transfer.
+  if (transfer->fd < 0) {
+    sl_selection_transfer_send_data(transfer);
+    sl_selection_transfer_destroy(transfer);
+    return 0;
   }
 
-  wl_event_source_remove(ctx->selection_event_source);
-  ctx->selection_event_source = NULL;
   return 1;
 }
 
-static void sl_handle_property_notify(struct sl_context* ctx,
-                                      xcb_property_notify_event_t* event) {
-  if (event->atom == XCB_ATOM_WM_NAME) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
+static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data);
+
+// Keeps reading from the data source while there is room in the chunk
+// buffer, which lets reading overlap with the requestor consuming the
+// previous chunk.
+static void sl_selection_transfer_update(
+    struct sl_selection_transfer* transfer) {
+  int readable = transfer->fd >= 0 &&
+                 transfer->data.size < transfer->ctx->selection_chunk_size;
+
+  if (readable && !transfer->event_source) {
+    transfer->event_source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(transfer->ctx->host_display), transfer->fd,
+        WL_EVENT_READABLE, sl_handle_selection_fd_readable, transfer);
+  } else if (!readable && transfer->event_source) {
+    wl_event_source_remove(transfer->event_source);
+    transfer->event_source = NULL;
+  }
+}
+
+static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
+  struct sl_selection_transfer* transfer = data;
+  struct sl_context* ctx = transfer->ctx;
+  uint32_t chunk_size = ctx->selection_chunk_size;
+  int bytes;
+
+  bytes = read(fd, (char*)transfer->data.data + transfer->data.size,
+               chunk_size - transfer->data.size);
+  if (bytes == -1) {
+    if (errno == EAGAIN)
+      return 1;
+
+    fprintf(stderr, "read error from data source: %m\n");
+    if (!transfer->incremental)
+      sl_send_selection_notify(ctx, &transfer->request, XCB_ATOM_NONE);
+    sl_selection_transfer_destroy(transfer);
+    return 1;
+  }
 
+  if (bytes == 0) {
+    close(transfer->fd);
+    transfer->fd = -1;
+
+    if (!transfer->incremental) {
+      sl_selection_transfer_send_data(transfer);
+      sl_send_selection_notify(ctx, &transfer->request,
+                               transfer->request.property);
+      sl_selection_transfer_destroy(transfer);
+      return 1;
+    }
+  } else {
+    transfer->data.size += bytes;
+    if (transfer->data.size >= chunk_size && !transfer->incremental) {
+      transfer->incremental = 1;
+      xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
+                          transfer->request.requestor,
+                          transfer->request.property,
+                          ctx->atoms[ATOM_INCR].value, 32, 1, &chunk_size);
+      transfer->ack_pending = 1;
+      sl_send_selection_notify(ctx, &transfer->request,
+                               transfer->request.property);
+    }
+  }
+
+  if (sl_selection_transfer_flush(transfer))
+    sl_selection_transfer_update(transfer);
+  return 1;
+}
+
+// Applies a window property fetched after a property notify event. |reply|
+// is NULL if the property was deleted or could not be fetched.
+static void sl_update_window_property(struct sl_context* ctx,
+                                      struct sl_window* window,
+                                      xcb_atom_t atom,
+                                      xcb_get_property_reply_t* reply) {
+  if (atom == XCB_ATOM_WM_NAME) {
     if (window->name) {
       free(window->name);
       window->name = NULL;
     }
 
-    if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_NAME,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        window->name = strndup(xcb_get_property_value(reply),
-                               xcb_get_property_value_length(reply));
-        free(reply);
-      }
+    if (reply) {
+      window->name = strndup(xcb_get_property_value(reply),
+                             xcb_get_property_value_length(reply));
     }
 
     if (!window->xdg_toplevel)
@@ -2407,40 +3381,18 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     } else {
       xdg_toplevel_set_title(window->xdg_toplevel, "");
     }
-  } else if (event->atom == XCB_ATOM_WM_CLASS) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window || event->state == XCB_PROPERTY_DELETE)
-      return;
-
-    xcb_get_property_cookie_t cookie =
-        xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_CLASS,
-                         XCB_ATOM_ANY, 0, 2048);
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, cookie, NULL);
-    if (reply) {
+  } else if (atom == XCB_ATOM_WM_CLASS) {
+    if (reply)
       sl_decode_wm_class(window, reply);
-      free(reply);
-    }
     sl_update_application_id(ctx, window);
-  } else if (event->atom == XCB_ATOM_WM_NORMAL_HINTS) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
+  } else if (atom == XCB_ATOM_WM_NORMAL_HINTS) {
     window->size_flags &= ~(P_MIN_SIZE | P_MAX_SIZE);
 
-    if (event->state != XCB_PROPERTY_DELETE) {
+    if (reply) {
       struct sl_wm_size_hints size_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_ANY, 0,
-                           sizeof(size_hints)),
-          NULL);
-      if (reply) {
+
+      if (xcb_get_property_value_length(reply) >= sizeof(size_hints))
         memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
-        free(reply);
-      }
 
       window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
       if (window->size_flags & P_MIN_SIZE) {
@@ -2471,51 +3423,31 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     } else {
       xdg_toplevel_set_max_size(window->xdg_toplevel, 0, 0);
     }
-  } else if (event->atom == XCB_ATOM_WM_HINTS) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
-    if (event->state == XCB_PROPERTY_DELETE)
-      return;
+  } else if (atom == XCB_ATOM_WM_HINTS) {
     struct sl_wm_hints wm_hints = {0};
-    xcb_get_property_reply_t* reply = xcb_get_property_reply(
-        ctx->connection,
-        xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_HINTS,
-                         XCB_ATOM_ANY, 0, sizeof(wm_hints)),
-        NULL);
 
     if (!reply)
       return;
-    memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
-    free(reply);
+    if (xcb_get_property_value_length(reply) >= sizeof(wm_hints))
+      memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
 
     if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
       sl_request_attention(ctx, window, /*is_strong_request=*/false);
     }
-  } else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
+  } else if (atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
     // Managed windows are decorated by default.
     window->decorated = window->managed;
 
-    if (event->state != XCB_PROPERTY_DELETE) {
+    if (reply) {
       struct sl_mwm_hints mwm_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_MOTIF_WM_HINTS].value, XCB_ATOM_ANY,
-                           0, sizeof(mwm_hints)),
-          NULL);
-      if (reply) {
-        if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
-          if (mwm_hints.decorations & MWM_DECOR_ALL)
-            window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
-          else
-            window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
-        }
+
+      if (xcb_get_property_value_length(reply) >= sizeof(mwm_hints))
+        memcpy(&mwm_hints, xcb_get_property_value(reply), sizeof(mwm_hints));
+      if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
+        if (mwm_hints.decorations & MWM_DECOR_ALL)
+          window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
+        else
+          window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
       }
     }
 
@@ -2527,29 +3459,13 @@ static void sl_handle_property_notify(struct sl_context* ctx,
                             : window->depth == 32
                                 ? ZAURA_SURFACE_FRAME_TYPE_NONE
                                 : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
-  } else if (event->atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
-    struct sl_window* window;
+  } else if (atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
     uint32_t frame_color;
 
-    window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
     window->dark_frame = 0;
 
-    if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        if (xcb_get_property_value_length(reply) >= 4)
-          window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
-        free(reply);
-      }
-    }
+    if (reply && xcb_get_property_value_length(reply) >= 4)
+      window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
 
     if (!window->aura_surface)
       return;
@@ -2557,60 +3473,84 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
     zaura_surface_set_frame_colors(window->aura_surface, frame_color,
                                    frame_color);
-  } else if (event->atom == ctx->atoms[ATOM_WL_SELECTION].value) {
-    if (event->window == ctx->selection_window &&
-        event->state == XCB_PROPERTY_NEW_VALUE &&
-        ctx->selection_incremental_transfer) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, ctx->selection_window,
-                           ctx->atoms[ATOM_WL_SELECTION].value,
-                           XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
-          NULL);
-
-      if (!reply)
-        return;
+  }
+}
 
-      if (xcb_get_property_value_length(reply) > 0) {
-        sl_write_selection_property(ctx, reply);
-      } else {
-        assert(!ctx->selection_send_event_source);
-        close(ctx->selection_data_source_send_fd);
-        ctx->selection_data_source_send_fd = -1;
-        free(reply);
+static void sl_handle_property_reply(struct sl_context* ctx,
+                                     void* reply,
+                                     void* data) {
+  struct sl_property_request* request = data;
+  struct sl_window* window = sl_lookup_window(ctx, request->window);
+  xcb_get_property_reply_t* property_reply = reply;
+
+  if (property_reply && property_reply->type == XCB_ATOM_NONE)
+    property_reply = NULL;
+  if (window)
+    sl_update_window_property(ctx, window, request->atom, property_reply);
+  sl_free_list_free(&sl_property_request_free_list, request);
+}
 
-        sl_process_data_source_send_pending_list(ctx);
-      }
-    }
-  } else if (event->atom == ctx->selection_request.property) {
-    if (event->window == ctx->selection_request.requestor &&
-        event->state == XCB_PROPERTY_DELETE &&
-        ctx->selection_incremental_transfer) {
-      int data_size = ctx->selection_data.size;
-
-      ctx->selection_data_ack_pending = 0;
-
-      // Handle the case when there's more data to be received.
-      if (ctx->selection_data_offer_receive_fd >= 0) {
-        // Avoid sending empty data until transfer is complete.
-        if (data_size)
-          sl_send_selection_data(ctx);
-
-        if (!ctx->selection_event_source) {
-          ctx->selection_event_source = wl_event_loop_add_fd(
-              wl_display_get_event_loop(ctx->host_display),
-              ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-              sl_handle_selection_fd_readable, ctx);
-        }
-        return;
-      }
+static void sl_handle_property_notify(struct sl_context* ctx,
+                                      xcb_property_notify_event_t* event) {
+  TRACE_EVENT("x11");
+
+  if (event->atom == XCB_ATOM_WM_NAME || event->atom == XCB_ATOM_WM_CLASS ||
+      event->atom == XCB_ATOM_WM_NORMAL_HINTS ||
+      event->atom == XCB_ATOM_WM_HINTS ||
+      event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value ||
+      event->atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
+    struct sl_property_request* request;
+    xcb_get_property_cookie_t cookie;
+    uint32_t length = 2048;
 
-      sl_send_selection_data(ctx);
+    if (!window)
+      return;
+
+    if (event->state == XCB_PROPERTY_DELETE) {
+      if (event->atom != XCB_ATOM_WM_CLASS && event->atom != XCB_ATOM_WM_HINTS)
+        sl_update_window_property(ctx, window, event->atom, NULL);
+      return;
+    }
 
-      // Release data if transfer is complete.
-      if (!data_size) {
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
+    if (event->atom == XCB_ATOM_WM_NORMAL_HINTS)
+      length = sizeof(struct sl_wm_size_hints);
+    else if (event->atom == XCB_ATOM_WM_HINTS)
+      length = sizeof(struct sl_wm_hints);
+    else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value)
+      length = sizeof(struct sl_mwm_hints);
+
+    // The new value is applied when the reply arrives. Replies are
+    // dispatched in order with events, so a later delete cannot be undone.
+    request = sl_free_list_alloc(&sl_property_request_free_list);
+    request->window = window->id;
+    request->atom = event->atom;
+    cookie = xcb_get_property(ctx->connection, 0, window->id, event->atom,
+                              XCB_ATOM_ANY, 0, length);
+    sl_add_x_reply_handler(ctx, cookie.sequence, sl_handle_property_reply,
+                           request);
+  } else if (event->atom == ctx->atoms[ATOM_WL_SELECTION].value) {
+    if (event->window == ctx->selection_window &&
+        event->state == XCB_PROPERTY_NEW_VALUE &&
+        ctx->selection_incremental_transfer &&
+        ctx->selection_data_source_send_fd >= 0) {
+      // Fetch the chunk once the previous one has been written out.
+      if (ctx->selection_property_reply || ctx->selection_property_requested)
+        ctx->selection_property_pending = 1;
+      else
+        sl_get_selection_chunk(ctx);
+    }
+  } else if (event->state == XCB_PROPERTY_DELETE) {
+    struct sl_selection_transfer* transfer;
+
+    wl_list_for_each(transfer, &ctx->selection_transfers, link) {
+      if (transfer->request.requestor == event->window &&
+          transfer->request.property == event->atom &&
+          transfer->incremental) {
+        transfer->ack_pending = 0;
+        if (sl_selection_transfer_flush(transfer))
+          sl_selection_transfer_update(transfer);
+        break;
       }
     }
   }
@@ -2626,17 +3566,24 @@ static void sl_internal_data_source_send(void* data,
                                          int32_t fd) {
   struct sl_data_source* host = data;
   struct sl_context* ctx = host->ctx;
+  xcb_atom_t atom = sl_atom_cache_get_atom(ctx, mime_type);
+  xcb_intern_atom_cookie_t cookie = {0};
 
-  xcb_intern_atom_cookie_t cookie =
-      xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
+  // Offered types come from the names of the TARGETS atoms, which are
+  // cached, so this rarely has to wait for the X server.
+  if (atom == XCB_ATOM_NONE) {
+    cookie =
+        xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
+  }
 
   if (ctx->selection_data_source_send_fd < 0) {
-    sl_begin_data_source_send(ctx, fd, cookie, host);
+    sl_begin_data_source_send(ctx, fd, atom, cookie, host);
   } else {
     struct sl_data_source_send_request* request =
-        malloc(sizeof(struct sl_data_source_send_request));
+        sl_free_list_alloc(&sl_data_source_send_request_free_list);
 
     request->fd = fd;
+    request->atom = atom;
     request->cookie = cookie;
     request->data_source = host;
     wl_list_insert(&ctx->selection_data_source_send_pending, &request->link);
@@ -2669,75 +3616,140 @@ char* sl_copy_atom_name(xcb_get_atom_name_reply_t* reply) {
   return name;
 }
 
-static void sl_get_selection_targets(struct sl_context* ctx) {
-  struct sl_data_source* data_source = NULL;
-  xcb_get_property_reply_t* reply;
-  xcb_atom_t* value;
-  uint32_t i;
+static void sl_offer_selection_targets(struct sl_context* ctx) {
+  struct sl_data_source* data_source;
+  xcb_atom_t* atom;
 
-  reply = xcb_get_property_reply(
-      ctx->connection,
-      xcb_get_property(ctx->connection, 1, ctx->selection_window,
-                       ctx->atoms[ATOM_WL_SELECTION].value,
-                       XCB_GET_PROPERTY_TYPE_ANY, 0, 4096),
-      NULL);
-  if (!reply)
+  if (!ctx->data_device_manager)
     return;
 
-  if (reply->type != XCB_ATOM_ATOM) {
-    free(reply);
-    return;
+  data_source = malloc(sizeof(*data_source));
+  assert(data_source);
+
+  data_source->ctx = ctx;
+  data_source->internal = wl_data_device_manager_create_data_source(
+      ctx->data_device_manager->internal);
+  wl_data_source_add_listener(data_source->internal,
+                              &sl_internal_data_source_listener, data_source);
+
+  wl_array_for_each(atom, &ctx->selection_targets) {
+    const char* name = sl_atom_cache_get_name(ctx, *atom);
+
+    if (name)
+      wl_data_source_offer(data_source->internal, name);
   }
 
-  if (ctx->data_device_manager) {
-    data_source = malloc(sizeof(*data_source));
-    assert(data_source);
-
-    data_source->ctx = ctx;
-    data_source->internal = wl_data_device_manager_create_data_source(
-        ctx->data_device_manager->internal);
-    wl_data_source_add_listener(data_source->internal,
-                                &sl_internal_data_source_listener, data_source);
-
-    value = xcb_get_property_value(reply);
-
-    // We need to convert all of the offered target types from X11 atoms to
-    // strings (i.e. getting the names of the atoms). Each conversion requires a
-    // round trip to the X server, but none of the requests depend on each
-    // other. Therefore, we can speed things up by sending out all the requests
-    // as a batch with xcb_get_atom_name, and then read all the replies as a
-    // batch with xcb_get_atom_name_reply.
-    xcb_get_atom_name_cookie_t* atom_name_cookies =
-        malloc(sizeof(xcb_get_atom_name_cookie_t) * reply->value_len);
-    for (i = 0; i < reply->value_len; i++) {
-      atom_name_cookies[i] = xcb_get_atom_name(ctx->connection, value[i]);
-    }
-    for (i = 0; i < reply->value_len; i++) {
-      xcb_get_atom_name_reply_t* atom_name_reply =
-          xcb_get_atom_name_reply(ctx->connection, atom_name_cookies[i], NULL);
-      if (atom_name_reply) {
-        char* name = sl_copy_atom_name(atom_name_reply);
-        wl_data_source_offer(data_source->internal, name);
-        free(atom_name_reply);
-        free(name);
-      }
-    }
-    free(atom_name_cookies);
+  if (ctx->selection_data_device && ctx->default_seat) {
+    wl_data_device_set_selection(ctx->selection_data_device,
+                                 data_source->internal,
+                                 ctx->default_seat->seat->last_serial);
+  }
 
-    if (ctx->selection_data_device && ctx->default_seat) {
-      wl_data_device_set_selection(ctx->selection_data_device,
-                                   data_source->internal,
-                                   ctx->default_seat->seat->last_serial);
-    }
+  if (ctx->selection_data_source) {
+    wl_data_source_destroy(ctx->selection_data_source->internal);
+    free(ctx->selection_data_source);
+  }
+  ctx->selection_data_source = data_source;
+}
 
-    if (ctx->selection_data_source) {
-      wl_data_source_destroy(ctx->selection_data_source->internal);
-      free(ctx->selection_data_source);
+static void sl_handle_selection_target_names(struct sl_context* ctx,
+                                             void* last_reply,
+                                             void* data) {
+  struct sl_targets_request* request = data;
+  int i;
+
+  for (i = 0; i < request->count; i++) {
+    xcb_get_atom_name_reply_t* reply =
+        i == request->count - 1
+            ? last_reply
+            : xcb_get_atom_name_reply(ctx->connection, request->cookies[i],
+                                      NULL);
+
+    if (reply) {
+      char* name = sl_copy_atom_name(reply);
+      sl_atom_cache_add(ctx, request->atoms[i], name);
+      free(name);
+      if (reply != last_reply)
+        free(reply);
     }
-    ctx->selection_data_source = data_source;
   }
 
-  free(reply);
+  free(request->atoms);
+  free(request->cookies);
+  free(request);
+
+  sl_offer_selection_targets(ctx);
+}
+
+static void sl_handle_selection_targets(struct sl_context* ctx,
+                                        void* reply,
+                                        void* data) {
+  xcb_get_property_reply_t* property_reply = reply;
+  struct sl_targets_request* request;
+  xcb_atom_t* value;
+  uint32_t i;
+
+  if (!property_reply || property_reply->type != XCB_ATOM_ATOM) {
+    ctx->selection_targets_reused = 0;
+    return;
+  }
+
+  value = xcb_get_property_value(property_reply);
+  if (ctx->selection_targets_reused) {
+    ctx->selection_targets_reused = 0;
+    if (ctx->selection_targets.size ==
+            sizeof(xcb_atom_t) * property_reply->value_len &&
+        !memcmp(ctx->selection_targets.data, value,
+                ctx->selection_targets.size))
+      return;
+  }
+
+  ctx->selection_targets.size = 0;
+  wl_array_add(&ctx->selection_targets,
+               sizeof(xcb_atom_t) * property_reply->value_len);
+  memcpy(ctx->selection_targets.data, value,
+         sizeof(xcb_atom_t) * property_reply->value_len);
+
+  request = malloc(sizeof(*request));
+  assert(request);
+  request->count = 0;
+  request->atoms = malloc(sizeof(xcb_atom_t) * property_reply->value_len);
+  assert(request->atoms);
+  request->cookies =
+      malloc(sizeof(xcb_get_atom_name_cookie_t) * property_reply->value_len);
+  assert(request->cookies);
+
+  // Only the names of atoms that aren't in the cache have to be requested.
+  // These requests don't depend on each other, so they are sent as a batch
+  // and the replies are handled once the last one has arrived.
+  for (i = 0; i < property_reply->value_len; i++) {
+    if (sl_atom_cache_get_name(ctx, value[i]))
+      continue;
+    request->atoms[request->count] = value[i];
+    request->cookies[request->count] =
+        xcb_get_atom_name(ctx->connection, value[i]);
+    request->count++;
+  }
+
+  if (request->count) {
+    sl_add_x_reply_handler(ctx, request->cookies[request->count - 1].sequence,
+                           sl_handle_selection_target_names, request);
+    return;
+  }
+
+  free(request->atoms);
+  free(request->cookies);
+  free(request);
+  sl_offer_selection_targets(ctx);
+}
+
+static void sl_get_selection_targets(struct sl_context* ctx) {
+  xcb_get_property_cookie_t cookie = xcb_get_property(
+      ctx->connection, 1, ctx->selection_window,
+      ctx->atoms[ATOM_WL_SELECTION].value, XCB_GET_PROPERTY_TYPE_ANY, 0, 4096);
+
+  sl_add_x_reply_handler(ctx, cookie.sequence, sl_handle_selection_targets,
+                         NULL);
 }
 
 static void sl_get_selection_data(struct sl_context* ctx) {
@@ -2750,6 +3762,7 @@ static void sl_get_selection_data(struct sl_context* ctx) {
   if (!reply)
     return;
 
+  ctx->selection_property_pending = 0;
   if (reply->type == ctx->atoms[ATOM_INCR].value) {
     ctx->selection_incremental_transfer = 1;
     free(reply);
@@ -2761,6 +3774,8 @@ static void sl_get_selection_data(struct sl_context* ctx) {
 
 static void sl_handle_selection_notify(struct sl_context* ctx,
                                        xcb_selection_notify_event_t* event) {
+  TRACE_EVENT("x11");
+
   if (event->property == XCB_ATOM_NONE)
     return;
 
@@ -2777,7 +3792,8 @@ static void sl_send_targets(struct sl_context* ctx) {
       ctx->selection_data_offer->atoms.size / sizeof(xcb_atom_t),
       ctx->selection_data_offer->atoms.data);
 
-  sl_send_selection_notify(ctx, ctx->selection_request.property);
+  sl_send_selection_notify(ctx, &ctx->selection_request,
+                           ctx->selection_request.property);
 }
 
 static void sl_send_timestamp(struct sl_context* ctx) {
@@ -2786,33 +3802,28 @@ static void sl_send_timestamp(struct sl_context* ctx) {
                       ctx->selection_request.property, XCB_ATOM_INTEGER, 32, 1,
                       &ctx->selection_timestamp);
 
-  sl_send_selection_notify(ctx, ctx->selection_request.property);
+  sl_send_selection_notify(ctx, &ctx->selection_request,
+                           ctx->selection_request.property);
 }
 
 static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
+  struct sl_selection_transfer* transfer;
+  const char* name;
   int rv, fd_to_receive, fd_to_wayland;
 
   if (!ctx->selection_data_offer) {
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+    sl_send_selection_notify(ctx, &ctx->selection_request, XCB_ATOM_NONE);
     return;
   }
 
-  if (ctx->selection_event_source) {
-    fprintf(stderr, "error: selection transfer already pending\n");
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+  // We need the name of this atom to tell the wayland server what type of
+  // data to send us. Offered atoms are always in the atom cache.
+  name = sl_atom_cache_get_name(ctx, data_type);
+  if (!name) {
+    sl_send_selection_notify(ctx, &ctx->selection_request, XCB_ATOM_NONE);
     return;
   }
 
-  ctx->selection_data_type = data_type;
-
-  // We will need the name of this atom later to tell the wayland server what
-  // type of data to send us, so start the request now.
-  xcb_get_atom_name_cookie_t atom_name_cookie =
-      xcb_get_atom_name(ctx->connection, data_type);
-
-  wl_array_init(&ctx->selection_data);
-  ctx->selection_data_ack_pending = 0;
-
   switch (ctx->data_driver) {
     case DATA_DRIVER_VIRTWL: {
       struct virtwl_ioctl_new new_pipe = {
@@ -2826,7 +3837,7 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
       if (rv) {
         fprintf(stderr, "error: failed to create virtwl pipe: %s\n",
                 strerror(errno));
-        sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+        sl_send_selection_notify(ctx, &ctx->selection_request, XCB_ATOM_NONE);
         return;
       }
 
@@ -2846,43 +3857,48 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
     } break;
   }
 
-  xcb_get_atom_name_reply_t* atom_name_reply =
-      xcb_get_atom_name_reply(ctx->connection, atom_name_cookie, NULL);
-  if (atom_name_reply) {
-    // If we got the atom name, then send the request to wayland and add our end
-    // of the pipe to the wayland event loop.
-    ctx->selection_data_offer_receive_fd = fd_to_receive;
-    char* name = sl_copy_atom_name(atom_name_reply);
-    wl_data_offer_receive(ctx->selection_data_offer->internal, name,
-                          fd_to_wayland);
-    free(atom_name_reply);
-    free(name);
-
-    ctx->selection_event_source = wl_event_loop_add_fd(
-        wl_display_get_event_loop(ctx->host_display),
-        ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-        sl_handle_selection_fd_readable, ctx);
-  } else {
-    // If getting the atom name failed, notify the requestor that there won't be
-    // any data, and close our end of the pipe.
-    close(fd_to_receive);
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-  }
+  // Send the request to wayland and add our end of the pipe to the wayland
+  // event loop.
+  wl_data_offer_receive(ctx->selection_data_offer->internal, name,
+                        fd_to_wayland);
 
-  // Close the wayland end of the pipe, now that it's either been sent or not
-  // going to be sent. The VIRTWL driver uses the same fd for both ends of the
-  // pipe, so don't close the fd if both ends are the same.
+  if (!wl_list_empty(&ctx->free_selection_transfers)) {
+    transfer =
+        wl_container_of(ctx->free_selection_transfers.next, transfer, link);
+    wl_list_remove(&transfer->link);
+  } else {
+    transfer = malloc(sizeof(*transfer));
+    assert(transfer);
+    wl_array_init(&transfer->data);
+    wl_array_add(&transfer->data, ctx->selection_chunk_size);
+  }
+  transfer->ctx = ctx;
+  transfer->request = ctx->selection_request;
+  transfer->data_type = data_type;
+  transfer->fd = fd_to_receive;
+  transfer->event_source = NULL;
+  transfer->data.size = 0;
+  transfer->incremental = 0;
+  transfer->ack_pending = 0;
+  wl_list_insert(&ctx->selection_transfers, &transfer->link);
+  sl_selection_transfer_update(transfer);
+
+  // Close the wayland end of the pipe, now that it's been sent. The VIRTWL
+  // driver uses the same fd for both ends of the pipe, so don't close the fd
+  // if both ends are the same.
   if (fd_to_receive != fd_to_wayland)
     close(fd_to_wayland);
 }
 
 static void sl_handle_selection_request(struct sl_context* ctx,
                                         xcb_selection_request_event_t* event) {
+  TRACE_EVENT("x11");
+
   ctx->selection_request = *event;
-  ctx->selection_incremental_transfer = 0;
 
   if (event->selection == ctx->atoms[ATOM_CLIPBOARD_MANAGER].value) {
-    sl_send_selection_notify(ctx, ctx->selection_request.property);
+    sl_send_selection_notify(ctx, &ctx->selection_request,
+                             ctx->selection_request.property);
     return;
   }
 
@@ -2901,16 +3917,23 @@ static void sl_handle_selection_request(struct sl_context* ctx,
       }
     }
     if (!success) {
-      sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+      sl_send_selection_notify(ctx, &ctx->selection_request, XCB_ATOM_NONE);
     }
   }
 }
 
 static void sl_handle_xfixes_selection_notify(
     struct sl_context* ctx, xcb_xfixes_selection_notify_event_t* event) {
+  TRACE_EVENT("x11");
+
   if (event->selection != ctx->atoms[ATOM_CLIPBOARD].value)
     return;
 
+  // Requests for a selection we no longer own can't be served.
+  if (ctx->selection_owner == ctx->selection_window &&
+      event->owner != ctx->selection_window)
+    sl_cancel_selection_transfers(ctx, XCB_WINDOW_NONE);
+
   if (event->owner == XCB_WINDOW_NONE) {
     // If client selection is gone. Set NULL selection for each seat.
     if (ctx->selection_owner != ctx->selection_window) {
@@ -2920,6 +3943,8 @@ static void sl_handle_xfixes_selection_notify(
       }
     }
     ctx->selection_owner = XCB_WINDOW_NONE;
+    ctx->selection_targets_owner = XCB_WINDOW_NONE;
+    ctx->selection_targets_reused = 0;
     return;
   }
 
@@ -2932,6 +3957,19 @@ static void sl_handle_xfixes_selection_notify(
   }
 
   ctx->selection_incremental_transfer = 0;
+
+  // An owner usually offers the same targets for each new selection. Offer
+  // the previous ones right away. TARGETS is still converted, and the
+  // targets are offered again only if they changed.
+  if (event->owner == ctx->selection_targets_owner &&
+      ctx->selection_targets.size) {
+    sl_offer_selection_targets(ctx);
+    ctx->selection_targets_reused = 1;
+  } else {
+    ctx->selection_targets_owner = event->owner;
+    ctx->selection_targets_reused = 0;
+    ctx->selection_targets.size = 0;
+  }
   xcb_convert_selection(ctx->connection, ctx->selection_window,
                         ctx->atoms[ATOM_CLIPBOARD].value,
                         ctx->atoms[ATOM_TARGETS].value,
@@ -2942,6 +3980,7 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   xcb_generic_event_t* event;
   uint32_t count = 0;
+  TRACE_EVENT("x11");
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
     fprintf(stderr, "Got error or hangup (mask %d) on X connection, exiting\n",
@@ -2950,6 +3989,8 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
   }
 
   while ((event = xcb_poll_for_event(ctx->connection))) {
+    sl_dispatch_x_replies(ctx, event);
+
     switch (event->response_type & ~SEND_EVENT_MASK) {
       case XCB_CREATE_NOTIFY:
         sl_handle_create_notify(ctx, (xcb_create_notify_event_t*)event);
@@ -3006,8 +4047,7 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
     ++count;
   }
 
-  if ((mask & ~WL_EVENT_WRITABLE) == 0)
-    xcb_flush(ctx->connection);
+  sl_dispatch_x_replies(ctx, NULL);
 
   return count;
 }
@@ -3031,6 +4071,27 @@ static void sl_set_supported(struct sl_context* ctx) {
                       supported_atoms);
 }
 
+static uint64_t sl_startup_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Prints the time spent since the previous startup phase completed.
+static void sl_startup_trace(struct sl_context* ctx, const char* phase) {
+  uint64_t now;
+
+  if (!ctx->startup_trace)
+    return;
+
+  now = sl_startup_now();
+  fprintf(stderr, "startup: %-24s %8.2f ms (+%.2f ms)\n", phase,
+          (now - ctx->startup_time) / 1000000.0,
+          (now - ctx->startup_phase_time) / 1000000.0);
+  ctx->startup_phase_time = now;
+}
+
 static void sl_connect(struct sl_context* ctx) {
   const char wm_name[] = "Sommelier";
   const xcb_setup_t* setup;
@@ -3046,7 +4107,18 @@ static void sl_connect(struct sl_context* ctx) {
 
   ctx->connection = xcb_connect_to_fd(ctx->wm_fd, NULL);
   assert(!xcb_connection_has_error(ctx->connection));
-
+  sl_startup_trace(ctx, "x connected");
+
+  // Leave room for the ChangeProperty request header. The maximum request
+  // length is in units of 4 bytes.
+  ctx->selection_chunk_size =
+      MIN(ctx->selection_chunk_size,
+          (uint64_t)xcb_get_maximum_request_length(ctx->connection) * 4 - 64);
+  ctx->selection_chunk_size =
+      MAX(ctx->selection_chunk_size, MIN_SELECTION_CHUNK_SIZE);
+
+  // Everything that does not depend on a reply is sent before the first
+  // reply is waited for, so setup takes two round trips.
   xcb_prefetch_extension_data(ctx->connection, &xcb_xfixes_id);
   xcb_prefetch_extension_data(ctx->connection, &xcb_composite_id);
 
@@ -3067,6 +4139,11 @@ static void sl_connect(struct sl_context* ctx) {
   change_attributes_cookie = xcb_change_window_attributes(
       ctx->connection, ctx->screen->root, XCB_CW_EVENT_MASK, values);
 
+  ctx->window = xcb_generate_id(ctx->connection);
+  xcb_create_window(ctx->connection, 0, ctx->window, ctx->screen->root, 0, 0, 1,
+                    1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
+                    NULL);
+
   ctx->connection_event_source = wl_event_loop_add_fd(
       wl_display_get_event_loop(ctx->host_display),
       xcb_get_file_descriptor(ctx->connection), WL_EVENT_READABLE,
@@ -3076,6 +4153,16 @@ static void sl_connect(struct sl_context* ctx) {
       xcb_get_extension_data(ctx->connection, &xcb_xfixes_id);
   assert(ctx->xfixes_extension->present);
 
+  composite_extension =
+      xcb_get_extension_data(ctx->connection, &xcb_composite_id);
+  assert(composite_extension->present);
+  UNUSED(composite_extension);
+
+  // Sent before the version query so that its result is known once the
+  // query reply arrives.
+  redirect_subwindows_cookie = xcb_composite_redirect_subwindows_checked(
+      ctx->connection, ctx->screen->root, XCB_COMPOSITE_REDIRECT_MANUAL);
+
   xfixes_query_version_reply = xcb_xfixes_query_version_reply(
       ctx->connection,
       xcb_xfixes_query_version(ctx->connection, XCB_XFIXES_MAJOR_VERSION,
@@ -3085,14 +4172,6 @@ static void sl_connect(struct sl_context* ctx) {
   assert(xfixes_query_version_reply->major_version >= 5);
   free(xfixes_query_version_reply);
 
-  composite_extension =
-      xcb_get_extension_data(ctx->connection, &xcb_composite_id);
-  assert(composite_extension->present);
-  UNUSED(composite_extension);
-
-  redirect_subwindows_cookie = xcb_composite_redirect_subwindows_checked(
-      ctx->connection, ctx->screen->root, XCB_COMPOSITE_REDIRECT_MANUAL);
-
   // Another window manager should not be running.
   error = xcb_request_check(ctx->connection, change_attributes_cookie);
   assert(!error);
@@ -3100,19 +4179,17 @@ static void sl_connect(struct sl_context* ctx) {
   // Redirecting subwindows of root for compositing should have succeeded.
   error = xcb_request_check(ctx->connection, redirect_subwindows_cookie);
   assert(!error);
-
-  ctx->window = xcb_generate_id(ctx->connection);
-  xcb_create_window(ctx->connection, 0, ctx->window, ctx->screen->root, 0, 0, 1,
-                    1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
-                    NULL);
+  sl_startup_trace(ctx, "x extensions");
 
   for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
     atom_reply =
         xcb_intern_atom_reply(ctx->connection, ctx->atoms[i].cookie, &error);
     assert(!error);
     ctx->atoms[i].value = atom_reply->atom;
+    sl_atom_cache_add(ctx, atom_reply->atom, ctx->atoms[i].name);
     free(atom_reply);
   }
+  sl_startup_trace(ctx, "atoms interned");
 
   depth_iterator = xcb_screen_allowed_depths_iterator(ctx->screen);
   while (depth_iterator.rem > 0) {
@@ -3205,6 +4282,54 @@ static void sl_sd_notify(const char* state) {
   errno_assert(rv != -1);
 }
 
+static int sl_handle_sigusr1(int signal_number, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  fprintf(stderr, "mmap: %" PRIu64 " munmap: %" PRIu64 "\n", sl_mmap_count,
+          sl_munmap_count);
+  fprintf(stderr,
+          "free lists: %" PRIu64 " slab allocations %" PRIu64
+          " live objects\n",
+          sl_free_list_slab_count, sl_free_list_live_count);
+#ifdef __GLIBC__
+  {
+    uint64_t count = __atomic_load_n(&sl_heap_alloc_count, __ATOMIC_RELAXED);
+
+    fprintf(stderr,
+            "heap: %" PRIu64 " allocations %" PRIu64 " since last dump\n",
+            count, count - sl_heap_alloc_count_last_dump);
+    sl_heap_alloc_count_last_dump = count;
+  }
+#endif
+  if (ctx->virtwl_ctx_fd >= 0) {
+    fprintf(stderr,
+            "virtwl send: %" PRIu64 " messages %" PRIu64 " bytes %" PRIu64
+            " ioctls\n",
+            ctx->virtwl_send_stats.messages, ctx->virtwl_send_stats.bytes,
+            ctx->virtwl_send_stats.ioctls);
+    fprintf(stderr,
+            "virtwl recv: %" PRIu64 " messages %" PRIu64 " bytes %" PRIu64
+            " ioctls\n",
+            ctx->virtwl_recv_stats.messages, ctx->virtwl_recv_stats.bytes,
+            ctx->virtwl_recv_stats.ioctls);
+  }
+  fprintf(stderr,
+          "loop: %" PRIu64 " iterations host reads: %" PRIu64
+          " writes: %" PRIu64 " (%" PRIu64 " blocked) x flushes: %" PRIu64
+          "\n",
+          ctx->loop_stats.iterations, ctx->loop_stats.host_reads,
+          ctx->loop_stats.host_writes, ctx->loop_stats.host_writes_blocked,
+          ctx->loop_stats.x_flushes);
+  if (ctx->stats) {
+    fprintf(stderr, "client flushes: %" PRIu64 "\n",
+            ctx->loop_stats.client_flushes);
+    sl_compositor_dump_stats(ctx);
+  }
+  sl_trace_dump();
+
+  return 1;
+}
+
 static int sl_handle_sigchld(int signal_number, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   int status;
@@ -3322,6 +4447,7 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
 
   display_name[bytes_read] = '\0';
   setenv("DISPLAY", display_name, 1);
+  sl_startup_trace(ctx, "xwayland ready");
 
   sl_connect(ctx);
 
@@ -3346,148 +4472,507 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   }
 
   ctx->child_pid = pid;
+  sl_startup_trace(ctx, "program started");
 
   return 1;
 }
 
-static void sl_sigchld_handler(int signal) {
-  while (waitpid(-1, NULL, WNOHANG) > 0)
-    continue;
-}
-
-static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
-  exit(0);
+// Stops the program and Xwayland started ahead of the host connection when
+// a later startup step fails.
+static int sl_abort_startup(struct sl_context* ctx) {
+  if (ctx->child_pid >= 0) {
+    kill(ctx->child_pid, SIGTERM);
+    waitpid(ctx->child_pid, NULL, 0);
+    ctx->child_pid = -1;
+  }
+  if (ctx->xwayland_pid >= 0) {
+    kill(ctx->xwayland_pid, SIGTERM);
+    waitpid(ctx->xwayland_pid, NULL, 0);
+    ctx->xwayland_pid = -1;
+  }
+  return EXIT_FAILURE;
 }
 
-static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_recv = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* recv_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct msghdr msg = {0};
-  struct iovec buffer_iov;
-  ssize_t bytes;
-  int fd_count;
-  int rv;
-
-  if (!(mask & WL_EVENT_READABLE)) {
-    fprintf(stderr,
-            "Got error or hangup on virtwl ctx fd"
-            " (mask %d), exiting\n",
-            mask);
-    exit(EXIT_SUCCESS);
+// Executes a peer instance. |peer_args| tell the peer where its client
+// connection comes from. Does not return.
+static void sl_exec_peer(int argc,
+                         char** argv,
+                         const char* peer_cmd_prefix,
+                         char** peer_args,
+                         int peer_arg_count) {
+  char* peer_cmd_prefix_str;
+  char** args;
+  int i = 0, j;
+
+  // Room for the prefix, the peer args, every forwarded flag and NULL.
+  args = malloc(sizeof(*args) * (32 + 1 + peer_arg_count + argc));
+  assert(args);
+
+  if (!peer_cmd_prefix)
+    peer_cmd_prefix = PEER_CMD_PREFIX;
+
+  if (peer_cmd_prefix) {
+    peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+
+    i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
+    if (i > 32) {
+      fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+      i = 0;
+    }
   }
 
-  ioctl_recv->len = max_recv_size;
-  rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
-  if (rv) {
-    close(ctx->virtwl_socket_fd);
-    ctx->virtwl_socket_fd = -1;
-    return 0;
+  args[i++] = argv[0];
+  for (j = 0; j < peer_arg_count; ++j)
+    args[i++] = peer_args[j];
+
+  // Forward some flags.
+  for (j = 1; j < argc; ++j) {
+    char* arg = argv[j];
+    if (strstr(arg, "--display") == arg ||
+        strstr(arg, "--scale") == arg ||
+        strstr(arg, "--accelerators") == arg ||
+        strstr(arg, "--virtwl-device") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--no-dmabuf-modifiers") == arg ||
+        strstr(arg, "--shm-driver") == arg ||
+        strstr(arg, "--data-driver") == arg ||
+        strstr(arg, "--copy-threads") == arg ||
+        strstr(arg, "--downsample") == arg ||
+        strstr(arg, "--buffer-pool-size") == arg ||
+        strstr(arg, "--buffer-pool-timeout") == arg ||
+        strstr(arg, "--max-buffers") == arg ||
+        strstr(arg, "--buffer-policy") == arg ||
+        strstr(arg, "--stats") == arg ||
+        strstr(arg, "--startup-trace") == arg ||
+        strstr(arg, "--trace") == arg ||
+        strstr(arg, "--coalesce-motion") == arg ||
+        strstr(arg, "--motion-interval") == arg) {
+      args[i++] = arg;
+    }
   }
 
-  buffer_iov.iov_base = recv_data;
-  buffer_iov.iov_len = ioctl_recv->len;
+  args[i++] = NULL;
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
+  execvp(args[0], args);
+  _exit(EXIT_FAILURE);
+}
 
-  // Count how many FDs the kernel gave us.
-  for (fd_count = 0; fd_count < VIRTWL_SEND_MAX_ALLOCS; fd_count++) {
-    if (ioctl_recv->fds[fd_count] < 0)
-      break;
-  }
-  if (fd_count) {
-    struct cmsghdr* cmsg;
+// Starts a peer that connects to the host right away and then waits for a
+// client to be handed over on its control socket.
+static void sl_spawn_warm_peer(int argc,
+                               char** argv,
+                               const char* peer_cmd_prefix,
+                               int sock_fd,
+                               int lock_fd,
+                               struct sl_warm_peer* peer) {
+  int cs[2];
+  pid_t pid;
+  int rv;
 
-    // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
-    // cmsghdr. We copy every fd we just received from the ioctl into this
-    // cmsghdr.
-    msg.msg_controllen = sizeof(fd_buffer);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
-    memcpy(CMSG_DATA(cmsg), ioctl_recv->fds, fd_count * sizeof(int));
-    msg.msg_controllen = cmsg->cmsg_len;
-  }
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, cs);
+  errno_assert(!rv);
 
-  bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
-  errno_assert(bytes == ioctl_recv->len);
+  pid = fork();
+  errno_assert(pid != -1);
+  if (pid == 0) {
+    char* peer_args[1];
 
-  while (fd_count--)
-    close(ioctl_recv->fds[fd_count]);
+    close(sock_fd);
+    close(lock_fd);
+    close(cs[0]);
 
-  return 1;
+    rv = fcntl(cs[1], F_SETFD, 0);
+    errno_assert(!rv);
+
+    peer_args[0] = sl_xasprintf("--peer-control-fd=%d", cs[1]);
+    sl_exec_peer(argc, argv, peer_cmd_prefix, peer_args, 1);
+  }
+  close(cs[1]);
+
+  peer->pid = pid;
+  peer->control_fd = cs[0];
 }
 
-static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_send = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_send_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct iovec buffer_iov;
+// Passes |client_fd| and the pid of the client process to a warm peer and
+// waits for the peer to acknowledge it. Returns 0 if the peer exited or did
+// not answer in time before taking over the client, in which case the
+// caller still owns |client_fd|. A peer that doesn't answer is killed so
+// that it can't serve the client as well.
+static int sl_hand_off_to_peer(struct sl_warm_peer* peer,
+                               int client_fd,
+                               pid_t peer_pid) {
+  int control_fd = peer->control_fd;
+  char fd_buffer[CMSG_SPACE(sizeof(client_fd))];
   struct msghdr msg = {0};
+  struct pollfd pfd = {.fd = control_fd, .events = POLLIN};
+  struct iovec iov;
   struct cmsghdr* cmsg;
+  char ack;
   ssize_t bytes;
-  int fd_count = 0;
   int rv;
-  int i;
+
+  iov.iov_base = &peer_pid;
+  iov.iov_len = sizeof(peer_pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = fd_buffer;
+  msg.msg_controllen = sizeof(fd_buffer);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(client_fd));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(client_fd));
+
+  if (sendmsg(control_fd, &msg, MSG_NOSIGNAL) != sizeof(peer_pid))
+    return 0;
+
+  // Don't let one hung peer hold up every client that connects after it.
+  do {
+    rv = poll(&pfd, 1, PEER_ACK_TIMEOUT_MS);
+  } while (rv < 0 && errno == EINTR);
+  if (rv <= 0) {
+    fprintf(stderr, "warning: warm peer %d did not take the client\n",
+            peer->pid);
+    kill(peer->pid, SIGKILL);
+    return 0;
+  }
+
+  // A peer that dies with the message still queued closes the socket
+  // without an ack.
+  do {
+    bytes = read(control_fd, &ack, sizeof(ack));
+  } while (bytes < 0 && errno == EINTR);
+
+  return bytes == sizeof(ack);
+}
+
+static int sl_handle_peer_control_event(int fd, uint32_t mask, void* data) {
+  struct sl_peer_control* control = (struct sl_peer_control*)data;
+  char fd_buffer[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {0};
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  pid_t peer_pid;
+  ssize_t bytes;
+  char ack = 0;
+
+  iov.iov_base = &peer_pid;
+  iov.iov_len = sizeof(peer_pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = fd_buffer;
+  msg.msg_controllen = sizeof(fd_buffer);
+
+  bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  cmsg = bytes > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (bytes != sizeof(peer_pid) || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    // The master exited before handing over a client.
+    exit(EXIT_SUCCESS);
+  }
+
+  memcpy(&control->client_fd, CMSG_DATA(cmsg), sizeof(control->client_fd));
+  control->ctx->peer_pid = peer_pid;
+
+  // Let the master close its copy of the client fd. If the master is gone
+  // there is nobody left to fall back to, so keep serving the client.
+  send(fd, &ack, sizeof(ack), MSG_NOSIGNAL);
+
+  return 1;
+}
+
+static void sl_sigchld_handler(int signal) {
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    continue;
+}
+
+static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
+  exit(0);
+}
+
+// Accepts a client in single-process mode. All clients share the host
+// connection, globals and buffer pools of this process.
+static int sl_handle_client_connection(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct wl_client* client;
+  int client_fd;
+
+  client_fd = accept(fd, NULL, NULL);
+  if (client_fd < 0) {
+    fprintf(stderr, "error: failed to accept: %m\n");
+    return 1;
+  }
+  fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+
+  client = wl_client_create(ctx->host_display, client_fd);
+  if (!client) {
+    close(client_fd);
+    return 1;
+  }
+
+  // Replace the core display implementation. This is needed in order to
+  // implement sync handler properly.
+  sl_set_display_implementation(ctx, client);
+
+  return 1;
+}
+
+// Size of the buffer that messages are batched in. Each wakeup drains as
+// many messages as fit before forwarding them.
+#define VIRTWL_TXN_BUFFER_SIZE (64 * 1024)
+
+// Largest transaction sent to the host in one VIRTWL_IOCTL_SEND. Devices
+// that reject it get smaller batches, down to the minimum.
+#define VIRTWL_TXN_MAX_SEND_SIZE (16 * 1024)
+#define VIRTWL_TXN_MIN_SEND_SIZE 4096
+
+// Maximum number of host messages coalesced into one sendmsg.
+#define VIRTWL_TXN_MAX_RECV_MESSAGES 64
+
+static uint8_t* sl_virtwl_txn_buffer(struct sl_context* ctx) {
+  if (!ctx->virtwl_txn_buffer) {
+    ctx->virtwl_txn_buffer = malloc(VIRTWL_TXN_BUFFER_SIZE);
+    assert(ctx->virtwl_txn_buffer);
+  }
+  return ctx->virtwl_txn_buffer;
+}
+
+static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  uint8_t* ioctl_buffer = sl_virtwl_txn_buffer(ctx);
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct iovec iov[VIRTWL_TXN_MAX_RECV_MESSAGES];
+  int fds[VIRTWL_SEND_MAX_ALLOCS];
+  TRACE_EVENT("virtwl");
 
   if (!(mask & WL_EVENT_READABLE)) {
     fprintf(stderr,
-            "Got error or hangup on virtwl socket"
+            "Got error or hangup on virtwl ctx fd"
             " (mask %d), exiting\n",
             mask);
     exit(EXIT_SUCCESS);
   }
 
-  buffer_iov.iov_base = send_data;
-  buffer_iov.iov_len = max_send_size;
+  for (;;) {
+    struct msghdr msg = {0};
+    size_t offset = 0;
+    size_t total = 0;
+    int fd_count = 0;
+    int iov_count = 0;
+    int drained = 0;
+    ssize_t bytes;
+    int i;
+
+    // Receive messages back to back into the buffer. Stop once a message
+    // carries FDs so that they are never split across sendmsg calls.
+    while (!fd_count && iov_count < VIRTWL_TXN_MAX_RECV_MESSAGES &&
+           VIRTWL_TXN_BUFFER_SIZE - offset >=
+               sizeof(struct virtwl_ioctl_txn) + VIRTWL_TXN_MIN_SEND_SIZE) {
+      struct virtwl_ioctl_txn* ioctl_recv =
+          (struct virtwl_ioctl_txn*)(ioctl_buffer + offset);
+      struct pollfd pfd = {.fd = fd, .events = POLLIN};
+      int rv;
+
+      // The context fd stays blocking as VIRTWL_IOCTL_SEND shares it, so
+      // only receive while another message is ready.
+      if (poll(&pfd, 1, 0) <= 0) {
+        drained = 1;
+        break;
+      }
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+      ioctl_recv->len =
+          VIRTWL_TXN_BUFFER_SIZE - offset - sizeof(struct virtwl_ioctl_txn);
+      rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
+      ++ctx->virtwl_recv_stats.ioctls;
+      if (rv) {
+        close(ctx->virtwl_socket_fd);
+        ctx->virtwl_socket_fd = -1;
+        return 0;
+      }
+      if (!ioctl_recv->len && ioctl_recv->fds[0] < 0) {
+        drained = 1;
+        break;
+      }
 
-  bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  errno_assert(bytes > 0);
+      // Count how many FDs the kernel gave us.
+      for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; i++) {
+        if (ioctl_recv->fds[i] < 0)
+          break;
+        fds[fd_count++] = ioctl_recv->fds[i];
+      }
+
+      iov[iov_count].iov_base = ioctl_recv + 1;
+      iov[iov_count].iov_len = ioctl_recv->len;
+      ++iov_count;
+      total += ioctl_recv->len;
+      offset += sizeof(struct virtwl_ioctl_txn) + ioctl_recv->len;
+      offset = (offset + sizeof(int) - 1) & ~(sizeof(int) - 1);
+      ++ctx->virtwl_recv_stats.messages;
+    }
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+    if (!iov_count)
+      break;
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+    msg.msg_control = fd_buffer;
+    if (fd_count) {
+      struct cmsghdr* cmsg;
+
+      // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
+      // cmsghdr. We copy every fd we just received from the ioctl into this
+      // cmsghdr.
+      msg.msg_controllen = sizeof(fd_buffer);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+      msg.msg_controllen = cmsg->cmsg_len;
+    }
+
+    bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
+    errno_assert(bytes == total);
+    ctx->virtwl_recv_stats.bytes += total;
+
+    while (fd_count--)
+      close(fds[fd_count]);
+
+    if (drained)
+      break;
+  }
+
+  return 1;
+}
+
+// Forwards a batch to the host. A batch the device rejects for its size is
+// split, and the smaller size is kept for later batches. FDs are sent with
+// the first part.
+static void sl_virtwl_send(struct sl_context* ctx,
+                           struct virtwl_ioctl_txn* ioctl_send) {
+  uint8_t* data = (uint8_t*)(ioctl_send + 1);
+  size_t len = ioctl_send->len;
+  int rv;
+
+  while (len) {
+    struct virtwl_ioctl_txn* part;
+    size_t part_len = MIN(len, ctx->virtwl_max_send_size);
+    int i;
+
+    // Parts are written right before the data they carry. Earlier data has
+    // already been sent so it can be overwritten.
+    part = (struct virtwl_ioctl_txn*)(data - sizeof(*part));
+    if (part != ioctl_send) {
+      for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+        part->fds[i] = -1;
+    }
+    part->len = part_len;
+    rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, part);
+    ++ctx->virtwl_send_stats.ioctls;
+    if (rv && (errno == EINVAL || errno == EMSGSIZE) &&
+        part_len > VIRTWL_TXN_MIN_SEND_SIZE) {
+      ctx->virtwl_max_send_size =
+          MAX(part_len / 2, VIRTWL_TXN_MIN_SEND_SIZE);
       continue;
+    }
+    errno_assert(!rv);
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    data += part_len;
+    len -= part_len;
+  }
+}
 
-    // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    fd_count += cmsg_fd_count;
+static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  uint8_t* ioctl_buffer = sl_virtwl_txn_buffer(ctx);
+  struct virtwl_ioctl_txn* ioctl_send = (struct virtwl_ioctl_txn*)ioctl_buffer;
+  uint8_t* send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  int recv_flags = 0;
+  TRACE_EVENT("virtwl");
+
+  if (!(mask & WL_EVENT_READABLE)) {
+    fprintf(stderr,
+            "Got error or hangup on virtwl socket"
+            " (mask %d), exiting\n",
+            mask);
+    exit(EXIT_SUCCESS);
   }
 
-  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
-    ioctl_send->fds[i] = -1;
+  for (;;) {
+    size_t len = 0;
+    int fd_count = 0;
+    int drained = 0;
+    int i;
+
+    // Coalesce everything that is available into one transaction. Stop
+    // after a read that carries FDs so that the control buffer always has
+    // room for as many FDs as a message can have.
+    while (!fd_count && len < ctx->virtwl_max_send_size) {
+      struct iovec buffer_iov;
+      struct msghdr msg = {0};
+      struct cmsghdr* cmsg;
+      ssize_t bytes;
+
+      buffer_iov.iov_base = send_data + len;
+      buffer_iov.iov_len = ctx->virtwl_max_send_size - len;
+
+      msg.msg_iov = &buffer_iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = fd_buffer;
+      msg.msg_controllen = sizeof(fd_buffer);
+
+      // Only the first read may block. The socket was reported readable.
+      bytes = recvmsg(ctx->virtwl_socket_fd, &msg, recv_flags);
+      recv_flags = MSG_DONTWAIT;
+      if (bytes < 0 && errno == EAGAIN) {
+        drained = 1;
+        break;
+      }
+      errno_assert(bytes > 0);
+
+      // If there were any FDs recv'd by recvmsg, there will be some data in
+      // the msg_control buffer. To get the FDs out we iterate all cmsghdr's
+      // within and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+      for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        size_t cmsg_fd_count;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+
+        cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
+        // control message buffer only allocates enough space for that many
+        // FDs.
+        memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
+               cmsg_fd_count * sizeof(int));
+        fd_count += cmsg_fd_count;
+      }
 
-  // The FDs and data were extracted from the recvmsg call into the ioctl_send
-  // structure which we now pass along to the kernel.
-  ioctl_send->len = bytes;
-  rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
-  errno_assert(!rv);
+      len += bytes;
+      ++ctx->virtwl_send_stats.messages;
+    }
+
+    if (!len)
+      break;
+
+    for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+      ioctl_send->fds[i] = -1;
 
-  while (fd_count--)
-    close(ioctl_send->fds[fd_count]);
+    // The FDs and data were extracted from the recvmsg calls into the
+    // ioctl_send structure which we now pass along to the kernel.
+    ioctl_send->len = len;
+    sl_virtwl_send(ctx, ioctl_send);
+    ctx->virtwl_send_stats.bytes += len;
+
+    while (fd_count--)
+      close(ioctl_send->fds[fd_count]);
+
+    if (drained)
+      break;
+  }
 
   return 1;
 }
@@ -3539,6 +5024,9 @@ static void sl_print_usage() {
       "  -h, --help\t\t\tPrint this help\n"
       "  -X\t\t\t\tEnable X11 forwarding\n"
       "  --master\t\t\tRun as master and spawn child processes\n"
+      "  --peer-pool-size=N\t\tNumber of pre-started child processes in"
+      " master mode\n"
+      "  --single-process\t\tServe all clients from the master process\n"
       "  --socket=SOCKET\t\tName of socket to listen on\n"
       "  --display=DISPLAY\t\tWayland display to connect to\n"
       "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl)\n"
@@ -3557,9 +5045,27 @@ static void sl_print_usage() {
       "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
       "  --virtwl-device=DEVICE\tVirtWL device to use\n"
       "  --drm-device=DEVICE\t\tDRM device to use\n"
+      "  --no-dmabuf-modifiers\t\tAllocate linear dmabuf output buffers\n"
       "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
       "  --fullscreen-mode=MODE\tDefault fullscreen behavior (immersive,"
-      " plain)\n");
+      " plain)\n"
+      "  --copy-threads=N\t\tNumber of threads used for buffer uploads\n"
+      "  --downsample\t\t\tDownsample contents shown at less than half"
+      " size\n"
+      "  --buffer-pool-size=MB\t\tMemory cap for unused output buffers\n"
+      "  --buffer-pool-timeout=MS\tTime before unused output buffers are"
+      " freed\n"
+      "  --max-buffers=N\t\tMaximum number of output buffers in flight per"
+      " surface\n"
+      "  --buffer-policy=POLICY\tBehavior when at the buffer limit (wait,"
+      " drop)\n"
+      "  --stats\t\t\tCollect per-surface stats, dumped on SIGUSR1\n"
+      "  --startup-trace\t\tPrint the time spent in each startup phase\n"
+      "  --trace=FILE\t\t\tRecord trace events to FILE (%%p is the pid) or"
+      " ftrace\n"
+      "  --coalesce-motion\t\tMerge pointer and touch motion within a frame\n"
+      "  --motion-interval=MS\t\tAlso merge pointer motion within MS\n"
+      "  --selection-chunk-size=BYTES\tChunk size for X clipboard transfers\n");
 }
 
 static const char* sl_arg_value(const char* arg) {
@@ -3586,6 +5092,7 @@ int main(int argc, char** argv) {
       .aura_shell = NULL,
       .viewporter = NULL,
       .linux_dmabuf = NULL,
+      .linux_explicit_synchronization = NULL,
       .keyboard_extension = NULL,
       .text_input_manager = NULL,
       .display_event_source = NULL,
@@ -3599,8 +5106,25 @@ int main(int argc, char** argv) {
       .virtwl_socket_fd = -1,
       .virtwl_ctx_event_source = NULL,
       .virtwl_socket_event_source = NULL,
+      .virtwl_txn_buffer = NULL,
+      .virtwl_max_send_size = VIRTWL_TXN_MAX_SEND_SIZE,
       .drm_device = NULL,
       .gbm = NULL,
+      .dmabuf_modifiers = 1,
+      .downsample = 0,
+      .copy_pool = NULL,
+      .output_buffer_pool_size = 0,
+      .output_buffer_pool_max_size = DEFAULT_BUFFER_POOL_SIZE,
+      .output_buffer_pool_timeout = DEFAULT_BUFFER_POOL_TIMEOUT,
+      .output_buffer_pool_timer = NULL,
+      .max_output_buffers = 0,
+      .output_buffer_policy = OUTPUT_BUFFER_POLICY_WAIT,
+      .stats = 0,
+      .startup_trace = 0,
+      .startup_time = 0,
+      .startup_phase_time = 0,
+      .coalesce_motion = 0,
+      .motion_interval = 0,
       .xwayland = 0,
       .xwayland_pid = -1,
       .child_pid = -1,
@@ -3629,6 +5153,9 @@ int main(int argc, char** argv) {
       .selection_incremental_transfer = 0,
       .selection_request = {.requestor = XCB_NONE, .property = XCB_ATOM_NONE},
       .selection_timestamp = XCB_CURRENT_TIME,
+      .selection_targets_owner = XCB_WINDOW_NONE,
+      .selection_targets_reused = 0,
+      .selection_offer_serial = 0,
       .selection_data_device = NULL,
       .selection_data_offer = NULL,
       .selection_data_source = NULL,
@@ -3636,9 +5163,9 @@ int main(int argc, char** argv) {
       .selection_send_event_source = NULL,
       .selection_property_reply = NULL,
       .selection_property_offset = 0,
-      .selection_event_source = NULL,
-      .selection_data_offer_receive_fd = -1,
-      .selection_data_ack_pending = 0,
+      .selection_property_pending = 0,
+      .selection_property_requested = 0,
+      .selection_chunk_size = DEFAULT_SELECTION_CHUNK_SIZE,
       .atoms =
           {
               [ATOM_WM_S0] = {"WM_S0"},
@@ -3676,9 +5203,11 @@ int main(int argc, char** argv) {
       .visual_ids = {0},
       .colormaps = {0}};
   const char* display = getenv("SOMMELIER_DISPLAY");
+  char* host_wayland_display = NULL;
   const char* scale = getenv("SOMMELIER_SCALE");
   const char* dpi = getenv("SOMMELIER_DPI");
   const char* clipboard_manager = getenv("SOMMELIER_CLIPBOARD_MANAGER");
+  const char* dmabuf_modifiers = getenv("SOMMELIER_DMABUF_MODIFIERS");
   const char* frame_color = getenv("SOMMELIER_FRAME_COLOR");
   const char* dark_frame_color = getenv("SOMMELIER_DARK_FRAME_COLOR");
   const char* virtwl_device = getenv("SOMMELIER_VIRTWL_DEVICE");
@@ -3688,6 +5217,7 @@ int main(int argc, char** argv) {
   const char* shm_driver = getenv("SOMMELIER_SHM_DRIVER");
   const char* data_driver = getenv("SOMMELIER_DATA_DRIVER");
   const char* peer_cmd_prefix = getenv("SOMMELIER_PEER_CMD_PREFIX");
+  const char* peer_pool_size_str = getenv("SOMMELIER_PEER_POOL_SIZE");
   const char* xwayland_cmd_prefix = getenv("SOMMELIER_XWAYLAND_CMD_PREFIX");
   const char* accelerators = getenv("SOMMELIER_ACCELERATORS");
   const char* xwayland_path = getenv("SOMMELIER_XWAYLAND_PATH");
@@ -3695,6 +5225,19 @@ int main(int argc, char** argv) {
       getenv("SOMMELIER_XWAYLAND_GL_DRIVER_PATH");
   const char* xauth_path = getenv("SOMMELIER_XAUTH_PATH");
   const char* xfont_path = getenv("SOMMELIER_XFONT_PATH");
+  const char* copy_threads = getenv("SOMMELIER_COPY_THREADS");
+  const char* downsample = getenv("SOMMELIER_DOWNSAMPLE");
+  const char* buffer_pool_size = getenv("SOMMELIER_BUFFER_POOL_SIZE");
+  const char* buffer_pool_timeout = getenv("SOMMELIER_BUFFER_POOL_TIMEOUT");
+  const char* max_buffers = getenv("SOMMELIER_MAX_BUFFERS");
+  const char* buffer_policy = getenv("SOMMELIER_BUFFER_POLICY");
+  const char* stats = getenv("SOMMELIER_STATS");
+  const char* startup_trace = getenv("SOMMELIER_STARTUP_TRACE");
+  const char* trace = getenv("SOMMELIER_TRACE");
+  const char* coalesce_motion = getenv("SOMMELIER_COALESCE_MOTION");
+  const char* motion_interval = getenv("SOMMELIER_MOTION_INTERVAL");
+  const char* selection_chunk_size =
+      getenv("SOMMELIER_SELECTION_CHUNK_SIZE");
   const char* socket_name = "wayland-0";
   const char* runtime_dir;
   struct wl_event_loop* event_loop;
@@ -3705,10 +5248,15 @@ int main(int argc, char** argv) {
   int virtwl_display_fd = -1;
   int xdisplay = -1;
   int master = 0;
+  int single_process = 0;
+  int listen_fd = -1;
   int client_fd = -1;
+  int peer_control_fd = -1;
   int rv;
   int i;
 
+  ctx.startup_time = ctx.startup_phase_time = sl_startup_now();
+
   for (i = 1; i < argc; ++i) {
     const char* arg = argv[i];
     if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0 ||
@@ -3722,6 +5270,8 @@ int main(int argc, char** argv) {
     }
     if (strstr(arg, "--master") == arg) {
       master = 1;
+    } else if (strstr(arg, "--single-process") == arg) {
+      single_process = 1;
     } else if (strstr(arg, "--socket") == arg) {
       socket_name = sl_arg_value(arg);
     } else if (strstr(arg, "--display") == arg) {
@@ -3732,6 +5282,10 @@ int main(int argc, char** argv) {
       data_driver = sl_arg_value(arg);
     } else if (strstr(arg, "--peer-pid") == arg) {
       ctx.peer_pid = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--peer-pool-size") == arg) {
+      peer_pool_size_str = sl_arg_value(arg);
+    } else if (strstr(arg, "--peer-control-fd") == arg) {
+      peer_control_fd = atoi(sl_arg_value(arg));
     } else if (strstr(arg, "--peer-cmd-prefix") == arg) {
       peer_cmd_prefix = sl_arg_value(arg);
     } else if (strstr(arg, "--xwayland-cmd-prefix") == arg) {
@@ -3762,6 +5316,8 @@ int main(int argc, char** argv) {
       ctx.sd_notify = sl_arg_value(arg);
     } else if (strstr(arg, "--no-clipboard-manager") == arg) {
       clipboard_manager = "0";
+    } else if (strstr(arg, "--no-dmabuf-modifiers") == arg) {
+      dmabuf_modifiers = "0";
     } else if (strstr(arg, "--frame-color") == arg) {
       frame_color = sl_arg_value(arg);
     } else if (strstr(arg, "--dark-frame-color") == arg) {
@@ -3778,6 +5334,30 @@ int main(int argc, char** argv) {
       xauth_path = sl_arg_value(arg);
     } else if (strstr(arg, "--x-font-path") == arg) {
       xfont_path = sl_arg_value(arg);
+    } else if (strstr(arg, "--copy-threads") == arg) {
+      copy_threads = sl_arg_value(arg);
+    } else if (strstr(arg, "--downsample") == arg) {
+      downsample = "1";
+    } else if (strstr(arg, "--buffer-pool-size") == arg) {
+      buffer_pool_size = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-pool-timeout") == arg) {
+      buffer_pool_timeout = sl_arg_value(arg);
+    } else if (strstr(arg, "--max-buffers") == arg) {
+      max_buffers = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-policy") == arg) {
+      buffer_policy = sl_arg_value(arg);
+    } else if (strstr(arg, "--stats") == arg) {
+      stats = "1";
+    } else if (strstr(arg, "--startup-trace") == arg) {
+      startup_trace = "1";
+    } else if (strstr(arg, "--trace") == arg) {
+      trace = sl_arg_value(arg);
+    } else if (strstr(arg, "--coalesce-motion") == arg) {
+      coalesce_motion = "1";
+    } else if (strstr(arg, "--motion-interval") == arg) {
+      motion_interval = sl_arg_value(arg);
+    } else if (strstr(arg, "--selection-chunk-size") == arg) {
+      selection_chunk_size = sl_arg_value(arg);
     } else if (arg[0] == '-') {
       if (strcmp(arg, "--") == 0) {
         ctx.runprog = &argv[i + 1];
@@ -3798,11 +5378,19 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  if (single_process && (!master || ctx.xwayland)) {
+    fprintf(stderr, "error: --single-process requires --master without X11\n");
+    return EXIT_FAILURE;
+  }
+
   if (master) {
     char* lock_addr;
     struct sockaddr_un addr;
     struct sigaction sa;
     struct stat sock_stat;
+    struct sl_warm_peer* peer_pool = NULL;
+    int peer_pool_size = 0;
+    int peer_pool_count = 0;
     int lock_fd;
     int sock_fd;
 
@@ -3867,13 +5455,29 @@ int main(int argc, char** argv) {
     rv = sigaction(SIGCHLD, &sa, NULL);
     errno_assert(rv >= 0);
 
-    do {
+    if (peer_pool_size_str)
+      peer_pool_size = MAX(atoi(peer_pool_size_str), 0);
+    if (peer_pool_size) {
+      peer_pool = calloc(peer_pool_size, sizeof(*peer_pool));
+      assert(peer_pool);
+    }
+
+    // In single-process mode clients are accepted by the event loop below
+    // instead of being handed to a peer process each.
+    while (!single_process) {
 #ifdef __linux__
       struct ucred ucred;
 #elif defined(__FreeBSD__)
       struct xucred ucred;
 #endif
       socklen_t length = sizeof(addr);
+      pid_t peer_pid;
+
+      // Keep the pool full. Warm peers initialize in the background.
+      while (peer_pool_count < peer_pool_size) {
+        sl_spawn_warm_peer(argc, argv, peer_cmd_prefix, sock_fd, lock_fd,
+                           &peer_pool[peer_pool_count++]);
+      }
 
       client_fd = accept(sock_fd, (struct sockaddr*)&addr, &length);
       if (client_fd < 0) {
@@ -3885,73 +5489,53 @@ int main(int argc, char** argv) {
 #ifdef __linux__
       ucred.pid = -1;
       rv = getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &ucred, &length);
+      peer_pid = ucred.pid;
 #elif defined(__FreeBSD__)
       ucred.cr_pid = -1;
       rv = getsockopt(client_fd, 0, LOCAL_PEERCRED, &ucred, &length);
+      peer_pid = ucred.cr_pid;
 #endif
 
+      // Hand the client to the oldest warm peer. Peers that have exited or
+      // don't answer are dropped and replaced when the pool is refilled. If
+      // no peer takes the client, a new peer is forked for it below.
+      while (peer_pool_count) {
+        int handed_off =
+            sl_hand_off_to_peer(&peer_pool[0], client_fd, peer_pid);
+
+        close(peer_pool[0].control_fd);
+        memmove(peer_pool, peer_pool + 1,
+                --peer_pool_count * sizeof(*peer_pool));
+        if (handed_off) {
+          close(client_fd);
+          client_fd = -1;
+          break;
+        }
+      }
+      if (client_fd < 0)
+        continue;
+
       pid = fork();
       errno_assert(pid != -1);
       if (pid == 0) {
-        char* client_fd_str;
-        char* peer_pid_str;
-        char* peer_cmd_prefix_str;
-        char* args[64];
-        int i = 0, j;
+        char* peer_args[2];
 
         close(sock_fd);
         close(lock_fd);
 
-        if (!peer_cmd_prefix)
-          peer_cmd_prefix = PEER_CMD_PREFIX;
-
-        if (peer_cmd_prefix) {
-          peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
-
-          i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
-
-        args[i++] = argv[0];
-#ifdef __linux__
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.pid);
-#elif defined(__FreeBSD__)
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.cr_pid);
-#endif
-        args[i++] = peer_pid_str;
-        client_fd_str = sl_xasprintf("--client-fd=%d", client_fd);
-        args[i++] = client_fd_str;
-
-        // forward some flags.
-        for (j = 1; j < argc; ++j) {
-          char* arg = argv[j];
-          if (strstr(arg, "--display") == arg ||
-              strstr(arg, "--scale") == arg ||
-              strstr(arg, "--accelerators") == arg ||
-              strstr(arg, "--virtwl-device") == arg ||
-              strstr(arg, "--drm-device") == arg ||
-              strstr(arg, "--shm-driver") == arg ||
-              strstr(arg, "--data-driver") == arg) {
-            args[i++] = arg;
-          }
-        }
-
-        args[i++] = NULL;
-
-        execvp(args[0], args);
-        _exit(EXIT_FAILURE);
+        peer_args[0] = sl_xasprintf("--peer-pid=%d", peer_pid);
+        peer_args[1] = sl_xasprintf("--client-fd=%d", client_fd);
+        sl_exec_peer(argc, argv, peer_cmd_prefix, peer_args, 2);
       }
       close(client_fd);
-    } while (1);
+    }
 
-    // Control should never reach here.
-    assert(false);
+    listen_fd = sock_fd;
+    // The optional child process has already been started.
+    ctx.runprog = NULL;
   }
 
-  if (client_fd == -1) {
+  if (client_fd == -1 && peer_control_fd == -1 && listen_fd == -1) {
     if (!ctx.runprog || !ctx.runprog[0]) {
       sl_print_usage();
       return EXIT_FAILURE;
@@ -3966,6 +5550,12 @@ int main(int argc, char** argv) {
       ctx.clipboard_manager = !!strcmp(clipboard_manager, "0");
   }
 
+  if (dmabuf_modifiers)
+    ctx.dmabuf_modifiers = !!strcmp(dmabuf_modifiers, "0");
+
+  if (downsample)
+    ctx.downsample = !!strcmp(downsample, "0");
+
   if (scale) {
     ctx.desired_scale = atof(scale);
     // Round to integer scale until we detect wp_viewporter support.
@@ -4002,18 +5592,203 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (buffer_policy) {
+    if (strcmp(buffer_policy, "wait") == 0) {
+      ctx.output_buffer_policy = OUTPUT_BUFFER_POLICY_WAIT;
+    } else if (strcmp(buffer_policy, "drop") == 0) {
+      ctx.output_buffer_policy = OUTPUT_BUFFER_POLICY_DROP;
+    } else {
+      fprintf(stderr, "error: unrecognised --buffer-policy\n");
+      sl_print_usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (stats && strcmp(stats, "0"))
+    ctx.stats = 1;
+
+  if (startup_trace && strcmp(startup_trace, "0"))
+    ctx.startup_trace = 1;
+
+  if (trace) {
+#ifdef SOMMELIER_TRACING
+    sl_trace_init(trace);
+#else
+    fprintf(stderr, "error: sommelier was built without tracing support\n");
+    return EXIT_FAILURE;
+#endif
+  }
+
+  if (coalesce_motion && strcmp(coalesce_motion, "0"))
+    ctx.coalesce_motion = 1;
+
+  // Merging motion over an interval implies merging it within a frame.
+  if (motion_interval && atoi(motion_interval) > 0) {
+    ctx.motion_interval = atoi(motion_interval);
+    ctx.coalesce_motion = 1;
+  }
+
+  if (selection_chunk_size && atoi(selection_chunk_size) > 0)
+    ctx.selection_chunk_size = atoi(selection_chunk_size);
+
+  // A surface needs at least one buffer on screen and one to draw into.
+  if (max_buffers && atoi(max_buffers) > 0)
+    ctx.max_output_buffers = MAX(atoi(max_buffers), 2);
+
   // Handle broken pipes without signals that kill the entire process.
   signal(SIGPIPE, SIG_IGN);
 
+  sl_copy_init();
+
   ctx.host_display = wl_display_create();
   assert(ctx.host_display);
 
+  // Client flushes are only counted for --stats, as the logger runs for
+  // every message sent.
+  wl_list_init(&ctx.dirty_clients);
+  if (ctx.stats)
+    wl_display_add_protocol_logger(ctx.host_display, sl_protocol_logger, &ctx);
+
   event_loop = wl_display_get_event_loop(ctx.host_display);
 
+  if (buffer_pool_size)
+    ctx.output_buffer_pool_max_size = (size_t)atoi(buffer_pool_size) << 20;
+  if (buffer_pool_timeout)
+    ctx.output_buffer_pool_timeout = atoi(buffer_pool_timeout);
+
+  if (copy_threads && atoi(copy_threads) > 0)
+    ctx.copy_pool = sl_copy_pool_create(event_loop, atoi(copy_threads));
+
+  // The host connection is set up after the environment has been changed
+  // for the client below.
+  if (getenv("WAYLAND_DISPLAY"))
+    host_wayland_display = strdup(getenv("WAYLAND_DISPLAY"));
+
+  // Start the client or Xwayland before the host connection is set up. Its
+  // own startup overlaps with ours and requests it sends in the meantime
+  // are queued on the socket until the client is created.
+  if (ctx.runprog || ctx.xwayland) {
+    // Wayland connection from client.
+    rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    errno_assert(!rv);
+
+    client_fd = sv[0];
+
+    ctx.sigchld_event_source =
+        wl_event_loop_add_signal(event_loop, SIGCHLD, sl_handle_sigchld, &ctx);
+
+    // Unset DISPLAY to prevent X clients from connecting to an existing X
+    // server when X forwarding is not enabled.
+    unsetenv("DISPLAY");
+    // Set WAYLAND_DISPLAY to value that is guaranteed to not point to a
+    // valid wayland compositor socket name. Resetting WAYLAND_DISPLAY is
+    // insufficient as clients will attempt to connect to wayland-0 if
+    // it's not set.
+    setenv("WAYLAND_DISPLAY", ".", 1);
+
+    if (ctx.xwayland) {
+      int ds[2], wm[2];
+
+      // Xwayland display ready socket.
+      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
+      errno_assert(!rv);
+
+      ctx.display_ready_event_source =
+          wl_event_loop_add_fd(event_loop, ds[0], WL_EVENT_READABLE,
+                               sl_handle_display_ready_event, &ctx);
+
+      // X connection to Xwayland.
+      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, wm);
+      errno_assert(!rv);
+
+      ctx.wm_fd = wm[0];
+
+      pid = fork();
+      errno_assert(pid != -1);
+      if (pid == 0) {
+        char* display_fd_str;
+        char* wm_fd_str;
+        char* xwayland_cmd_prefix_str;
+        char* args[64];
+        int i = 0;
+        int fd;
+
+        if (xwayland_cmd_prefix) {
+          xwayland_cmd_prefix_str = sl_xasprintf("%s", xwayland_cmd_prefix);
+
+          i = sl_parse_cmd_prefix(xwayland_cmd_prefix_str, 32, args);
+          if (i > 32) {
+            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+            i = 0;
+          }
+        }
+
+        args[i++] = sl_xasprintf("%s", xwayland_path ?: XWAYLAND_PATH);
+
+        fd = dup(ds[1]);
+        display_fd_str = sl_xasprintf("%d", fd);
+        fd = dup(wm[1]);
+        wm_fd_str = sl_xasprintf("%d", fd);
+
+        if (xdisplay > 0) {
+          args[i++] = sl_xasprintf(":%d", xdisplay);
+        }
+        args[i++] = "-nolisten";
+        args[i++] = "tcp";
+        args[i++] = "-rootless";
+        // Use software rendering unless we have a DRM device and glamor is
+        // enabled.
+        if (!drm_device || !glamor || !strcmp(glamor, "0"))
+          args[i++] = "-shm";
+        args[i++] = "-displayfd";
+        args[i++] = display_fd_str;
+        args[i++] = "-wm";
+        args[i++] = wm_fd_str;
+        if (xauth_path) {
+          args[i++] = "-auth";
+          args[i++] = sl_xasprintf("%s", xauth_path);
+        }
+        if (xfont_path) {
+          args[i++] = "-fp";
+          args[i++] = sl_xasprintf("%s", xfont_path);
+        }
+        args[i++] = NULL;
+
+        // If a path is explicitly specified via command line or environment
+        // use that instead of the compiled in default.  In either case, only
+        // set the environment variable if the value specified is non-empty.
+        if (xwayland_gl_driver_path) {
+          if (*xwayland_gl_driver_path) {
+            setenv("LIBGL_DRIVERS_PATH", xwayland_gl_driver_path, 1);
+          }
+        } else if (XWAYLAND_GL_DRIVER_PATH && *XWAYLAND_GL_DRIVER_PATH) {
+          setenv("LIBGL_DRIVERS_PATH", XWAYLAND_GL_DRIVER_PATH, 1);
+        }
+
+        sl_execvp(args[0], args, sv[1]);
+        _exit(EXIT_FAILURE);
+      }
+      close(wm[1]);
+      ctx.xwayland_pid = pid;
+      sl_startup_trace(&ctx, "xwayland started");
+    } else {
+      pid = fork();
+      errno_assert(pid != -1);
+      if (pid == 0) {
+        sl_execvp(ctx.runprog[0], ctx.runprog, sv[1]);
+        _exit(EXIT_FAILURE);
+      }
+      ctx.child_pid = pid;
+      sl_startup_trace(&ctx, "program started");
+    }
+    close(sv[1]);
+  }
+
   if (!virtwl_device)
     virtwl_device = VIRTWL_DEVICE;
 
-  if (virtwl_device) {
+  // An empty device name disables virtwl.
+  if (virtwl_device && *virtwl_device) {
     struct virtwl_ioctl_new new_ctx = {
         .type = VIRTWL_IOCTL_NEW_CTX,
         .fd = -1,
@@ -4025,7 +5800,7 @@ int main(int argc, char** argv) {
     if (ctx.virtwl_fd == -1) {
       fprintf(stderr, "error: could not open %s (%s)\n", virtwl_device,
               strerror(errno));
-      return EXIT_FAILURE;
+      return sl_abort_startup(&ctx);
     }
 
     // We use a virtwl context unless display was explicitly specified.
@@ -4046,7 +5821,7 @@ int main(int argc, char** argv) {
       if (rv) {
         fprintf(stderr, "error: failed to create virtwl context: %s\n",
                 strerror(errno));
-        return EXIT_FAILURE;
+        return sl_abort_startup(&ctx);
       }
 
       ctx.virtwl_ctx_fd = new_ctx.fd;
@@ -4058,6 +5833,7 @@ int main(int argc, char** argv) {
           wl_event_loop_add_fd(event_loop, ctx.virtwl_ctx_fd, WL_EVENT_READABLE,
                                sl_handle_virtwl_ctx_event, &ctx);
     }
+    sl_startup_trace(&ctx, "virtwl context");
   }
 
   if (drm_device) {
@@ -4065,16 +5841,17 @@ int main(int argc, char** argv) {
     if (drm_fd == -1) {
       fprintf(stderr, "error: could not open %s (%s)\n", drm_device,
               strerror(errno));
-      return EXIT_FAILURE;
+      return sl_abort_startup(&ctx);
     }
 
     ctx.gbm = gbm_create_device(drm_fd);
     if (!ctx.gbm) {
       fprintf(stderr, "error: couldn't get display device\n");
-      return EXIT_FAILURE;
+      return sl_abort_startup(&ctx);
     }
 
     ctx.drm_device = drm_device;
+    sl_startup_trace(&ctx, "drm device");
   }
 
   if (!shm_driver)
@@ -4084,14 +5861,14 @@ int main(int argc, char** argv) {
     if (strcmp(shm_driver, "dmabuf") == 0) {
       if (!ctx.drm_device) {
         fprintf(stderr, "error: need drm device for dmabuf driver\n");
-        return EXIT_FAILURE;
+        return sl_abort_startup(&ctx);
       }
       ctx.shm_driver = SHM_DRIVER_DMABUF;
     } else if (strcmp(shm_driver, "virtwl") == 0 ||
                strcmp(shm_driver, "virtwl-dmabuf") == 0) {
       if (ctx.virtwl_fd == -1) {
         fprintf(stderr, "error: need device for virtwl driver\n");
-        return EXIT_FAILURE;
+        return sl_abort_startup(&ctx);
       }
       ctx.shm_driver = strcmp(shm_driver, "virtwl") ? SHM_DRIVER_VIRTWL_DMABUF
                                                     : SHM_DRIVER_VIRTWL;
@@ -4131,7 +5908,7 @@ int main(int argc, char** argv) {
     if (strcmp(data_driver, "virtwl") == 0) {
       if (ctx.virtwl_fd == -1) {
         fprintf(stderr, "error: need device for virtwl driver\n");
-        return EXIT_FAILURE;
+        return sl_abort_startup(&ctx);
       }
       ctx.data_driver = DATA_DRIVER_VIRTWL;
     }
@@ -4154,26 +5931,19 @@ int main(int argc, char** argv) {
     free(str);
   }
 
-  if (ctx.runprog || ctx.xwayland) {
-    // Wayland connection from client.
-    rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
-    errno_assert(!rv);
-
-    client_fd = sv[0];
-  }
-
   // The success of this depends on xkb-data being installed.
   ctx.xkb_context = xkb_context_new(0);
   if (!ctx.xkb_context) {
     fprintf(stderr, "error: xkb_context_new failed. xkb-data missing?\n");
-    return EXIT_FAILURE;
+    return sl_abort_startup(&ctx);
   }
+  sl_startup_trace(&ctx, "xkb context");
 
   if (virtwl_display_fd != -1) {
     ctx.display = wl_display_connect_to_fd(virtwl_display_fd);
   } else {
     if (display == NULL)
-      display = getenv("WAYLAND_DISPLAY");
+      display = host_wayland_display;
     if (display == NULL)
       display = "wayland-0";
 
@@ -4182,8 +5952,9 @@ int main(int argc, char** argv) {
 
   if (!ctx.display) {
     fprintf(stderr, "error: failed to connect to %s\n", display);
-    return EXIT_FAILURE;
+    return sl_abort_startup(&ctx);
   }
+  sl_startup_trace(&ctx, "host connected");
 
   wl_list_init(&ctx.accelerators);
   wl_list_init(&ctx.registries);
@@ -4192,8 +5963,26 @@ int main(int argc, char** argv) {
   wl_list_init(&ctx.seats);
   wl_list_init(&ctx.windows);
   wl_list_init(&ctx.unpaired_windows);
+  wl_list_init(&ctx.dirty_windows);
+  for (i = 0; i < SL_WINDOW_TABLE_SIZE; ++i) {
+    wl_list_init(&ctx.window_table[i]);
+    wl_list_init(&ctx.frame_table[i]);
+    wl_list_init(&ctx.host_surface_table[i]);
+  }
+  for (i = 0; i < SL_ATOM_TABLE_SIZE; ++i) {
+    wl_list_init(&ctx.atom_table[i]);
+    wl_list_init(&ctx.atom_name_table[i]);
+  }
   wl_list_init(&ctx.host_outputs);
   wl_list_init(&ctx.selection_data_source_send_pending);
+  wl_list_init(&ctx.selection_transfers);
+  wl_list_init(&ctx.free_selection_transfers);
+  wl_list_init(&ctx.output_buffer_pool);
+  wl_list_init(&ctx.x_reply_handlers);
+  wl_array_init(&ctx.selection_targets);
+  wl_list_init(&ctx.drm_handles);
+  wl_list_init(&ctx.surface_stats);
+  wl_list_init(&ctx.keymap_cache);
 
   // Parse the list of accelerators that should be reserved by the
   // compositor. Format is "|MODIFIERS|KEYSYM", where MODIFIERS is a
@@ -4217,7 +6006,7 @@ int main(int argc, char** argv) {
           accelerators += 7;
         } else {
           fprintf(stderr, "error: invalid modifier\n");
-          return EXIT_FAILURE;
+          return sl_abort_startup(&ctx);
         }
       } else {
         struct sl_accelerator* accelerator;
@@ -4230,7 +6019,7 @@ int main(int argc, char** argv) {
             xkb_keysym_from_name(name, XKB_KEYSYM_CASE_INSENSITIVE);
         if (accelerator->symbol == XKB_KEY_NoSymbol) {
           fprintf(stderr, "error: invalid key symbol\n");
-          return EXIT_FAILURE;
+          return sl_abort_startup(&ctx);
         }
 
         wl_list_insert(&ctx.accelerators, &accelerator->link);
@@ -4249,133 +6038,56 @@ int main(int argc, char** argv) {
   wl_registry_add_listener(wl_display_get_registry(ctx.display),
                            &sl_registry_listener, &ctx);
 
-  ctx.client = wl_client_create(ctx.host_display, client_fd);
-
-  // Replace the core display implementation. This is needed in order to
-  // implement sync handler properly.
-  sl_set_display_implementation(&ctx);
-
-  if (ctx.runprog || ctx.xwayland) {
-    ctx.sigchld_event_source =
-        wl_event_loop_add_signal(event_loop, SIGCHLD, sl_handle_sigchld, &ctx);
-
-    // Unset DISPLAY to prevent X clients from connecting to an existing X
-    // server when X forwarding is not enabled.
-    unsetenv("DISPLAY");
-    // Set WAYLAND_DISPLAY to value that is guaranteed to not point to a
-    // valid wayland compositor socket name. Resetting WAYLAND_DISPLAY is
-    // insufficient as clients will attempt to connect to wayland-0 if
-    // it's not set.
-    setenv("WAYLAND_DISPLAY", ".", 1);
-
-    if (ctx.xwayland) {
-      int ds[2], wm[2];
+  // A warm peer binds host globals while it waits for the master to hand
+  // over a client.
+  if (peer_control_fd != -1) {
+    struct sl_peer_control control = {&ctx, -1};
+    struct wl_event_source* control_event_source =
+        wl_event_loop_add_fd(event_loop, peer_control_fd, WL_EVENT_READABLE,
+                             sl_handle_peer_control_event, &control);
 
-      // Xwayland display ready socket.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
-      errno_assert(!rv);
-
-      ctx.display_ready_event_source =
-          wl_event_loop_add_fd(event_loop, ds[0], WL_EVENT_READABLE,
-                               sl_handle_display_ready_event, &ctx);
-
-      // X connection to Xwayland.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, wm);
-      errno_assert(!rv);
-
-      ctx.wm_fd = wm[0];
-
-      pid = fork();
-      errno_assert(pid != -1);
-      if (pid == 0) {
-        char* display_fd_str;
-        char* wm_fd_str;
-        char* xwayland_cmd_prefix_str;
-        char* args[64];
-        int i = 0;
-        int fd;
-
-        if (xwayland_cmd_prefix) {
-          xwayland_cmd_prefix_str = sl_xasprintf("%s", xwayland_cmd_prefix);
-
-          i = sl_parse_cmd_prefix(xwayland_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
-
-        args[i++] = sl_xasprintf("%s", xwayland_path ?: XWAYLAND_PATH);
-
-        fd = dup(ds[1]);
-        display_fd_str = sl_xasprintf("%d", fd);
-        fd = dup(wm[1]);
-        wm_fd_str = sl_xasprintf("%d", fd);
-
-        if (xdisplay > 0) {
-          args[i++] = sl_xasprintf(":%d", xdisplay);
-        }
-        args[i++] = "-nolisten";
-        args[i++] = "tcp";
-        args[i++] = "-rootless";
-        // Use software rendering unless we have a DRM device and glamor is
-        // enabled.
-        if (!ctx.drm_device || !glamor || !strcmp(glamor, "0"))
-          args[i++] = "-shm";
-        args[i++] = "-displayfd";
-        args[i++] = display_fd_str;
-        args[i++] = "-wm";
-        args[i++] = wm_fd_str;
-        if (xauth_path) {
-          args[i++] = "-auth";
-          args[i++] = sl_xasprintf("%s", xauth_path);
-        }
-        if (xfont_path) {
-          args[i++] = "-fp";
-          args[i++] = sl_xasprintf("%s", xfont_path);
-        }
-        args[i++] = NULL;
+    while (control.client_fd == -1) {
+      if (sl_flush_connections(&ctx) < 0)
+        return EXIT_FAILURE;
+      wl_event_loop_dispatch(event_loop, -1);
+    }
+    wl_event_source_remove(control_event_source);
+    close(peer_control_fd);
+    client_fd = control.client_fd;
+  }
 
-        // If a path is explicitly specified via command line or environment
-        // use that instead of the compiled in default.  In either case, only
-        // set the environment variable if the value specified is non-empty.
-        if (xwayland_gl_driver_path) {
-          if (*xwayland_gl_driver_path) {
-            setenv("LIBGL_DRIVERS_PATH", xwayland_gl_driver_path, 1);
-          }
-        } else if (XWAYLAND_GL_DRIVER_PATH && *XWAYLAND_GL_DRIVER_PATH) {
-          setenv("LIBGL_DRIVERS_PATH", XWAYLAND_GL_DRIVER_PATH, 1);
-        }
+  if (listen_fd != -1) {
+    wl_event_loop_add_fd(event_loop, listen_fd, WL_EVENT_READABLE,
+                         sl_handle_client_connection, &ctx);
+  } else {
+    ctx.client = wl_client_create(ctx.host_display, client_fd);
+    sl_startup_trace(&ctx, "client created");
 
-        sl_execvp(args[0], args, sv[1]);
-        _exit(EXIT_FAILURE);
-      }
-      close(wm[1]);
-      ctx.xwayland_pid = pid;
-    } else {
-      pid = fork();
-      errno_assert(pid != -1);
-      if (pid == 0) {
-        sl_execvp(ctx.runprog[0], ctx.runprog, sv[1]);
-        _exit(EXIT_FAILURE);
-      }
-      ctx.child_pid = pid;
-    }
-    close(sv[1]);
+    // Replace the core display implementation. This is needed in order to
+    // implement sync handler properly.
+    sl_set_display_implementation(&ctx, ctx.client);
   }
 
-  wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
+  wl_event_loop_add_signal(event_loop, SIGUSR1, sl_handle_sigusr1, &ctx);
+
+  // Exit with the client unless this process serves many of them.
+  if (ctx.client)
+    wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
 
   do {
-    wl_display_flush_clients(ctx.host_display);
     if (ctx.connection) {
+      sl_process_dirty_windows(&ctx);
       if (ctx.needs_set_input_focus) {
         sl_set_input_focus(&ctx, ctx.host_focus_window);
         ctx.needs_set_input_focus = 0;
       }
-      xcb_flush(ctx.connection);
+      // Replies may have been queued by a synchronous request without the
+      // connection becoming readable again.
+      if (!wl_list_empty(&ctx.x_reply_handlers)) {
+        sl_handle_x_connection_event(ctx.wm_fd, WL_EVENT_READABLE, &ctx);
+      }
     }
-    if (wl_display_flush(ctx.display) < 0)
+    if (sl_flush_connections(&ctx) < 0)
       return EXIT_FAILURE;
   } while (wl_event_loop_dispatch(event_loop, -1) != -1);
 
@@ -73,6 +73,7 @@
       'link_settings': {
         'libraries': [
           '-lm',
+          '-lpthread',
         ],
       },
       'dependencies': [
@@ -80,6 +81,7 @@
       ],
       'sources': [
         'sommelier-compositor.c',
+        'sommelier-copy.c',
         'sommelier-data-device-manager.c',
         'sommelier-display.c',
         'sommelier-drm.c',
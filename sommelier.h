@@ -20,6 +20,12 @@
 
 #define UNUSED(x) ((void)(x))
 
+// Number of buckets in each of the window lookup tables.
+#define SL_WINDOW_TABLE_SIZE 256
+
+// Number of buckets in each of the atom cache tables.
+#define SL_ATOM_TABLE_SIZE 64
+
 #define CONTROL_MASK (1 << 0)
 #define ALT_MASK (1 << 1)
 #define SHIFT_MASK (1 << 2)
@@ -40,10 +46,39 @@ struct sl_keyboard_extension;
 struct sl_text_input_manager;
 struct sl_relative_pointer_manager;
 struct sl_pointer_constraints;
+struct sl_linux_explicit_synchronization;
+struct sl_host_surface_synchronization;
 struct sl_window;
+struct sl_mmap;
+struct sl_copy_pool;
+struct sl_copy_job;
+struct pixman_box32;
+struct gbm_bo;
+struct sl_damage_history;
+struct sl_drm_handle;
+struct sl_surface_stats;
 struct zaura_shell;
 struct zcr_keyboard_extension_v1;
 
+// Counters for traffic forwarded over virtwl. Messages are reads from the
+// source side and ioctls are VIRTWL_IOCTL_SEND/RECV calls.
+struct sl_virtwl_stats {
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t ioctls;
+};
+
+// Event loop counters. Flushes only count connections that had data to
+// write, so they measure how well writes are batched per iteration.
+struct sl_loop_stats {
+  uint64_t iterations;
+  uint64_t host_reads;
+  uint64_t host_writes;
+  uint64_t host_writes_blocked;
+  uint64_t client_flushes;
+  uint64_t x_flushes;
+};
+
 enum {
   ATOM_WM_S0,
   ATOM_WM_PROTOCOLS,
@@ -89,6 +124,11 @@ enum {
   DATA_DRIVER_VIRTWL,
 };
 
+enum {
+  OUTPUT_BUFFER_POLICY_WAIT,
+  OUTPUT_BUFFER_POLICY_DROP,
+};
+
 struct sl_context {
   char** runprog;
   struct wl_display* display;
@@ -107,6 +147,7 @@ struct sl_context {
   struct sl_text_input_manager* text_input_manager;
   struct sl_relative_pointer_manager* relative_pointer_manager;
   struct sl_pointer_constraints* pointer_constraints;
+  struct sl_linux_explicit_synchronization* linux_explicit_synchronization;
   struct wl_list outputs;
   struct wl_list seats;
   struct wl_event_source* display_event_source;
@@ -121,13 +162,39 @@ struct sl_context {
   int virtwl_socket_fd;
   struct wl_event_source* virtwl_ctx_event_source;
   struct wl_event_source* virtwl_socket_event_source;
+  uint8_t* virtwl_txn_buffer;
+  // Largest transaction the device has accepted, lowered when it rejects
+  // one for its size.
+  size_t virtwl_max_send_size;
+  struct sl_virtwl_stats virtwl_send_stats;
+  struct sl_virtwl_stats virtwl_recv_stats;
+  struct sl_loop_stats loop_stats;
   const char* drm_device;
   struct gbm_device* gbm;
+  int dmabuf_modifiers;
+  int downsample;
+  struct wl_list drm_handles;
+  struct sl_copy_pool* copy_pool;
+  struct wl_list output_buffer_pool;
+  size_t output_buffer_pool_size;
+  size_t output_buffer_pool_max_size;
+  int output_buffer_pool_timeout;
+  struct wl_event_source* output_buffer_pool_timer;
+  int max_output_buffers;
+  int output_buffer_policy;
+  int stats;
+  struct wl_list surface_stats;
+  int startup_trace;
+  uint64_t startup_time;
+  uint64_t startup_phase_time;
+  int coalesce_motion;
+  int motion_interval;
   int xwayland;
   pid_t xwayland_pid;
   pid_t child_pid;
   pid_t peer_pid;
   struct xkb_context* xkb_context;
+  struct wl_list keymap_cache;
   struct wl_list accelerators;
   struct wl_list registries;
   struct wl_list globals;
@@ -139,6 +206,13 @@ struct sl_context {
   xcb_screen_t* screen;
   xcb_window_t window;
   struct wl_list windows, unpaired_windows;
+  struct wl_list dirty_windows;
+  // Clients that had events queued since the last flush.
+  struct wl_list dirty_clients;
+  // Windows hashed by X window id, frame id and host surface id.
+  struct wl_list window_table[SL_WINDOW_TABLE_SIZE];
+  struct wl_list frame_table[SL_WINDOW_TABLE_SIZE];
+  struct wl_list host_surface_table[SL_WINDOW_TABLE_SIZE];
   struct sl_window* host_focus_window;
   int needs_set_input_focus;
   double desired_scale;
@@ -156,6 +230,17 @@ struct sl_context {
   int selection_incremental_transfer;
   xcb_selection_request_event_t selection_request;
   xcb_timestamp_t selection_timestamp;
+  // Atom cache, looked up by atom and by name.
+  struct wl_list atom_table[SL_ATOM_TABLE_SIZE];
+  struct wl_list atom_name_table[SL_ATOM_TABLE_SIZE];
+  xcb_window_t selection_targets_owner;
+  // Set when the targets of the previous selection of the owner have been
+  // offered again before its TARGETS arrived.
+  int selection_targets_reused;
+  // Incremented for every Wayland selection, so that interned types of a
+  // replaced offer are not applied to the current one.
+  uint32_t selection_offer_serial;
+  struct wl_array selection_targets;
   struct wl_data_device* selection_data_device;
   struct sl_data_offer* selection_data_offer;
   struct sl_data_source* selection_data_source;
@@ -164,11 +249,14 @@ struct sl_context {
   struct wl_event_source* selection_send_event_source;
   xcb_get_property_reply_t* selection_property_reply;
   int selection_property_offset;
-  struct wl_event_source* selection_event_source;
-  xcb_atom_t selection_data_type;
-  struct wl_array selection_data;
-  int selection_data_offer_receive_fd;
-  int selection_data_ack_pending;
+  int selection_property_pending;
+  // Set while the next chunk of an incremental transfer is being fetched.
+  int selection_property_requested;
+  struct wl_list selection_transfers;
+  // Finished transfers, kept with their chunk buffers.
+  struct wl_list free_selection_transfers;
+  struct wl_list x_reply_handlers;
+  uint32_t selection_chunk_size;
   union {
     const char* name;
     xcb_intern_atom_cookie_t cookie;
@@ -212,6 +300,14 @@ struct sl_host_pointer {
   uint32_t time;
   wl_fixed_t axis_delta[2];
   int32_t axis_discrete[2];
+  int motion_pending;
+  uint32_t motion_time;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  int frame_has_events;
+  int frame_deferred;
+  uint32_t last_frame_time;
+  struct wl_event_source* motion_timer;
 };
 
 struct sl_relative_pointer_manager {
@@ -223,6 +319,7 @@ struct sl_relative_pointer_manager {
 
 struct sl_viewport {
   struct wl_list link;
+  struct sl_host_surface* surface;
   wl_fixed_t src_x;
   wl_fixed_t src_y;
   wl_fixed_t src_width;
@@ -252,12 +349,62 @@ struct sl_host_surface {
   struct sl_output_buffer* current_buffer;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  struct sl_copy_job* pending_copy;
+  int has_viewport_source;
+  uint32_t contents_shm_format;
+  int deferred_attach;
+  int deferred_commit;
+  int32_t deferred_x;
+  int32_t deferred_y;
+  struct wl_list frame_callbacks;
+  struct sl_damage_history* damage;
+  // Damage boxes of the current copy, kept to avoid allocating per commit.
+  struct wl_array damage_boxes;
+  // Buffer whose attach waits for GPU rendering to finish.
+  struct sl_host_buffer* sync_buffer;
+  struct wl_event_source* sync_event_source;
+  struct sl_surface_stats* stats;
+  int hidden;
+  int64_t hidden_time;
+  struct wl_event_source* hidden_timer;
+  int downsample;
+  struct sl_host_surface_synchronization* synchronization;
+  int buffer_attached;
+  int buffer_is_dmabuf;
+  // Requests queued behind a deferred commit.
+  struct wl_list requests;
+  int replaying_requests;
 };
 
 struct sl_host_region {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_region* proxy;
+  // Rects added and subtracted so far, in host coordinates, used to copy
+  // the region for queued requests.
+  struct wl_array ops;
+};
+
+struct sl_surface_request;
+
+typedef void (*sl_surface_request_func_t)(struct sl_surface_request* request);
+
+// Request that arrived while an earlier commit of a surface had not reached
+// the host yet. Queued requests are replayed in order after that commit so
+// that their state isn't applied by it.
+struct sl_surface_request {
+  struct wl_list link;
+  sl_surface_request_func_t func;
+  // Object the request was made on. The request is dropped if the object
+  // is destroyed first.
+  struct wl_resource* resource;
+  struct wl_listener resource_destroy_listener;
+  // Optional object argument. Reset to NULL if it is destroyed first.
+  struct wl_resource* object;
+  struct wl_listener object_destroy_listener;
+  // Copy of a region argument, destroyed with the request.
+  struct wl_region* region;
+  int32_t args[4];
 };
 
 struct sl_host_buffer {
@@ -268,10 +415,14 @@ struct sl_host_buffer {
   struct sl_mmap* shm_mmap;
   uint32_t shm_format;
   struct sl_sync_point* sync_point;
+  int is_dmabuf;
+  // Surface waiting on |sync_point| before attaching this buffer.
+  struct sl_host_surface* sync_surface;
 };
 
 struct sl_data_source_send_request {
   int fd;
+  xcb_atom_t atom;
   xcb_intern_atom_cookie_t cookie;
   struct sl_data_source* data_source;
   struct wl_list link;
@@ -349,11 +500,17 @@ struct sl_data_device_manager {
   struct wl_data_device_manager* internal;
 };
 
+// Offered MIME type that was not in the atom cache.
+struct sl_data_offer_type {
+  char* name;
+  xcb_intern_atom_cookie_t cookie;
+};
+
 struct sl_data_offer {
   struct sl_context* ctx;
   struct wl_data_offer* internal;
-  struct wl_array atoms;    // Contains xcb_atom_t
-  struct wl_array cookies;  // Contains xcb_intern_atom_cookie_t
+  struct wl_array atoms;  // Contains xcb_atom_t
+  struct wl_array types;  // Contains struct sl_data_offer_type
 };
 
 struct sl_text_input_manager {
@@ -370,6 +527,13 @@ struct sl_pointer_constraints {
   struct zwp_pointer_constraints_v1* internal;
 };
 
+struct sl_linux_explicit_synchronization {
+  struct sl_context* ctx;
+  uint32_t id;
+  uint32_t version;
+  struct sl_global* host_global;
+};
+
 struct sl_viewporter {
   struct sl_context* ctx;
   uint32_t id;
@@ -398,6 +562,13 @@ struct sl_linux_dmabuf {
   uint32_t version;
   struct sl_global* host_drm_global;
   struct zwp_linux_dmabuf_v1* internal;
+  struct wl_array modifiers;
+};
+
+// Format/modifier pair advertised by the host.
+struct sl_dmabuf_modifier {
+  uint32_t format;
+  uint64_t modifier;
 };
 
 struct sl_global {
@@ -416,7 +587,18 @@ struct sl_host_registry {
   struct wl_list link;
 };
 
-typedef void (*sl_begin_end_access_func_t)(int fd);
+// Free list of fixed size objects. Objects that are created and destroyed
+// every frame are recycled through these instead of the heap. Only used on
+// the main thread.
+struct sl_free_list {
+  size_t size;
+  void* head;
+};
+
+#define SL_FREE_LIST_INIT(type) \
+  { .size = sizeof(type), .head = NULL }
+
+typedef void (*sl_begin_end_access_func_t)(struct sl_mmap* map);
 
 struct sl_mmap {
   int refcount;
@@ -431,14 +613,25 @@ struct sl_mmap {
   sl_begin_end_access_func_t begin_write;
   sl_begin_end_access_func_t end_write;
   struct wl_resource* buffer_resource;
+  struct sl_mmap* parent;
+  struct gbm_bo* bo;
+  void* bo_map_data;
+  // Bounds of the next write. Buffer objects are only mapped there.
+  int32_t write_x;
+  int32_t write_y;
+  int32_t write_width;
+  int32_t write_height;
 };
 
 typedef void (*sl_sync_func_t)(struct sl_context* ctx,
                                struct sl_sync_point* sync_point);
+typedef void (*sl_sync_destroy_func_t)(struct sl_sync_point* sync_point);
 
 struct sl_sync_point {
   int fd;
   sl_sync_func_t sync;
+  sl_sync_destroy_func_t destroy;
+  void* data;
 };
 
 struct sl_config {
@@ -465,6 +658,7 @@ struct sl_window {
   int realized;
   int activated;
   int maximized;
+  int hidden;
   int allow_resize;
   xcb_window_t transient_for;
   xcb_window_t client_leader;
@@ -481,11 +675,16 @@ struct sl_window {
   int max_height;
   struct sl_config next_config;
   struct sl_config pending_config;
+  int needs_update;
   struct xdg_surface* xdg_surface;
   struct xdg_toplevel* xdg_toplevel;
   struct xdg_popup* xdg_popup;
   struct zaura_surface* aura_surface;
   struct wl_list link;
+  struct wl_list window_link;
+  struct wl_list frame_link;
+  struct wl_list host_surface_link;
+  struct wl_list dirty_link;
 };
 
 struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
@@ -506,6 +705,8 @@ size_t sl_shm_bpp_for_shm_format(uint32_t format);
 
 size_t sl_shm_num_planes_for_shm_format(uint32_t format);
 
+uint32_t sl_drm_format_for_shm_format(uint32_t format);
+
 struct sl_global* sl_shm_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_subcompositor_global_create(struct sl_context* ctx);
@@ -514,6 +715,8 @@ struct sl_global* sl_shell_global_create(struct sl_context* ctx);
 
 double sl_output_aura_scale_factor_to_double(int scale_factor);
 
+double sl_output_get_host_scale(struct sl_context* ctx);
+
 void sl_output_send_host_output_state(struct sl_host_output* host);
 
 struct sl_global* sl_output_global_create(struct sl_output* output);
@@ -533,11 +736,27 @@ struct sl_global* sl_gtk_shell_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_drm_global_create(struct sl_context* ctx);
 
+// Imports a prime fd into the drm device. Returns NULL if |fd| is not a
+// dma-buf that the device can import.
+struct sl_drm_handle* sl_drm_handle_import(struct sl_context* ctx, int fd);
+
+void sl_drm_handle_unref(struct sl_drm_handle* handle);
+
 struct sl_global* sl_text_input_manager_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_pointer_constraints_global_create(struct sl_context* ctx);
 
-void sl_set_display_implementation(struct sl_context* ctx);
+struct sl_global* sl_linux_explicit_synchronization_global_create(
+    struct sl_context* ctx);
+
+int sl_surface_synchronization_commit(struct sl_host_surface* surface,
+                                      int has_buffer);
+
+void sl_set_display_implementation(struct sl_context* ctx,
+                                   struct wl_client* client);
+
+void* sl_free_list_alloc(struct sl_free_list* list);
+void sl_free_list_free(struct sl_free_list* list, void* object);
 
 struct sl_mmap* sl_mmap_create(int fd,
                                size_t size,
@@ -549,9 +768,34 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t stride1,
                                size_t y_ss0,
                                size_t y_ss1);
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* parent,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1);
+struct sl_mmap* sl_mmap_create_bo(struct gbm_bo* bo, size_t bpp);
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map);
 void sl_mmap_unref(struct sl_mmap* map);
 
+typedef void (*sl_copy_done_func_t)(void* data);
+
+void sl_copy_init(void);
+struct sl_copy_pool* sl_copy_pool_create(struct wl_event_loop* event_loop,
+                                         int num_threads);
+struct sl_copy_job* sl_copy_region(struct sl_copy_pool* pool,
+                                   struct sl_mmap* dst,
+                                   struct sl_mmap* src,
+                                   const struct pixman_box32* boxes,
+                                   int n,
+                                   int downsample,
+                                   sl_copy_done_func_t done,
+                                   void* data);
+void sl_copy_job_finish(struct sl_copy_job* job);
+
 struct sl_sync_point* sl_sync_point_create(int fd);
 void sl_sync_point_destroy(struct sl_sync_point* sync_point);
 
@@ -567,4 +811,56 @@ int sl_process_pending_configure_acks(struct sl_window* window,
 
 void sl_window_update(struct sl_window* window);
 
+void sl_window_set_host_surface_id(struct sl_window* window,
+                                   uint32_t host_surface_id);
+
+struct sl_window* sl_lookup_host_surface_window(struct sl_context* ctx,
+                                                uint32_t host_surface_id,
+                                                int unpaired);
+
+// Returns a new request that |host| replays once its deferred commit has
+// reached the host, or NULL if nothing is deferred and the request should
+// be handled right away.
+struct sl_surface_request* sl_host_surface_queue_request(
+    struct sl_host_surface* host,
+    struct wl_resource* resource,
+    sl_surface_request_func_t func);
+void sl_surface_request_set_object(struct sl_surface_request* request,
+                                   struct wl_resource* object);
+void sl_host_surface_sync_done(struct sl_host_surface* host);
+void sl_compositor_dump_stats(struct sl_context* ctx);
+
+void sl_host_surface_set_hidden(struct sl_host_surface* host, int hidden);
+
+// Trace events are only built with -Dtracing=true. TRACE_EVENT records the
+// time until the end of the enclosing scope as an event named after the
+// current function.
+#ifdef SOMMELIER_TRACING
+struct sl_trace_scope {
+  const char* category;
+  const char* name;
+  uint64_t begin;
+};
+
+void sl_trace_init(const char* output);
+struct sl_trace_scope sl_trace_scope_begin(const char* category,
+                                           const char* name);
+void sl_trace_scope_end(struct sl_trace_scope* scope);
+void sl_trace_dump(void);
+
+#define SL_TRACE_CONCAT_(a, b) a##b
+#define SL_TRACE_CONCAT(a, b) SL_TRACE_CONCAT_(a, b)
+#define TRACE_EVENT(category)                                            \
+  struct sl_trace_scope SL_TRACE_CONCAT(sl_trace_scope_, __LINE__)       \
+      __attribute__((cleanup(sl_trace_scope_end))) =                     \
+          sl_trace_scope_begin(category, __func__)
+#else
+#define TRACE_EVENT(category) \
+  do {                        \
+  } while (0)
+#define sl_trace_dump() \
+  do {                  \
+  } while (0)
+#endif
+
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_H_